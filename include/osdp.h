@@ -415,6 +415,31 @@ enum osdp_cmd_e {
 	OSDP_CMD_SENTINEL
 };
 
+/**
+ * @brief Priority lanes of the command queue of a PD (CP only). Commands in
+ * a lane are sent only when the lanes above it are empty; in the order they
+ * were queued within a lane.
+ */
+enum osdp_cmd_priority_e {
+	/**
+	 * @brief Lane by kind of command: CONTROL for output commands,
+	 * INDICATOR for LED, buzzer and text commands and BULK for the rest.
+	 */
+	OSDP_CMD_PRIORITY_DEFAULT,
+	/**
+	 * @brief Actuation; door strikes and such.
+	 */
+	OSDP_CMD_PRIORITY_CONTROL,
+	/**
+	 * @brief Feedback to the user at the reader.
+	 */
+	OSDP_CMD_PRIORITY_INDICATOR,
+	/**
+	 * @brief Manufacturer specific and configuration commands.
+	 */
+	OSDP_CMD_PRIORITY_BULK,
+};
+
 /**
  * @brief OSDP Command Structure. This is a wrapper for all individual OSDP
  * commands.
@@ -426,6 +451,12 @@ enum osdp_cmd_e {
  * @param output output command structure
  * @param comset comset command structure
  * @param keyset keyset command structure
+ * @param priority lane the command is queued in (CP only)
+ * @param deadline_ms if the command is not sent within this many milliseconds
+ *        of osdp_cp_send_command(), it is dropped rather than sent late and
+ *        counted in `expired` of struct osdp_stats. 0 for no deadline (CP only)
+ * @param tag passed back, as is, when the command completes (CP only; see
+ *        osdp_cp_set_completion_callback())
  */
 struct osdp_cmd {
 	enum osdp_cmd_e id;
@@ -438,6 +469,9 @@ struct osdp_cmd {
 		struct osdp_cmd_keyset keyset;
 		struct osdp_cmd_mfg    mfg;
 	};
+	enum osdp_cmd_priority_e priority;
+	uint32_t deadline_ms;
+	uint32_t tag;
 };
 
 typedef int (*keypress_callback_t)(void *data, int address, uint8_t key);
@@ -492,15 +526,256 @@ struct osdp_event {
 	};
 };
 
+#define OSDP_STATS_NAK_CODES           10
+#define OSDP_STATS_LATENCY_BUCKETS     16
+
+/**
+ * @brief Link statistics of a PD. Counters start at 0 on setup (and after
+ * osdp_reset_stats()) and wrap around on overflow.
+ *
+ * @param tx_frames frames sent (commands in CP mode; replies in PD mode)
+ * @param rx_frames valid frames received
+ * @param tx_bytes bytes sent
+ * @param rx_bytes bytes received
+ * @param crc_errors frames dropped due to a CRC/checksum mismatch
+ * @param mac_errors secure channel frames dropped due to a MAC mismatch
+ * @param naks NAKs indexed by reason code; received by a CP, sent by a PD.
+ *        Codes outside the array are counted at index 0.
+ * @param timeouts commands that didn't get a reply in time (CP only)
+ * @param retries commands sent again after the PD was busy (CP only)
+ * @param resends frames sent again as is: commands after a reply timeout
+ *        (CP) or replies when the CP repeated a sequence number (PD)
+ * @param busy osdp_BUSY replies received (CP only)
+ * @param offline number of times the PD went offline (CP only)
+ * @param coalesced commands that were replaced in the queue by a newer one
+ *        before they were sent (CP only; see osdp_cp_set_command_coalescing())
+ * @param expired commands dropped because they could not be sent before their
+ *        deadline (CP only; see struct osdp_cmd)
+ * @param sc_handshakes secure channel handshakes that succeeded
+ * @param sc_failures secure channel handshakes that failed
+ * @param latency histogram of command to reply round-trip times (CP only).
+ *        Bucket 0 counts replies that took less than 1ms and bucket i counts
+ *        the ones that took [2^(i-1), 2^i) ms. The last bucket also counts
+ *        anything slower.
+ */
+struct osdp_stats {
+	uint32_t tx_frames;
+	uint32_t rx_frames;
+	uint32_t tx_bytes;
+	uint32_t rx_bytes;
+	uint32_t crc_errors;
+	uint32_t mac_errors;
+	uint32_t naks[OSDP_STATS_NAK_CODES];
+	uint32_t timeouts;
+	uint32_t retries;
+	uint32_t resends;
+	uint32_t busy;
+	uint32_t offline;
+	uint32_t coalesced;
+	uint32_t expired;
+	uint32_t sc_handshakes;
+	uint32_t sc_failures;
+	uint32_t latency[OSDP_STATS_LATENCY_BUCKETS];
+};
+
+/**
+ * @brief Results of osdp_capture_replay().
+ *
+ * @param records number of records read from the capture
+ * @param frames replies (CP side) or commands (PD side) that were framed and
+ *        decoded successfully
+ * @param errors frames that failed framing, checks or decoding
+ */
+struct osdp_replay_stats {
+	uint32_t records;
+	uint32_t frames;
+	uint32_t errors;
+};
+
 typedef int (*pd_commnand_callback_t)(void *arg, int addr, struct osdp_cmd *c);
 typedef int (*cp_event_callback_t)(void *arg, int addr, struct osdp_event *ev);
 
+/**
+ * @brief Connection status of a PD as seen by the CP.
+ */
+enum osdp_pd_status_e {
+	/**
+	 * @brief Not online; the CP is (re)connecting to it.
+	 */
+	OSDP_PD_STATUS_OFFLINE,
+	/**
+	 * @brief Online without a secure channel.
+	 */
+	OSDP_PD_STATUS_ONLINE,
+	/**
+	 * @brief Online with an active secure channel.
+	 */
+	OSDP_PD_STATUS_SC_ACTIVE,
+};
+
+/**
+ * @brief Why the status of a PD changed.
+ */
+enum osdp_pd_status_reason_e {
+	/**
+	 * @brief The CP finished bringing the PD up (ID, capabilities and,
+	 * if possible, secure channel).
+	 */
+	OSDP_PD_STATUS_REASON_CONNECTED,
+	/**
+	 * @brief A command got no valid reply, even after resends.
+	 */
+	OSDP_PD_STATUS_REASON_LINK_ERROR,
+	/**
+	 * @brief The CP is setting up a secure channel with an online PD again.
+	 */
+	OSDP_PD_STATUS_REASON_SC_RESTART,
+};
+
+typedef void (*cp_status_callback_t)(void *arg, int pd,
+				     enum osdp_pd_status_e old_status,
+				     enum osdp_pd_status_e new_status,
+				     enum osdp_pd_status_reason_e reason);
+
+/**
+ * @brief Returned by osdp_cp_send_command() (and osdp_pd_notify_event()) when
+ * the queue is full. Nothing was queued; try again once some of the queued
+ * commands (or events) have been sent. A PD command callback returns it to
+ * have the command sent again later.
+ */
+#define OSDP_ERR_WOULD_BLOCK           (-2)
+
+typedef void (*cp_queue_callback_t)(void *arg, int pd, int depth, int high);
+
+/**
+ * @brief How a command sent with osdp_cp_send_command() completed.
+ */
+enum osdp_cmd_result_e {
+	/**
+	 * @brief The PD accepted the command (osdp_ACK or a reply with data).
+	 */
+	OSDP_CMD_RESULT_ACK,
+	/**
+	 * @brief The PD replied with an osdp_NAK; see `nak_code`.
+	 */
+	OSDP_CMD_RESULT_NAK,
+	/**
+	 * @brief The PD kept replying with an osdp_BUSY. The CP sends the
+	 * command again, every OSDP_CP_BUSY_RETRY_MS, up to
+	 * OSDP_CP_MAX_BUSY_RETRIES times before giving up with this result.
+	 */
+	OSDP_CMD_RESULT_BUSY,
+	/**
+	 * @brief No valid reply, even after resends; the PD goes offline.
+	 */
+	OSDP_CMD_RESULT_TIMEOUT,
+	/**
+	 * @brief Not sent; it could not be sent before its deadline.
+	 */
+	OSDP_CMD_RESULT_EXPIRED,
+	/**
+	 * @brief Not sent; a newer command took its place in the queue (see
+	 * osdp_cp_set_command_coalescing()).
+	 */
+	OSDP_CMD_RESULT_COALESCED,
+};
+
+/**
+ * @brief Completion of a command sent with osdp_cp_send_command().
+ *
+ * @param tag `tag` of the struct osdp_cmd that was sent
+ * @param result how the command completed
+ * @param nak_code reason code of the osdp_NAK (OSDP_CMD_RESULT_NAK only)
+ * @param latency_ms time from osdp_cp_send_command() to the completion
+ */
+struct osdp_cmd_completion {
+	uint32_t tag;
+	enum osdp_cmd_result_e result;
+	int nak_code;
+	uint32_t latency_ms;
+};
+
+typedef void (*cp_completion_callback_t)(void *arg, int pd,
+					 struct osdp_cmd_completion *c);
+typedef void (*osdp_log_callback_t)(void *arg, int log_level, int pd,
+				    const char *msg);
+
 /* =============================== CP Methods =============================== */
 
 osdp_t *osdp_cp_setup(int num_pd, osdp_pd_info_t *info, uint8_t *master_key);
 void osdp_cp_refresh(osdp_t *ctx);
 void osdp_cp_teardown(osdp_t *ctx);
 
+/**
+ * @brief Time until the CP has some work to do. Applications that don't want
+ * to call osdp_cp_refresh() at a fixed interval can sleep for (at most) this
+ * long before the next call.
+ *
+ * While a PD is waiting for a reply (see osdp_cp_get_rx_wait_bitmap()), the
+ * bytes can arrive at any time before this deadline. The application must
+ * also wake up when that PD's channel becomes readable and call
+ * osdp_cp_notify_readable() (or osdp_cp_refresh()).
+ *
+ * @param ctx OSDP context
+ *
+ * @retval 0 osdp_cp_refresh() must be called right away
+ * @retval +ve number of milliseconds until the next timer expires
+ */
+int osdp_cp_next_deadline(osdp_t *ctx);
+
+/**
+ * @brief Get a bitmap of PDs that have sent a command and are waiting for
+ * the reply. Only these PDs' channels need to be watched for readability.
+ * See osdp_get_status_bitmap() for the layout. Can be called from any
+ * thread.
+ *
+ * @param ctx OSDP context
+ * @param bitmap filled with OSDP_STATUS_BITMAP_WORDS(num_pd) words. Can be
+ *        NULL to get just the count.
+ * @param n number of words that `bitmap` can hold
+ *
+ * @retval number of PDs that are waiting for a reply
+ * @retval -1 if `bitmap` is too small
+ */
+int osdp_cp_get_rx_wait_bitmap(osdp_t *ctx, uint64_t *bitmap, int n);
+
+/**
+ * @brief Inform LibOSDP that the channel of a PD has data to be read. Only
+ * the PD that currently owns that channel (the one whose command is awaiting
+ * a reply; the given PD when the channel is free) is processed; the rest are
+ * left to osdp_cp_refresh().
+ *
+ * @param ctx OSDP context
+ * @param pd PD offset number as in `pd_info_t *`.
+ */
+void osdp_cp_notify_readable(osdp_t *ctx, int pd);
+
+/**
+ * @brief Start one worker thread per distinct osdp_channel (same data, send
+ * and recv) to drive the PDs on it, so a slow bus doesn't hold up the others.
+ *
+ * Once started, osdp_cp_refresh() only delivers events to the callback set
+ * by osdp_cp_set_event_callback() in the caller's thread and
+ * osdp_cp_next_deadline() tells when events may be pending. The channel
+ * methods of a PD are invoked from its worker. osdp_cp_send_command() can be
+ * called from any thread, with or without workers.
+ *
+ * @param ctx OSDP context
+ *
+ * @retval 0 on success
+ * @retval -1 on failure (or if built without CONFIG_OSDP_THREADED_CP)
+ */
+int osdp_cp_start_workers(osdp_t *ctx);
+
+/**
+ * @brief Stop the worker threads started by osdp_cp_start_workers(). Pending
+ * events are delivered before this method returns; after that the
+ * application must call osdp_cp_refresh() periodically again.
+ *
+ * @param ctx OSDP context
+ */
+void osdp_cp_stop_workers(osdp_t *ctx);
+
 /**
  * @brief Generic command enqueue API.
  *
@@ -509,6 +784,9 @@ void osdp_cp_teardown(osdp_t *ctx);
  * @param cmd command pointer. Must be filled by application.
  *
  * @retval 0 on success
+ * @retval OSDP_ERR_WOULD_BLOCK if the command queue of the PD is full, or if
+ *         OSDP_CP_CMD_POOL_SIZE commands were sent since it was last
+ *         refreshed
  * @retval -1 on failure
  *
  * @note This method only enques the command on to a particular PD. The command
@@ -518,6 +796,89 @@ int osdp_cp_send_command(osdp_t *ctx, int pd, struct osdp_cmd *cmd);
 
 void osdp_cp_set_event_callback(osdp_t *ctx, cp_event_callback_t cb, void *arg);
 
+/**
+ * @brief Set a callback for changes to the status of PDs (see
+ * osdp_get_status_bitmap()). It is invoked once for each change, from
+ * osdp_cp_refresh() in the caller's thread (also when workers are running),
+ * so the application doesn't have to poll the status of every PD.
+ *
+ * @param ctx OSDP context
+ * @param cb The callback function's pointer; `pd` is the PD offset number as
+ *           in `pd_info_t *`. NULL to stop the callbacks.
+ * @param arg A pointer that will be passed as the first argument of `cb`
+ */
+void osdp_cp_set_status_callback(osdp_t *ctx, cp_status_callback_t cb,
+				 void *arg);
+
+/**
+ * @brief Let a newer LED, buzzer, text or output command replace one that is
+ * still queued, in the same priority lane, for the same PD and the same LED
+ * (reader and LED number), buzzer (reader), text position (reader, control
+ * code, row and column; if the new text is no shorter) or output (output
+ * number; codes 1/2 replace any other, 3/4 replace 1-4 and 5/6 replace 5/6).
+ * Only the last command queued for that LED, buzzer, reader display or output
+ * can be replaced. The newer command is sent in the place of the older one
+ * so bus time goes to the current state rather than to stale ones. Commands
+ * of other kinds, and the order of commands to different targets, are left
+ * as is. Off by default; call this before starting workers.
+ *
+ * @param ctx OSDP context
+ * @param enable 1 to enable; 0 to disable
+ */
+void osdp_cp_set_command_coalescing(osdp_t *ctx, int enable);
+
+/**
+ * @brief Number of commands sent to a PD with osdp_cp_send_command() that
+ * are still queued (including those held while the PD is offline). At most
+ * OSDP_CP_CMD_POOL_MAX commands can be queued for a PD.
+ *
+ * @param ctx OSDP context
+ * @param pd PD offset number as in `pd_info_t *`.
+ *
+ * @retval queue depth on success
+ * @retval -1 on invalid PD offset
+ */
+int osdp_cp_get_queue_depth(osdp_t *ctx, int pd);
+
+/**
+ * @brief Set a callback for the command queues of PDs filling up. `cb` is
+ * invoked with `high` = 1 when the depth (see osdp_cp_get_queue_depth()) of
+ * a PD reaches `high_mark` and, after that, with `high` = 0 once it drains
+ * to `low_mark`; so an application can hold off on a PD before it sees
+ * OSDP_ERR_WOULD_BLOCK. Like the status callback, it is invoked from
+ * osdp_cp_refresh() in the caller's thread. Call this before starting
+ * workers.
+ *
+ * @param ctx OSDP context
+ * @param high_mark 1 to OSDP_CP_CMD_POOL_MAX
+ * @param low_mark 0 to high_mark - 1
+ * @param cb The callback function's pointer. NULL to stop the callbacks.
+ * @param arg A pointer that will be passed as the first argument of `cb`
+ *
+ * @retval 0 on success
+ * @retval -1 on invalid watermarks
+ */
+int osdp_cp_set_queue_watermarks(osdp_t *ctx, int high_mark, int low_mark,
+				 cp_queue_callback_t cb, void *arg);
+
+/**
+ * @brief Set a callback for the completion of commands sent with
+ * osdp_cp_send_command(); so an application can pipeline commands and act on
+ * their outcome without polling. It is invoked once for each command (for
+ * CMD_KEYSET, once for each PD) when the PD replies to it, when the PD is
+ * given up on, or when it is dropped from the queue without being sent. Like
+ * the status callback, it is invoked from osdp_cp_refresh() in the caller's
+ * thread. Commands still queued when the CP is torn down are not reported.
+ * Call this before starting workers.
+ *
+ * @param ctx OSDP context
+ * @param cb The callback function's pointer; `pd` is the PD offset number as
+ *           in `pd_info_t *`. NULL to stop the callbacks.
+ * @param arg A pointer that will be passed as the first argument of `cb`
+ */
+void osdp_cp_set_completion_callback(osdp_t *ctx, cp_completion_callback_t cb,
+				     void *arg);
+
 /* =============================== PD Methods =============================== */
 
 osdp_t *osdp_pd_setup(osdp_pd_info_t * info, uint8_t *scbk);
@@ -529,7 +890,9 @@ void osdp_pd_refresh(osdp_t *ctx);
  * invoked when the PD receives a command from the CP. This function must
  * return:
  *   - 0 if LibOSDP must send a `osdp_ACK` response
- *   - -ve if LibOSDP must send a `osdp_NAK` response
+ *   - OSDP_ERR_WOULD_BLOCK if LibOSDP must send a `osdp_BUSY` response; the
+ *     CP sends the command again a little later
+ *   - other -ve values if LibOSDP must send a `osdp_NAK` response
  *   - +ve and modify the passed `struct osdp_cmd *cmd` if LibOSDP must send a
  *     specific response. This is useful for sending manufacturer specific reply
  *     ``osdp_MFGREP``.
@@ -540,18 +903,194 @@ void osdp_pd_refresh(osdp_t *ctx);
  */
 void osdp_pd_set_command_callback(osdp_t *ctx, pd_commnand_callback_t cb, void *arg);
 
+/**
+ * @brief Queue an event to be reported to the CP when it polls next.
+ *
+ * @param ctx OSDP context
+ * @param event event to report; copied into the queue
+ *
+ * @retval 0 on success
+ * @retval OSDP_ERR_WOULD_BLOCK if OSDP_CP_CMD_POOL_MAX events are queued
+ * @retval -1 on failure
+ */
 int osdp_pd_notify_event(osdp_t *ctx, struct osdp_event *event);
 
 /* ============================= Common Methods ============================= */
 
 #define osdp_set_log_level(l) osdp_logger_init(l, NULL)
 void osdp_logger_init(int log_level, int (*log_fn)(const char *fmt, ...));
+
+/**
+ * @brief In deferred mode, log calls only copy the format string, a timestamp
+ * and the arguments into a per-thread ring buffer. Nothing is formatted or
+ * printed until osdp_logger_flush() is called, which makes logging safe to
+ * leave on in timing sensitive paths. Messages are dropped (and counted) when
+ * a ring is full. Disabling deferred mode flushes pending messages.
+ *
+ * @param enable 1 to defer; 0 to format and print at the call site (default)
+ */
+void osdp_logger_set_deferred(int enable);
+
+/**
+ * @brief Format and print all messages pending in the deferred log rings
+ * through the log function passed to osdp_logger_init(). Can be called from
+ * any thread; typically from the application's main loop or a dedicated
+ * logging thread.
+ *
+ * @retval Number of messages printed
+ */
+int osdp_logger_flush();
+
+/**
+ * @brief Set a log level and a log sink for one OSDP context. Messages that
+ * LibOSDP logs while working on this context (from any thread) are filtered
+ * with this level and passed to `cb` instead of the global log function. This
+ * lets multiple contexts in one process log independently. Must be called
+ * before the context is refreshed.
+ *
+ * @param ctx OSDP context
+ * @param log_level log level for this context; -1 to use the global level
+ * @param cb Sink for formatted messages (without the trailing newline); `pd`
+ *           is the PD offset the message is about or -1. NULL to use the
+ *           global log function.
+ * @param arg A pointer that will be passed as the first argument of `cb`
+ */
+void osdp_logger_ctx_init(osdp_t *ctx, int log_level, osdp_log_callback_t cb,
+			  void *arg);
 const char *osdp_get_version();
 const char *osdp_get_source_info();
 
+/**
+ * @brief Replace the clock that LibOSDP uses for all its timers. By default,
+ * CLOCK_MONOTONIC is used. Simulations and tests can pass a virtual clock to
+ * run faster (or slower) than wall clock time. The clock is global to all
+ * contexts and must never go backwards.
+ *
+ * @param millis_fn function that returns current time in milliseconds. Pass
+ *        NULL to go back to the default clock.
+ * @param arg A pointer that will be passed as the first argument of `millis_fn`
+ */
+void osdp_set_time_source(int64_t (*millis_fn)(void *arg), void *arg);
+
+/**
+ * @brief Get a mask of the PDs that are online. Only the first 32 PDs fit in
+ * the mask; use osdp_get_status_bitmap() on larger CPs.
+ *
+ * @param ctx OSDP context
+ *
+ * @retval bit `i` set if PD `i` is online
+ */
 uint32_t osdp_get_status_mask(osdp_t *ctx);
+
+/**
+ * @brief Get a mask of the PDs that have an active secure channel. Only the
+ * first 32 PDs fit in the mask; use osdp_get_sc_status_bitmap() on larger
+ * CPs.
+ *
+ * @param ctx OSDP context
+ *
+ * @retval bit `i` set if PD `i` has an active secure channel
+ */
 uint32_t osdp_get_sc_status_mask(osdp_t *ctx);
 
+/**
+ * @brief Number of 64-bit words in a status bitmap of `num_pd` PDs.
+ */
+#define OSDP_STATUS_BITMAP_WORDS(num_pd)  (((num_pd) + 63) / 64)
+
+/**
+ * @brief Get a bitmap of the PDs that are online. PD `i` is bit `i % 64` of
+ * `bitmap[i / 64]`. The CP keeps this bitmap and the count up to date as PDs
+ * change state so neither costs a pass over the PDs. Can be called from any
+ * thread.
+ *
+ * @param ctx OSDP context
+ * @param bitmap filled with OSDP_STATUS_BITMAP_WORDS(num_pd) words. Can be
+ *        NULL to get just the count.
+ * @param n number of words that `bitmap` can hold
+ *
+ * @retval number of PDs that are online
+ * @retval -1 if `bitmap` is too small
+ */
+int osdp_get_status_bitmap(osdp_t *ctx, uint64_t *bitmap, int n);
+
+/**
+ * @brief Get a bitmap of the PDs that are online and have an active secure
+ * channel. See osdp_get_status_bitmap() for the layout.
+ *
+ * @param ctx OSDP context
+ * @param bitmap filled with OSDP_STATUS_BITMAP_WORDS(num_pd) words. Can be
+ *        NULL to get just the count.
+ * @param n number of words that `bitmap` can hold
+ *
+ * @retval number of PDs that have an active secure channel
+ * @retval -1 if `bitmap` is too small
+ */
+int osdp_get_sc_status_bitmap(osdp_t *ctx, uint64_t *bitmap, int n);
+
+/**
+ * @brief Get a snapshot of the link statistics of a PD. Can be called from
+ * any thread; counters that change while they are being copied may be off
+ * by the updates in flight.
+ *
+ * @param ctx OSDP context
+ * @param pd PD offset number as in `pd_info_t *`; must be 0 in PD mode.
+ * @param stats filled with the counters of this PD
+ *
+ * @retval 0 on success
+ * @retval -1 on failure
+ */
+int osdp_get_stats(osdp_t *ctx, int pd, struct osdp_stats *stats);
+
+/**
+ * @brief Zero all link statistics of a PD.
+ *
+ * @param ctx OSDP context
+ * @param pd PD offset number as in `pd_info_t *`; must be 0 in PD mode.
+ */
+void osdp_reset_stats(osdp_t *ctx, int pd);
+
+/**
+ * @brief Start capturing all packets sent and bytes received by this context
+ * (including POLLs) to a file in pcap format (link type USER0). Each record
+ * carries a timestamp from the LibOSDP clock and a 4 byte pseudo header:
+ * direction (0: CP TX, 1: CP RX, 2: PD RX, 3: PD TX), PD offset, PD address
+ * and the command/reply ID (TX only). Writes are buffered; the file is
+ * complete after osdp_capture_stop().
+ *
+ * @param ctx OSDP context
+ * @param path file to write to (truncated)
+ *
+ * @retval 0 on success
+ * @retval -1 on failure
+ */
+int osdp_capture_start(osdp_t *ctx, const char *path);
+
+/**
+ * @brief Stop capturing and close the capture file. Also done on teardown.
+ *
+ * @param ctx OSDP context
+ */
+void osdp_capture_stop(osdp_t *ctx);
+
+/**
+ * @brief Feed a capture written by osdp_capture_start() back through the
+ * LibOSDP receive path as fast as possible. CP side replies are framed,
+ * decoded and handled as responses to the captured commands; PD side commands
+ * are framed and decoded. Sequence numbers are not checked and secure channel
+ * packets cannot be decoded (they count as errors).
+ *
+ * @param path capture file
+ * @param cb Optional callback for events decoded from CP side replies
+ * @param arg A pointer that will be passed as the first argument of `cb`
+ * @param stats filled with the results of the replay
+ *
+ * @retval 0 on success
+ * @retval -1 if the file could not be read
+ */
+int osdp_capture_replay(const char *path, cp_event_callback_t cb, void *arg,
+			struct osdp_replay_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -275,3 +275,32 @@ print_usage:
 		"led\n\tbuzzer\n\toutput\n\ttext\n\tcomset\n\tstatus\n\n");
 	return -1;
 }
+
+int cmd_handler_stats(int argc, char *argv[], void *data)
+{
+	int offset;
+	struct config_s *c = data;
+	struct osdpctl_cmd mq_cmd;
+
+	if (argc < 1 || argc > 2 ||
+	    (argc == 2 && strcmp("reset", argv[1]) != 0)) {
+		printf("Usage: stats <PD> [reset]\n");
+		return -1;
+	}
+
+	if (safe_atoi(argv[0], &offset)) {
+		printf("Error: Invalid PD offset");
+		return -1;
+	}
+
+	memset(&mq_cmd, 0, sizeof(struct osdpctl_cmd));
+	mq_cmd.id = (argc == 2) ? OSDPCTL_CMD_STATS_RESET : OSDPCTL_CMD_STATS;
+	mq_cmd.offset = offset;
+
+	if (msgq_send_command(c, &mq_cmd)) {
+		printf("Error: failed to send command\n");
+		return -1;
+	}
+
+	return 0;
+}
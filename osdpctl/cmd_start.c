@@ -20,6 +20,9 @@
 
 #include "common.h"
 
+#define OSDPCTL_CMD_POLL_MS		50
+#define OSDPCTL_RX_POLL_MS		2
+
 struct osdpctl_msgbuf msgq_cmd;
 
 void pack_pd_capabilities(struct osdp_pd_cap *cap)
@@ -168,6 +171,49 @@ void stop_cmd_server(struct config_s *c)
 	msgctl(c->cs_recv_msgid, IPC_RMID, NULL);
 }
 
+void print_stats(osdp_t *ctx, int offset)
+{
+	int i;
+	struct osdp_stats s;
+
+	if (osdp_get_stats(ctx, offset, &s)) {
+		printf("Error: failed to get stats of PD[%d]\n", offset);
+		return;
+	}
+
+	printf("PD[%d] stats:\n", offset);
+	printf("  frames tx/rx: %u/%u\n", s.tx_frames, s.rx_frames);
+	printf("  bytes tx/rx: %u/%u\n", s.tx_bytes, s.rx_bytes);
+	printf("  crc/mac errors: %u/%u\n", s.crc_errors, s.mac_errors);
+	printf("  timeouts: %u retries: %u resends: %u busy: %u offline: %u\n",
+	       s.timeouts, s.retries, s.resends, s.busy, s.offline);
+	printf("  sc handshakes ok/failed: %u/%u\n",
+	       s.sc_handshakes, s.sc_failures);
+	printf("  naks:");
+	for (i = 0; i < OSDP_STATS_NAK_CODES; i++) {
+		if (s.naks[i])
+			printf(" [%d]=%u", i, s.naks[i]);
+	}
+	printf("\n  latency:");
+	for (i = 0; i < OSDP_STATS_LATENCY_BUCKETS; i++) {
+		if (s.latency[i] == 0)
+			continue;
+		if (i == 0)
+			printf(" <1ms=%u", s.latency[i]);
+		else
+			printf(" <%dms=%u", 1 << i, s.latency[i]);
+	}
+	printf("\n");
+}
+
+void handle_stats_command(osdp_t *ctx, struct osdpctl_cmd *p)
+{
+	if (p->id == OSDPCTL_CMD_STATS_RESET)
+		osdp_reset_stats(ctx, p->offset);
+	else
+		print_stats(ctx, p->offset);
+}
+
 void handle_cp_command(struct config_s *c, struct osdpctl_cmd *p)
 {
 	if (p->id < OSDPCTL_CP_CMD_LED || p->id >= OSDPCTL_CP_CMD_SENTINEL) {
@@ -188,12 +234,17 @@ void handle_cp_command(struct config_s *c, struct osdpctl_cmd *p)
 		printf("SC Status: 0x%08x\n", osdp_get_sc_status_mask(c->cp_ctx));
 		printf("   Status: 0x%08x\n", osdp_get_status_mask(c->cp_ctx));
 		break;
+	case OSDPCTL_CMD_STATS:
+	case OSDPCTL_CMD_STATS_RESET:
+		handle_stats_command(c->cp_ctx, p);
+		break;
 	}
 }
 
 int process_commands(struct config_s *c)
 {
 	int ret;
+	struct osdpctl_cmd *p;
 
 	ret = msgrcv(c->cs_recv_msgid, &msgq_cmd, 1024, 1, IPC_NOWAIT);
 	if (ret == 0 || (ret < 0 && errno == EAGAIN))
@@ -204,12 +255,36 @@ int process_commands(struct config_s *c)
 	}
 	if (ret <= 0) return -1;;
 
+	p = (struct osdpctl_cmd *)msgq_cmd.mtext;
 	if (c->mode == CONFIG_MODE_CP)
-		handle_cp_command(c, (struct osdpctl_cmd *)msgq_cmd.mtext);
+		handle_cp_command(c, p);
+	else if (p->id == OSDPCTL_CMD_STATS || p->id == OSDPCTL_CMD_STATS_RESET)
+		handle_stats_command(c->pd_ctx, p);
 
 	return 0;
 }
 
+/**
+ * Sleep until the CP has something to do. The channels opened through
+ * utils/channel don't expose a pollable fd (msgq channels have none) so while
+ * a PD is waiting for a reply, we check back every OSDPCTL_RX_POLL_MS instead
+ * of sleeping till the response timeout. The command msgq is not pollable
+ * either; OSDPCTL_CMD_POLL_MS bounds how long a command can sit in it.
+ */
+void cp_wait_for_work(struct config_s *c)
+{
+	int timeout;
+
+	timeout = osdp_cp_next_deadline(c->cp_ctx);
+	if (timeout > OSDPCTL_CMD_POLL_MS)
+		timeout = OSDPCTL_CMD_POLL_MS;
+	if (osdp_cp_get_rx_wait_bitmap(c->cp_ctx, NULL, 0) > 0 &&
+	    timeout > OSDPCTL_RX_POLL_MS)
+		timeout = OSDPCTL_RX_POLL_MS;
+	if (timeout > 0)
+		usleep(timeout * 1000);
+}
+
 int cmd_handler_start(int argc, char *argv[], void *data)
 {
 	int i, ret;
@@ -296,11 +371,13 @@ int cmd_handler_start(int argc, char *argv[], void *data)
 	while (1) {
 		if (c->mode == CONFIG_MODE_CP) {
 			osdp_cp_refresh(c->cp_ctx);
+			process_commands(c);
+			cp_wait_for_work(c);
 		} else {
 			osdp_pd_refresh(c->pd_ctx);
+			process_commands(c);
+			usleep(20 * 1000);
 		}
-		process_commands(c);
-		usleep(20 * 1000);
 	}
 
 	return 0;
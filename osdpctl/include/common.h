@@ -82,6 +82,7 @@ int cmd_handler_start(int argc, char *argv[], void *data);
 int cmd_handler_send(int argc, char *argv[], void *data);
 int cmd_handler_stop(int argc, char *argv[], void *data);
 int cmd_handler_check(int argc, char *argv[], void *data);
+int cmd_handler_stats(int argc, char *argv[], void *data);
 
 // API
 
@@ -94,6 +95,8 @@ enum osdpctl_cmd_e {
 	OSDPCTL_CP_CMD_COMSET,
 	OSDPCTL_CP_CMD_KEYSET,
 	OSDPCTL_CMD_STATUS,
+	OSDPCTL_CMD_STATS,
+	OSDPCTL_CMD_STATS_RESET,
 	OSDPCTL_CP_CMD_SENTINEL
 };
 
@@ -35,6 +35,10 @@ struct ap_option ap_opts[] = {
 		AP_CMD("send", cmd_handler_send),
 		AP_HELP("Send a command to a osdp device")
 	},
+	{
+		AP_CMD("stats", cmd_handler_stats),
+		AP_HELP("Print (or reset) link statistics of a PD")
+	},
 	{
 		AP_CMD("stop", cmd_handler_stop),
 		AP_HELP("Stop a service started earlier")
@@ -86,6 +86,16 @@ void pyosdp_add_module_constants(PyObject *module)
 	ADD_CONST("CARD_FMT_RAW_WIEGAND",     OSDP_CARD_FMT_RAW_WIEGAND);
 	ADD_CONST("CARD_FMT_ASCII",           OSDP_CARD_FMT_ASCII);
 
+	/* enum osdp_pd_status_e */
+	ADD_CONST("PD_STATUS_OFFLINE",   OSDP_PD_STATUS_OFFLINE);
+	ADD_CONST("PD_STATUS_ONLINE",    OSDP_PD_STATUS_ONLINE);
+	ADD_CONST("PD_STATUS_SC_ACTIVE", OSDP_PD_STATUS_SC_ACTIVE);
+
+	/* enum osdp_pd_status_reason_e */
+	ADD_CONST("PD_STATUS_REASON_CONNECTED",  OSDP_PD_STATUS_REASON_CONNECTED);
+	ADD_CONST("PD_STATUS_REASON_LINK_ERROR", OSDP_PD_STATUS_REASON_LINK_ERROR);
+	ADD_CONST("PD_STATUS_REASON_SC_RESTART", OSDP_PD_STATUS_REASON_SC_RESTART);
+
 	/* enum osdp_pd_cap_function_code_e */
 	ADD_CONST("CAP_UNUSED",                  OSDP_PD_CAP_UNUSED);
 	ADD_CONST("CAP_CONTACT_STATUS_MONITORING", OSDP_PD_CAP_CONTACT_STATUS_MONITORING);
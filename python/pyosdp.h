@@ -21,6 +21,7 @@ typedef struct {
 	PyObject_HEAD
 	PyObject *command_cb;
 	PyObject *event_cb;
+	PyObject *status_cb;
 	osdp_t *ctx;
 	struct channel_manager chn_mgr;
 	int num_pd;
@@ -13,19 +13,19 @@ static const char pyosdp_cp_tp_doc[] =
 static PyObject *pyosdp_cp_pd_is_online(pyosdp_t *self, PyObject *args)
 {
 	int pd;
-	uint32_t mask;
+	uint64_t map[OSDP_STATUS_BITMAP_WORDS(127)];
 
 	if (!PyArg_ParseTuple(args, "I", &pd))
 		return NULL;
 
-	if (pd < 0 || pd > self->num_pd) {
+	if (pd < 0 || pd >= self->num_pd) {
 		PyErr_SetString(PyExc_ValueError, "Invalid PD offset");
 		return NULL;
 	}
 
-	mask = osdp_get_status_mask(self->ctx);
+	osdp_get_status_bitmap(self->ctx, map, OSDP_STATUS_BITMAP_WORDS(127));
 
-	if (mask & 1 << pd)
+	if ((map[pd / 64] >> (pd % 64)) & 1)
 		Py_RETURN_TRUE;
 	else
 		Py_RETURN_FALSE;
@@ -34,19 +34,20 @@ static PyObject *pyosdp_cp_pd_is_online(pyosdp_t *self, PyObject *args)
 static PyObject *pyosdp_cp_pd_is_sc_active(pyosdp_t *self, PyObject *args)
 {
 	int pd;
-	uint32_t mask;
+	uint64_t map[OSDP_STATUS_BITMAP_WORDS(127)];
 
 	if (!PyArg_ParseTuple(args, "I", &pd))
 		return NULL;
 
-	if (pd < 0 || pd > self->num_pd) {
+	if (pd < 0 || pd >= self->num_pd) {
 		PyErr_SetString(PyExc_ValueError, "Invalid PD offset");
 		return NULL;
 	}
 
-	mask = osdp_get_sc_status_mask(self->ctx);
+	osdp_get_sc_status_bitmap(self->ctx, map,
+				  OSDP_STATUS_BITMAP_WORDS(127));
 
-	if (mask & 1 << pd)
+	if ((map[pd / 64] >> (pd % 64)) & 1)
 		Py_RETURN_TRUE;
 	else
 		Py_RETURN_FALSE;
@@ -87,6 +88,42 @@ static PyObject *pyosdp_cp_set_event_callback(pyosdp_t *self, PyObject *args)
 	Py_RETURN_NONE;
 }
 
+void pyosdp_cp_status_cb(void *data, int pd, enum osdp_pd_status_e old_status,
+			 enum osdp_pd_status_e new_status,
+			 enum osdp_pd_status_reason_e reason)
+{
+	pyosdp_t *self = data;
+	PyObject *arglist, *result;
+
+	if (self->status_cb == NULL)
+		return;
+
+	arglist = Py_BuildValue("(IIII)", pd, old_status, new_status, reason);
+
+	result = PyEval_CallObject(self->status_cb, arglist);
+
+	Py_XDECREF(result);
+	Py_DECREF(arglist);
+}
+
+static PyObject *pyosdp_cp_set_status_callback(pyosdp_t *self, PyObject *args)
+{
+	PyObject *status_cb = NULL;
+
+	if (!PyArg_ParseTuple(args, "O", &status_cb))
+		return NULL;
+
+	if (!status_cb || !PyCallable_Check(status_cb)) {
+		PyErr_SetString(PyExc_TypeError, "Need a callable object!");
+		return NULL;
+	}
+
+	Py_XDECREF(self->status_cb); /* if set_callback was called earlier */
+	self->status_cb = status_cb;
+	Py_INCREF(self->status_cb);
+	Py_RETURN_NONE;
+}
+
 static PyObject *pyosdp_cp_set_loglevel(pyosdp_t *self, PyObject *args)
 {
 	int log_level;
@@ -140,6 +177,7 @@ static PyObject *pyosdp_cp_send_command(pyosdp_t *self, PyObject *args)
 static int pyosdp_cp_tp_clear(pyosdp_t *self)
 {
 	Py_XDECREF(self->event_cb);
+	Py_XDECREF(self->status_cb);
 	return 0;
 }
 
@@ -154,6 +192,7 @@ static PyObject *pyosdp_cp_tp_new(PyTypeObject *type, PyObject *args,
 	}
 	self->ctx = NULL;
 	self->event_cb = NULL;
+	self->status_cb = NULL;
 	self->command_cb = NULL;
 	self->num_pd = 0;
 	return (PyObject *)self;
@@ -258,6 +297,7 @@ static int pyosdp_cp_tp_init(pyosdp_t *self, PyObject *args, PyObject *kwargs)
 	}
 
 	osdp_cp_set_event_callback(ctx, pyosdp_cp_event_cb, self);
+	osdp_cp_set_status_callback(ctx, pyosdp_cp_status_cb, self);
 
 	ret = 0;
 	self->ctx = ctx;
@@ -306,6 +346,12 @@ static PyMethodDef pyosdp_cp_tp_methods[] = {
 		METH_VARARGS,
 		"Set osdp event callback. Args: (PyObject callable)"
 	},
+	{
+		"set_status_callback",
+		(PyCFunction)pyosdp_cp_set_status_callback,
+		METH_VARARGS,
+		"Set PD status change callback. Args: (PyObject callable)"
+	},
 	{
 		"send_command",
 		(PyCFunction)pyosdp_cp_send_command,
@@ -8,23 +8,38 @@
 #define _OSDP_COMMON_H_
 
 #include <assert.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #include <utils/utils.h>
 #include <utils/queue.h>
-#include <utils/slab.h>
 
 #include <osdp.h>
 #include "osdp_config.h"  /* generated */
 #include "osdp_export.h"  /* generated */
 
+#ifdef CONFIG_OSDP_SC_ENABLED
+#include "osdp_aes.h"
+#endif
+
+#ifdef CONFIG_OSDP_THREADED_CP
+#include <pthread.h>
+#endif
+
 #ifndef NULL
 #define NULL                           ((void *)0)
 #endif
 
 #define ARG_UNUSED(x)                  (void)(x)
 
+#ifdef CONFIG_OSDP_THREADED_CP
+#define OSDP_THREAD_LOCAL              __thread
+#else
+#define OSDP_THREAD_LOCAL
+#endif
+
 #define ISSET_FLAG(p, f)               (((p)->flags & (f)) == (f))
 #define SET_FLAG(p, f)                 ((p)->flags |= (f))
 #define CLEAR_FLAG(p, f)               ((p)->flags &= ~(f))
@@ -46,8 +61,6 @@
 		TO_CP(p)->current_pd = TO_PD(p, i);             \
 		TO_CP(p)->pd_offset = i;                        \
 	} while (0)
-#define PD_MASK(ctx) \
-	(uint32_t)((1 << (TO_CP(ctx)->num_pd)) - 1)
 #define AES_PAD_LEN(x)                 ((x + 16 - 1) & (~(16 - 1)))
 #define NUM_PD(ctx)                    (TO_CP(ctx)->num_pd)
 
@@ -131,8 +144,12 @@ union osdp_ephemeral_data {
 #define SCS_17                  0x17    /* CP -> PD -- packets w MAC w ENC*/
 #define SCS_18                  0x18    /* PD -> CP -- packets w MAC w ENC*/
 
+#define OSDP_CP_CMD_LANES		OSDP_CMD_PRIORITY_BULK
+
 /* Global flags */
 #define FLAG_CP_MODE		0x00000001 /* Set when initialized as CP */
+#define FLAG_CP_THREADED	0x00000002 /* PDs are driven by worker threads */
+#define FLAG_CP_COALESCE	0x00000004 /* newer commands replace queued ones */
 
 /* PD Flags */
 #define PD_FLAG_SC_CAPABLE	0x00000001 /* PD secure channel capable */
@@ -147,15 +164,25 @@ union osdp_ephemeral_data {
 #define PD_FLAG_INSTALL_MODE	0x40000000 /* PD is in install mode */
 #define PD_FLAG_PD_MODE		0x80000000 /* device is setup as PD */
 
-/* logging short hands */
-#define LOG_EM(...)	(osdp_log(LOG_EMERG, __VA_ARGS__))
-#define LOG_ALERT(...)	(osdp_log(LOG_ALERT, __VA_ARGS__))
-#define LOG_CRIT(...)	(osdp_log(LOG_CRIT, __VA_ARGS__))
-#define LOG_ERR(...)	(osdp_log(LOG_ERR, __VA_ARGS__))
-#define LOG_INF(...)	(osdp_log(LOG_INFO, __VA_ARGS__))
-#define LOG_WRN(...)	(osdp_log(LOG_WARNING, __VA_ARGS__))
-#define LOG_NOT(...)	(osdp_log(LOG_NOTICE, __VA_ARGS__))
-#define LOG_DBG(...)	(osdp_log(LOG_DEBUG, __VA_ARGS__))
+/**
+ * logging short hands; messages less severe than OSDP_LOG_MIN_LEVEL are
+ * compiled out and the runtime level is checked before evaluating arguments.
+ */
+#define OSDP_LOG(l, ...)                                                       \
+	(((l) <= OSDP_LOG_MIN_LEVEL && (l) <= osdp_log_level()) ?              \
+	 osdp_log(l, __VA_ARGS__) : (void)0)
+
+#define LOG_EM(...)	OSDP_LOG(LOG_EMERG, __VA_ARGS__)
+#define LOG_ALERT(...)	OSDP_LOG(LOG_ALERT, __VA_ARGS__)
+#define LOG_CRIT(...)	OSDP_LOG(LOG_CRIT, __VA_ARGS__)
+#define LOG_ERR(...)	OSDP_LOG(LOG_ERR, __VA_ARGS__)
+#define LOG_INF(...)	OSDP_LOG(LOG_INFO, __VA_ARGS__)
+#define LOG_WRN(...)	OSDP_LOG(LOG_WARNING, __VA_ARGS__)
+#define LOG_NOT(...)	OSDP_LOG(LOG_NOTICE, __VA_ARGS__)
+#define LOG_DBG(...)	OSDP_LOG(LOG_DEBUG, __VA_ARGS__)
+
+#define LOG_CTX_GLOBAL	-153
+#define LOG_MSG_MAX_LEN	256
 
 enum osdp_pd_nak_code_e {
 	/**
@@ -232,10 +259,18 @@ enum osdp_state_e {
 	OSDP_CP_STATE_OFFLINE
 };
 
+enum osdp_phy_rx_state_e {
+	OSDP_PHY_RX_STATE_MARK,
+	OSDP_PHY_RX_STATE_HEADER,
+	OSDP_PHY_RX_STATE_BODY,
+	OSDP_PHY_RX_STATE_DONE,
+};
+
 enum osdp_pkt_errors_e {
 	OSDP_ERR_PKT_FMT   = -1,
 	OSDP_ERR_PKT_WAIT  = -2,
-	OSDP_ERR_PKT_SKIP  = -3
+	OSDP_ERR_PKT_SKIP  = -3,
+	OSDP_ERR_PKT_RESEND = -4	/* repeated sequence number (PD) */
 };
 
 struct osdp_slab {
@@ -253,6 +288,55 @@ struct osdp_notifiers {
 };
 
 #ifdef CONFIG_OSDP_SC_ENABLED
+#define OSDP_AES_RK_WORDS              44  /* AES-128: 4 * (10 + 1) */
+
+/**
+ * An AES-128 key along with its expanded round keys. The contents of `rk` are
+ * private to the backend (`ops`) that was active when osdp_aes_key_init() was
+ * called on it.
+ */
+struct osdp_aes_key {
+	const struct osdp_aes_ops *ops;
+	union {
+		struct AES_ctx tiny;
+		uint32_t words[2][OSDP_AES_RK_WORDS]; /* encrypt, decrypt */
+		void *handle[2];
+	} rk;
+};
+
+/**
+ * AES-128 backend. Lengths are always a multiple of the 16 byte block size
+ * and the CBC methods do not write back to `iv`. `supported` and `release`
+ * are optional.
+ */
+struct osdp_aes_ops {
+	const char *name;
+	int (*supported)(void);
+	int (*set_key)(struct osdp_aes_key *k, const uint8_t *key);
+	void (*ecb_encrypt)(struct osdp_aes_key *k, uint8_t *block);
+	void (*ecb_decrypt)(struct osdp_aes_key *k, uint8_t *block);
+	void (*cbc_encrypt)(struct osdp_aes_key *k, const uint8_t *iv,
+			    uint8_t *data, int len);
+	void (*cbc_decrypt)(struct osdp_aes_key *k, const uint8_t *iv,
+			    uint8_t *data, int len);
+	void (*release)(struct osdp_aes_key *k);
+};
+
+/**
+ * Incremental secure channel MAC state; see osdp_mac_init().
+ *
+ * @param k1 S-MAC1 key; used for all but the last block
+ * @param k2 S-MAC2 key; used for the last block
+ * @param chain CBC chaining value with the pending block XORed in
+ * @param pos number of bytes of the pending block in `chain`
+ */
+struct osdp_mac_ctx {
+	struct osdp_aes_key *k1;
+	struct osdp_aes_key *k2;
+	uint8_t chain[16];
+	int pos;
+};
+
 struct osdp_secure_channel {
 	uint8_t scbk[16];
 	uint8_t s_enc[16];
@@ -265,14 +349,123 @@ struct osdp_secure_channel {
 	uint8_t pd_client_uid[8];
 	uint8_t cp_cryptogram[16];
 	uint8_t pd_cryptogram[16];
+
+	/* expanded key schedules of s_enc, s_mac1 and s_mac2 */
+	struct osdp_aes_key s_enc_ctx;
+	struct osdp_aes_key s_mac1_ctx;
+	struct osdp_aes_key s_mac2_ctx;
 };
 #endif
 
+/**
+ * Resumable receive state of osdp_phy_check_packet(). This lets the phy layer
+ * pick up from where it left off when more bytes are appended to rx_buf
+ * instead of re-validating the whole buffer each time.
+ *
+ * @param state one of enum osdp_phy_rx_state_e
+ * @param pkt_len length of the frame being received (including mark byte)
+ * @param pos offset into rx_buf till which `check` has been computed
+ * @param check running CRC16 (or checksum) of rx_buf[1 .. pos - 1]
+ */
+struct osdp_phy_rx {
+	int state;
+	int pkt_len;
+	int pos;
+	uint16_t check;
+};
+
+/**
+ * @brief Pool of fixed size blocks that grows in chunks up to a cap; see
+ * osdp_pool.c. Fields are private to it.
+ */
+struct osdp_pool {
+	size_t block_size;
+	int chunk_blocks;
+	int max_blocks;
+	int num_blocks;
+	int used_blocks;
+	void *free_list;
+	void *chunks;
+};
+
 struct osdp_queue {
 	queue_t queue;
-	slab_t slab;
+	struct osdp_pool pool;
+};
+
+#define OSDP_POLL_FRAME_LEN            9
+
+/**
+ * CMD_POLL frames of a PD, one for each sequence number, built at setup (see
+ * osdp_phy_poll_frame()). A POLL depends on nothing else when the secure
+ * channel is not active. When it is, sc[] holds the frame up to the MAC and
+ * sc_crc the CRC of that part, so only the MAC and CRC tail is computed for
+ * each one sent.
+ */
+struct osdp_poll_cache {
+	uint8_t plain[4][OSDP_POLL_FRAME_LEN];
+#ifdef CONFIG_OSDP_SC_ENABLED
+	uint8_t sc[4][OSDP_POLL_FRAME_LEN];
+	uint16_t sc_crc[4];
+#endif
+};
+
+/**
+ * @brief Bounded lock-free multi-producer single-consumer queue; see
+ * osdp_mpsc.c. Fields are private to it.
+ */
+struct osdp_mpsc {
+	uint8_t *buf;
+	uint32_t *seq;
+	size_t elem_size;
+	uint32_t mask;
+	uint32_t head;
+	uint32_t tail;
 };
 
+/**
+ * @brief PDs that share an osdp_channel (a multi-drop bus). Only one of them
+ * can have a command on the wire at any time; the others wait their turn.
+ *
+ * @param owner PD whose command is in flight; NULL when the bus is free
+ * @param burst_credit share of the bus time left for PDs in a poll burst; see
+ *        cp_bus_refresh()
+ * @param burst_pass set while cp_bus_refresh() serves PDs in a poll burst
+ * @param next index into pd[] of the PD that is served first in the next pass
+ * @param poll_gap_us time between the starts of two POLLs that keeps them
+ *        within OSDP_BUS_POLL_BUDGET_PCT of the bus time
+ * @param poll_due_us earliest time at which the next POLL may start
+ */
+struct osdp_bus {
+	struct osdp_pd *owner;
+	int next;
+	int burst_credit;
+	bool burst_pass;
+	int poll_gap_us;
+	int64_t poll_due_us;
+	int num_pd;
+	struct osdp_pd **pd;
+};
+
+#ifdef CONFIG_OSDP_THREADED_CP
+/**
+ * @brief A thread that drives all PDs on a bus.
+ *
+ * @param kick set (under lock) to wake the thread before its timeout
+ * @param now clock sampled at the start of each pass; used by its PDs
+ */
+struct osdp_cp_worker {
+	struct osdp *ctx;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int kick;
+	int stop;
+	int64_t now;
+	struct osdp_bus *bus;
+};
+#endif
+
 struct osdp_pd {
 	void *__parent;
 	int offset;
@@ -289,10 +482,12 @@ struct osdp_pd {
 	int state;
 	int phy_state;
 
+	int64_t *now;	/* clock sample of whoever is driving this PD */
 	int64_t tstamp;
 	int64_t sc_tstamp;
 	uint8_t rx_buf[OSDP_PACKET_BUF_SIZE];
 	int rx_buf_len;
+	struct osdp_phy_rx phy_rx;
 	int64_t phy_tstamp;
 
 	int cmd_id;
@@ -303,6 +498,55 @@ struct osdp_pd {
 		struct osdp_queue cmd;
 		struct osdp_queue event;
 	};
+	struct osdp_mpsc cmd_ingress;	/* from osdp_cp_send_command() */
+	int cmd_depth;			/* app commands not yet sent (CP) */
+	bool cmd_backlog;		/* cmd_depth went past the high mark */
+	bool cmd_inflight;		/* cmd_id was sent by the app (CP) */
+	uint32_t cmd_tag;		/* of that command */
+	int64_t cmd_submitted;		/* when the app sent it */
+	struct osdp_bus *bus;
+	int bus_offset;			/* index into bus->pd[] */
+
+	struct osdp_stats stats;
+	int64_t tx_tstamp;		/* when the last command was sent */
+
+	/**
+	 * Last frame sent, as it went on the wire. It is sent again verbatim
+	 * when a reply times out (CP) or when the CP repeats a sequence number
+	 * because our reply was lost (PD). Resending the encoded frame, rather
+	 * than building it again, leaves the sequence number and the secure
+	 * channel MAC chain untouched.
+	 */
+	uint8_t tx_buf[OSDP_PACKET_BUF_SIZE];
+	int tx_buf_len;
+	int resends;			/* of the frame in tx_buf (CP) */
+	int busy_retries;		/* of the frame in tx_buf (CP) */
+	struct osdp_poll_cache poll_cache;	/* CP only */
+
+	/**
+	 * CP only. Commands from the application that were queued when the PD
+	 * went offline are parked here, and sent once it is back online. The
+	 * time between reconnect attempts (retry_wait) doubles with each
+	 * failed one, from OSDP_CP_BACKOFF_MIN_MS to OSDP_CP_BACKOFF_MAX_MS,
+	 * less a random jitter so that PDs on a bus don't retry in lockstep.
+	 */
+	queue_t cmd_parked;
+	/**
+	 * CP only. Commands from the application, one queue for each of
+	 * CONTROL, INDICATOR and BULK of enum osdp_cmd_priority_e. The CP's
+	 * own commands (in cmd.queue) go ahead of all of them.
+	 */
+	queue_t cmd_lanes[OSDP_CP_CMD_LANES];
+	int backoff;			/* failed reconnects since last online */
+	int64_t retry_wait;
+	uint32_t backoff_rng;
+	int idle_polls;			/* since the last event (CP) */
+	int64_t burst_tstamp;		/* of the last event (CP) */
+#ifdef CONFIG_OSDP_THREADED_CP
+	struct osdp_cp_worker *worker;
+	bool event_held;		/* cp->events was full (CP) */
+	struct osdp_event held_event;
+#endif
 
 	struct osdp_channel channel;
 #ifdef CONFIG_OSDP_SC_ENABLED
@@ -320,6 +564,35 @@ struct osdp_cp {
 	int pd_offset;			/* current pd's offset into ctx->pd */
 	void *event_callback_arg;
 	cp_event_callback_t event_callback;
+	void *status_callback_arg;
+	cp_status_callback_t status_callback;
+	void *queue_callback_arg;
+	cp_queue_callback_t queue_callback;
+	int queue_high;			/* watermarks of pd->cmd_depth */
+	int queue_low;
+	void *completion_callback_arg;
+	cp_completion_callback_t completion_callback;
+	int num_bus;
+	struct osdp_bus *bus;
+	uint64_t *status_map;		/* bit i: PD i is online */
+	uint64_t *sc_status_map;	/* bit i: PD i is online with SC */
+	uint64_t *rx_wait_map;		/* bit i: PD i awaits a reply */
+	int num_rx_wait;
+	int num_online;
+	int num_sc_active;
+#ifdef CONFIG_OSDP_THREADED_CP
+	int num_workers;
+	struct osdp_cp_worker *workers;
+	struct osdp_mpsc events;	/* from workers to osdp_cp_refresh() */
+	int events_held;		/* some PD has an event_held */
+#endif
+};
+
+struct osdp_capture {
+	FILE *fp;
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_t lock;	/* CP workers share the capture file */
+#endif
 };
 
 struct osdp {
@@ -327,6 +600,11 @@ struct osdp {
 	uint32_t flags;
 	struct osdp_cp *cp;
 	struct osdp_pd *pd;
+	int64_t now;	/* clock sampled at the start of a refresh */
+	int log_level;	/* -1 to follow the global log level */
+	osdp_log_callback_t log_callback;
+	void *log_callback_arg;
+	struct osdp_capture capture;
 #ifdef CONFIG_OSDP_SC_ENABLED
 	uint8_t sc_master_key[16];
 #endif
@@ -348,35 +626,197 @@ enum log_levels_e {
 int osdp_phy_packet_init(struct osdp_pd *p, uint8_t *buf, int max_len);
 int osdp_phy_packet_finalize(struct osdp_pd *p, uint8_t *buf,
 			       int len, int max_len);
+int osdp_phy_check_packet(struct osdp_pd *p);
 int osdp_phy_decode_packet(struct osdp_pd *p, uint8_t *buf, int len);
+void osdp_phy_rx_reset(struct osdp_pd *pd);
+void osdp_phy_rx_discard(struct osdp_pd *pd, int len);
 void osdp_phy_state_reset(struct osdp_pd *pd);
+int osdp_phy_packet_get_address(const uint8_t *buf);
 int osdp_phy_packet_get_data_offset(struct osdp_pd *p, const uint8_t *buf);
 uint8_t *osdp_phy_packet_get_smb(struct osdp_pd *p, const uint8_t *buf);
+void osdp_phy_poll_cache_init(struct osdp_pd *pd);
+int osdp_phy_poll_frame(struct osdp_pd *pd, uint8_t *buf, int max_len);
+
+/* from osdp_cp.c */
+int osdp_cp_process_rx_buf(struct osdp_pd *pd);
+
+/* from osdp_capture.c */
+enum osdp_capture_dir_e {
+	OSDP_CAPTURE_CP_TX,
+	OSDP_CAPTURE_CP_RX,
+	OSDP_CAPTURE_PD_RX,
+	OSDP_CAPTURE_PD_TX,
+};
+
+void osdp_capture_init(struct osdp *ctx);
+void osdp_capture_del(struct osdp *ctx);
+void osdp_capture_write(struct osdp_pd *pd, int dir, int id,
+			const uint8_t *buf, int len);
+
+static inline void osdp_capture(struct osdp_pd *pd, int dir, int id,
+				const uint8_t *buf, int len)
+{
+	if (__atomic_load_n(&TO_CTX(pd)->capture.fp, __ATOMIC_RELAXED)) {
+		osdp_capture_write(pd, dir, id, buf, len);
+	}
+}
+
+/* from osdp_mpsc.c */
+int osdp_mpsc_init(struct osdp_mpsc *q, size_t elem_size, int capacity);
+void osdp_mpsc_del(struct osdp_mpsc *q);
+int osdp_mpsc_push(struct osdp_mpsc *q, const void *elem);
+int osdp_mpsc_pop(struct osdp_mpsc *q, void *elem);
+int osdp_mpsc_is_empty(struct osdp_mpsc *q);
+
+/* from osdp_pool.c */
+int osdp_pool_init(struct osdp_pool *p, size_t block_size, int chunk_blocks,
+		   int max_blocks);
+void osdp_pool_del(struct osdp_pool *p);
+void *osdp_pool_alloc(struct osdp_pool *p);
+void osdp_pool_free(struct osdp_pool *p, void *block);
 
 /* from osdp_sc.c */
 void osdp_compute_scbk(struct osdp_pd *p, uint8_t *scbk);
-void osdp_compute_session_keys(struct osdp *ctx);
+void osdp_compute_session_keys(struct osdp_pd *p);
 void osdp_compute_cp_cryptogram(struct osdp_pd *p);
 int osdp_verify_cp_cryptogram(struct osdp_pd *p);
 void osdp_compute_pd_cryptogram(struct osdp_pd *p);
 int osdp_verify_pd_cryptogram(struct osdp_pd *p);
 void osdp_compute_rmac_i(struct osdp_pd *p);
 int osdp_decrypt_data(struct osdp_pd *p, int is_cmd, uint8_t *data, int length);
-int osdp_encrypt_data(struct osdp_pd *p, int is_cmd, uint8_t *data, int length);
+#ifdef CONFIG_OSDP_SC_ENABLED
+int osdp_encrypt_data(struct osdp_pd *p, int is_cmd, uint8_t *data, int length,
+		      struct osdp_mac_ctx *mac);
+void osdp_mac_init(struct osdp_mac_ctx *mac, struct osdp_pd *p, int is_cmd);
+void osdp_mac_update(struct osdp_mac_ctx *mac, const uint8_t *data, int len);
+void osdp_mac_final(struct osdp_mac_ctx *mac, uint8_t *out);
+#endif
 int osdp_compute_mac(struct osdp_pd *p, int is_cmd, const uint8_t *data, int len);
 void osdp_sc_init(struct osdp_pd *p);
+void osdp_sc_teardown(struct osdp_pd *p);
+
+/* from osdp_crypto.c and osdp_aes_*.c */
+#ifdef CONFIG_OSDP_SC_ENABLED
+extern const struct osdp_aes_ops osdp_aes_tiny_ops;
+extern const struct osdp_aes_ops osdp_aes_ttable_ops;
+#ifdef CONFIG_OSDP_CRYPTO_AESNI
+extern const struct osdp_aes_ops osdp_aes_ni_ops;
+#endif
+#ifdef CONFIG_OSDP_CRYPTO_OPENSSL
+extern const struct osdp_aes_ops osdp_aes_openssl_ops;
+#endif
+extern const struct osdp_aes_ops *const osdp_aes_backends[];
+
+const struct osdp_aes_ops *osdp_crypto_get_ops(void);
+int osdp_crypto_set_ops(const struct osdp_aes_ops *ops);
+void osdp_aes_key_init(struct osdp_aes_key *k, const uint8_t *key);
+void osdp_aes_key_release(struct osdp_aes_key *k);
+void osdp_encrypt_ctx(struct osdp_aes_key *k, uint8_t *iv,
+		      uint8_t *data, int len);
+void osdp_decrypt_ctx(struct osdp_aes_key *k, uint8_t *iv,
+		      uint8_t *data, int len);
+#endif
+void osdp_encrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len);
+void osdp_decrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len);
+
+/* from osdp_crc.c */
+#define OSDP_CRC16_SEED                0x1D0F
+uint16_t osdp_compute_crc16(const uint8_t *buf, size_t len);
+uint16_t osdp_crc16_bytewise(uint16_t seed, const uint8_t *buf, size_t len);
+uint16_t osdp_crc16_table(uint16_t seed, const uint8_t *buf, size_t len);
+uint16_t osdp_crc16_slice4(uint16_t seed, const uint8_t *buf, size_t len);
+uint16_t osdp_crc16_slice8(uint16_t seed, const uint8_t *buf, size_t len);
 
 /* from osdp_common.c */
 int64_t osdp_millis_now(void);
 int64_t osdp_millis_since(int64_t last);
+int osdp_status_bitmap_copy(osdp_t *ctx, const uint64_t *map,
+			    const int *count, uint64_t *bitmap, int n);
+
+/**
+ * The clock is read once per refresh and shared by all PDs of the context
+ * (or of the worker thread, in threaded CP mode; see struct osdp_pd::now).
+ * The FSMs must use these rather than osdp_millis_now()/osdp_millis_since().
+ */
+static inline void osdp_clock_update(struct osdp *ctx)
+{
+	ctx->now = osdp_millis_now();
+}
+
+static inline int64_t osdp_pd_millis_now(struct osdp_pd *pd)
+{
+	return *pd->now;
+}
+
+static inline int64_t osdp_pd_millis_since(struct osdp_pd *pd, int64_t last)
+{
+	return *pd->now - last;
+}
+
+/**
+ * Stats are written only by the thread that drives the PD but are read (and
+ * reset) by the application. Relaxed atomics keep that well defined while
+ * still compiling to a plain load-add-store.
+ */
+#define OSDP_STATS_ADD(pd, f, n)                                           \
+	__atomic_store_n(&(pd)->stats.f,                                   \
+			 __atomic_load_n(&(pd)->stats.f, __ATOMIC_RELAXED) \
+			 + (n), __ATOMIC_RELAXED)
+#define OSDP_STATS_INC(pd, f)          OSDP_STATS_ADD(pd, f, 1)
+
+static inline void osdp_stats_nak(struct osdp_pd *pd, int code)
+{
+	if (code < 0 || code >= OSDP_STATS_NAK_CODES) {
+		code = 0;
+	}
+	OSDP_STATS_INC(pd, naks[code]);
+}
+
+static inline void osdp_stats_latency(struct osdp_pd *pd, int64_t millis)
+{
+	int i = 0;
+
+	if (millis > 0) {
+		/* bucket i holds [2^(i-1), 2^i) ms */
+		i = 64 - __builtin_clzll((uint64_t)millis);
+		if (i >= OSDP_STATS_LATENCY_BUCKETS) {
+			i = OSDP_STATS_LATENCY_BUCKETS - 1;
+		}
+	}
+	OSDP_STATS_INC(pd, latency[i]);
+}
+
+extern int g_log_level;
+extern OSDP_THREAD_LOCAL struct osdp *g_log_osdp;
+
+/* level of the context this thread is logging for; else the global level */
+static inline int osdp_log_level()
+{
+	int log_level = -1;
+
+	if (g_log_osdp != NULL) {
+		log_level = __atomic_load_n(&g_log_osdp->log_level,
+					    __ATOMIC_RELAXED);
+	}
+	if (log_level < 0) {
+		log_level = __atomic_load_n(&g_log_level, __ATOMIC_RELAXED);
+	}
+	return log_level;
+}
+
+typedef void (*osdp_log_emit_fn_t)(struct osdp *ctx, int log_level,
+				   int log_ctx, int64_t tstamp,
+				   const char *msg);
+
 void osdp_dump(const char *head, uint8_t *buf, int len);
-uint16_t osdp_compute_crc16(const uint8_t *buf, size_t len);
 void osdp_log(int log_level, const char *fmt, ...);
-void osdp_log_ctx_set(int log_ctx);
+void osdp_log_ring_record(struct osdp *ctx, int log_level, int log_ctx,
+			  const char *fmt, va_list args);
+int osdp_log_ring_flush(osdp_log_emit_fn_t emit);
+void osdp_log_ctx_set(struct osdp_pd *pd);
 void osdp_log_ctx_reset();
 void osdp_log_ctx_restore();
-void osdp_encrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len);
-void osdp_decrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len);
+void osdp_log_ctx_release(struct osdp *ctx);
 void osdp_fill_random(uint8_t *buf, int len);
 void safe_free(void *p);
 
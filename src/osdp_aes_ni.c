@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * AES-128 using the x86 AES-NI instructions. The functions here are built
+ * with a per-function target attribute (rather than -maes for the whole
+ * file) so the library still loads on CPUs without AES-NI; the backend is
+ * only picked if CPUID says it is there.
+ *
+ * CBC encryption is inherently serial. CBC decryption is not, so it is done
+ * four blocks at a time to keep the AESDEC pipeline full.
+ */
+
+#include "osdp_common.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AESNI_TARGET                   __attribute__((target("aes,sse2")))
+
+#define AESNI_RK(k, dir, i)            \
+	_mm_loadu_si128((const __m128i *)&(k)->rk.words[dir][4 * (i)])
+#define AESNI_RK_SET(k, dir, i, v)     \
+	_mm_storeu_si128((__m128i *)&(k)->rk.words[dir][4 * (i)], (v))
+
+static int aesni_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+	return (ecx & bit_AES) != 0;
+}
+
+AESNI_TARGET
+static inline __m128i aesni_expand(__m128i key, __m128i assist)
+{
+	assist = _mm_shuffle_epi32(assist, 0xff);
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, assist);
+}
+
+/* aeskeygenassist needs the round constant as an immediate */
+#define AESNI_EXPAND(k, i, rcon) do {                                   \
+		__m128i prev_rk = AESNI_RK(k, 0, (i) - 1);              \
+		AESNI_RK_SET(k, 0, i, aesni_expand(prev_rk,             \
+			_mm_aeskeygenassist_si128(prev_rk, rcon)));     \
+	} while (0)
+
+AESNI_TARGET
+static int aesni_set_key(struct osdp_aes_key *k, const uint8_t *key)
+{
+	int i;
+
+	AESNI_RK_SET(k, 0, 0, _mm_loadu_si128((const __m128i *)key));
+	AESNI_EXPAND(k, 1, 0x01);
+	AESNI_EXPAND(k, 2, 0x02);
+	AESNI_EXPAND(k, 3, 0x04);
+	AESNI_EXPAND(k, 4, 0x08);
+	AESNI_EXPAND(k, 5, 0x10);
+	AESNI_EXPAND(k, 6, 0x20);
+	AESNI_EXPAND(k, 7, 0x40);
+	AESNI_EXPAND(k, 8, 0x80);
+	AESNI_EXPAND(k, 9, 0x1b);
+	AESNI_EXPAND(k, 10, 0x36);
+
+	/* decrypt schedule for AESDEC: reversed, InvMixColumns in between */
+	AESNI_RK_SET(k, 1, 0, AESNI_RK(k, 0, 10));
+	for (i = 1; i < 10; i++) {
+		AESNI_RK_SET(k, 1, i, _mm_aesimc_si128(AESNI_RK(k, 0, 10 - i)));
+	}
+	AESNI_RK_SET(k, 1, 10, AESNI_RK(k, 0, 0));
+	return 0;
+}
+
+AESNI_TARGET
+static inline __m128i aesni_encrypt_block(const __m128i *rk, __m128i b)
+{
+	int i;
+
+	b = _mm_xor_si128(b, rk[0]);
+	for (i = 1; i < 10; i++) {
+		b = _mm_aesenc_si128(b, rk[i]);
+	}
+	return _mm_aesenclast_si128(b, rk[10]);
+}
+
+AESNI_TARGET
+static inline __m128i aesni_decrypt_block(const __m128i *rk, __m128i b)
+{
+	int i;
+
+	b = _mm_xor_si128(b, rk[0]);
+	for (i = 1; i < 10; i++) {
+		b = _mm_aesdec_si128(b, rk[i]);
+	}
+	return _mm_aesdeclast_si128(b, rk[10]);
+}
+
+AESNI_TARGET
+static inline void aesni_load_schedule(struct osdp_aes_key *k, int dir,
+				       __m128i *rk)
+{
+	int i;
+
+	for (i = 0; i <= 10; i++) {
+		rk[i] = AESNI_RK(k, dir, i);
+	}
+}
+
+AESNI_TARGET
+static void aesni_ecb_encrypt(struct osdp_aes_key *k, uint8_t *block)
+{
+	__m128i rk[11], b;
+
+	aesni_load_schedule(k, 0, rk);
+	b = _mm_loadu_si128((const __m128i *)block);
+	_mm_storeu_si128((__m128i *)block, aesni_encrypt_block(rk, b));
+}
+
+AESNI_TARGET
+static void aesni_ecb_decrypt(struct osdp_aes_key *k, uint8_t *block)
+{
+	__m128i rk[11], b;
+
+	aesni_load_schedule(k, 1, rk);
+	b = _mm_loadu_si128((const __m128i *)block);
+	_mm_storeu_si128((__m128i *)block, aesni_decrypt_block(rk, b));
+}
+
+AESNI_TARGET
+static void aesni_cbc_encrypt(struct osdp_aes_key *k, const uint8_t *iv,
+			      uint8_t *data, int len)
+{
+	int i;
+	__m128i rk[11], b;
+
+	aesni_load_schedule(k, 0, rk);
+	b = _mm_loadu_si128((const __m128i *)iv);
+	for (i = 0; i < len; i += 16) {
+		b = _mm_xor_si128(b, _mm_loadu_si128((__m128i *)(data + i)));
+		b = aesni_encrypt_block(rk, b);
+		_mm_storeu_si128((__m128i *)(data + i), b);
+	}
+}
+
+AESNI_TARGET
+static void aesni_cbc_decrypt(struct osdp_aes_key *k, const uint8_t *iv,
+			      uint8_t *data, int len)
+{
+	int i, j, r;
+	__m128i rk[11], prev, c[4], b[4];
+
+	aesni_load_schedule(k, 1, rk);
+	prev = _mm_loadu_si128((const __m128i *)iv);
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		for (j = 0; j < 4; j++) {
+			c[j] = _mm_loadu_si128((__m128i *)(data + i + 16 * j));
+			b[j] = _mm_xor_si128(c[j], rk[0]);
+		}
+		for (r = 1; r < 10; r++) {
+			for (j = 0; j < 4; j++) {
+				b[j] = _mm_aesdec_si128(b[j], rk[r]);
+			}
+		}
+		for (j = 0; j < 4; j++) {
+			b[j] = _mm_aesdeclast_si128(b[j], rk[10]);
+			b[j] = _mm_xor_si128(b[j], prev);
+			_mm_storeu_si128((__m128i *)(data + i + 16 * j), b[j]);
+			prev = c[j];
+		}
+	}
+	for (; i < len; i += 16) {
+		c[0] = _mm_loadu_si128((__m128i *)(data + i));
+		b[0] = _mm_xor_si128(aesni_decrypt_block(rk, c[0]), prev);
+		_mm_storeu_si128((__m128i *)(data + i), b[0]);
+		prev = c[0];
+	}
+}
+
+const struct osdp_aes_ops osdp_aes_ni_ops = {
+	.name = "aes-ni",
+	.supported = aesni_supported,
+	.set_key = aesni_set_key,
+	.ecb_encrypt = aesni_ecb_encrypt,
+	.ecb_decrypt = aesni_ecb_decrypt,
+	.cbc_encrypt = aesni_cbc_encrypt,
+	.cbc_decrypt = aesni_cbc_decrypt,
+};
+
+#else /* x86 && GNUC */
+
+static int aesni_supported(void)
+{
+	return 0;
+}
+
+/* Never selected; present so the backend list need not change per arch */
+const struct osdp_aes_ops osdp_aes_ni_ops = {
+	.name = "aes-ni",
+	.supported = aesni_supported,
+};
+
+#endif /* x86 && GNUC */
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * AES-128 through OpenSSL's EVP interface (-DCONFIG_OSDP_CRYPTO_OPENSSL=on).
+ *
+ * One EVP_CIPHER_CTX per direction is created when the key is set and kept
+ * for the lifetime of the key; each call only resets the IV so OpenSSL does
+ * not redo its key schedule. A single ECB block is the same as a single CBC
+ * block with an all-zero IV, so both modes share the CBC context.
+ */
+
+#include <openssl/evp.h>
+
+#include "osdp_common.h"
+
+#define TAG "CRYPTO: "
+
+static const uint8_t openssl_zero_iv[16];
+
+static int openssl_set_key(struct osdp_aes_key *k, const uint8_t *key)
+{
+	int enc;
+	EVP_CIPHER_CTX *ctx;
+
+	for (enc = 0; enc < 2; enc++) {
+		ctx = k->rk.handle[enc];
+		if (ctx == NULL) {
+			ctx = EVP_CIPHER_CTX_new();
+			if (ctx == NULL) {
+				LOG_ERR(TAG "EVP_CIPHER_CTX_new failed");
+				return -1;
+			}
+			k->rk.handle[enc] = ctx;
+		}
+		if (EVP_CipherInit_ex(ctx, EVP_aes_128_cbc(), NULL,
+				      key, openssl_zero_iv, enc) != 1) {
+			LOG_ERR(TAG "EVP_CipherInit_ex failed");
+			return -1;
+		}
+		EVP_CIPHER_CTX_set_padding(ctx, 0);
+	}
+	return 0;
+}
+
+static void openssl_cipher(struct osdp_aes_key *k, int enc, const uint8_t *iv,
+			   uint8_t *data, int len)
+{
+	int out_len;
+	EVP_CIPHER_CTX *ctx = k->rk.handle[enc];
+
+	if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1) != 1 ||
+	    EVP_CipherUpdate(ctx, data, &out_len, data, len) != 1 ||
+	    out_len != len) {
+		LOG_ERR(TAG "EVP_CipherUpdate failed");
+	}
+}
+
+static void openssl_ecb_encrypt(struct osdp_aes_key *k, uint8_t *block)
+{
+	openssl_cipher(k, 1, openssl_zero_iv, block, 16);
+}
+
+static void openssl_ecb_decrypt(struct osdp_aes_key *k, uint8_t *block)
+{
+	openssl_cipher(k, 0, openssl_zero_iv, block, 16);
+}
+
+static void openssl_cbc_encrypt(struct osdp_aes_key *k, const uint8_t *iv,
+				uint8_t *data, int len)
+{
+	openssl_cipher(k, 1, iv, data, len);
+}
+
+static void openssl_cbc_decrypt(struct osdp_aes_key *k, const uint8_t *iv,
+				uint8_t *data, int len)
+{
+	openssl_cipher(k, 0, iv, data, len);
+}
+
+static void openssl_release(struct osdp_aes_key *k)
+{
+	EVP_CIPHER_CTX_free(k->rk.handle[0]);
+	EVP_CIPHER_CTX_free(k->rk.handle[1]);
+	k->rk.handle[0] = NULL;
+	k->rk.handle[1] = NULL;
+}
+
+const struct osdp_aes_ops osdp_aes_openssl_ops = {
+	.name = "openssl",
+	.set_key = openssl_set_key,
+	.ecb_encrypt = openssl_ecb_encrypt,
+	.ecb_decrypt = openssl_ecb_decrypt,
+	.cbc_encrypt = openssl_cbc_encrypt,
+	.cbc_decrypt = openssl_cbc_decrypt,
+	.release = openssl_release,
+};
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * Packet capture and replay. Captures are standard pcap files (so they can
+ * be opened with existing tools) with one record per packet sent or chunk of
+ * bytes received. Each record starts with a 4 byte pseudo header; see
+ * struct capture_hdr below.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "osdp_common.h"
+
+#define TAG "CAP: "
+
+#define PCAP_MAGIC                     0xa1b2c3d4
+#define PCAP_MAGIC_SWAPPED             0xd4c3b2a1
+#define PCAP_LINKTYPE_USER0            147
+#define CAPTURE_BUF_SIZE               (64 * 1024)
+#define CAPTURE_MAX_PD                 256
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t network;
+};
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct capture_hdr {
+	uint8_t dir;		/* enum osdp_capture_dir_e */
+	uint8_t pd;		/* PD offset */
+	uint8_t address;	/* PD address */
+	uint8_t id;		/* command/reply ID for TX records; else 0 */
+};
+
+void osdp_capture_init(struct osdp *ctx)
+{
+	ctx->capture.fp = NULL;
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_init(&ctx->capture.lock, NULL);
+#endif
+}
+
+void osdp_capture_del(struct osdp *ctx)
+{
+	osdp_capture_stop(ctx);
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_destroy(&ctx->capture.lock);
+#endif
+}
+
+static void capture_lock(struct osdp *ctx)
+{
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_lock(&ctx->capture.lock);
+#else
+	ARG_UNUSED(ctx);
+#endif
+}
+
+static void capture_unlock(struct osdp *ctx)
+{
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_unlock(&ctx->capture.lock);
+#else
+	ARG_UNUSED(ctx);
+#endif
+}
+
+void osdp_capture_write(struct osdp_pd *pd, int dir, int id,
+			const uint8_t *buf, int len)
+{
+	struct osdp *ctx = TO_CTX(pd);
+	int64_t now = osdp_millis_now();
+	struct capture_hdr hdr = {
+		.dir = dir,
+		.pd = pd->offset,
+		.address = pd->address,
+		.id = id,
+	};
+	struct pcap_rec_hdr rec = {
+		.ts_sec = (uint32_t)(now / 1000),
+		.ts_usec = (uint32_t)(now % 1000) * 1000,
+		.incl_len = sizeof(hdr) + len,
+		.orig_len = sizeof(hdr) + len,
+	};
+
+	capture_lock(ctx);
+	if (ctx->capture.fp != NULL) {
+		fwrite(&rec, sizeof(rec), 1, ctx->capture.fp);
+		fwrite(&hdr, sizeof(hdr), 1, ctx->capture.fp);
+		fwrite(buf, 1, len, ctx->capture.fp);
+	}
+	capture_unlock(ctx);
+}
+
+OSDP_EXPORT
+int osdp_capture_start(osdp_t *ctx, const char *path)
+{
+	FILE *fp;
+	struct pcap_file_hdr hdr = {
+		.magic = PCAP_MAGIC,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = sizeof(struct capture_hdr) + OSDP_PACKET_BUF_SIZE,
+		.network = PCAP_LINKTYPE_USER0,
+	};
+
+	assert(ctx);
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		LOG_ERR(TAG "failed to open %s", path);
+		return -1;
+	}
+	setvbuf(fp, NULL, _IOFBF, CAPTURE_BUF_SIZE);
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+		fclose(fp);
+		return -1;
+	}
+	osdp_capture_stop(ctx);
+	capture_lock(ctx);
+	__atomic_store_n(&TO_OSDP(ctx)->capture.fp, fp, __ATOMIC_RELAXED);
+	capture_unlock(ctx);
+	return 0;
+}
+
+OSDP_EXPORT
+void osdp_capture_stop(osdp_t *ctx)
+{
+	FILE *fp;
+
+	assert(ctx);
+
+	capture_lock(ctx);
+	fp = TO_OSDP(ctx)->capture.fp;
+	__atomic_store_n(&TO_OSDP(ctx)->capture.fp, NULL, __ATOMIC_RELAXED);
+	capture_unlock(ctx);
+	if (fp != NULL) {
+		fclose(fp);
+	}
+}
+
+/* --- replay --- */
+
+struct capture_replay {
+	struct osdp ctx;
+	struct osdp_cp cp;
+	struct osdp_pd *pd[2][CAPTURE_MAX_PD];	/* [is_pd_side][offset] */
+	struct osdp_replay_stats *stats;
+};
+
+static struct osdp_pd *replay_get_pd(struct capture_replay *r,
+				     struct capture_hdr *hdr)
+{
+	int pd_side = (hdr->dir == OSDP_CAPTURE_PD_RX ||
+		       hdr->dir == OSDP_CAPTURE_PD_TX);
+	struct osdp_pd *pd = r->pd[pd_side][hdr->pd];
+
+	if (pd == NULL) {
+		pd = calloc(1, sizeof(struct osdp_pd));
+		if (pd == NULL) {
+			return NULL;
+		}
+		pd->__parent = &r->ctx;
+		pd->offset = hdr->pd;
+		pd->now = &r->ctx.now;
+		pd->seq_number = -1;
+		SET_FLAG(pd, PD_FLAG_SKIP_SEQ_CHECK);
+		if (pd_side) {
+			SET_FLAG(pd, PD_FLAG_PD_MODE);
+		}
+		r->pd[pd_side][hdr->pd] = pd;
+	}
+	pd->address = hdr->address;
+	return pd;
+}
+
+static void replay_rx_append(struct osdp_pd *pd, const uint8_t *buf, int len)
+{
+	int max_len = sizeof(pd->rx_buf) - pd->rx_buf_len;
+
+	if (len > max_len) {
+		len = max_len;
+	}
+	memcpy(pd->rx_buf + pd->rx_buf_len, buf, len);
+	pd->rx_buf_len += len;
+}
+
+static void replay_cp_rx(struct capture_replay *r, struct osdp_pd *pd,
+			 const uint8_t *buf, int len)
+{
+	int ret;
+
+	replay_rx_append(pd, buf, len);
+	ret = osdp_cp_process_rx_buf(pd);
+	if (ret == 1) {
+		return;	/* OSDP_CP_ERR_NO_DATA: incomplete reply */
+	}
+	if (ret < 0) {
+		r->stats->errors++;
+	} else {
+		r->stats->frames++;
+	}
+	osdp_phy_rx_reset(pd);
+}
+
+static void replay_pd_rx(struct capture_replay *r, struct osdp_pd *pd,
+			 const uint8_t *buf, int len)
+{
+	int ret;
+
+	replay_rx_append(pd, buf, len);
+	ret = osdp_phy_check_packet(pd);
+	if (ret == OSDP_ERR_PKT_WAIT) {
+		return;
+	}
+	if (ret > 0) {
+		ret = osdp_phy_decode_packet(pd, pd->rx_buf, ret);
+	}
+	if (ret == OSDP_ERR_PKT_WAIT || ret == OSDP_ERR_PKT_FMT) {
+		r->stats->errors++;
+	} else if (ret != OSDP_ERR_PKT_SKIP) {
+		r->stats->frames++;
+	}
+	osdp_phy_rx_reset(pd);
+}
+
+static int replay_record(struct capture_replay *r, struct capture_hdr *hdr,
+			 const uint8_t *buf, int len)
+{
+	struct osdp_pd *pd;
+
+	pd = replay_get_pd(r, hdr);
+	if (pd == NULL) {
+		return -1;
+	}
+	switch (hdr->dir) {
+	case OSDP_CAPTURE_CP_TX:
+		/* the reply that follows is for this command */
+		pd->cmd_id = hdr->id;
+		osdp_phy_rx_reset(pd);
+		break;
+	case OSDP_CAPTURE_CP_RX:
+		replay_cp_rx(r, pd, buf, len);
+		break;
+	case OSDP_CAPTURE_PD_RX:
+		replay_pd_rx(r, pd, buf, len);
+		break;
+	case OSDP_CAPTURE_PD_TX:
+		osdp_phy_rx_reset(pd);
+		break;
+	}
+	return 0;
+}
+
+static uint32_t swap32(uint32_t v, int swap)
+{
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+OSDP_EXPORT
+int osdp_capture_replay(const char *path, cp_event_callback_t cb, void *arg,
+			struct osdp_replay_stats *stats)
+{
+	FILE *fp;
+	int i, j, swap, len, ret = -1;
+	struct capture_replay *r;
+	struct pcap_file_hdr fhdr;
+	struct pcap_rec_hdr rec;
+	struct capture_hdr hdr;
+	uint8_t buf[OSDP_PACKET_BUF_SIZE];
+
+	assert(stats);
+	memset(stats, 0, sizeof(struct osdp_replay_stats));
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		LOG_ERR(TAG "failed to open %s", path);
+		return -1;
+	}
+	r = calloc(1, sizeof(struct capture_replay));
+	if (r == NULL) {
+		goto out;
+	}
+	r->ctx.magic = 0xDEADBEAF;
+	r->ctx.flags = FLAG_CP_MODE;
+	r->ctx.log_level = -1;
+	r->ctx.cp = &r->cp;
+	r->ctx.now = osdp_millis_now();
+	r->cp.__parent = &r->ctx;
+	r->cp.event_callback = cb;
+	r->cp.event_callback_arg = arg;
+	r->stats = stats;
+
+	if (fread(&fhdr, sizeof(fhdr), 1, fp) != 1 ||
+	    (fhdr.magic != PCAP_MAGIC && fhdr.magic != PCAP_MAGIC_SWAPPED)) {
+		LOG_ERR(TAG "%s is not a pcap file", path);
+		goto out;
+	}
+	swap = fhdr.magic == PCAP_MAGIC_SWAPPED;
+	if (swap32(fhdr.network, swap) != PCAP_LINKTYPE_USER0) {
+		LOG_ERR(TAG "%s is not a LibOSDP capture", path);
+		goto out;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		len = (int)swap32(rec.incl_len, swap) - (int)sizeof(hdr);
+		if (len < 0 || len > (int)sizeof(buf) ||
+		    fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+		    fread(buf, 1, len, fp) != (size_t)len) {
+			LOG_ERR(TAG "truncated record %u", stats->records);
+			break;
+		}
+		stats->records++;
+		if (replay_record(r, &hdr, buf, len)) {
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	if (r != NULL) {
+		for (i = 0; i < 2; i++) {
+			for (j = 0; j < CAPTURE_MAX_PD; j++) {
+				safe_free(r->pd[i][j]);
+			}
+		}
+		safe_free(r);
+	}
+	fclose(fp);
+	return ret;
+}
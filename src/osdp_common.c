@@ -10,14 +10,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
-#include <sys/time.h>
+#include <time.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "osdp_common.h"
 
-#define LOG_CTX_GLOBAL -153
-
 #ifndef PROJECT_VERSION
 #define PROJECT_VERSION "0.0.0"
 #endif
@@ -41,75 +39,149 @@ const char *log_level_names[LOG_MAX_LEVEL] = {
 	"WARN ", "NOTIC", "INFO ", "DEBUG"
 };
 
-int g_log_level = LOG_WARNING;	/* Note: log level is not contextual */
-int g_log_ctx = LOG_CTX_GLOBAL;
-int g_old_log_ctx = LOG_CTX_GLOBAL;
+int g_log_level = LOG_WARNING;	/* used by contexts without a level */
+/* each thread logs for the context and PD it is working on */
+OSDP_THREAD_LOCAL struct osdp *g_log_osdp;
+OSDP_THREAD_LOCAL int g_log_ctx = LOG_CTX_GLOBAL;
+static OSDP_THREAD_LOCAL struct osdp *g_old_log_osdp;
+static OSDP_THREAD_LOCAL int g_old_log_ctx = LOG_CTX_GLOBAL;
 int (*log_printf)(const char *fmt, ...) = printf;
+static int g_log_deferred;
+static int g_log_color = -1;	/* -1: not yet known */
 
-void osdp_log_set_color(const char *color)
+/* colors are only used when printing to a terminal with the default printf */
+static bool osdp_log_use_color()
 {
-	int ret, len;
+	int color = __atomic_load_n(&g_log_color, __ATOMIC_RELAXED);
 
-	len = strnlen(color, 8);
-	if (isatty(fileno(stdout))) {
-		ret = write(fileno(stdout), color, len);
-		assert(ret == len);
-		ARG_UNUSED(ret); /* squash warning in Release builds */
+	if (color == -1) {
+		color = isatty(fileno(stdout));
+		__atomic_store_n(&g_log_color, color, __ATOMIC_RELAXED);
 	}
+	return color && log_printf == printf;
+}
+
+static void osdp_log_emit(struct osdp *ctx, int log_level, int log_ctx,
+			  int64_t tstamp, const char *msg)
+{
+	char head[48];
+	int len = 0;
+	const char *color = "", *reset = "";
+
+	if (ctx != NULL && ctx->log_callback != NULL) {
+		ctx->log_callback(ctx->log_callback_arg, log_level,
+				  log_ctx == LOG_CTX_GLOBAL ? -1 : log_ctx, msg);
+		return;
+	}
+	if (osdp_log_use_color()) {
+		color = log_level_colors[log_level];
+		reset = RESET;
+	}
+	if (tstamp >= 0) {
+		len = snprintf(head, sizeof(head), "[%lld.%03d] ",
+			       (long long)(tstamp / 1000),
+			       (int)(tstamp % 1000));
+	}
+	if (log_ctx != LOG_CTX_GLOBAL) {
+		snprintf(head + len, sizeof(head) - len, "PD[%d] ", log_ctx);
+	} else {
+		head[len] = '\0';
+	}
+	log_printf("%sOSDP: %s: %s%s\n%s", color, log_level_names[log_level],
+		   head, msg, reset);
 }
 
 OSDP_EXPORT
 void osdp_logger_init(int log_level, int (*log_fn)(const char *fmt, ...))
 {
-	g_log_level = log_level;
+	__atomic_store_n(&g_log_level, log_level, __ATOMIC_RELAXED);
 	if (log_fn != NULL) {
 		log_printf = log_fn;
 	}
 }
 
-void osdp_log_ctx_set(int log_ctx)
+OSDP_EXPORT
+void osdp_logger_ctx_init(osdp_t *ctx, int log_level, osdp_log_callback_t cb,
+			  void *arg)
+{
+	assert(ctx);
+
+	TO_OSDP(ctx)->log_callback_arg = arg;
+	TO_OSDP(ctx)->log_callback = cb;
+	__atomic_store_n(&TO_OSDP(ctx)->log_level, log_level, __ATOMIC_RELAXED);
+}
+
+OSDP_EXPORT
+void osdp_logger_set_deferred(int enable)
+{
+	__atomic_store_n(&g_log_deferred, enable, __ATOMIC_RELAXED);
+	if (!enable) {
+		osdp_logger_flush();
+	}
+}
+
+OSDP_EXPORT
+int osdp_logger_flush()
+{
+	return osdp_log_ring_flush(osdp_log_emit);
+}
+
+void osdp_log_ctx_set(struct osdp_pd *pd)
 {
+	g_old_log_osdp = g_log_osdp;
 	g_old_log_ctx = g_log_ctx;
-	g_log_ctx = log_ctx;
+	g_log_osdp = TO_CTX(pd);
+	g_log_ctx = pd->offset;
 }
 
 void osdp_log_ctx_reset()
 {
+	g_old_log_osdp = g_log_osdp;
 	g_old_log_ctx = g_log_ctx;
+	g_log_osdp = NULL;
 	g_log_ctx = LOG_CTX_GLOBAL;
 }
 
 void osdp_log_ctx_restore()
 {
+	g_log_osdp = g_old_log_osdp;
 	g_log_ctx = g_old_log_ctx;
 }
 
+/* called before a context is freed; its deferred messages refer to it */
+void osdp_log_ctx_release(struct osdp *ctx)
+{
+	osdp_logger_flush();
+	if (g_log_osdp == ctx) {
+		osdp_log_ctx_reset();
+	}
+	if (g_old_log_osdp == ctx) {
+		g_old_log_osdp = NULL;
+		g_old_log_ctx = LOG_CTX_GLOBAL;
+	}
+}
+
 void osdp_log(int log_level, const char *fmt, ...)
 {
 	va_list args;
-	char *buf;
+	char buf[LOG_MSG_MAX_LEN];
 
 	if (log_level < LOG_EMERG || log_level >= LOG_MAX_LEVEL) {
 		return;
 	}
-	if (log_level > g_log_level) {
+	if (log_level > osdp_log_level()) {
 		return;
 	}
 	va_start(args, fmt);
-	if (vasprintf(&buf, fmt, args) == -1) {
-		log_printf("vasprintf error\n");
+	if (__atomic_load_n(&g_log_deferred, __ATOMIC_RELAXED)) {
+		osdp_log_ring_record(g_log_osdp, log_level, g_log_ctx, fmt,
+				     args);
+		va_end(args);
 		return;
 	}
+	vsnprintf(buf, sizeof(buf), fmt, args);
 	va_end(args);
-	osdp_log_set_color(log_level_colors[log_level]);
-	if (g_log_ctx == LOG_CTX_GLOBAL) {
-		log_printf("OSDP: %s: %s\n", log_level_names[log_level], buf);
-	} else {
-		log_printf("OSDP: %s: PD[%d] %s\n", log_level_names[log_level],
-			   g_log_ctx, buf);
-	}
-	osdp_log_set_color(RESET);
-	free(buf);
+	osdp_log_emit(g_log_osdp, log_level, g_log_ctx, -1, buf);
 }
 
 void osdp_dump(const char *head, uint8_t *buf, int len)
@@ -117,29 +189,25 @@ void osdp_dump(const char *head, uint8_t *buf, int len)
 	hexdump(head, buf, len);
 }
 
-uint16_t crc16_itu_t(uint16_t seed, const uint8_t * src, size_t len)
-{
-	for (; len > 0; len--) {
-		seed = (seed >> 8U) | (seed << 8U);
-		seed ^= *src++;
-		seed ^= (seed & 0xffU) >> 4U;
-		seed ^= seed << 12U;
-		seed ^= (seed & 0xffU) << 5U;
-	}
-	return seed;
-}
+static int64_t (*g_millis_fn)(void *arg);
+static void *g_millis_arg;
 
-uint16_t osdp_compute_crc16(const uint8_t *buf, size_t len)
+OSDP_EXPORT
+void osdp_set_time_source(int64_t (*millis_fn)(void *arg), void *arg)
 {
-	return crc16_itu_t(0x1D0F, buf, len);
+	g_millis_fn = millis_fn;
+	g_millis_arg = arg;
 }
 
 int64_t osdp_millis_now()
 {
-	struct timeval tv;
+	struct timespec ts;
 
-	gettimeofday(&tv, NULL);
-	return (int64_t) ((tv.tv_sec) * 1000L + (tv.tv_usec) / 1000L);
+	if (g_millis_fn != NULL) {
+		return g_millis_fn(g_millis_arg);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
 }
 
 int64_t osdp_millis_since(int64_t last)
@@ -148,39 +216,6 @@ int64_t osdp_millis_since(int64_t last)
 }
 
 #ifdef CONFIG_OSDP_SC_ENABLED
-#include "osdp_aes.h"
-
-void osdp_encrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len)
-{
-	struct AES_ctx aes_ctx;
-
-	if (iv != NULL) {
-		/* encrypt multiple block with AES in CBC mode */
-		AES_init_ctx_iv(&aes_ctx, key, iv);
-		AES_CBC_encrypt_buffer(&aes_ctx, data, len);
-	} else {
-		/* encrypt one block with AES in ECB mode */
-		assert(len <= 16);
-		AES_init_ctx(&aes_ctx, key);
-		AES_ECB_encrypt(&aes_ctx, data);
-	}
-}
-
-void osdp_decrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len)
-{
-	struct AES_ctx aes_ctx;
-
-	if (iv != NULL) {
-		/* decrypt multiple block with AES in CBC mode */
-		AES_init_ctx_iv(&aes_ctx, key, iv);
-		AES_CBC_decrypt_buffer(&aes_ctx, data, len);
-	} else {
-		/* decrypt one block with AES in ECB mode */
-		assert(len <= 16);
-		AES_init_ctx(&aes_ctx, key);
-		AES_ECB_decrypt(&aes_ctx, data);
-	}
-}
 
 void osdp_fill_random(uint8_t *buf, int len)
 {
@@ -213,53 +248,125 @@ const char *osdp_get_source_info()
 	}
 }
 
+int osdp_status_bitmap_copy(osdp_t *ctx, const uint64_t *map,
+			    const int *count, uint64_t *bitmap, int n)
+{
+	int i, words = OSDP_STATUS_BITMAP_WORDS(NUM_PD(ctx));
+
+	if (bitmap != NULL) {
+		if (n < words) {
+			return -1;
+		}
+		for (i = 0; i < words; i++) {
+			bitmap[i] = __atomic_load_n(&map[i], __ATOMIC_RELAXED);
+		}
+	}
+	return __atomic_load_n(count, __ATOMIC_RELAXED);
+}
+
 OSDP_EXPORT
-uint32_t osdp_get_sc_status_mask(osdp_t *ctx)
+int osdp_get_sc_status_bitmap(osdp_t *ctx, uint64_t *bitmap, int n)
 {
-	int i;
-	uint32_t mask = 0;
-	struct osdp_pd *pd;
+	int active;
 
 	assert(ctx);
 
 	if (ISSET_FLAG(TO_OSDP(ctx), FLAG_CP_MODE)) {
-		for (i = 0; i < NUM_PD(ctx); i++) {
-			pd = TO_PD(ctx, i);
-			if (pd->state == OSDP_CP_STATE_ONLINE &&
-			    ISSET_FLAG(pd, PD_FLAG_SC_ACTIVE)) {
-				mask |= 1 << i;
-			}
-		}
-	} else {
-		pd = TO_PD(ctx, 0);
-		if (ISSET_FLAG(pd, PD_FLAG_SC_ACTIVE)) {
-			mask = 1;
-		}
+		return osdp_status_bitmap_copy(ctx, TO_CP(ctx)->sc_status_map,
+					       &TO_CP(ctx)->num_sc_active,
+					       bitmap, n);
 	}
+	if (bitmap != NULL && n < 1) {
+		return -1;
+	}
+	active = ISSET_FLAG(TO_PD(ctx, 0), PD_FLAG_SC_ACTIVE) ? 1 : 0;
+	if (bitmap != NULL) {
+		bitmap[0] = active;
+	}
+	return active;
+}
 
-	return mask;
+OSDP_EXPORT
+int osdp_get_status_bitmap(osdp_t *ctx, uint64_t *bitmap, int n)
+{
+	assert(ctx);
+
+	if (ISSET_FLAG(TO_OSDP(ctx), FLAG_CP_MODE)) {
+		return osdp_status_bitmap_copy(ctx, TO_CP(ctx)->status_map,
+					       &TO_CP(ctx)->num_online,
+					       bitmap, n);
+	}
+	if (bitmap != NULL && n < 1) {
+		return -1;
+	}
+	/* PD is stateless */
+	if (bitmap != NULL) {
+		bitmap[0] = 1;
+	}
+	return 1;
 }
 
 OSDP_EXPORT
-uint32_t osdp_get_status_mask(osdp_t *ctx)
+uint32_t osdp_get_sc_status_mask(osdp_t *ctx)
 {
-	int i;
-	uint32_t mask = 0;
-	struct osdp_pd *pd;
+	assert(ctx);
 
+	if (ISSET_FLAG(TO_OSDP(ctx), FLAG_CP_MODE)) {
+		return (uint32_t)__atomic_load_n(&TO_CP(ctx)->sc_status_map[0],
+						 __ATOMIC_RELAXED);
+	}
+	return ISSET_FLAG(TO_PD(ctx, 0), PD_FLAG_SC_ACTIVE) ? 1 : 0;
+}
+
+OSDP_EXPORT
+uint32_t osdp_get_status_mask(osdp_t *ctx)
+{
 	assert(ctx);
 
 	if (ISSET_FLAG(TO_OSDP(ctx), FLAG_CP_MODE)) {
-		for (i = 0; i < TO_OSDP(ctx)->cp->num_pd; i++) {
-			pd = TO_PD(ctx, i);
-			if (pd->state == OSDP_CP_STATE_ONLINE) {
-				mask |= 1 << i;
-			}
-		}
-	} else {
-		/* PD is stateless */
-		mask = 1;
+		return (uint32_t)__atomic_load_n(&TO_CP(ctx)->status_map[0],
+						 __ATOMIC_RELAXED);
 	}
+	/* PD is stateless */
+	return 1;
+}
+
+OSDP_EXPORT
+int osdp_get_stats(osdp_t *ctx, int pd, struct osdp_stats *stats)
+{
+	size_t i;
+	uint32_t *src, *dst;
+
+	assert(ctx);
+	assert(stats);
 
-	return mask;
+	if (pd < 0 || pd >= NUM_PD(ctx)) {
+		LOG_ERR("Invalid PD number");
+		return -1;
+	}
+	/* all counters are uint32_t; copy them one at a time */
+	src = (uint32_t *)&TO_PD(ctx, pd)->stats;
+	dst = (uint32_t *)stats;
+	for (i = 0; i < sizeof(struct osdp_stats) / sizeof(uint32_t); i++) {
+		dst[i] = __atomic_load_n(src + i, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+OSDP_EXPORT
+void osdp_reset_stats(osdp_t *ctx, int pd)
+{
+	size_t i;
+	uint32_t *p;
+
+	assert(ctx);
+
+	if (pd < 0 || pd >= NUM_PD(ctx)) {
+		LOG_ERR("Invalid PD number");
+		return;
+	}
+	p = (uint32_t *)&TO_PD(ctx, pd)->stats;
+	for (i = 0; i < sizeof(struct osdp_stats) / sizeof(uint32_t); i++) {
+		__atomic_store_n(p + i, 0, __ATOMIC_RELAXED);
+	}
 }
@@ -46,6 +46,7 @@
 #define REPLY_BUSY_DATA_LEN            0
 
 #define OSDP_CP_ERR_GENERIC           -1
+#define OSDP_CP_ERR_CORRUPT           -2
 #define OSDP_CP_ERR_NO_DATA            1
 #define OSDP_CP_ERR_RETRY_CMD          2
 #define OSDP_CP_ERR_CAN_YIELD          3
@@ -53,65 +54,456 @@
 
 struct cp_cmd_node {
 	queue_node_t node;
+	bool from_app;			/* counted in pd->cmd_depth */
+	int lane;			/* index into pd->cmd_lanes (app only) */
+	int64_t deadline;		/* drop if not sent by then; 0: never */
+	int64_t submitted;		/* on the clock of pd->now */
 	struct osdp_cmd object;
 };
 
+#ifdef CONFIG_OSDP_THREADED_CP
+enum cp_event_node_type {
+	CP_EVENT_NODE_EVENT,
+	CP_EVENT_NODE_STATUS,
+	CP_EVENT_NODE_QUEUE,
+	CP_EVENT_NODE_COMPLETION,
+};
+
+struct cp_event_node {
+	int address;
+	enum cp_event_node_type type;
+	union {
+		struct osdp_event object;
+		struct {
+			int pd;
+			enum osdp_pd_status_e old_status;
+			enum osdp_pd_status_e new_status;
+			enum osdp_pd_status_reason_e reason;
+		} status;
+		struct {
+			int pd;
+			int depth;
+			int high;
+		} queue;
+		struct {
+			int pd;
+			struct osdp_cmd_completion object;
+		} completion;
+	};
+};
+#endif
+
 static int cp_cmd_queue_init(struct osdp_pd *pd)
 {
-	if (slab_init(&pd->cmd.slab, sizeof(struct cp_cmd_node),
-		      OSDP_CP_CMD_POOL_SIZE)) {
-		LOG_ERR("Failed to initialize command slab");
+	int i;
+
+	/* +1 for the command that the CP state machine itself has queued */
+	if (osdp_pool_init(&pd->cmd.pool, sizeof(struct cp_cmd_node),
+			   OSDP_CP_CMD_POOL_SIZE, OSDP_CP_CMD_POOL_MAX + 1)) {
+		LOG_ERR("Failed to initialize command pool");
 		return -1;
 	}
 	queue_init(&pd->cmd.queue);
+	queue_init(&pd->cmd_parked);
+	for (i = 0; i < OSDP_CP_CMD_LANES; i++) {
+		queue_init(&pd->cmd_lanes[i]);
+	}
 	return 0;
 }
 
 static void cp_cmd_queue_del(struct osdp_pd *pd)
 {
-	slab_del(&pd->cmd.slab);
+	osdp_pool_del(&pd->cmd.pool);
 }
 
 static struct osdp_cmd *cp_cmd_alloc(struct osdp_pd *pd)
 {
-	struct cp_cmd_node *cmd = NULL;
+	struct cp_cmd_node *cmd;
 
-	if (slab_alloc(&pd->cmd.slab, (void **)&cmd)) {
+	cmd = osdp_pool_alloc(&pd->cmd.pool);
+	if (cmd == NULL) {
 		LOG_ERR("Memory allocation failed");
 		return NULL;
 	}
+	cmd->from_app = false;
 	return &cmd->object;
 }
 
+static void cp_notify_queue(struct osdp_pd *pd, int depth, int high)
+{
+	struct osdp_cp *cp = TO_CP(pd->__parent);
+#ifdef CONFIG_OSDP_THREADED_CP
+	struct cp_event_node n;
+
+	if (ISSET_FLAG(TO_CTX(pd), FLAG_CP_THREADED)) {
+		/* delivered from osdp_cp_refresh() in the app's thread */
+		n.address = pd->address;
+		n.type = CP_EVENT_NODE_QUEUE;
+		n.queue.pd = pd->offset;
+		n.queue.depth = depth;
+		n.queue.high = high;
+		if (osdp_mpsc_push(&cp->events, &n)) {
+			LOG_ERR(TAG "event queue full; dropped queue watermark");
+		}
+		return;
+	}
+#endif
+	cp->queue_callback(cp->queue_callback_arg, pd->offset, depth, high);
+}
+
+/**
+ * Tell the application when the command queue of this PD fills up to the
+ * high watermark and, after that, when it drains down to the low one.
+ */
+static void cp_cmd_watermark_check(struct osdp_pd *pd)
+{
+	struct osdp_cp *cp = TO_CP(pd->__parent);
+	int depth;
+
+	if (cp->queue_callback == NULL) {
+		return;
+	}
+	depth = __atomic_load_n(&pd->cmd_depth, __ATOMIC_RELAXED);
+	if (!pd->cmd_backlog && depth >= cp->queue_high) {
+		pd->cmd_backlog = true;
+		cp_notify_queue(pd, depth, 1);
+	} else if (pd->cmd_backlog && depth <= cp->queue_low) {
+		pd->cmd_backlog = false;
+		cp_notify_queue(pd, depth, 0);
+	}
+}
+
+/**
+ * Tell the application how a command that it sent (with `tag`, at time
+ * `submitted`) completed.
+ */
+static void cp_notify_completion(struct osdp_pd *pd, uint32_t tag,
+				 int64_t submitted,
+				 enum osdp_cmd_result_e result, int nak_code)
+{
+	struct osdp_cp *cp = TO_CP(pd->__parent);
+	struct osdp_cmd_completion c;
+	int64_t latency;
+#ifdef CONFIG_OSDP_THREADED_CP
+	struct cp_event_node n;
+#endif
+
+	if (cp->completion_callback == NULL) {
+		return;
+	}
+	latency = osdp_pd_millis_since(pd, submitted);
+	c.tag = tag;
+	c.result = result;
+	c.nak_code = nak_code;
+	c.latency_ms = latency > 0 ? (uint32_t)latency : 0;
+#ifdef CONFIG_OSDP_THREADED_CP
+	if (ISSET_FLAG(TO_CTX(pd), FLAG_CP_THREADED)) {
+		/* delivered from osdp_cp_refresh() in the app's thread */
+		n.address = pd->address;
+		n.type = CP_EVENT_NODE_COMPLETION;
+		n.completion.pd = pd->offset;
+		memcpy(&n.completion.object, &c,
+		       sizeof(struct osdp_cmd_completion));
+		if (osdp_mpsc_push(&cp->events, &n)) {
+			LOG_ERR(TAG "event queue full; dropped completion");
+		}
+		return;
+	}
+#endif
+	cp->completion_callback(cp->completion_callback_arg, pd->offset, &c);
+}
+
+/**
+ * The command in flight got a reply (or the PD was given up on). Nothing to
+ * report if it was one of the CP's own commands.
+ */
+static void cp_cmd_complete(struct osdp_pd *pd, enum osdp_cmd_result_e result,
+			    int nak_code)
+{
+	if (!pd->cmd_inflight) {
+		return;
+	}
+	pd->cmd_inflight = false;
+	cp_notify_completion(pd, pd->cmd_tag, pd->cmd_submitted, result,
+			     nak_code);
+}
+
 static void cp_cmd_free(struct osdp_pd *pd, struct osdp_cmd *cmd)
 {
 	struct cp_cmd_node *n;
 
 	n = CONTAINER_OF(cmd, struct cp_cmd_node, object);
-	slab_free(&pd->cmd.slab, n);
+	if (n->from_app) {
+		__atomic_sub_fetch(&pd->cmd_depth, 1, __ATOMIC_RELAXED);
+		cp_cmd_watermark_check(pd);
+	}
+	osdp_pool_free(&pd->cmd.pool, n);
+}
+
+/**
+ * LED, buzzer, text and output commands set the state of one LED, buzzer,
+ * reader display or output. Returns true if `a` and `b` act on the same one.
+ */
+static bool cp_cmd_same_target(struct osdp_cmd *a, struct osdp_cmd *b)
+{
+	if (a->id != b->id) {
+		return false;
+	}
+	switch ((int)a->id) { /* holds the CMD_* code once queued */
+	case CMD_LED:
+		return a->led.reader == b->led.reader &&
+		       a->led.led_number == b->led.led_number;
+	case CMD_BUZ:
+		return a->buzzer.reader == b->buzzer.reader;
+	case CMD_TEXT:
+		return a->text.reader == b->text.reader;
+	case CMD_OUT:
+		return a->output.output_no == b->output.output_no;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Returns true if `new` leaves nothing of what `old` (a command to the same
+ * target) would have set, so `old` need not be sent if it is still queued.
+ */
+static bool cp_cmd_supersedes(struct osdp_cmd *new, struct osdp_cmd *old)
+{
+	switch ((int)new->id) {
+	case CMD_LED:
+		/* control code 0 (NOP) leaves that part of the LED state as is */
+		return (new->led.temporary.control_code != 0 ||
+			old->led.temporary.control_code == 0) &&
+		       (new->led.permanent.control_code != 0 ||
+			old->led.permanent.control_code == 0);
+	case CMD_BUZ:
+		return true;
+	case CMD_TEXT:
+		return new->text.control_code == old->text.control_code &&
+		       new->text.offset_row == old->text.offset_row &&
+		       new->text.offset_col == old->text.offset_col &&
+		       new->text.length >= old->text.length;
+	case CMD_OUT:
+		/*
+		 * Like an LED, an output has a permanent state and a timed
+		 * (temporary) one. Codes 1/2 set the former and abort the
+		 * latter; 3/4 set the permanent state but let a timed operation
+		 * complete; 5/6 only start a timed operation.
+		 */
+		switch (new->output.control_code) {
+		case 1:
+		case 2:
+			return true;
+		case 3:
+		case 4:
+			return old->output.control_code >= 1 &&
+			       old->output.control_code <= 4;
+		case 5:
+		case 6:
+			return old->output.control_code == 5 ||
+			       old->output.control_code == 6;
+		default:
+			return false;
+		}
+	default:
+		return false;
+	}
 }
 
 static void cp_cmd_enqueue(struct osdp_pd *pd, struct osdp_cmd *cmd)
 {
-	struct cp_cmd_node *n;
+	struct cp_cmd_node *n, *old, *last = NULL;
+	queue_node_t *node;
+	queue_t *lane;
 
 	n = CONTAINER_OF(cmd, struct cp_cmd_node, object);
-	queue_enqueue(&pd->cmd.queue, &n->node);
+	if (!n->from_app) {
+		queue_enqueue(&pd->cmd.queue, &n->node);
+		return;
+	}
+	lane = &pd->cmd_lanes[n->lane];
+	if (ISSET_FLAG(TO_CTX(pd), FLAG_CP_COALESCE)) {
+		/**
+		 * Take the place (and turn) of the last queued command to the
+		 * same target if it supersedes that; an earlier one must not
+		 * be overtaken by what was queued after it.
+		 */
+		for (node = lane->head; node; node = node->next) {
+			old = CONTAINER_OF(node, struct cp_cmd_node, node);
+			if (cp_cmd_same_target(cmd, &old->object)) {
+				last = old;
+			}
+		}
+		if (last && cp_cmd_supersedes(cmd, &last->object)) {
+			cp_notify_completion(pd, last->object.tag,
+					     last->submitted,
+					     OSDP_CMD_RESULT_COALESCED, 0);
+			memcpy(&last->object, cmd, sizeof(struct osdp_cmd));
+			last->deadline = n->deadline;
+			last->submitted = n->submitted;
+			cp_cmd_free(pd, cmd);
+			OSDP_STATS_INC(pd, coalesced);
+			return;
+		}
+	}
+	queue_enqueue(lane, &n->node);
 }
 
-static int cp_cmd_dequeue(struct osdp_pd *pd, struct osdp_cmd **cmd)
+/**
+ * Queue that the next command goes out from: the CP's own commands first,
+ * then the lanes of application commands in order of priority. Commands
+ * that missed their deadline are dropped on the way rather than sent late.
+ */
+static queue_t *cp_cmd_next_queue(struct osdp_pd *pd)
 {
+	int i;
+	queue_node_t *node;
 	struct cp_cmd_node *n;
+
+	if (queue_peek_first(&pd->cmd.queue, &node) == 0) {
+		return &pd->cmd.queue;
+	}
+	for (i = 0; i < OSDP_CP_CMD_LANES; i++) {
+		while (queue_peek_first(&pd->cmd_lanes[i], &node) == 0) {
+			n = CONTAINER_OF(node, struct cp_cmd_node, node);
+			if (n->deadline == 0 ||
+			    osdp_pd_millis_now(pd) <= n->deadline) {
+				return &pd->cmd_lanes[i];
+			}
+			LOG_INF(TAG "CMD: %02x missed its deadline; dropped",
+				n->object.id);
+			queue_dequeue(&pd->cmd_lanes[i], &node);
+			OSDP_STATS_INC(pd, expired);
+			cp_notify_completion(pd, n->object.tag, n->submitted,
+					     OSDP_CMD_RESULT_EXPIRED, 0);
+			cp_cmd_free(pd, &n->object);
+		}
+	}
+	return NULL;
+}
+
+static bool cp_cmd_pending(struct osdp_pd *pd)
+{
+	int i;
 	queue_node_t *node;
 
-	if (queue_dequeue(&pd->cmd.queue, &node)) {
-		return -1;
+	if (queue_peek_first(&pd->cmd.queue, &node) == 0) {
+		return true;
 	}
+	for (i = 0; i < OSDP_CP_CMD_LANES; i++) {
+		if (queue_peek_first(&pd->cmd_lanes[i], &node) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void cp_cmd_dequeue(struct osdp_pd *pd, queue_t *queue,
+			   struct osdp_cmd **cmd)
+{
+	queue_node_t *node;
+	struct cp_cmd_node *n;
+
+	queue_dequeue(queue, &node);
 	n = CONTAINER_OF(node, struct cp_cmd_node, node);
+	/* the node is freed once sent; keep what cp_cmd_complete() needs */
+	pd->cmd_inflight = n->from_app;
+	pd->cmd_tag = n->object.tag;
+	pd->cmd_submitted = n->submitted;
 	*cmd = &n->object;
-	return 0;
 }
 
+/**
+ * Commands from the application arrive through cmd_ingress so that they can
+ * be sent from any thread. Move them to the command queue (or park them till
+ * the PD is online); this runs only in the thread that drives the PD.
+ */
+static void cp_cmd_ingress_drain(struct osdp_pd *pd)
+{
+	struct osdp_cmd *cmd;
+	struct cp_cmd_node *n;
+	int64_t lag;
+
+	if (osdp_mpsc_is_empty(&pd->cmd_ingress)) {
+		return;
+	}
+	do {
+		cmd = cp_cmd_alloc(pd);
+		if (cmd == NULL) {
+			break; /* retry when some command is freed */
+		}
+		/* the whole node was filled in by cp_cmd_submit() */
+		n = CONTAINER_OF(cmd, struct cp_cmd_node, object);
+		osdp_mpsc_pop(&pd->cmd_ingress, n);
+		/**
+		 * cp_cmd_submit() read the clock after this pass cached it
+		 * in pd->now; move the command back onto the cached clock so
+		 * that its latency and deadline are measured on one clock.
+		 */
+		lag = n->submitted - osdp_pd_millis_now(pd);
+		if (lag > 0) {
+			n->submitted -= lag;
+			if (n->deadline) {
+				n->deadline -= lag;
+			}
+		}
+		if (pd->state == OSDP_CP_STATE_ONLINE) {
+			cp_cmd_enqueue(pd, cmd);
+		} else {
+			queue_enqueue(&pd->cmd_parked, &n->node);
+		}
+	} while (!osdp_mpsc_is_empty(&pd->cmd_ingress));
+	cp_cmd_watermark_check(pd);
+}
+
+static void cp_notify_event(struct osdp_pd *pd, struct osdp_event *event)
+{
+	struct osdp_cp *cp = TO_CP(pd->__parent);
+#ifdef CONFIG_OSDP_THREADED_CP
+	struct cp_event_node n;
+
+	if (ISSET_FLAG(TO_CTX(pd), FLAG_CP_THREADED)) {
+		/* delivered from osdp_cp_refresh() in the app's thread */
+		n.address = pd->address;
+		n.type = CP_EVENT_NODE_EVENT;
+		memcpy(&n.object, event, sizeof(struct osdp_event));
+		if (pd->event_held && event != &pd->held_event) {
+			LOG_ERR(TAG "event queue full; dropped event");
+			return;
+		}
+		if (osdp_mpsc_push(&cp->events, &n) == 0) {
+			return;
+		}
+		if (event != &pd->held_event) {
+			LOG_WRN(TAG "event queue full; holding event");
+			memcpy(&pd->held_event, event,
+			       sizeof(struct osdp_event));
+		}
+		pd->event_held = true;
+		__atomic_store_n(&cp->events_held, 1, __ATOMIC_RELEASE);
+		return;
+	}
+#endif
+	cp->event_callback(cp->event_callback_arg, pd->address, event);
+}
+
+#ifdef CONFIG_OSDP_THREADED_CP
+/**
+ * An event that didn't fit in cp->events is held, and the PD is not polled
+ * (so it keeps the rest of its events), until osdp_cp_refresh() makes room
+ * and kicks the worker. Events are never dropped for want of room, just as
+ * they aren't without workers.
+ */
+static void cp_event_retry(struct osdp_pd *pd)
+{
+	if (pd->event_held) {
+		pd->event_held = false;
+		cp_notify_event(pd, &pd->held_event);
+	}
+}
+#endif
+
 /**
  * Returns:
  * +ve: length of command
@@ -355,6 +747,33 @@ static int cp_build_command(struct osdp_pd *pd, uint8_t *buf, int max_len)
 	return len;
 }
 
+/**
+ * POLLs on a bus start no closer together than the wire time of a POLL and
+ * its ACK, scaled up by 100 / OSDP_BUS_POLL_BUDGET_PCT. That wire time is
+ * 2 * OSDP_POLL_FRAME_LEN bytes of 10 bits (8N1) each at the baud rate of the
+ * slowest PD; line turnaround and secure channel MACs come on top of it so
+ * this is a lower bound.
+ */
+static void cp_bus_set_poll_gap(struct osdp_bus *bus)
+{
+	int i;
+	int64_t bits = 2 * OSDP_POLL_FRAME_LEN * 10;
+	int64_t baud_rate = bus->pd[0]->baud_rate;
+
+	for (i = 1; i < bus->num_pd; i++) {
+		if (bus->pd[i]->baud_rate < baud_rate) {
+			baud_rate = bus->pd[i]->baud_rate;
+		}
+	}
+	bus->poll_gap_us = 0;
+	bus->poll_due_us = 0;
+	if (baud_rate <= 0) {
+		return;
+	}
+	bus->poll_gap_us = (bits * 1000 * 1000 * 100) /
+			   (baud_rate * OSDP_BUS_POLL_BUDGET_PCT);
+}
+
 static int cp_decode_response(struct osdp_pd *pd, uint8_t *buf, int len)
 {
 	uint32_t temp32;
@@ -382,6 +801,7 @@ static int cp_decode_response(struct osdp_pd *pd, uint8_t *buf, int len)
 			break;
 		}
 		LOG_ERR(TAG "PD replied with NAK code %d", buf[pos]);
+		osdp_stats_nak(pd, buf[pos]);
 		ret = 0;
 		break;
 	case REPLY_PDID:
@@ -465,6 +885,9 @@ static int cp_decode_response(struct osdp_pd *pd, uint8_t *buf, int len)
 		LOG_WRN(TAG "COMSET responded with ID:%d baud:%d", t1, temp32);
 		pd->address = t1;
 		pd->baud_rate = temp32;
+		/* prebuilt POLLs carry the address; the poll gap, the baud */
+		osdp_phy_poll_cache_init(pd);
+		cp_bus_set_poll_gap(pd->bus);
 		ret = 0;
 		break;
 	case REPLY_KEYPPAD:
@@ -480,7 +903,7 @@ static int cp_decode_response(struct osdp_pd *pd, uint8_t *buf, int len)
 		for (i = 0; i < event.keypress.length; i++) {
 			event.keypress.data[i] = buf[pos + i];
 		}
-		cp->event_callback(cp->event_callback_arg, pd->address, &event);
+		cp_notify_event(pd, &event);
 		ret = 0;
 		break;
 	case REPLY_RAW:
@@ -500,7 +923,7 @@ static int cp_decode_response(struct osdp_pd *pd, uint8_t *buf, int len)
 		for (i = 0; i < t1; i++) {
 			event.cardread.data[i] = buf[pos + i];
 		}
-		cp->event_callback(cp->event_callback_arg, pd->address, &event);
+		cp_notify_event(pd, &event);
 		ret = 0;
 		break;
 	case REPLY_FMT:
@@ -519,7 +942,7 @@ static int cp_decode_response(struct osdp_pd *pd, uint8_t *buf, int len)
 		for (i = 0; i < event.cardread.length; i++) {
 			event.cardread.data[i] = buf[pos + i];
 		}
-		cp->event_callback(cp->event_callback_arg, pd->address, &event);
+		cp_notify_event(pd, &event);
 		ret = 0;
 		break;
 	case REPLY_BUSY:
@@ -545,7 +968,7 @@ static int cp_decode_response(struct osdp_pd *pd, uint8_t *buf, int len)
 		for (i = 0; i < event.mfgrep.length; i++) {
 			event.mfgrep.data[i] = buf[pos + i];
 		}
-		cp->event_callback(cp->event_callback_arg, pd->address, &event);
+		cp_notify_event(pd, &event);
 		ret = 0;
 		break;
 #ifdef CONFIG_OSDP_SC_ENABLED
@@ -562,7 +985,7 @@ static int cp_decode_response(struct osdp_pd *pd, uint8_t *buf, int len)
 		for (i = 0; i < 16; i++) {
 			pd->sc.pd_cryptogram[i] = buf[pos++];
 		}
-		osdp_compute_session_keys(TO_CTX(pd));
+		osdp_compute_session_keys(pd);
 		if (osdp_verify_pd_cryptogram(pd) != 0) {
 			LOG_ERR(TAG "failed to verify PD_crypt");
 			return -1;
@@ -595,48 +1018,135 @@ static int cp_decode_response(struct osdp_pd *pd, uint8_t *buf, int len)
 		LOG_DBG(TAG "CMD: %02x REPLY: %02x", pd->cmd_id, pd->reply_id);
 	}
 
+	if (pd->reply_id == REPLY_KEYPPAD || pd->reply_id == REPLY_RAW ||
+	    pd->reply_id == REPLY_FMT) {
+		/* someone is at the reader; poll faster for a while */
+		pd->idle_polls = 0;
+		pd->burst_tstamp = osdp_pd_millis_now(pd);
+	}
+
 	return ret;
 }
 
-static int cp_send_command(struct osdp_pd *pd)
+/**
+ * Returns:
+ * +ve: length of the frame built in pd->tx_buf
+ * -ve: error
+ */
+static int cp_build_packet(struct osdp_pd *pd)
 {
 	int ret, len;
 
+	if (pd->cmd_id == CMD_POLL) {
+		/* bulk of the traffic; frames are prebuilt at setup */
+		return osdp_phy_poll_frame(pd, pd->tx_buf, sizeof(pd->tx_buf));
+	}
+
 	/* init packet buf with header */
-	len = osdp_phy_packet_init(pd, pd->rx_buf, sizeof(pd->rx_buf));
+	len = osdp_phy_packet_init(pd, pd->tx_buf, sizeof(pd->tx_buf));
 	if (len < 0) {
 		return -1;
 	}
 
 	/* fill command data */
-	ret = cp_build_command(pd, pd->rx_buf, sizeof(pd->rx_buf));
+	ret = cp_build_command(pd, pd->tx_buf, sizeof(pd->tx_buf));
 	if (ret < 0) {
 		return -1;
 	}
 	len += ret;
 
 	/* finalize packet */
-	len = osdp_phy_packet_finalize(pd, pd->rx_buf, len, sizeof(pd->rx_buf));
+	return osdp_phy_packet_finalize(pd, pd->tx_buf, len,
+					sizeof(pd->tx_buf));
+}
+
+static int cp_send_command(struct osdp_pd *pd)
+{
+	int ret, len;
+
+	pd->tx_buf_len = 0;
+	pd->resends = 0;
+	pd->busy_retries = 0;
+	len = cp_build_packet(pd);
 	if (len < 0) {
 		return -1;
 	}
 
-	ret = pd->channel.send(pd->channel.data, pd->rx_buf, len);
+	ret = pd->channel.send(pd->channel.data, pd->tx_buf, len);
+	if (ret == len) {
+		pd->tx_buf_len = len;
+		OSDP_STATS_INC(pd, tx_frames);
+		OSDP_STATS_ADD(pd, tx_bytes, len);
+		pd->tx_tstamp = osdp_pd_millis_now(pd);
+		osdp_capture(pd, OSDP_CAPTURE_CP_TX, pd->cmd_id, pd->tx_buf,
+			     len);
+	}
 
 	if (IS_ENABLED(CONFIG_OSDP_PACKET_TRACE)) {
 		if (pd->cmd_id != CMD_POLL) {
 			LOG_DBG(TAG "bytes sent");
-			osdp_dump(NULL, pd->rx_buf, len);
+			osdp_dump(NULL, pd->tx_buf, len);
 		}
 	}
 
 	return (ret == len) ? 0 : -1;
 }
 
+/**
+ * Send the last command again, with the same sequence number (and MAC), so
+ * the PD can tell that we didn't get its reply and resend it.
+ */
+static int cp_resend_command(struct osdp_pd *pd)
+{
+	int ret;
+
+	if (pd->tx_buf_len == 0 || pd->resends >= OSDP_CP_MAX_RESENDS) {
+		return -1;
+	}
+	osdp_phy_rx_reset(pd);
+	if (pd->channel.flush) {
+		pd->channel.flush(pd->channel.data);
+	}
+	ret = pd->channel.send(pd->channel.data, pd->tx_buf, pd->tx_buf_len);
+	if (ret != pd->tx_buf_len) {
+		return -1;
+	}
+	pd->resends++;
+	OSDP_STATS_INC(pd, tx_frames);
+	OSDP_STATS_INC(pd, resends);
+	OSDP_STATS_ADD(pd, tx_bytes, ret);
+	pd->tx_tstamp = osdp_pd_millis_now(pd);
+	osdp_capture(pd, OSDP_CAPTURE_CP_TX, pd->cmd_id, pd->tx_buf, ret);
+	return 0;
+}
+
+/**
+ * Send the last command again after the PD replied osdp_BUSY to it. Unlike a
+ * resend, it is built afresh with the next sequence number: the PD did reply
+ * to the last one, and a PD that keeps that reply to resend on a repeated
+ * sequence number (see osdp_phy_decode_packet()) would just send osdp_BUSY
+ * again without looking at the command.
+ */
+static int cp_retry_command(struct osdp_pd *pd)
+{
+	int busy_retries = pd->busy_retries;
+
+	osdp_phy_rx_reset(pd);
+	if (pd->channel.flush) {
+		pd->channel.flush(pd->channel.data);
+	}
+	if (cp_send_command(pd)) {
+		return -1;
+	}
+	pd->busy_retries = busy_retries + 1;
+	OSDP_STATS_INC(pd, retries);
+	return 0;
+}
+
 static int cp_process_reply(struct osdp_pd *pd)
 {
 	uint8_t *buf;
-	int rec_bytes, ret, max_len;
+	int rec_bytes, max_len;
 
 	buf = pd->rx_buf + pd->rx_buf_len;
 	max_len = sizeof(pd->rx_buf) - pd->rx_buf_len;
@@ -646,6 +1156,8 @@ static int cp_process_reply(struct osdp_pd *pd)
 		return OSDP_CP_ERR_NO_DATA;
 	}
 	pd->rx_buf_len += rec_bytes;
+	OSDP_STATS_ADD(pd, rx_bytes, rec_bytes);
+	osdp_capture(pd, OSDP_CAPTURE_CP_RX, 0, buf, rec_bytes);
 
 	if (IS_ENABLED(CONFIG_OSDP_PACKET_TRACE)) {
 		if (pd->cmd_id != CMD_POLL) {
@@ -654,71 +1166,411 @@ static int cp_process_reply(struct osdp_pd *pd)
 		}
 	}
 
+	return osdp_cp_process_rx_buf(pd);
+}
+
+/**
+ * Frame and decode the reply bytes accumulated in pd->rx_buf. Also used to
+ * replay captured traffic (see osdp_capture.c).
+ */
+int osdp_cp_process_rx_buf(struct osdp_pd *pd)
+{
+	int ret;
+
+	/* Frame the bytes received so far */
+	while ((ret = osdp_phy_check_packet(pd)) > 0 &&
+	       osdp_phy_packet_get_address(pd->rx_buf) != pd->address) {
+		/**
+		 * All PDs on a bus reply into the same rx stream. This is a
+		 * late reply from another PD (whose command timed out); drop
+		 * just this frame and keep looking for ours.
+		 */
+		LOG_WRN(TAG "discarded reply from PD address %d",
+			osdp_phy_packet_get_address(pd->rx_buf));
+		osdp_phy_rx_discard(pd, ret);
+	}
+	if (ret == OSDP_ERR_PKT_WAIT) {
+		/* incomplete frame; wait for more data */
+		return OSDP_CP_ERR_NO_DATA;
+	} else if (ret < 0) {
+		return OSDP_CP_ERR_CORRUPT; /* reply garbled on the wire */
+	}
+
 	/* Valid OSDP packet in buffer */
-	ret = osdp_phy_decode_packet(pd, pd->rx_buf, pd->rx_buf_len);
+	ret = osdp_phy_decode_packet(pd, pd->rx_buf, ret);
 	if (ret == OSDP_ERR_PKT_FMT) {
-		return -1; /* fatal errors */
+		/* bad seq/MAC; also what a PD sends for a garbled command */
+		return OSDP_CP_ERR_CORRUPT;
 	} else if (ret == OSDP_ERR_PKT_WAIT) {
 		/* rx_buf_len != pkt->len; wait for more data */
 		return OSDP_CP_ERR_NO_DATA;
 	} else if (ret == OSDP_ERR_PKT_SKIP) {
 		/* soft fail - discard this message */
-		pd->rx_buf_len = 0;
+		osdp_phy_rx_reset(pd);
 		if (pd->channel.flush) {
 			pd->channel.flush(pd->channel.data);
 		}
 		return OSDP_CP_ERR_NO_DATA;
 	}
 	pd->rx_buf_len = ret;
+	OSDP_STATS_INC(pd, rx_frames);
+	osdp_stats_latency(pd, osdp_pd_millis_since(pd, pd->tx_tstamp));
 
 	return cp_decode_response(pd, pd->rx_buf, pd->rx_buf_len);
 }
 
-static void cp_flush_command_queue(struct osdp_pd *pd)
+/**
+ * Application commands that are queued when the phy errors out are held
+ * until the PD is back online so they don't get ahead of the ID/CAP/SC
+ * commands that bring it there.
+ */
+static void cp_cmd_park(struct osdp_pd *pd)
 {
-	struct osdp_cmd *cmd;
+	int i;
+	queue_node_t *node;
 
-	while (cp_cmd_dequeue(pd, &cmd) == 0) {
-		cp_cmd_free(pd, cmd);
+	for (i = 0; i < OSDP_CP_CMD_LANES; i++) {
+		while (queue_dequeue(&pd->cmd_lanes[i], &node) == 0) {
+			queue_enqueue(&pd->cmd_parked, node);
+		}
+	}
+}
+
+static void cp_cmd_unpark(struct osdp_pd *pd)
+{
+	int i;
+	queue_node_t *node;
+	struct cp_cmd_node *n;
+
+	if (queue_peek_first(&pd->cmd_parked, &node)) {
+		return;
+	}
+	/* parked commands are older than anything in their lane */
+	for (i = 0; i < OSDP_CP_CMD_LANES; i++) {
+		while (queue_dequeue(&pd->cmd_lanes[i], &node) == 0) {
+			queue_enqueue(&pd->cmd_parked, node);
+		}
+	}
+	while (queue_dequeue(&pd->cmd_parked, &node) == 0) {
+		n = CONTAINER_OF(node, struct cp_cmd_node, node);
+		queue_enqueue(&pd->cmd_lanes[n->lane], node);
+	}
+}
+
+static uint32_t cp_backoff_rand(struct osdp_pd *pd)
+{
+	uint32_t x = pd->backoff_rng;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	pd->backoff_rng = x;
+	return x;
+}
+
+static void cp_status_map_set(uint64_t *map, int *count, int i, bool set)
+{
+	uint64_t old, bit = 1ULL << (i % 64);
+
+	/* other workers update other bits of the same word */
+	if (set) {
+		old = __atomic_fetch_or(&map[i / 64], bit, __ATOMIC_RELAXED);
+		if ((old & bit) == 0) {
+			__atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		old = __atomic_fetch_and(&map[i / 64], ~bit, __ATOMIC_RELAXED);
+		if (old & bit) {
+			__atomic_fetch_sub(count, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static enum osdp_pd_status_e cp_status_get(struct osdp_cp *cp, int i)
+{
+	uint64_t bit = 1ULL << (i % 64);
+
+	if ((__atomic_load_n(&cp->status_map[i / 64], __ATOMIC_RELAXED) &
+	     bit) == 0) {
+		return OSDP_PD_STATUS_OFFLINE;
+	}
+	if (__atomic_load_n(&cp->sc_status_map[i / 64], __ATOMIC_RELAXED) &
+	    bit) {
+		return OSDP_PD_STATUS_SC_ACTIVE;
+	}
+	return OSDP_PD_STATUS_ONLINE;
+}
+
+static void cp_notify_status(struct osdp_pd *pd, enum osdp_pd_status_e old,
+			     enum osdp_pd_status_e new,
+			     enum osdp_pd_status_reason_e reason)
+{
+	struct osdp_cp *cp = TO_CP(pd->__parent);
+#ifdef CONFIG_OSDP_THREADED_CP
+	struct cp_event_node n;
+
+	if (ISSET_FLAG(TO_CTX(pd), FLAG_CP_THREADED)) {
+		/* delivered from osdp_cp_refresh() in the app's thread */
+		n.address = pd->address;
+		n.type = CP_EVENT_NODE_STATUS;
+		n.status.pd = pd->offset;
+		n.status.old_status = old;
+		n.status.new_status = new;
+		n.status.reason = reason;
+		if (osdp_mpsc_push(&cp->events, &n)) {
+			LOG_ERR(TAG "event queue full; dropped status change");
+		}
+		return;
+	}
+#endif
+	if (cp->status_callback) {
+		cp->status_callback(cp->status_callback_arg, pd->offset,
+				    old, new, reason);
+	}
+}
+
+/**
+ * Reflect the state of this PD in the status bitmaps (and counts) of the CP
+ * and tell the application if that changed. Must be called after every
+ * change to pd->state.
+ */
+static void cp_status_update(struct osdp_pd *pd,
+			     enum osdp_pd_status_reason_e reason)
+{
+	struct osdp_cp *cp = TO_CP(pd->__parent);
+	bool online = (pd->state == OSDP_CP_STATE_ONLINE);
+	enum osdp_pd_status_e old, new;
+
+	old = cp_status_get(cp, pd->offset);
+	cp_status_map_set(cp->status_map, &cp->num_online, pd->offset, online);
+	cp_status_map_set(cp->sc_status_map, &cp->num_sc_active, pd->offset,
+			  online && ISSET_FLAG(pd, PD_FLAG_SC_ACTIVE));
+	new = cp_status_get(cp, pd->offset);
+	if (old != new) {
+		cp_notify_status(pd, old, new, reason);
 	}
 }
 
 static inline void cp_set_offline(struct osdp_pd *pd)
 {
-	pd->state = OSDP_CP_STATE_OFFLINE;
-	pd->tstamp = osdp_millis_now();
+	int64_t wait;
+
+	OSDP_STATS_INC(pd, offline);
+	__atomic_store_n(&pd->state, OSDP_CP_STATE_OFFLINE, __ATOMIC_RELAXED);
+	cp_status_update(pd, OSDP_PD_STATUS_REASON_LINK_ERROR);
+	pd->tstamp = osdp_pd_millis_now(pd);
+
+	wait = (int64_t)OSDP_CP_BACKOFF_MIN_MS << pd->backoff;
+	if (wait < OSDP_CP_BACKOFF_MAX_MS) {
+		pd->backoff++;
+	} else {
+		wait = OSDP_CP_BACKOFF_MAX_MS;
+	}
+	wait -= cp_backoff_rand(pd) %
+		(wait * OSDP_CP_BACKOFF_JITTER_PCT / 100 + 1);
+	pd->retry_wait = wait;
+	LOG_INF(TAG "offline; retry in %lld ms", (long long)wait);
 }
 
 static inline void cp_reset_state(struct osdp_pd *pd)
 {
-	pd->state = OSDP_CP_STATE_INIT;
+	__atomic_store_n(&pd->state, OSDP_CP_STATE_INIT, __ATOMIC_RELAXED);
 	osdp_phy_state_reset(pd);
 	pd->flags = 0;
+	cp_status_update(pd, OSDP_PD_STATUS_REASON_LINK_ERROR);
 }
 
 static inline void cp_set_state(struct osdp_pd *pd, enum osdp_state_e state)
 {
-	pd->state = state;
+	/* relaxed store; read from app threads by the status APIs */
+	__atomic_store_n(&pd->state, state, __ATOMIC_RELAXED);
+	/* the only way out of ONLINE here is to set up SC again */
+	cp_status_update(pd, (state == OSDP_CP_STATE_ONLINE) ?
+			     OSDP_PD_STATUS_REASON_CONNECTED :
+			     OSDP_PD_STATUS_REASON_SC_RESTART);
 	CLEAR_FLAG(pd, PD_FLAG_AWAIT_RESP);
+	if (state == OSDP_CP_STATE_ONLINE) {
+		pd->backoff = 0;
+		pd->idle_polls = 0;
+		pd->burst_tstamp = osdp_pd_millis_now(pd) -
+				   OSDP_PD_POLL_BURST_TIME_MS;
+	}
 }
 
-/**
- * Note: This method must not dequeue cmd unless it reaches an invalid state.
- */
-static int cp_phy_state_update(struct osdp_pd *pd)
+static int cp_same_channel(struct osdp_channel *a, struct osdp_channel *b)
 {
-	int ret = OSDP_CP_ERR_INPROG, tmp;
-	struct osdp_cmd *cmd = NULL;
+	return a->data == b->data && a->send == b->send && a->recv == b->recv;
+}
+
+static inline int cp_pd_in_burst(struct osdp_pd *pd)
+{
+	int64_t elapsed = osdp_pd_millis_since(pd, pd->burst_tstamp);
+
+	/* elapsed < 0 if the time source was changed under us */
+	return pd->state == OSDP_CP_STATE_ONLINE &&
+	       elapsed >= 0 && elapsed < OSDP_PD_POLL_BURST_TIME_MS;
+}
+
+/**
+ * Take the bus before sending a command. Returns -1 if another PD on this bus
+ * is waiting for its reply.
+ */
+static int cp_bus_acquire(struct osdp_pd *pd)
+{
+	struct osdp_bus *bus = pd->bus;
+
+	if (bus->owner != NULL && bus->owner != pd) {
+		return -1;
+	}
+	bus->owner = pd;
+	if (cp_pd_in_burst(pd)) {
+		bus->burst_credit -= OSDP_BUS_POLL_BUDGET_PCT;
+	} else {
+		bus->burst_credit += 100 - OSDP_BUS_POLL_BUDGET_PCT;
+	}
+	if (bus->burst_credit > 100) {
+		bus->burst_credit = 100;
+	} else if (bus->burst_credit < -100) {
+		bus->burst_credit = -100;
+	}
+	/* round-robin: the PD after us gets the first shot next time */
+	bus->next = (pd->bus_offset + 1) % bus->num_pd;
+	return 0;
+}
+
+static void cp_bus_release(struct osdp_pd *pd)
+{
+	if (pd->bus->owner == pd) {
+		pd->bus->owner = NULL;
+	}
+}
+
+static void cp_bus_teardown(struct osdp *ctx)
+{
+	int i;
+	struct osdp_cp *cp = TO_CP(ctx);
+
+	for (i = 0; i < cp->num_bus; i++) {
+		safe_free(cp->bus[i].pd);
+	}
+	safe_free(cp->bus);
+	cp->bus = NULL;
+	cp->num_bus = 0;
+}
+
+/**
+ * Group PDs by the channel they share. Each group becomes a bus.
+ */
+static int cp_bus_setup(struct osdp *ctx)
+{
+	int i, j;
+	struct osdp_pd *pd;
+	struct osdp_bus *bus;
+	struct osdp_cp *cp = TO_CP(ctx);
+
+	cp->bus = calloc(NUM_PD(ctx), sizeof(struct osdp_bus));
+	if (cp->bus == NULL) {
+		LOG_ERR(TAG "failed to alloc struct osdp_bus[]");
+		return -1;
+	}
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		pd = TO_PD(ctx, i);
+		for (j = 0; j < cp->num_bus; j++) {
+			bus = cp->bus + j;
+			if (cp_same_channel(&bus->pd[0]->channel, &pd->channel)) {
+				break;
+			}
+		}
+		bus = cp->bus + j;
+		if (j == cp->num_bus) {
+			bus->pd = calloc(NUM_PD(ctx), sizeof(struct osdp_pd *));
+			if (bus->pd == NULL) {
+				LOG_ERR(TAG "failed to alloc struct osdp_bus");
+				return -1;
+			}
+			cp->num_bus++;
+		}
+		pd->bus = bus;
+		pd->bus_offset = bus->num_pd;
+		bus->pd[bus->num_pd++] = pd;
+	}
+	for (j = 0; j < cp->num_bus; j++) {
+		cp_bus_set_poll_gap(cp->bus + j);
+	}
+	return 0;
+}
+
+/**
+ * Time between POLLs to an online PD. It drops to OSDP_PD_POLL_BURST_MS for
+ * OSDP_PD_POLL_BURST_TIME_MS after each card read or keypress so that the
+ * rest of the entry comes in quickly. Otherwise it is OSDP_PD_POLL_TIMEOUT_MS,
+ * doubling after every OSDP_PD_POLL_IDLE_COUNT polls that brought nothing, up
+ * to OSDP_PD_POLL_MAX_MS.
+ */
+static int cp_poll_interval(struct osdp_pd *pd)
+{
+	int n, interval = OSDP_PD_POLL_TIMEOUT_MS;
+
+	if (cp_pd_in_burst(pd)) {
+		return OSDP_PD_POLL_BURST_MS;
+	}
+	n = pd->idle_polls / OSDP_PD_POLL_IDLE_COUNT;
+	while (n-- > 0 && interval < OSDP_PD_POLL_MAX_MS) {
+		interval *= 2;
+	}
+	if (interval > OSDP_PD_POLL_MAX_MS) {
+		interval = OSDP_PD_POLL_MAX_MS;
+	}
+	return interval;
+}
+
+/**
+ * Returns the time (in millis) before which no PD on this bus may be polled,
+ * to keep the bus within its budget. The PDs served in the burst pass of
+ * cp_bus_refresh() are not held back by this.
+ */
+static inline int64_t cp_bus_poll_due(struct osdp_pd *pd)
+{
+	struct osdp_bus *bus = pd->bus;
+	int64_t due_us = bus->poll_due_us;
+	int64_t now_us = osdp_pd_millis_now(pd) * 1000;
+
+	if (bus->burst_pass) {
+		return 0;
+	}
+	/* the time source may have been stepped back */
+	if (due_us > now_us + bus->poll_gap_us) {
+		due_us = now_us + bus->poll_gap_us;
+	}
+	return (due_us + 999) / 1000;
+}
+
+/**
+ * Note: This method must not dequeue cmd unless it reaches an invalid state.
+ */
+static int cp_phy_state_update(struct osdp_pd *pd)
+{
+	int ret = OSDP_CP_ERR_INPROG, tmp;
+	struct osdp_cmd *cmd = NULL;
+	queue_t *queue;
 
 	switch (pd->phy_state) {
 	case OSDP_CP_PHY_STATE_ERR_WAIT:
 		ret = OSDP_CP_ERR_GENERIC;
 		break;
 	case OSDP_CP_PHY_STATE_IDLE:
-		if (cp_cmd_dequeue(pd, &cmd)) {
+		if (pd->state == OSDP_CP_STATE_ONLINE) {
+			cp_cmd_unpark(pd);
+		}
+		queue = cp_cmd_next_queue(pd);
+		if (queue == NULL) {
 			ret = 0;
 			break;
 		}
+		if (cp_bus_acquire(pd)) {
+			break; /* wait for our turn on the bus */
+		}
+		cp_cmd_dequeue(pd, queue, &cmd);
 		pd->cmd_id = cmd->id;
 		memcpy(pd->ephemeral_data, cmd, sizeof(struct osdp_cmd));
 		cp_cmd_free(pd, cmd);
@@ -731,43 +1583,78 @@ static int cp_phy_state_update(struct osdp_pd *pd)
 			break;
 		}
 		pd->phy_state = OSDP_CP_PHY_STATE_REPLY_WAIT;
-		pd->rx_buf_len = 0; /* reset buf_len for next use */
-		pd->phy_tstamp = osdp_millis_now();
+		osdp_phy_rx_reset(pd); /* reset rx_buf for next use */
+		pd->phy_tstamp = osdp_pd_millis_now(pd);
 		break;
 	case OSDP_CP_PHY_STATE_REPLY_WAIT:
 		tmp = cp_process_reply(pd);
 		if (tmp == 0) { /* success */
+			/* the decoded reply is at the head of rx_buf */
+			if (pd->reply_id == REPLY_NAK) {
+				cp_cmd_complete(pd, OSDP_CMD_RESULT_NAK,
+						pd->rx_buf[1]);
+			} else {
+				cp_cmd_complete(pd, OSDP_CMD_RESULT_ACK, 0);
+			}
 			pd->phy_state = OSDP_CP_PHY_STATE_CLEANUP;
 			break;
 		}
 		if (tmp == OSDP_CP_ERR_RETRY_CMD) {
+			OSDP_STATS_INC(pd, busy);
+			if (pd->busy_retries >= OSDP_CP_MAX_BUSY_RETRIES) {
+				LOG_ERR(TAG "CMD: %02x - PD busy; giving up",
+					pd->cmd_id);
+				cp_cmd_complete(pd, OSDP_CMD_RESULT_BUSY, 0);
+				pd->phy_state = OSDP_CP_PHY_STATE_CLEANUP;
+				break;
+			}
 			LOG_INF(TAG "PD busy; retry last command");
-			pd->phy_tstamp = osdp_millis_now();
+			pd->phy_tstamp = osdp_pd_millis_now(pd);
 			pd->phy_state = OSDP_CP_PHY_STATE_WAIT;
-			ret = 2;
 			break;
 		}
 		if (tmp == OSDP_CP_ERR_GENERIC) {
 			pd->phy_state = OSDP_CP_PHY_STATE_ERR;
 			break;
 		}
-		if (osdp_millis_since(pd->phy_tstamp) > OSDP_RESP_TOUT_MS) {
+		if (tmp == OSDP_CP_ERR_CORRUPT) {
+			LOG_ERR(TAG "CMD: %02x - corrupt reply", pd->cmd_id);
+		} else if (osdp_pd_millis_since(pd, pd->phy_tstamp) >
+			   OSDP_RESP_TOUT_MS) {
 			LOG_ERR(TAG "CMD: %02x - response timeout", pd->cmd_id);
-			pd->phy_state = OSDP_CP_PHY_STATE_ERR;
+			OSDP_STATS_INC(pd, timeouts);
+		} else {
+			break;
+		}
+		if (cp_resend_command(pd) == 0) {
+			LOG_INF(TAG "CMD: %02x - resent", pd->cmd_id);
+			pd->phy_tstamp = osdp_pd_millis_now(pd);
+			break;
 		}
+		pd->phy_state = OSDP_CP_PHY_STATE_ERR;
 		break;
 	case OSDP_CP_PHY_STATE_WAIT:
-		if (osdp_millis_since(pd->phy_tstamp) < OSDP_CMD_RETRY_WAIT_MS) {
+		if (osdp_pd_millis_since(pd, pd->phy_tstamp) <
+		    OSDP_CP_BUSY_RETRY_MS) {
 			break;
 		}
-		pd->phy_state = OSDP_CP_PHY_STATE_IDLE;
+		if (cp_bus_acquire(pd)) {
+			break; /* the bus was given to another PD meanwhile */
+		}
+		if (cp_retry_command(pd)) {
+			pd->phy_state = OSDP_CP_PHY_STATE_ERR;
+			break;
+		}
+		pd->phy_state = OSDP_CP_PHY_STATE_REPLY_WAIT;
+		pd->phy_tstamp = osdp_pd_millis_now(pd);
 		break;
 	case OSDP_CP_PHY_STATE_ERR:
-		pd->rx_buf_len = 0;
+		cp_cmd_complete(pd, OSDP_CMD_RESULT_TIMEOUT, 0);
+		osdp_phy_rx_reset(pd);
 		if (pd->channel.flush) {
 			pd->channel.flush(pd->channel.data);
 		}
-		cp_flush_command_queue(pd);
+		cp_cmd_park(pd);
 		pd->phy_state = OSDP_CP_PHY_STATE_ERR_WAIT;
 		ret = OSDP_CP_ERR_GENERIC;
 		break;
@@ -777,6 +1664,13 @@ static int cp_phy_state_update(struct osdp_pd *pd)
 		break;
 	}
 
+	if (pd->phy_state != OSDP_CP_PHY_STATE_REPLY_WAIT) {
+		cp_bus_release(pd);
+	}
+	/* phy_state is only for this thread; the app reads the bitmap */
+	cp_status_map_set(TO_CP(pd->__parent)->rx_wait_map,
+			  &TO_CP(pd->__parent)->num_rx_wait, pd->offset,
+			  pd->phy_state == OSDP_CP_PHY_STATE_REPLY_WAIT);
 	return ret;
 }
 
@@ -810,6 +1704,10 @@ static int state_update(struct osdp_pd *pd)
 {
 	int phy_state, soft_fail;
 
+#ifdef CONFIG_OSDP_THREADED_CP
+	cp_event_retry(pd);
+#endif
+	cp_cmd_ingress_drain(pd);
 	phy_state = cp_phy_state_update(pd);
 	if (phy_state == OSDP_CP_ERR_INPROG ||
 	    phy_state == OSDP_CP_ERR_CAN_YIELD) {
@@ -832,21 +1730,40 @@ static int state_update(struct osdp_pd *pd)
 #ifdef CONFIG_OSDP_SC_ENABLED
 		if (ISSET_FLAG(pd, PD_FLAG_SC_ACTIVE)  == false &&
 		    ISSET_FLAG(pd, PD_FLAG_SC_CAPABLE) == true  &&
-		    osdp_millis_since(pd->sc_tstamp) > OSDP_PD_SC_RETRY_MS) {
+		    osdp_pd_millis_since(pd, pd->sc_tstamp) >
+		    OSDP_PD_SC_RETRY_MS) {
 			LOG_INF("retry SC after retry timeout");
 			cp_set_state(pd, OSDP_CP_STATE_SC_INIT);
 			break;
 		}
 #endif
-		if (osdp_millis_since(pd->tstamp) < OSDP_PD_POLL_TIMEOUT_MS) {
+		if (osdp_pd_millis_since(pd, pd->tstamp) <
+		    cp_poll_interval(pd)) {
 			break;
 		}
+#ifdef CONFIG_OSDP_THREADED_CP
+		if (pd->event_held &&
+		    ISSET_FLAG(pd, PD_FLAG_AWAIT_RESP) == false) {
+			break; /* see cp_event_retry() */
+		}
+#endif
+		if (ISSET_FLAG(pd, PD_FLAG_AWAIT_RESP) == false &&
+		    pd->bus->burst_pass == false) {
+			if (osdp_pd_millis_now(pd) < cp_bus_poll_due(pd)) {
+				break;
+			}
+			pd->bus->poll_due_us = osdp_pd_millis_now(pd) * 1000 +
+					       pd->bus->poll_gap_us;
+		}
 		if (cp_cmd_dispatcher(pd, CMD_POLL) == 0) {
-			pd->tstamp = osdp_millis_now();
+			pd->tstamp = osdp_pd_millis_now(pd);
+			if (pd->idle_polls < 8 * OSDP_PD_POLL_IDLE_COUNT) {
+				pd->idle_polls++;
+			}
 		}
 		break;
 	case OSDP_CP_STATE_OFFLINE:
-		if (osdp_millis_since(pd->tstamp) > OSDP_CMD_RETRY_WAIT_MS) {
+		if (osdp_pd_millis_since(pd, pd->tstamp) > pd->retry_wait) {
 			cp_reset_state(pd);
 		}
 		break;
@@ -889,7 +1806,8 @@ static int state_update(struct osdp_pd *pd)
 		if (phy_state < 0) {
 			if (ISSET_FLAG(pd, PD_FLAG_SC_SCBKD_DONE)) {
 				LOG_INF(TAG "SC Failed; online without SC");
-				pd->sc_tstamp = osdp_millis_now();
+				OSDP_STATS_INC(pd, sc_failures);
+				pd->sc_tstamp = osdp_pd_millis_now(pd);
 				cp_set_state(pd, OSDP_CP_STATE_ONLINE);
 				break;
 			}
@@ -898,11 +1816,13 @@ static int state_update(struct osdp_pd *pd)
 			cp_set_state(pd, OSDP_CP_STATE_SC_INIT);
 			pd->phy_state = 0; /* soft reset phy state */
 			LOG_WRN(TAG "SC Failed; retry with SCBK-D");
+			OSDP_STATS_INC(pd, sc_failures);
 			break;
 		}
 		if (pd->reply_id != REPLY_CCRYPT) {
 			LOG_ERR(TAG "CHLNG failed. Online without SC");
-			pd->sc_tstamp = osdp_millis_now();
+			OSDP_STATS_INC(pd, sc_failures);
+			pd->sc_tstamp = osdp_pd_millis_now(pd);
 			cp_set_state(pd, OSDP_CP_STATE_ONLINE);
 			break;
 		}
@@ -914,17 +1834,19 @@ static int state_update(struct osdp_pd *pd)
 		}
 		if (pd->reply_id != REPLY_RMAC_I) {
 			LOG_ERR(TAG "SCRYPT failed. Online without SC");
-			pd->sc_tstamp = osdp_millis_now();
+			OSDP_STATS_INC(pd, sc_failures);
+			pd->sc_tstamp = osdp_pd_millis_now(pd);
 			cp_set_state(pd, OSDP_CP_STATE_ONLINE);
 			break;
 		}
+		OSDP_STATS_INC(pd, sc_handshakes);
 		if (ISSET_FLAG(pd, PD_FLAG_SC_USE_SCBKD)) {
 			LOG_WRN(TAG "SC ACtive with SCBK-D; Set SCBK");
 			cp_set_state(pd, OSDP_CP_STATE_SET_SCBK);
 			break;
 		}
 		LOG_INF(TAG "SC Active");
-		pd->sc_tstamp = osdp_millis_now();
+		pd->sc_tstamp = osdp_pd_millis_now(pd);
 		cp_set_state(pd, OSDP_CP_STATE_ONLINE);
 		break;
 	case OSDP_CP_STATE_SET_SCBK:
@@ -950,28 +1872,407 @@ static int state_update(struct osdp_pd *pd)
 	return 0;
 }
 
-static int osdp_cp_send_command_keyset(osdp_t *ctx, struct osdp_cmd_keyset *p)
+/**
+ * Run one pass over the PDs of a bus, starting with the one whose turn it is.
+ *
+ * PDs that just reported a card read or keypress go before that, so the rest
+ * of the entry isn't stuck behind the idle polls of the whole bus. The
+ * round-robin doesn't move for them and bus->burst_credit keeps them to
+ * about 100 - OSDP_BUS_POLL_BUDGET_PCT percent of the commands sent.
+ */
+static void cp_bus_refresh(struct osdp_bus *bus)
 {
+	int i, next = bus->next;
+	struct osdp_pd *pd = bus->owner;
+
+	/*
+	 * After a burst pass, the PD on the wire needn't be the last one in the
+	 * round-robin order. Let it take its reply first so that the bus goes to
+	 * the PD whose turn it is rather than to whoever comes after it.
+	 */
+	if (pd != NULL) {
+		osdp_log_ctx_set(pd);
+		state_update(pd);
+		osdp_log_ctx_restore();
+	}
+
+	if (bus->burst_credit > 0) {
+		bus->burst_pass = true;
+		for (i = 0; i < bus->num_pd; i++) {
+			pd = bus->pd[i];
+			if (!cp_pd_in_burst(pd)) {
+				continue;
+			}
+			osdp_log_ctx_set(pd);
+			state_update(pd);
+			osdp_log_ctx_restore();
+		}
+		bus->burst_pass = false;
+		bus->next = next;
+	}
+
+	for (i = 0; i < bus->num_pd; i++) {
+		pd = bus->pd[(next + i) % bus->num_pd];
+		osdp_log_ctx_set(pd);
+		state_update(pd);
+		osdp_log_ctx_restore();
+	}
+}
+
+/**
+ * Returns the absolute time (in millis) at which state_update() has some work
+ * to do for this PD. The conditions here must mirror the timer checks in
+ * cp_phy_state_update() and state_update() above.
+ */
+static int64_t cp_pd_bus_free_at(struct osdp_pd *pd, int64_t now)
+{
+	struct osdp_pd *owner = pd->bus->owner;
+
+	if (owner != NULL && owner != pd &&
+	    owner->phy_state == OSDP_CP_PHY_STATE_REPLY_WAIT) {
+		/* bus is busy; at the latest, it frees up */
+		return owner->phy_tstamp + OSDP_RESP_TOUT_MS + 1;
+	}
+	return now;
+}
+
+static int64_t cp_pd_deadline(struct osdp_pd *pd, int64_t now)
+{
+	int64_t deadline;
+	queue_node_t *node;
+
+	switch (pd->phy_state) {
+	case OSDP_CP_PHY_STATE_REPLY_WAIT:
+		return pd->phy_tstamp + OSDP_RESP_TOUT_MS + 1;
+	case OSDP_CP_PHY_STATE_WAIT:
+		deadline = pd->phy_tstamp + OSDP_CP_BUSY_RETRY_MS;
+		if (deadline > now) {
+			return deadline;
+		}
+		return cp_pd_bus_free_at(pd, now);
+	case OSDP_CP_PHY_STATE_IDLE:
+		if (cp_cmd_pending(pd) ||
+		    (pd->state == OSDP_CP_STATE_ONLINE &&
+		     (!osdp_mpsc_is_empty(&pd->cmd_ingress) ||
+		      queue_peek_first(&pd->cmd_parked, &node) == 0))) {
+			return cp_pd_bus_free_at(pd, now);
+		}
+		break;
+	case OSDP_CP_PHY_STATE_ERR_WAIT:
+		break;
+	default:
+		return now;
+	}
+
+	/* PD_FLAG_AWAIT_RESP stays set on a PD that went offline mid-command */
+	if (pd->state == OSDP_CP_STATE_OFFLINE) {
+		return pd->tstamp + pd->retry_wait + 1;
+	}
+
+	/* a reply is yet to be consumed by state_update() */
+	if (ISSET_FLAG(pd, PD_FLAG_AWAIT_RESP)) {
+		return now;
+	}
+
+	switch (pd->state) {
+	case OSDP_CP_STATE_ONLINE:
+#ifdef CONFIG_OSDP_THREADED_CP
+		if (pd->event_held) {
+			/* osdp_cp_refresh() kicks us once it makes room */
+			return now + OSDP_PD_POLL_TIMEOUT_MS;
+		}
+#endif
+		deadline = pd->tstamp + cp_poll_interval(pd);
+		if (deadline < cp_bus_poll_due(pd) &&
+		    (!cp_pd_in_burst(pd) || pd->bus->burst_credit <= 0)) {
+			deadline = cp_bus_poll_due(pd);
+		}
 #ifdef CONFIG_OSDP_SC_ENABLED
+		if (ISSET_FLAG(pd, PD_FLAG_SC_ACTIVE)  == false &&
+		    ISSET_FLAG(pd, PD_FLAG_SC_CAPABLE) == true  &&
+		    pd->sc_tstamp + OSDP_PD_SC_RETRY_MS + 1 < deadline) {
+			deadline = pd->sc_tstamp + OSDP_PD_SC_RETRY_MS + 1;
+		}
+#endif
+		return deadline;
+	default:
+		return now;
+	}
+}
+
+#ifdef CONFIG_OSDP_THREADED_CP
+
+static void cp_event_node_deliver(struct osdp_cp *cp, struct cp_event_node *n)
+{
+	switch (n->type) {
+	case CP_EVENT_NODE_EVENT:
+		if (cp->event_callback) {
+			cp->event_callback(cp->event_callback_arg, n->address,
+					   &n->object);
+		}
+		break;
+	case CP_EVENT_NODE_STATUS:
+		if (cp->status_callback) {
+			cp->status_callback(cp->status_callback_arg,
+					    n->status.pd, n->status.old_status,
+					    n->status.new_status,
+					    n->status.reason);
+		}
+		break;
+	case CP_EVENT_NODE_QUEUE:
+		if (cp->queue_callback) {
+			cp->queue_callback(cp->queue_callback_arg, n->queue.pd,
+					   n->queue.depth, n->queue.high);
+		}
+		break;
+	case CP_EVENT_NODE_COMPLETION:
+		if (cp->completion_callback) {
+			cp->completion_callback(cp->completion_callback_arg,
+						n->completion.pd,
+						&n->completion.object);
+		}
+		break;
+	}
+}
+
+static void cp_worker_kick(struct osdp_cp_worker *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->kick = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * Sleep till the earliest deadline of this worker's PDs or till some one
+ * kicks us. Channels don't give us a way to wait for data so while a reply
+ * is expected, check back every OSDP_CP_WORKER_RX_POLL_MS.
+ */
+static void cp_worker_wait(struct osdp_cp_worker *w)
+{
 	int i;
-	struct osdp_cmd *cmd;
+	struct timespec ts;
 	struct osdp_pd *pd;
+	int64_t now, deadline, next = -1;
 
-	if (osdp_get_sc_status_mask(ctx) != PD_MASK(ctx)) {
+	now = osdp_millis_now();
+	for (i = 0; i < w->bus->num_pd; i++) {
+		pd = w->bus->pd[i];
+		deadline = cp_pd_deadline(pd, now);
+		if (pd->phy_state == OSDP_CP_PHY_STATE_REPLY_WAIT &&
+		    deadline > now + OSDP_CP_WORKER_RX_POLL_MS) {
+			deadline = now + OSDP_CP_WORKER_RX_POLL_MS;
+		}
+		if (next < 0 || deadline < next) {
+			next = deadline;
+		}
+	}
+	if (next <= now) {
+		return;
+	}
+
+	/* condvars only know the realtime clock; this is just a timeout */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += (next - now) / 1000;
+	ts.tv_nsec += ((next - now) % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec += 1;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&w->lock);
+	while (!w->kick && !w->stop) {
+		if (pthread_cond_timedwait(&w->cond, &w->lock, &ts) != 0) {
+			break;
+		}
+	}
+	w->kick = 0;
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void *cp_worker_thread(void *arg)
+{
+	struct osdp_cp_worker *w = arg;
+
+	while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+		w->now = osdp_millis_now();
+		cp_bus_refresh(w->bus);
+		cp_worker_wait(w);
+	}
+	return NULL;
+}
+
+static void cp_workers_stop(struct osdp *ctx)
+{
+	int i;
+	struct osdp_cp *cp = TO_CP(ctx);
+	struct osdp_cp_worker *w;
+	struct cp_event_node n;
+
+	for (i = 0; i < cp->num_workers; i++) {
+		w = cp->workers + i;
+		if (w->ctx != NULL) { /* thread is running */
+			pthread_mutex_lock(&w->lock);
+			__atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+			pthread_cond_signal(&w->cond);
+			pthread_mutex_unlock(&w->lock);
+			pthread_join(w->thread, NULL);
+		}
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+	}
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		TO_PD(ctx, i)->worker = NULL;
+		TO_PD(ctx, i)->now = &ctx->now;
+	}
+	CLEAR_FLAG(ctx, FLAG_CP_THREADED);
+	/* hand over events that the app has not collected yet */
+	while (osdp_mpsc_pop(&cp->events, &n) == 0) {
+		cp_event_node_deliver(cp, &n);
+	}
+	for (i = 0; i < NUM_PD(ctx); i++) {
+		cp_event_retry(TO_PD(ctx, i));
+	}
+	cp->events_held = 0;
+	osdp_mpsc_del(&cp->events);
+	safe_free(cp->workers);
+	cp->workers = NULL;
+	cp->num_workers = 0;
+}
+
+static int cp_workers_start(struct osdp *ctx)
+{
+	int i, j;
+	struct osdp_pd *pd;
+	struct osdp_cp *cp = TO_CP(ctx);
+	struct osdp_cp_worker *w;
+
+	cp->workers = calloc(cp->num_bus, sizeof(struct osdp_cp_worker));
+	if (cp->workers == NULL ||
+	    osdp_mpsc_init(&cp->events, sizeof(struct cp_event_node),
+			   OSDP_CP_EVENT_QUEUE_SIZE)) {
+		LOG_ERR(TAG "failed to alloc workers");
+		safe_free(cp->workers);
+		cp->workers = NULL;
+		return -1;
+	}
+
+	/* one worker per bus */
+	for (i = 0; i < cp->num_bus; i++) {
+		w = cp->workers + i;
+		w->bus = cp->bus + i;
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		for (j = 0; j < w->bus->num_pd; j++) {
+			pd = w->bus->pd[j];
+			pd->worker = w;
+			pd->now = &w->now;
+		}
+	}
+	cp->num_workers = cp->num_bus;
+
+	SET_FLAG(ctx, FLAG_CP_THREADED);
+	for (i = 0; i < cp->num_workers; i++) {
+		w = cp->workers + i;
+		w->now = osdp_millis_now();
+		if (pthread_create(&w->thread, NULL, cp_worker_thread, w)) {
+			LOG_ERR(TAG "failed to start worker thread");
+			goto error;
+		}
+		w->ctx = ctx;
+	}
+	LOG_INF(TAG "started %d worker(s)", cp->num_workers);
+	return 0;
+
+error:
+	cp_workers_stop(ctx);
+	return -1;
+}
+
+static void cp_dispatch_events(struct osdp *ctx)
+{
+	int i;
+	struct osdp_cp *cp = TO_CP(ctx);
+	struct cp_event_node n;
+
+	while (osdp_mpsc_pop(&cp->events, &n) == 0) {
+		cp_event_node_deliver(cp, &n);
+	}
+	if (__atomic_exchange_n(&cp->events_held, 0, __ATOMIC_ACQ_REL)) {
+		for (i = 0; i < cp->num_workers; i++) {
+			cp_worker_kick(cp->workers + i);
+		}
+	}
+}
+
+#endif /* CONFIG_OSDP_THREADED_CP */
+
+/**
+ * Queue a command from the application. Can be called from any thread.
+ */
+static int cp_cmd_submit(struct osdp_pd *pd, struct osdp_cmd *cmd)
+{
+	struct cp_cmd_node n;
+
+	n.from_app = true;
+	/* pd->now is not ours to read; see cp_cmd_ingress_drain() */
+	n.submitted = osdp_millis_now();
+	n.deadline = 0;
+	if (cmd->deadline_ms) {
+		n.deadline = n.submitted + cmd->deadline_ms;
+	}
+	if (cmd->priority != OSDP_CMD_PRIORITY_DEFAULT) {
+		n.lane = cmd->priority - 1;
+	} else if (cmd->id == CMD_OUT) {
+		n.lane = OSDP_CMD_PRIORITY_CONTROL - 1;
+	} else if (cmd->id == CMD_LED || cmd->id == CMD_BUZ ||
+		   cmd->id == CMD_TEXT) {
+		n.lane = OSDP_CMD_PRIORITY_INDICATOR - 1;
+	} else {
+		n.lane = OSDP_CMD_PRIORITY_BULK - 1;
+	}
+	memcpy(&n.object, cmd, sizeof(struct osdp_cmd));
+
+	/*
+	 * cmd_depth caps the commands in cmd_ingress, the command queue and
+	 * cmd_parked together; so the pool never has to grow past the cap.
+	 * cmd_ingress itself only holds OSDP_CP_CMD_POOL_SIZE commands till
+	 * cp_cmd_ingress_drain() moves them to the (growable) command queue;
+	 * a longer burst is held off with OSDP_ERR_WOULD_BLOCK till then.
+	 */
+	if (__atomic_add_fetch(&pd->cmd_depth, 1, __ATOMIC_RELAXED) >
+	    OSDP_CP_CMD_POOL_MAX || osdp_mpsc_push(&pd->cmd_ingress, &n)) {
+		__atomic_sub_fetch(&pd->cmd_depth, 1, __ATOMIC_RELAXED);
+		LOG_DBG(TAG "command queue full");
+		return OSDP_ERR_WOULD_BLOCK;
+	}
+#ifdef CONFIG_OSDP_THREADED_CP
+	if (pd->worker != NULL) {
+		cp_worker_kick(pd->worker);
+	}
+#endif
+	return 0;
+}
+
+static int osdp_cp_send_command_keyset(osdp_t *ctx, struct osdp_cmd *p)
+{
+#ifdef CONFIG_OSDP_SC_ENABLED
+	int i;
+	struct osdp_cmd cmd;
+	struct osdp_pd *pd;
+
+	if (osdp_get_sc_status_bitmap(ctx, NULL, 0) != NUM_PD(ctx)) {
 		LOG_WRN(TAG "CMD_KEYSET can be sent only when all PDs are "
 			"ONLINE and SC_ACTIVE.");
 		return 1;
 	}
 
+	memcpy(&cmd, p, sizeof(struct osdp_cmd));
+	cmd.id = CMD_KEYSET;
 	for (i = 0; i < NUM_PD(ctx); i++) {
 		pd = TO_PD(ctx, i);
-		cmd = cp_cmd_alloc(pd);
-		if (cmd == NULL) {
+		if (cp_cmd_submit(pd, &cmd)) {
 			return -1;
 		}
-		cmd->id = CMD_KEYSET;
-		memcpy(&cmd->keyset, p, sizeof(struct osdp_cmd_keyset));
-		cp_cmd_enqueue(pd, cmd);
 	}
 
 	return 0;
@@ -1002,6 +2303,8 @@ osdp_t *osdp_cp_setup(int num_pd, osdp_pd_info_t *info, uint8_t *master_key)
 	}
 	ctx->magic = 0xDEADBEAF;
 	ctx->flags |= FLAG_CP_MODE;
+	ctx->log_level = -1;
+	osdp_capture_init(ctx);
 
 #ifdef CONFIG_OSDP_SC_ENABLED
 	if (master_key != NULL) {
@@ -1025,6 +2328,17 @@ osdp_t *osdp_cp_setup(int num_pd, osdp_pd_info_t *info, uint8_t *master_key)
 		goto error;
 	}
 	cp->num_pd = num_pd;
+	cp->status_map = calloc(OSDP_STATUS_BITMAP_WORDS(num_pd),
+				sizeof(uint64_t));
+	cp->sc_status_map = calloc(OSDP_STATUS_BITMAP_WORDS(num_pd),
+				   sizeof(uint64_t));
+	cp->rx_wait_map = calloc(OSDP_STATUS_BITMAP_WORDS(num_pd),
+				 sizeof(uint64_t));
+	if (cp->status_map == NULL || cp->sc_status_map == NULL ||
+	    cp->rx_wait_map == NULL) {
+		LOG_ERR(TAG "failed to alloc status bitmaps");
+		goto error;
+	}
 
 	for (i = 0; i < num_pd; i++) {
 		osdp_pd_info_t *p = info + i;
@@ -1035,11 +2349,23 @@ osdp_t *osdp_cp_setup(int num_pd, osdp_pd_info_t *info, uint8_t *master_key)
 		pd->address = p->address;
 		pd->flags = p->flags;
 		pd->seq_number = -1;
+		pd->now = &ctx->now;
+		osdp_phy_poll_cache_init(pd);
+		/* any odd multiplier keeps the xorshift state non-zero */
+		pd->backoff_rng = 0x9E3779B9u * (uint32_t)(p->address + 1);
 		if (cp_cmd_queue_init(pd)) {
 			goto error;
 		}
+		if (osdp_mpsc_init(&pd->cmd_ingress, sizeof(struct cp_cmd_node),
+				   OSDP_CP_CMD_POOL_SIZE)) {
+			LOG_ERR(TAG "failed to alloc command ingress queue");
+			goto error;
+		}
 		memcpy(&pd->channel, &p->channel, sizeof(struct osdp_channel));
 	}
+	if (cp_bus_setup(ctx)) {
+		goto error;
+	}
 	SET_CURRENT_PD(ctx, 0);
 	LOG_INF(TAG "setup complete");
 	return (osdp_t *) ctx;
@@ -1058,9 +2384,24 @@ void osdp_cp_teardown(osdp_t *ctx)
 		return;
 	}
 
+#ifdef CONFIG_OSDP_THREADED_CP
+	if (TO_CP(ctx)->workers != NULL) {
+		cp_workers_stop(TO_OSDP(ctx));
+	}
+#endif
 	for (i = 0; i < NUM_PD(ctx); i++) {
+#ifdef CONFIG_OSDP_SC_ENABLED
+		osdp_sc_teardown(TO_PD(ctx, i));
+#endif
 		cp_cmd_queue_del(TO_PD(ctx, i));
+		osdp_mpsc_del(&TO_PD(ctx, i)->cmd_ingress);
 	}
+	cp_bus_teardown(TO_OSDP(ctx));
+	osdp_capture_del(TO_OSDP(ctx));
+	osdp_log_ctx_release(TO_OSDP(ctx));
+	safe_free(TO_CP(ctx)->status_map);
+	safe_free(TO_CP(ctx)->sc_status_map);
+	safe_free(TO_CP(ctx)->rx_wait_map);
 	safe_free(TO_PD(ctx, 0));
 	safe_free(TO_CP(ctx));
 	safe_free(ctx);
@@ -1073,11 +2414,87 @@ void osdp_cp_refresh(osdp_t *ctx)
 
 	assert(ctx);
 
+#ifdef CONFIG_OSDP_THREADED_CP
+	if (ISSET_FLAG(TO_OSDP(ctx), FLAG_CP_THREADED)) {
+		cp_dispatch_events(ctx);
+		return;
+	}
+#endif
+	osdp_clock_update(TO_OSDP(ctx));
+	for (i = 0; i < TO_CP(ctx)->num_bus; i++) {
+		cp_bus_refresh(TO_CP(ctx)->bus + i);
+	}
+}
+
+OSDP_EXPORT
+int osdp_cp_next_deadline(osdp_t *ctx)
+{
+	int i;
+	int64_t now, deadline, next = -1;
+
+	assert(ctx);
+
+#ifdef CONFIG_OSDP_THREADED_CP
+	if (ISSET_FLAG(TO_OSDP(ctx), FLAG_CP_THREADED)) {
+		/* PD timers are the workers' business */
+		if (!osdp_mpsc_is_empty(&TO_CP(ctx)->events)) {
+			return 0;
+		}
+		return OSDP_PD_POLL_TIMEOUT_MS;
+	}
+#endif
+	now = osdp_millis_now();
 	for (i = 0; i < NUM_PD(ctx); i++) {
-		SET_CURRENT_PD(ctx, i);
-		osdp_log_ctx_set(i);
-		state_update(GET_CURRENT_PD(ctx));
+		deadline = cp_pd_deadline(TO_PD(ctx, i), now);
+		if (next < 0 || deadline < next) {
+			next = deadline;
+		}
 	}
+	if (next <= now) {
+		return 0;
+	}
+	return (int)(next - now);
+}
+
+OSDP_EXPORT
+int osdp_cp_get_rx_wait_bitmap(osdp_t *ctx, uint64_t *bitmap, int n)
+{
+	assert(ctx);
+
+	return osdp_status_bitmap_copy(ctx, TO_CP(ctx)->rx_wait_map,
+				       &TO_CP(ctx)->num_rx_wait, bitmap, n);
+}
+
+OSDP_EXPORT
+void osdp_cp_notify_readable(osdp_t *ctx, int pd)
+{
+	struct osdp_pd *owner;
+
+	assert(ctx);
+
+	if (pd < 0 || pd >= NUM_PD(ctx)) {
+		LOG_ERR(TAG "Invalid PD number");
+		return;
+	}
+#ifdef CONFIG_OSDP_THREADED_CP
+	if (TO_PD(ctx, pd)->worker != NULL) {
+		cp_worker_kick(TO_PD(ctx, pd)->worker);
+		return;
+	}
+#endif
+	/**
+	 * On a multi-drop channel, the bytes belong to the PD whose command is
+	 * on the wire, not necessarily to the one the app was told about.
+	 */
+	owner = TO_PD(ctx, pd)->bus->owner;
+	if (owner != NULL) {
+		pd = owner->offset;
+	}
+	osdp_clock_update(TO_OSDP(ctx));
+	SET_CURRENT_PD(ctx, pd);
+	osdp_log_ctx_set(GET_CURRENT_PD(ctx));
+	state_update(GET_CURRENT_PD(ctx));
+	osdp_log_ctx_restore();
 }
 
 OSDP_EXPORT void
@@ -1089,21 +2506,36 @@ osdp_cp_set_event_callback(osdp_t *ctx, cp_event_callback_t cb, void *arg)
 	TO_CP(ctx)->event_callback_arg = arg;
 }
 
+OSDP_EXPORT void
+osdp_cp_set_status_callback(osdp_t *ctx, cp_status_callback_t cb, void *arg)
+{
+	assert(ctx);
+
+	TO_CP(ctx)->status_callback = cb;
+	TO_CP(ctx)->status_callback_arg = arg;
+}
+
 OSDP_EXPORT
 int osdp_cp_send_command(osdp_t *ctx, int pd, struct osdp_cmd *p)
 {
 	assert(ctx);
-	struct osdp_cmd *cmd;
+	struct osdp_cmd cmd;
 	int cmd_id;
 
 	if (pd < 0 || pd >= NUM_PD(ctx)) {
 		LOG_ERR(TAG "Invalid PD number");
 		return -1;
 	}
-	if (TO_PD(ctx, pd)->state != OSDP_CP_STATE_ONLINE) {
+	if (__atomic_load_n(&TO_PD(ctx, pd)->state, __ATOMIC_RELAXED) !=
+	    OSDP_CP_STATE_ONLINE) {
 		LOG_WRN(TAG "PD not online");
 		return -1;
 	}
+	if (p->priority < OSDP_CMD_PRIORITY_DEFAULT ||
+	    p->priority > OSDP_CMD_PRIORITY_BULK) {
+		LOG_ERR(TAG "Invalid command priority");
+		return -1;
+	}
 
 	switch (p->id) {
 	case OSDP_CMD_OUTPUT:
@@ -1126,32 +2558,126 @@ int osdp_cp_send_command(osdp_t *ctx, int pd, struct osdp_cmd *p)
 		break;
 #ifdef CONFIG_OSDP_SC_ENABLED
 	case OSDP_CMD_KEYSET:
-		return osdp_cp_send_command_keyset(ctx, &p->keyset);
+		return osdp_cp_send_command_keyset(ctx, p);
 #endif
 	default:
 		LOG_ERR(TAG "Invalid command ID");
 		return -1;
 	}
 
-	cmd = cp_cmd_alloc(TO_PD(ctx, pd));
-	if (cmd == NULL) {
+	memcpy(&cmd, p, sizeof(struct osdp_cmd));
+	cmd.id = cmd_id; /* translate to internal */
+	return cp_cmd_submit(TO_PD(ctx, pd), &cmd);
+}
+
+OSDP_EXPORT
+void osdp_cp_set_command_coalescing(osdp_t *ctx, int enable)
+{
+	assert(ctx);
+
+	if (enable) {
+		SET_FLAG(TO_OSDP(ctx), FLAG_CP_COALESCE);
+	} else {
+		CLEAR_FLAG(TO_OSDP(ctx), FLAG_CP_COALESCE);
+	}
+}
+
+OSDP_EXPORT
+int osdp_cp_get_queue_depth(osdp_t *ctx, int pd)
+{
+	assert(ctx);
+
+	if (pd < 0 || pd >= NUM_PD(ctx)) {
+		LOG_ERR(TAG "Invalid PD number");
 		return -1;
 	}
+	return __atomic_load_n(&TO_PD(ctx, pd)->cmd_depth, __ATOMIC_RELAXED);
+}
+
+OSDP_EXPORT
+int osdp_cp_set_queue_watermarks(osdp_t *ctx, int high_mark, int low_mark,
+				 cp_queue_callback_t cb, void *arg)
+{
+	assert(ctx);
+	struct osdp_cp *cp = TO_CP(ctx);
 
-	memcpy(cmd, p, sizeof(struct osdp_cmd));
-	cmd->id = cmd_id; /* translate to internal */
-	cp_cmd_enqueue(TO_PD(ctx, pd), cmd);
+	if (high_mark < 1 || high_mark > OSDP_CP_CMD_POOL_MAX ||
+	    low_mark < 0 || low_mark >= high_mark) {
+		LOG_ERR(TAG "Invalid queue watermarks");
+		return -1;
+	}
+	cp->queue_high = high_mark;
+	cp->queue_low = low_mark;
+	cp->queue_callback_arg = arg;
+	cp->queue_callback = cb;
 	return 0;
 }
 
+OSDP_EXPORT void
+osdp_cp_set_completion_callback(osdp_t *ctx, cp_completion_callback_t cb,
+				void *arg)
+{
+	assert(ctx);
+
+	TO_CP(ctx)->completion_callback = cb;
+	TO_CP(ctx)->completion_callback_arg = arg;
+}
+
+OSDP_EXPORT
+int osdp_cp_start_workers(osdp_t *ctx)
+{
+	assert(ctx);
+
+#ifdef CONFIG_OSDP_THREADED_CP
+	if (TO_CP(ctx)->workers != NULL) {
+		return 0;
+	}
+	return cp_workers_start(TO_OSDP(ctx));
+#else
+	ARG_UNUSED(ctx);
+	LOG_ERR(TAG "built without CONFIG_OSDP_THREADED_CP");
+	return -1;
+#endif
+}
+
+OSDP_EXPORT
+void osdp_cp_stop_workers(osdp_t *ctx)
+{
+	assert(ctx);
+
+#ifdef CONFIG_OSDP_THREADED_CP
+	if (TO_CP(ctx)->workers != NULL) {
+		cp_workers_stop(TO_OSDP(ctx));
+	}
+#else
+	ARG_UNUSED(ctx);
+#endif
+}
+
 #ifdef UNIT_TESTING
 
+/**
+ * Tests drive the FSMs directly instead of through osdp_cp_refresh() so the
+ * clock needs to be sampled on their behalf.
+ */
+static int test_cp_phy_state_update_wrapper(struct osdp_pd *pd)
+{
+	osdp_clock_update(TO_CTX(pd));
+	return cp_phy_state_update(pd);
+}
+
+static int test_state_update_wrapper(struct osdp_pd *pd)
+{
+	osdp_clock_update(TO_CTX(pd));
+	return state_update(pd);
+}
+
 /**
  * Force export some private methods for testing.
  */
 void (*test_cp_cmd_enqueue)(struct osdp_pd *, struct osdp_cmd *) = cp_cmd_enqueue;
 struct osdp_cmd * (*test_cp_cmd_alloc)(struct osdp_pd *) = cp_cmd_alloc;
-int (*test_cp_phy_state_update)(struct osdp_pd *) = cp_phy_state_update;
-int (*test_state_update)(struct osdp_pd *) = state_update;
+int (*test_cp_phy_state_update)(struct osdp_pd *) = test_cp_phy_state_update_wrapper;
+int (*test_state_update)(struct osdp_pd *) = test_state_update_wrapper;
 
 #endif /* UNIT_TESTING */
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+
+#include "osdp_common.h"
+
+#define TAG "CRYPTO: "
+
+/* --- tiny-AES (osdp_aes.c) backend; portable reference --- */
+
+static int tiny_set_key(struct osdp_aes_key *k, const uint8_t *key)
+{
+	AES_init_ctx(&k->rk.tiny, key);
+	return 0;
+}
+
+static void tiny_ecb_encrypt(struct osdp_aes_key *k, uint8_t *block)
+{
+	AES_ECB_encrypt(&k->rk.tiny, block);
+}
+
+static void tiny_ecb_decrypt(struct osdp_aes_key *k, uint8_t *block)
+{
+	AES_ECB_decrypt(&k->rk.tiny, block);
+}
+
+static void tiny_cbc_encrypt(struct osdp_aes_key *k, const uint8_t *iv,
+			     uint8_t *data, int len)
+{
+	AES_ctx_set_iv(&k->rk.tiny, iv);
+	AES_CBC_encrypt_buffer(&k->rk.tiny, data, len);
+}
+
+static void tiny_cbc_decrypt(struct osdp_aes_key *k, const uint8_t *iv,
+			     uint8_t *data, int len)
+{
+	AES_ctx_set_iv(&k->rk.tiny, iv);
+	AES_CBC_decrypt_buffer(&k->rk.tiny, data, len);
+}
+
+const struct osdp_aes_ops osdp_aes_tiny_ops = {
+	.name = "tiny-aes",
+	.set_key = tiny_set_key,
+	.ecb_encrypt = tiny_ecb_encrypt,
+	.ecb_decrypt = tiny_ecb_decrypt,
+	.cbc_encrypt = tiny_cbc_encrypt,
+	.cbc_decrypt = tiny_cbc_decrypt,
+};
+
+/**
+ * Backends in order of preference. The first one that is supported on the
+ * running CPU is picked when the first key is initialized. Secure channel
+ * messages are a few AES blocks long so the per-call overhead of EVP puts
+ * OpenSSL behind AES-NI; it is still the fastest choice on other hosts
+ * (ARMv8 crypto extensions, etc.,) when built in.
+ */
+const struct osdp_aes_ops *const osdp_aes_backends[] = {
+#ifdef CONFIG_OSDP_CRYPTO_AESNI
+	&osdp_aes_ni_ops,
+#endif
+#ifdef CONFIG_OSDP_CRYPTO_OPENSSL
+	&osdp_aes_openssl_ops,
+#endif
+	&osdp_aes_ttable_ops,
+	&osdp_aes_tiny_ops,
+	NULL
+};
+
+/**
+ * Shared by all contexts, and so by CP worker threads that set up secure
+ * channels at the same time; only accessed atomically.
+ */
+static const struct osdp_aes_ops *g_aes_ops;
+
+const struct osdp_aes_ops *osdp_crypto_get_ops(void)
+{
+	int i;
+	const struct osdp_aes_ops *ops, *expected = NULL;
+
+	ops = __atomic_load_n(&g_aes_ops, __ATOMIC_ACQUIRE);
+	if (ops != NULL) {
+		return ops;
+	}
+	ops = &osdp_aes_tiny_ops;
+	for (i = 0; osdp_aes_backends[i] != NULL; i++) {
+		if (osdp_aes_backends[i]->supported == NULL ||
+		    osdp_aes_backends[i]->supported()) {
+			ops = osdp_aes_backends[i];
+			break;
+		}
+	}
+	/* if some other thread got here first, go with its pick */
+	if (!__atomic_compare_exchange_n(&g_aes_ops, &expected, ops, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return expected;
+	}
+	LOG_DBG(TAG "using %s backend", ops->name);
+	return ops;
+}
+
+/**
+ * Select the backend for keys initialized from now on. Keys that already
+ * exist keep using the backend they were expanded with.
+ *
+ * Returns:
+ *  0: success
+ * -1: backend not supported on this CPU
+ */
+int osdp_crypto_set_ops(const struct osdp_aes_ops *ops)
+{
+	if (ops->supported && !ops->supported()) {
+		return -1;
+	}
+	__atomic_store_n(&g_aes_ops, ops, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void osdp_aes_key_init(struct osdp_aes_key *k, const uint8_t *key)
+{
+	const struct osdp_aes_ops *ops = osdp_crypto_get_ops();
+
+	if (k->ops != ops) {
+		/* rk layout is backend specific; don't reuse across them */
+		osdp_aes_key_release(k);
+		k->ops = ops;
+	}
+	if (ops->set_key(k, key) != 0) {
+		LOG_WRN(TAG "%s: set_key failed; using %s", ops->name,
+			osdp_aes_ttable_ops.name);
+		osdp_aes_key_release(k);
+		k->ops = &osdp_aes_ttable_ops;
+		k->ops->set_key(k, key);
+	}
+}
+
+void osdp_aes_key_release(struct osdp_aes_key *k)
+{
+	if (k->ops && k->ops->release) {
+		k->ops->release(k);
+	}
+	memset(k, 0, sizeof(struct osdp_aes_key));
+}
+
+void osdp_encrypt_ctx(struct osdp_aes_key *k, uint8_t *iv,
+		      uint8_t *data, int len)
+{
+	if (iv != NULL) {
+		/* encrypt multiple block with AES in CBC mode */
+		k->ops->cbc_encrypt(k, iv, data, len);
+	} else {
+		/* encrypt one block with AES in ECB mode */
+		assert(len <= 16);
+		k->ops->ecb_encrypt(k, data);
+	}
+}
+
+void osdp_decrypt_ctx(struct osdp_aes_key *k, uint8_t *iv,
+		      uint8_t *data, int len)
+{
+	if (iv != NULL) {
+		/* decrypt multiple block with AES in CBC mode */
+		k->ops->cbc_decrypt(k, iv, data, len);
+	} else {
+		/* decrypt one block with AES in ECB mode */
+		assert(len <= 16);
+		k->ops->ecb_decrypt(k, data);
+	}
+}
+
+void osdp_encrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len)
+{
+	struct osdp_aes_key k = { 0 };
+
+	osdp_aes_key_init(&k, key);
+	osdp_encrypt_ctx(&k, iv, data, len);
+	osdp_aes_key_release(&k);
+}
+
+void osdp_decrypt(uint8_t *key, uint8_t *iv, uint8_t *data, int len)
+{
+	struct osdp_aes_key k = { 0 };
+
+	osdp_aes_key_init(&k, key);
+	osdp_decrypt_ctx(&k, iv, data, len);
+	osdp_aes_key_release(&k);
+}
@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * Deferred logging. Instead of formatting the message, osdp_log() stores the
+ * format string (which is a literal, so its address is its id), a timestamp
+ * and the raw arguments into a ring buffer owned by the calling thread. Each
+ * ring has one producer (its thread) and one consumer (whoever calls
+ * osdp_log_ring_flush(), under a lock) so no atomic RMW is needed on the
+ * fast path. Messages are formatted only when the rings are flushed.
+ *
+ * Arguments are recovered from the va_list by walking the format string, so
+ * only the printf conversions that LibOSDP uses are supported: integers (with
+ * hh/h/l/ll/z/j/t modifiers), doubles, chars, pointers and strings. Strings
+ * are copied (and truncated) into the record.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "osdp_common.h"
+
+#define LOG_RING_MAX_ARGS              8
+#define LOG_RING_STR_LEN               64
+
+enum log_arg_type_e {
+	LOG_ARG_INT,
+	LOG_ARG_LONG,
+	LOG_ARG_LLONG,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_PTR,
+	LOG_ARG_STR,
+};
+
+struct log_record {
+	int64_t tstamp;
+	struct osdp *ctx;
+	const char *fmt;
+	int16_t log_level;
+	int16_t log_ctx;
+	uint8_t num_args;
+	uint8_t arg_type[LOG_RING_MAX_ARGS];
+	union {
+		long long i;
+		double d;
+		const void *p;
+		int s;		/* offset into str */
+	} args[LOG_RING_MAX_ARGS];
+	char str[LOG_RING_STR_LEN];
+};
+
+struct log_ring {
+	struct log_ring *next;
+	int in_use;
+	uint32_t head;		/* written by the producer */
+	uint32_t tail;		/* written by the consumer */
+	uint32_t dropped;
+	struct log_record rec[OSDP_LOG_RING_SIZE];
+};
+
+static struct log_ring *g_log_rings;
+static OSDP_THREAD_LOCAL struct log_ring *g_log_ring;
+
+#ifdef CONFIG_OSDP_THREADED_CP
+static pthread_mutex_t g_log_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_log_ring_key;
+static pthread_once_t g_log_ring_once = PTHREAD_ONCE_INIT;
+
+/* give the ring of an exiting thread to the next thread that logs */
+static void log_ring_release(void *arg)
+{
+	struct log_ring *r = arg;
+
+	__atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void log_ring_key_init(void)
+{
+	pthread_key_create(&g_log_ring_key, log_ring_release);
+}
+#endif
+
+static struct log_ring *log_ring_get(void)
+{
+	int in_use;
+	struct log_ring *r;
+
+	if (g_log_ring != NULL) {
+		return g_log_ring;
+	}
+
+	/* reuse a ring left behind by a thread that has exited */
+	for (r = __atomic_load_n(&g_log_rings, __ATOMIC_ACQUIRE); r != NULL;
+	     r = r->next) {
+		in_use = 0;
+		if (__atomic_compare_exchange_n(&r->in_use, &in_use, 1, false,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if (r == NULL) {
+		r = calloc(1, sizeof(struct log_ring));
+		if (r == NULL) {
+			return NULL;
+		}
+		r->in_use = 1;
+		r->next = __atomic_load_n(&g_log_rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&g_log_rings, &r->next, r,
+						    true, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED)) {
+			/* r->next was reloaded; try again */
+		}
+	}
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_once(&g_log_ring_once, log_ring_key_init);
+	pthread_setspecific(g_log_ring_key, r);
+#endif
+	g_log_ring = r;
+	return r;
+}
+
+/**
+ * Returns a pointer to the conversion character of the format specifier that
+ * starts at `p` (just after the '%'), and sets `mod` to the number of 'l'-ish
+ * length modifiers (0: none/h/hh, 1: l/z/t, 2: ll/j). Any '*' fields are
+ * counted in `num_star`.
+ */
+static const char *log_parse_spec(const char *p, int *mod, int *num_star)
+{
+	*mod = 0;
+	*num_star = 0;
+	while (*p && strchr("-+ #0", *p)) {
+		p++;
+	}
+	while (*p && (strchr("0123456789.", *p) || *p == '*')) {
+		if (*p == '*') {
+			(*num_star)++;
+		}
+		p++;
+	}
+	while (*p && strchr("hlzjtL", *p)) {
+		if (*p == 'l') {
+			*mod += 1;
+		} else if (*p == 'z' || *p == 't') {
+			*mod = 1;
+		} else if (*p == 'j') {
+			*mod = 2;
+		}
+		p++;
+	}
+	return p;
+}
+
+void osdp_log_ring_record(struct osdp *ctx, int log_level, int log_ctx,
+			  const char *fmt, va_list args)
+{
+	struct log_ring *r;
+	struct log_record *rec;
+	const char *p, *s;
+	int i, n = 0, mod, num_star, len, str_len = 0;
+	uint32_t head;
+
+	r = log_ring_get();
+	if (r == NULL) {
+		return;
+	}
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >=
+	    OSDP_LOG_RING_SIZE) {
+		r->dropped++;
+		return;
+	}
+	rec = &r->rec[head % OSDP_LOG_RING_SIZE];
+	rec->tstamp = osdp_millis_now();
+	rec->ctx = ctx;
+	rec->fmt = fmt;
+	rec->log_level = log_level;
+	rec->log_ctx = log_ctx;
+
+	for (p = fmt; *p && n < LOG_RING_MAX_ARGS; p++) {
+		if (*p != '%') {
+			continue;
+		}
+		p++;
+		if (*p == '%') {
+			continue;
+		}
+		p = log_parse_spec(p, &mod, &num_star);
+		for (i = 0; i < num_star && n < LOG_RING_MAX_ARGS; i++) {
+			rec->arg_type[n] = LOG_ARG_INT;
+			rec->args[n++].i = va_arg(args, int);
+		}
+		if (n >= LOG_RING_MAX_ARGS) {
+			break;
+		}
+		switch (*p) {
+		case 'd': case 'i': case 'o': case 'u':
+		case 'x': case 'X': case 'c':
+			if (mod == 0) {
+				rec->arg_type[n] = LOG_ARG_INT;
+				rec->args[n].i = va_arg(args, int);
+			} else if (mod == 1) {
+				rec->arg_type[n] = LOG_ARG_LONG;
+				rec->args[n].i = va_arg(args, long);
+			} else {
+				rec->arg_type[n] = LOG_ARG_LLONG;
+				rec->args[n].i = va_arg(args, long long);
+			}
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			rec->arg_type[n] = LOG_ARG_DOUBLE;
+			rec->args[n].d = va_arg(args, double);
+			break;
+		case 'p':
+			rec->arg_type[n] = LOG_ARG_PTR;
+			rec->args[n].p = va_arg(args, void *);
+			break;
+		case 's':
+			s = va_arg(args, const char *);
+			if (s == NULL) {
+				s = "(null)";
+			}
+			len = strnlen(s, LOG_RING_STR_LEN - 1 - str_len);
+			memcpy(rec->str + str_len, s, len);
+			rec->str[str_len + len] = '\0';
+			rec->arg_type[n] = LOG_ARG_STR;
+			rec->args[n].s = str_len;
+			str_len += len;
+			if (str_len < LOG_RING_STR_LEN - 1) {
+				str_len++;
+			}
+			break;
+		default:
+			/* unsupported; the rest is printed verbatim */
+			goto out;
+		}
+		n++;
+	}
+out:
+	rec->num_args = n;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Format one specifier (in `spec`, NUL terminated) with the record's args
+ * starting at `*arg`.
+ */
+static int log_format_spec(char *buf, int max_len, const char *spec,
+			   int num_star, struct log_record *rec, int *arg)
+{
+	int i = *arg, w[2] = { 0, 0 }, k;
+
+	for (k = 0; k < num_star; k++) {
+		w[k] = (int)rec->args[i++].i;
+	}
+	*arg = i + 1;
+
+#define LOG_FMT(v)                                                         \
+	((num_star == 0) ? snprintf(buf, max_len, spec, v) :               \
+	 (num_star == 1) ? snprintf(buf, max_len, spec, w[0], v) :         \
+			   snprintf(buf, max_len, spec, w[0], w[1], v))
+
+	switch (rec->arg_type[i]) {
+	case LOG_ARG_INT:
+		return LOG_FMT((int)rec->args[i].i);
+	case LOG_ARG_LONG:
+		return LOG_FMT((long)rec->args[i].i);
+	case LOG_ARG_LLONG:
+		return LOG_FMT(rec->args[i].i);
+	case LOG_ARG_DOUBLE:
+		return LOG_FMT(rec->args[i].d);
+	case LOG_ARG_PTR:
+		return LOG_FMT(rec->args[i].p);
+	case LOG_ARG_STR:
+		return LOG_FMT(rec->str + rec->args[i].s);
+	}
+#undef LOG_FMT
+	return 0;
+}
+
+static void log_format_record(struct log_record *rec, char *buf, int max_len)
+{
+	const char *p, *end;
+	char spec[32];
+	int arg = 0, len = 0, mod, num_star, ret;
+
+	for (p = rec->fmt; *p && len < max_len - 1; p++) {
+		if (*p != '%' || *(p + 1) == '%' ||
+		    arg >= rec->num_args) {
+			buf[len++] = *p;
+			if (*p == '%' && *(p + 1) == '%') {
+				p++;
+			}
+			continue;
+		}
+		end = log_parse_spec(p + 1, &mod, &num_star);
+		if (*end == '\0' || end - p + 2 > (int)sizeof(spec) ||
+		    num_star > 2 || arg + num_star >= rec->num_args) {
+			buf[len++] = *p;
+			continue;
+		}
+		memcpy(spec, p, end - p + 1);
+		spec[end - p + 1] = '\0';
+		ret = log_format_spec(buf + len, max_len - len, spec,
+				      num_star, rec, &arg);
+		if (ret > 0) {
+			len += ret;
+		}
+		if (len > max_len - 1) {
+			len = max_len - 1;
+		}
+		p = end;
+	}
+	buf[len] = '\0';
+}
+
+int osdp_log_ring_flush(osdp_log_emit_fn_t emit)
+{
+	int count = 0;
+	uint32_t tail, head, dropped;
+	struct log_ring *r;
+	struct log_record *rec;
+	char msg[LOG_MSG_MAX_LEN];
+
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_lock(&g_log_flush_lock);
+#endif
+	for (r = __atomic_load_n(&g_log_rings, __ATOMIC_ACQUIRE); r != NULL;
+	     r = r->next) {
+		tail = r->tail;
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		while (tail != head) {
+			rec = &r->rec[tail % OSDP_LOG_RING_SIZE];
+			log_format_record(rec, msg, sizeof(msg));
+			emit(rec->ctx, rec->log_level, rec->log_ctx, rec->tstamp,
+			     msg);
+			tail++;
+			count++;
+			__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		}
+		dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped) {
+			snprintf(msg, sizeof(msg), "%u log messages dropped",
+				 dropped);
+			emit(NULL, LOG_WARNING, LOG_CTX_GLOBAL,
+			     osdp_millis_now(), msg);
+		}
+	}
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_unlock(&g_log_flush_lock);
+#endif
+	return count;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * Bounded, lock-free, multi-producer single-consumer queue of fixed size
+ * elements. Each slot has a sequence number that tells the producers whether
+ * it is free and the consumer whether it is filled (D. Vyukov's bounded
+ * queue); producers only contend on the CAS of `head`.
+ *
+ * Elements are copied in and out, so no memory is allocated after init.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "osdp_common.h"
+
+#define MPSC_SLOT(q, pos)   ((q)->buf + ((pos) & (q)->mask) * (q)->elem_size)
+
+int osdp_mpsc_init(struct osdp_mpsc *q, size_t elem_size, int capacity)
+{
+	uint32_t i;
+
+	/* round capacity up to a power of 2 so the index is just a mask */
+	q->mask = 1;
+	while ((int)q->mask < capacity) {
+		q->mask <<= 1;
+	}
+	q->seq = calloc(q->mask, sizeof(uint32_t));
+	q->buf = calloc(q->mask, elem_size);
+	if (q->seq == NULL || q->buf == NULL) {
+		osdp_mpsc_del(q);
+		return -1;
+	}
+	for (i = 0; i < q->mask; i++) {
+		q->seq[i] = i;
+	}
+	q->mask -= 1;
+	q->elem_size = elem_size;
+	q->head = 0;
+	q->tail = 0;
+	return 0;
+}
+
+void osdp_mpsc_del(struct osdp_mpsc *q)
+{
+	safe_free(q->seq);
+	safe_free(q->buf);
+	q->seq = NULL;
+	q->buf = NULL;
+}
+
+/**
+ * Can be called from any thread.
+ *
+ * Returns:
+ *  0: success
+ * -1: queue full
+ */
+int osdp_mpsc_push(struct osdp_mpsc *q, const void *elem)
+{
+	uint32_t pos, seq;
+	int32_t diff;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	while (1) {
+		seq = __atomic_load_n(&q->seq[pos & q->mask], __ATOMIC_ACQUIRE);
+		diff = (int32_t)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+							true, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+	memcpy(MPSC_SLOT(q, pos), elem, q->elem_size);
+	__atomic_store_n(&q->seq[pos & q->mask], pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Must only be called from the (single) consumer thread.
+ *
+ * Returns:
+ *  0: success
+ * -1: queue empty
+ */
+int osdp_mpsc_pop(struct osdp_mpsc *q, void *elem)
+{
+	uint32_t pos = q->tail;
+
+	if (osdp_mpsc_is_empty(q)) {
+		return -1;
+	}
+	memcpy(elem, MPSC_SLOT(q, pos), q->elem_size);
+	__atomic_store_n(&q->seq[pos & q->mask], pos + q->mask + 1,
+			 __ATOMIC_RELEASE);
+	q->tail = pos + 1;
+	return 0;
+}
+
+int osdp_mpsc_is_empty(struct osdp_mpsc *q)
+{
+	uint32_t pos = q->tail;
+
+	return __atomic_load_n(&q->seq[pos & q->mask], __ATOMIC_ACQUIRE) !=
+	       pos + 1;
+}
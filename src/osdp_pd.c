@@ -40,6 +40,7 @@
 #define REPLY_FMT_LEN                  3
 #define REPLY_COM_LEN                  6
 #define REPLY_NAK_LEN                  2
+#define REPLY_BUSY_LEN                 1
 #define REPLY_MFGREP_LEN               4   /* variable length command */
 #define REPLY_CCRYPT_LEN               33
 #define REPLY_RMAC_I_LEN               17
@@ -72,9 +73,9 @@ struct pd_event_node {
 
 static int pd_event_queue_init(struct osdp_pd *pd)
 {
-	if (slab_init(&pd->event.slab, sizeof(struct pd_event_node),
-		      OSDP_CP_CMD_POOL_SIZE)) {
-		LOG_ERR("Failed to initialize command slab");
+	if (osdp_pool_init(&pd->event.pool, sizeof(struct pd_event_node),
+			   OSDP_CP_CMD_POOL_SIZE, OSDP_CP_CMD_POOL_MAX)) {
+		LOG_ERR("Failed to initialize event pool");
 		return -1;
 	}
 	queue_init(&pd->event.queue);
@@ -83,15 +84,16 @@ static int pd_event_queue_init(struct osdp_pd *pd)
 
 static void pd_event_queue_del(struct osdp_pd *pd)
 {
-	slab_del(&pd->event.slab);
+	osdp_pool_del(&pd->event.pool);
 }
 
 static struct osdp_event *pd_event_alloc(struct osdp_pd *pd)
 {
-	struct pd_event_node *event = NULL;
+	struct pd_event_node *event;
 
-	if (slab_alloc(&pd->event.slab, (void **)&event)) {
-		LOG_ERR("Memory allocation failed");
+	event = osdp_pool_alloc(&pd->event.pool);
+	if (event == NULL) {
+		LOG_ERR("Event queue full");
 		return NULL;
 	}
 	return &event->object;
@@ -102,7 +104,7 @@ static void pd_event_free(struct osdp_pd *pd, struct osdp_event *event)
 	struct pd_event_node *n;
 
 	n = CONTAINER_OF(event, struct pd_event_node, object);
-	slab_free(&pd->event.slab, n);
+	osdp_pool_free(&pd->event.pool, n);
 }
 
 static void pd_event_enqueue(struct osdp_pd *pd, struct osdp_event *event)
@@ -157,6 +159,21 @@ static int pd_translate_event(struct osdp_event *event, uint8_t *data)
 	return reply_code;
 }
 
+/**
+ * The app's command callback did not take the command; see
+ * osdp_pd_set_command_callback() for what `ret` means.
+ */
+static void pd_reply_refused(struct osdp_pd *pd, int ret)
+{
+	if (ret == OSDP_ERR_WOULD_BLOCK) {
+		/* the CP sends it again in a while */
+		pd->reply_id = REPLY_BUSY;
+		return;
+	}
+	pd->reply_id = REPLY_NAK;
+	pd->ephemeral_data[0] = OSDP_PD_NAK_RECORD;
+}
+
 static void pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 {
 	int i, ret = -1, pos = 0, tmp;
@@ -238,8 +255,7 @@ static void pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 		ret = pd->command_callback(pd->command_callback_arg,
 					   pd->address, &cmd);
 		if (ret != 0) {
-			pd->reply_id = REPLY_NAK;
-			pd->ephemeral_data[0] = OSDP_PD_NAK_RECORD;
+			pd_reply_refused(pd, ret);
 			ret = 0;
 			break;
 		}
@@ -270,8 +286,7 @@ static void pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 		ret = pd->command_callback(pd->command_callback_arg,
 					   pd->address, &cmd);
 		if (ret != 0) {
-			pd->reply_id = REPLY_NAK;
-			pd->ephemeral_data[0] = OSDP_PD_NAK_RECORD;
+			pd_reply_refused(pd, ret);
 			ret = 0;
 			break;
 		}
@@ -291,8 +306,7 @@ static void pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 		ret = pd->command_callback(pd->command_callback_arg,
 					   pd->address, &cmd);
 		if (ret != 0) {
-			pd->reply_id = REPLY_NAK;
-			pd->ephemeral_data[0] = OSDP_PD_NAK_RECORD;
+			pd_reply_refused(pd, ret);
 			ret = 0;
 			break;
 		}
@@ -321,8 +335,7 @@ static void pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 		ret = pd->command_callback(pd->command_callback_arg,
 					   pd->address, &cmd);
 		if (ret != 0) {
-			pd->reply_id = REPLY_NAK;
-			pd->ephemeral_data[0] = OSDP_PD_NAK_RECORD;
+			pd_reply_refused(pd, ret);
 			ret = 0;
 			break;
 		}
@@ -350,8 +363,7 @@ static void pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 		ret = pd->command_callback(pd->command_callback_arg,
 						pd->address, &cmd);
 		if (ret != 0) {
-			pd->reply_id = REPLY_NAK;
-			pd->ephemeral_data[0] = OSDP_PD_NAK_RECORD;
+			pd_reply_refused(pd, ret);
 			ret = 0;
 			break;
 		}
@@ -382,8 +394,7 @@ static void pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 			memcpy(pd->ephemeral_data, &cmd, sizeof(struct osdp_cmd));
 			pd->reply_id = REPLY_MFGREP;
 		} else if (ret < 0) { /* Errors */
-			pd->reply_id = REPLY_NAK;
-			pd->ephemeral_data[0] = OSDP_PD_NAK_RECORD;
+			pd_reply_refused(pd, ret);
 		} else {
 			pd->reply_id = REPLY_ACK;
 		}
@@ -423,8 +434,7 @@ static void pd_decode_command(struct osdp_pd *pd, uint8_t *buf, int len)
 			LOG_WRN(TAG "Keyset without command callback trigger");
 		}
 		if (ret != 0) {
-			pd->reply_id = REPLY_NAK;
-			pd->ephemeral_data[0] = OSDP_PD_NAK_RECORD;
+			pd_reply_refused(pd, ret);
 			ret = 0;
 			break;
 		}
@@ -658,6 +668,15 @@ static int pd_build_reply(struct osdp_pd *pd, uint8_t *buf, int max_len)
 		}
 		buf[len++] = pd->reply_id;
 		buf[len++] = pd->ephemeral_data[0];
+		osdp_stats_nak(pd, pd->ephemeral_data[0]);
+		ret = 0;
+		break;
+	case REPLY_BUSY:
+		if (max_len < REPLY_BUSY_LEN) {
+			LOG_ERR(TAG "Out of buffer space!");
+			break;
+		}
+		buf[len++] = pd->reply_id;
 		ret = 0;
 		break;
 	case REPLY_MFGREP:
@@ -685,7 +704,7 @@ static int pd_build_reply(struct osdp_pd *pd, uint8_t *buf, int max_len)
 			return -1;
 		}
 		osdp_fill_random(pd->sc.pd_random, 8);
-		osdp_compute_session_keys(TO_CTX(pd));
+		osdp_compute_session_keys(pd);
 		osdp_compute_pd_cryptogram(pd);
 		buf[len++] = pd->reply_id;
 		for (i = 0; i < 8; i++) {
@@ -719,6 +738,7 @@ static int pd_build_reply(struct osdp_pd *pd, uint8_t *buf, int max_len)
 		if (osdp_verify_cp_cryptogram(pd) == 0) {
 			smb[2] = 1;  /* CP auth succeeded */
 			SET_FLAG(pd, PD_FLAG_SC_ACTIVE);
+			OSDP_STATS_INC(pd, sc_handshakes);
 			if (ISSET_FLAG(pd, PD_FLAG_SC_USE_SCBKD)) {
 				LOG_WRN(TAG "SC Active with SCBK-D");
 			} else {
@@ -727,6 +747,7 @@ static int pd_build_reply(struct osdp_pd *pd, uint8_t *buf, int max_len)
 		} else {
 			smb[2] = 0;  /* CP auth failed */
 			LOG_WRN(TAG "failed to verify CP_crypt");
+			OSDP_STATS_INC(pd, sc_failures);
 		}
 		ret = 0;
 		break;
@@ -751,6 +772,7 @@ static int pd_build_reply(struct osdp_pd *pd, uint8_t *buf, int max_len)
 		buf[0] = REPLY_NAK;
 		buf[1] = OSDP_PD_NAK_RECORD;
 		len = 2;
+		osdp_stats_nak(pd, OSDP_PD_NAK_RECORD);
 	}
 
 	return len;
@@ -767,40 +789,71 @@ static int pd_send_reply(struct osdp_pd *pd)
 	int ret, len;
 
 	/* init packet buf with header */
-	len = osdp_phy_packet_init(pd, pd->rx_buf, sizeof(pd->rx_buf));
+	pd->tx_buf_len = 0;
+	len = osdp_phy_packet_init(pd, pd->tx_buf, sizeof(pd->tx_buf));
 	if (len < 0) {
 		return -1;
 	}
 
 	/* fill reply data */
-	ret = pd_build_reply(pd, pd->rx_buf, sizeof(pd->rx_buf));
+	ret = pd_build_reply(pd, pd->tx_buf, sizeof(pd->tx_buf));
 	if (ret <= 0) {
 		return -1;
 	}
 	len += ret;
 
 	/* finalize packet */
-	len = osdp_phy_packet_finalize(pd, pd->rx_buf, len, sizeof(pd->rx_buf));
+	len = osdp_phy_packet_finalize(pd, pd->tx_buf, len, sizeof(pd->tx_buf));
 	if (len < 0) {
 		return -1;
 	}
 
-	ret = pd->channel.send(pd->channel.data, pd->rx_buf, len);
+	ret = pd->channel.send(pd->channel.data, pd->tx_buf, len);
+	if (ret == len) {
+		/* keep it around in case the CP doesn't get it */
+		pd->tx_buf_len = len;
+		OSDP_STATS_INC(pd, tx_frames);
+		OSDP_STATS_ADD(pd, tx_bytes, len);
+		osdp_capture(pd, OSDP_CAPTURE_PD_TX, pd->reply_id, pd->tx_buf,
+			     len);
+	}
 
 	if (IS_ENABLED(CONFIG_OSDP_PACKET_TRACE)) {
 		if (pd->cmd_id != CMD_POLL) {
-			osdp_dump("PD sent", pd->rx_buf, len);
+			osdp_dump("PD sent", pd->tx_buf, len);
 		}
 	}
 
 	return (ret == len) ? 0 : -1;
 }
 
+/**
+ * Send the last reply again, as is; the CP repeated the sequence number of
+ * the command it was for.
+ */
+static int pd_resend_reply(struct osdp_pd *pd)
+{
+	int ret;
+
+	ret = pd->channel.send(pd->channel.data, pd->tx_buf, pd->tx_buf_len);
+	if (ret != pd->tx_buf_len) {
+		return -1;
+	}
+	OSDP_STATS_INC(pd, tx_frames);
+	OSDP_STATS_INC(pd, resends);
+	OSDP_STATS_ADD(pd, tx_bytes, ret);
+	osdp_capture(pd, OSDP_CAPTURE_PD_TX,
+		     pd->tx_buf[osdp_phy_packet_get_data_offset(pd, pd->tx_buf)],
+		     pd->tx_buf, ret);
+	return 0;
+}
+
 /**
  * pd_receve_packet - received buffer from serial stream handling partials
  * Returns:
  *  0: success
  *  1: no data yet
+ *  2: repeated command; resend the last reply
  * -1: fatal errors
  * -2: phy layer errors that need to reply with NAK
  */
@@ -809,6 +862,12 @@ static int pd_receve_packet(struct osdp_pd *pd)
 	uint8_t *buf;
 	int rec_bytes, ret, was_empty, max_len;
 
+	if (pd->rx_buf_len > 0 &&
+	    osdp_pd_millis_since(pd, pd->tstamp) > OSDP_RESP_TOUT_MS) {
+		/* the rest of this frame was lost; don't wait for it forever */
+		LOG_WRN(TAG "discarding incomplete frame");
+		osdp_phy_rx_reset(pd);
+	}
 	was_empty = pd->rx_buf_len == 0;
 	buf = pd->rx_buf + pd->rx_buf_len;
 	max_len = sizeof(pd->rx_buf) - pd->rx_buf_len;
@@ -819,9 +878,11 @@ static int pd_receve_packet(struct osdp_pd *pd)
 	}
 	if (was_empty && rec_bytes > 0) {
 		/* Start of message */
-		pd->tstamp = osdp_millis_now();
+		pd->tstamp = osdp_pd_millis_now(pd);
 	}
 	pd->rx_buf_len += rec_bytes;
+	OSDP_STATS_ADD(pd, rx_bytes, rec_bytes);
+	osdp_capture(pd, OSDP_CAPTURE_PD_RX, 0, buf, rec_bytes);
 
 	if (IS_ENABLED(CONFIG_OSDP_PACKET_TRACE)) {
 		/**
@@ -837,8 +898,19 @@ static int pd_receve_packet(struct osdp_pd *pd)
 
 	pd->reply_id = 0;    /* reset past reply ID so phy can send NAK */
 	pd->ephemeral_data[0] = 0; /* reset past NAK reason */
-	ret = osdp_phy_decode_packet(pd, pd->rx_buf, pd->rx_buf_len);
-	if (ret == OSDP_ERR_PKT_FMT) {
+	ret = osdp_phy_check_packet(pd);
+	if (ret == OSDP_ERR_PKT_WAIT) {
+		/* incomplete frame; wait for more data */
+		return 1;
+	} else if (ret == OSDP_ERR_PKT_FMT) {
+		return -2; /* CRC errors; Send a NAK */
+	}
+
+	ret = osdp_phy_decode_packet(pd, pd->rx_buf, ret);
+	if (ret == OSDP_ERR_PKT_RESEND) {
+		OSDP_STATS_INC(pd, rx_frames);
+		return 2;
+	} else if (ret == OSDP_ERR_PKT_FMT) {
 		if (pd->reply_id != 0) {
 			return -2; /* Send a NAK */
 		}
@@ -848,13 +920,14 @@ static int pd_receve_packet(struct osdp_pd *pd)
 		return 1;
 	} else if (ret == OSDP_ERR_PKT_SKIP) {
 		/* soft fail - discard this message */
-		pd->rx_buf_len = 0;
+		osdp_phy_rx_reset(pd);
 		if (pd->channel.flush) {
 			pd->channel.flush(pd->channel.data);
 		}
 		return 1;
 	}
 	pd->rx_buf_len = ret;
+	OSDP_STATS_INC(pd, rx_frames);
 	return 0;
 }
 
@@ -868,8 +941,16 @@ static void osdp_pd_update(struct osdp_pd *pd)
 		if (ret == 1) {
 			break;
 		}
+		if (ret == 2) {
+			if (pd_resend_reply(pd)) {
+				pd->state = OSDP_PD_STATE_ERR;
+				break;
+			}
+			osdp_phy_rx_reset(pd);
+			break;
+		}
 		if (ret == -1 || (pd->rx_buf_len > 0 &&
-		    osdp_millis_since(pd->tstamp) > OSDP_RESP_TOUT_MS)) {
+		    osdp_pd_millis_since(pd, pd->tstamp) > OSDP_RESP_TOUT_MS)) {
 			/**
 			 * When we receive a command from PD after a timeout,
 			 * any established secure channel must be discarded.
@@ -888,7 +969,7 @@ static void osdp_pd_update(struct osdp_pd *pd)
 			pd->state = OSDP_PD_STATE_ERR;
 			break;
 		}
-		pd->rx_buf_len = 0;
+		osdp_phy_rx_reset(pd);
 		pd->state = OSDP_PD_STATE_IDLE;
 		break;
 	case OSDP_PD_STATE_ERR:
@@ -898,7 +979,8 @@ static void osdp_pd_update(struct osdp_pd *pd)
 		 * go back to idle state.
 		 */
 		CLEAR_FLAG(pd, PD_FLAG_SC_ACTIVE);
-		pd->rx_buf_len = 0;
+		pd->tx_buf_len = 0;
+		osdp_phy_rx_reset(pd);
 		if (pd->channel.flush) {
 			pd->channel.flush(pd->channel.data);
 		}
@@ -943,6 +1025,8 @@ osdp_t *osdp_pd_setup(osdp_pd_info_t *info, uint8_t *scbk)
 		return NULL;
 	}
 	ctx->magic = 0xDEADBEAF;
+	ctx->log_level = -1;
+	osdp_capture_init(ctx);
 
 	ctx->cp = calloc(1, sizeof(struct osdp_cp));
 	if (ctx->cp == NULL) {
@@ -963,6 +1047,7 @@ osdp_t *osdp_pd_setup(osdp_pd_info_t *info, uint8_t *scbk)
 
 	pd->__parent = ctx;
 	pd->offset = 0;
+	pd->now = &ctx->now;
 	pd->baud_rate = info->baud_rate;
 	pd->address = info->address;
 	pd->flags = info->flags;
@@ -1003,7 +1088,12 @@ void osdp_pd_teardown(osdp_t *ctx)
 {
 	assert(ctx);
 
+#ifdef CONFIG_OSDP_SC_ENABLED
+	osdp_sc_teardown(TO_PD(ctx, 0));
+#endif
 	pd_event_queue_del(TO_PD(ctx, 0));
+	osdp_capture_del(TO_OSDP(ctx));
+	osdp_log_ctx_release(TO_OSDP(ctx));
 	safe_free(TO_PD(ctx, 0));
 	safe_free(TO_CP(ctx));
 	safe_free(ctx);
@@ -1015,7 +1105,10 @@ void osdp_pd_refresh(osdp_t *ctx)
 	assert(ctx);
 	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
 
+	osdp_clock_update(TO_OSDP(ctx));
+	osdp_log_ctx_set(pd);
 	osdp_pd_update(pd);
+	osdp_log_ctx_restore();
 }
 
 OSDP_EXPORT
@@ -1037,7 +1130,7 @@ int osdp_pd_notify_event(osdp_t *ctx, struct osdp_event *event)
 
 	ev = pd_event_alloc(pd);
 	if (ev == NULL) {
-		return -1;
+		return OSDP_ERR_WOULD_BLOCK;
 	}
 
 	memcpy(ev, event, sizeof(struct osdp_event));
@@ -1050,6 +1143,12 @@ int osdp_pd_notify_event(osdp_t *ctx, struct osdp_event *event)
 /**
  * Force export some private methods for testing.
  */
-void (*test_osdp_pd_update)(struct osdp_pd *pd) = osdp_pd_update;
+static void test_osdp_pd_update_wrapper(struct osdp_pd *pd)
+{
+	osdp_clock_update(TO_CTX(pd));
+	osdp_pd_update(pd);
+}
+
+void (*test_osdp_pd_update)(struct osdp_pd *pd) = test_osdp_pd_update_wrapper;
 
 #endif /* UNIT_TESTING */
@@ -50,6 +50,14 @@ static int osdp_phy_get_seq_number(struct osdp_pd *pd, int do_inc)
 	return pd->seq_number & PKT_CONTROL_SQN;
 }
 
+int osdp_phy_packet_get_address(const uint8_t *buf)
+{
+	struct osdp_packet_header *pkt;
+
+	pkt = (struct osdp_packet_header *)buf;
+	return pkt->pd_address & 0x7F;
+}
+
 int osdp_phy_packet_get_data_offset(struct osdp_pd *pd, const uint8_t *buf)
 {
 	int sb_len = 0;
@@ -144,8 +152,9 @@ int osdp_phy_packet_finalize(struct osdp_pd *pd, uint8_t *buf,
 	pkt->len_msb = BYTE_1(len - 1 + 2);
 
 #ifdef CONFIG_OSDP_SC_ENABLED
-	uint8_t *data;
-	int i, is_cmd, data_len;
+	uint8_t *data = NULL;
+	int i, is_cmd, data_len = 0, enc_len = 0;
+	struct osdp_mac_ctx mac;
 
 	if (ISSET_FLAG(pd, PD_FLAG_SC_ACTIVE) &&
 	    pkt->control & PKT_CONTROL_SCB &&
@@ -169,24 +178,36 @@ int osdp_phy_packet_finalize(struct osdp_pd *pd, uint8_t *buf,
 			 * data where length may be rounded up to the nearest
 			 * 16 byte block bondary.
 			 */
-			if (AES_PAD_LEN(data_len + 1) > max_len) {
+			enc_len = AES_PAD_LEN(data_len + 1);
+			if (enc_len > max_len) {
 				/* data_len + 1 for OSDP_SC_EOM_MARKER */
 				goto out_of_space_error;
 			}
-			len += osdp_encrypt_data(pd, is_cmd, data, data_len);
 		}
 		/* len: with 4bytes MAC; with 2 byte CRC; without 1 byte mark */
-		if (len + 4 > max_len) {
+		if (len + enc_len + 4 > max_len) {
 			goto out_of_space_error;
 		}
 
 		/* len: without 1 mark byte; with 2 byte CRC; with 4 byte MAC */
-		pkt->len_lsb = BYTE_0(len - 1 + 2 + 4);
-		pkt->len_msb = BYTE_1(len - 1 + 2 + 4);
+		pkt->len_lsb = BYTE_0(len + enc_len - 1 + 2 + 4);
+		pkt->len_msb = BYTE_1(len + enc_len - 1 + 2 + 4);
 
-		/* compute and extend the buf with 4 MAC bytes */
-		osdp_compute_mac(pd, is_cmd, buf + 1, len - 1);
+		/**
+		 * Encrypt-then-MAC in one pass: MAC the plain text part
+		 * (header, security block and ID), then let encrypt_data()
+		 * feed each cipher block to the MAC as it is produced.
+		 */
+		osdp_mac_init(&mac, pd, is_cmd);
+		osdp_mac_update(&mac, buf + 1, len - 1);
+		if (data != NULL) {
+			len += osdp_encrypt_data(pd, is_cmd, data, data_len,
+						 &mac);
+		}
 		data = is_cmd ? pd->sc.c_mac : pd->sc.r_mac;
+		osdp_mac_final(&mac, data);
+
+		/* extend the buf with 4 MAC bytes */
 		for (i = 0; i < 4; i++) {
 			buf[len + i] = data[i];
 		}
@@ -211,11 +232,233 @@ out_of_space_error:
 	return OSDP_ERR_PKT_FMT;
 }
 
+static void phy_poll_frame_fill(uint8_t *buf, int address, int seq, int sc)
+{
+	struct osdp_packet_header *pkt = (struct osdp_packet_header *)buf;
+	int len = OSDP_POLL_FRAME_LEN;
+
+	pkt->mark = OSDP_PKT_MARK;
+	pkt->som = OSDP_PKT_SOM;
+	pkt->pd_address = address & 0x7F;
+	pkt->control = seq | PKT_CONTROL_CRC;
+	if (sc) {
+		pkt->control |= PKT_CONTROL_SCB;
+		pkt->data[0] = 2;
+		pkt->data[1] = SCS_15;
+		pkt->data[2] = CMD_POLL;
+		len += 4 + 2; /* MAC and CRC after the cached part */
+	} else {
+		pkt->data[0] = CMD_POLL;
+	}
+	/* len: without 1 byte mark */
+	pkt->len_lsb = BYTE_0(len - 1);
+	pkt->len_msb = BYTE_1(len - 1);
+}
+
+/**
+ * Build the frames that osdp_phy_poll_frame() sends; must be called again if
+ * the PD address changes.
+ */
+void osdp_phy_poll_cache_init(struct osdp_pd *pd)
+{
+	int seq;
+	uint16_t crc16;
+	uint8_t *buf;
+	struct osdp_poll_cache *c = &pd->poll_cache;
+
+	for (seq = 0; seq < 4; seq++) {
+		buf = c->plain[seq];
+		phy_poll_frame_fill(buf, pd->address, seq, 0);
+		crc16 = osdp_compute_crc16(buf + 1, OSDP_POLL_FRAME_LEN - 3);
+		buf[OSDP_POLL_FRAME_LEN - 2] = BYTE_0(crc16);
+		buf[OSDP_POLL_FRAME_LEN - 1] = BYTE_1(crc16);
+#ifdef CONFIG_OSDP_SC_ENABLED
+		buf = c->sc[seq];
+		phy_poll_frame_fill(buf, pd->address, seq, 1);
+		c->sc_crc[seq] = osdp_compute_crc16(buf + 1,
+						    OSDP_POLL_FRAME_LEN - 1);
+#endif
+	}
+}
+
+/**
+ * Same as osdp_phy_packet_init(), a CMD_POLL and osdp_phy_packet_finalize()
+ * in CP mode, but from the frames in pd->poll_cache.
+ *
+ * Returns the length of the frame in buf or OSDP_ERR_PKT_FMT.
+ */
+int osdp_phy_poll_frame(struct osdp_pd *pd, uint8_t *buf, int max_len)
+{
+	int seq;
+	struct osdp_poll_cache *c = &pd->poll_cache;
+
+	if (max_len < OSDP_POLL_FRAME_LEN + 6) {
+		return OSDP_ERR_PKT_FMT;
+	}
+	seq = osdp_phy_get_seq_number(pd, 1);
+
+#ifdef CONFIG_OSDP_SC_ENABLED
+	uint16_t crc16;
+	struct osdp_mac_ctx mac;
+	int len = OSDP_POLL_FRAME_LEN;
+
+	if (ISSET_FLAG(pd, PD_FLAG_SC_ACTIVE)) {
+		memcpy(buf, c->sc[seq], len);
+		osdp_mac_init(&mac, pd, 1);
+		osdp_mac_update(&mac, buf + 1, len - 1);
+		osdp_mac_final(&mac, pd->sc.c_mac);
+		memcpy(buf + len, pd->sc.c_mac, 4);
+		crc16 = osdp_crc16_table(c->sc_crc[seq], buf + len, 4);
+		len += 4;
+		buf[len + 0] = BYTE_0(crc16);
+		buf[len + 1] = BYTE_1(crc16);
+		return len + 2;
+	}
+#endif
+	memcpy(buf, c->plain[seq], OSDP_POLL_FRAME_LEN);
+	return OSDP_POLL_FRAME_LEN;
+}
+
+/**
+ * Drop the first len bytes of pd->rx_buf and start looking for the next frame
+ * in what follows.
+ */
+void osdp_phy_rx_discard(struct osdp_pd *pd, int len)
+{
+	pd->rx_buf_len -= len;
+	memmove(pd->rx_buf, pd->rx_buf + len, pd->rx_buf_len);
+	pd->phy_rx.state = OSDP_PHY_RX_STATE_MARK;
+}
+
+/**
+ * Incrementally frame the bytes accumulated in pd->rx_buf. Each call resumes
+ * from the state left behind by the previous one so bytes are examined only
+ * once as they trickle in. Leading junk (line noise, partial frames) is
+ * dropped by scanning for the next MARK/SOM pair rather than failing.
+ *
+ * A frame whose check bytes don't match may have started at a stray MARK/SOM
+ * and swallowed the real frame that followed; so only its first byte is
+ * dropped and the rest is scanned again.
+ *
+ * Returns:
+ * +ve: length of a complete frame, with valid check bytes, at pd->rx_buf
+ * OSDP_ERR_PKT_WAIT: need more bytes
+ * OSDP_ERR_PKT_FMT: CRC/checksum mismatch and no other frame (complete or
+ *                   not) in what was left; NAK reason is set
+ */
+int osdp_phy_check_packet(struct osdp_pd *pd)
+{
+	int i, len, check_len;
+	uint8_t comp;
+	bool bad, corrupt = false;
+	struct osdp_phy_rx *rx = &pd->phy_rx;
+	struct osdp_packet_header *pkt;
+
+	pkt = (struct osdp_packet_header *)pd->rx_buf;
+
+	while (rx->state != OSDP_PHY_RX_STATE_DONE) {
+		switch (rx->state) {
+		case OSDP_PHY_RX_STATE_MARK:
+			for (i = 0; i < pd->rx_buf_len; i++) {
+				if (pd->rx_buf[i] == OSDP_PKT_MARK) {
+					break;
+				}
+			}
+			if (i > 0) {
+				LOG_DBG(TAG "skipped %d bytes to find MARK", i);
+				osdp_phy_rx_discard(pd, i);
+			}
+			if (pd->rx_buf_len < 2) {
+				return corrupt ? OSDP_ERR_PKT_FMT :
+						 OSDP_ERR_PKT_WAIT;
+			}
+			if (pkt->som != OSDP_PKT_SOM) {
+				osdp_phy_rx_discard(pd, 1);
+				break;
+			}
+			rx->state = OSDP_PHY_RX_STATE_HEADER;
+			/* FALLTHRU */
+		case OSDP_PHY_RX_STATE_HEADER:
+			if ((unsigned long)pd->rx_buf_len <
+			    sizeof(struct osdp_packet_header)) {
+				return OSDP_ERR_PKT_WAIT;
+			}
+			/* len: with 1 mark byte; with 1 or 2 check bytes */
+			len = ((pkt->len_msb << 8) | pkt->len_lsb) + 1;
+			check_len = (pkt->control & PKT_CONTROL_CRC) ? 2 : 1;
+			if (len < (int)sizeof(struct osdp_packet_header) +
+				  1 + check_len ||
+			    len > (int)sizeof(pd->rx_buf)) {
+				/* not a real frame start; hunt for next MARK */
+				osdp_phy_rx_discard(pd, 1);
+				break;
+			}
+			rx->pkt_len = len;
+			rx->pos = 1; /* check bytes exclude the mark byte */
+			rx->check = (check_len == 2) ? OSDP_CRC16_SEED : 0;
+			rx->state = OSDP_PHY_RX_STATE_BODY;
+			/* FALLTHRU */
+		case OSDP_PHY_RX_STATE_BODY:
+			check_len = (pkt->control & PKT_CONTROL_CRC) ? 2 : 1;
+			len = rx->pkt_len - check_len;
+			if (pd->rx_buf_len < len) {
+				len = pd->rx_buf_len;
+			}
+			if (check_len == 2) {
+				rx->check = osdp_crc16_slice8(rx->check,
+							      pd->rx_buf + rx->pos,
+							      len - rx->pos);
+			} else {
+				for (i = rx->pos; i < len; i++) {
+					rx->check += pd->rx_buf[i];
+				}
+			}
+			rx->pos = len;
+			if (pd->rx_buf_len < rx->pkt_len) {
+				return OSDP_ERR_PKT_WAIT;
+			}
+			len = rx->pkt_len;
+			bad = false;
+			if (check_len == 2 &&
+			    rx->check != ((pd->rx_buf[len - 1] << 8) |
+					  pd->rx_buf[len - 2])) {
+				LOG_ERR(TAG "invalid crc 0x%04x/0x%04x",
+					rx->check, (pd->rx_buf[len - 1] << 8) |
+					pd->rx_buf[len - 2]);
+				bad = true;
+			}
+			comp = (uint8_t)(~(rx->check & 0xff) + 1);
+			if (check_len == 1 && comp != pd->rx_buf[len - 1]) {
+				LOG_ERR(TAG "invalid checksum %02x/%02x",
+					comp, pd->rx_buf[len - 1]);
+				bad = true;
+			}
+			if (bad) {
+				OSDP_STATS_INC(pd, crc_errors);
+				pd->reply_id = REPLY_NAK;
+				pd->ephemeral_data[0] = OSDP_PD_NAK_MSG_CHK;
+				osdp_phy_rx_discard(pd, 1);
+				corrupt = true;
+				break;
+			}
+			if (corrupt) {
+				/* resynced on a good frame; it is not NAKed */
+				pd->reply_id = 0;
+				pd->ephemeral_data[0] = 0;
+			}
+			rx->state = OSDP_PHY_RX_STATE_DONE;
+			break;
+		}
+	}
+
+	return rx->pkt_len;
+}
+
 int osdp_phy_decode_packet(struct osdp_pd *pd, uint8_t *buf, int len)
 {
 	uint8_t *data;
 	uint16_t comp, cur;
-	int pkt_len, pd_mode, pd_addr, mac_offset;
+	int pkt_len, pd_mode, pd_addr, mac_offset, verified;
 	struct osdp_packet_header *pkt;
 
 	pd_mode = ISSET_FLAG(pd, PD_FLAG_PD_MODE);
@@ -268,14 +511,23 @@ int osdp_phy_decode_packet(struct osdp_pd *pd, uint8_t *buf, int len)
 		 * invalidate any established secure channels.
 		 */
 		pd->seq_number = -1;
+		pd->tx_buf_len = 0;
 		CLEAR_FLAG(pd, PD_FLAG_SC_ACTIVE);
 	}
+	verified = (buf == pd->rx_buf &&
+		    pd->phy_rx.state == OSDP_PHY_RX_STATE_DONE);
 	if (pd_mode && cur == pd->seq_number) {
 		/**
-		 * TODO: PD must resend the last response if CP send the same
-		 * sequence number again.
+		 * CP didn't get our last reply and sent the same command
+		 * again. Resend the reply we have in tx_buf; the command must
+		 * not be processed again (nor its MAC verified, as that would
+		 * advance the SC MAC chain).
 		 */
-		LOG_ERR(TAG "seq-repeat reply-resend feature not supported!");
+		if (pd->tx_buf_len > 0 && verified) {
+			LOG_INF(TAG "seq repeat; resending last reply");
+			return OSDP_ERR_PKT_RESEND;
+		}
+		LOG_ERR(TAG "seq repeat but there is no reply to resend");
 		pd->reply_id = REPLY_NAK;
 		pd->ephemeral_data[0] = OSDP_PD_NAK_SEQ_NUM;
 		return OSDP_ERR_PKT_FMT;
@@ -289,12 +541,16 @@ int osdp_phy_decode_packet(struct osdp_pd *pd, uint8_t *buf, int len)
 	}
 	len -= sizeof(struct osdp_packet_header); /* consume header */
 
-	/* validate CRC/checksum */
+	/**
+	 * validate CRC/checksum; skipped if osdp_phy_check_packet() has already
+	 * done it while the bytes were coming in.
+	 */
 	if (pkt->control & PKT_CONTROL_CRC) {
 		cur = (buf[pkt_len] << 8) | buf[pkt_len - 1];
-		comp = osdp_compute_crc16(buf + 1, pkt_len - 2);
+		comp = verified ? cur : osdp_compute_crc16(buf + 1, pkt_len - 2);
 		if (comp != cur) {
 			LOG_ERR(TAG "invalid crc 0x%04x/0x%04x", comp, cur);
+			OSDP_STATS_INC(pd, crc_errors);
 			pd->reply_id = REPLY_NAK;
 			pd->ephemeral_data[0] = OSDP_PD_NAK_MSG_CHK;
 			return OSDP_ERR_PKT_FMT;
@@ -302,9 +558,12 @@ int osdp_phy_decode_packet(struct osdp_pd *pd, uint8_t *buf, int len)
 		mac_offset = pkt_len - 4 - 2;
 		len -= 2; /* consume CRC */
 	} else {
-		comp = osdp_compute_checksum(buf + 1, pkt_len - 1);
-		if (comp != buf[len - 1]) {
+		cur = buf[pkt_len];
+		comp = verified ? cur : osdp_compute_checksum(buf + 1,
+							      pkt_len - 1);
+		if (comp != cur) {
 			LOG_ERR(TAG "invalid checksum %02x/%02x", comp, cur);
+			OSDP_STATS_INC(pd, crc_errors);
 			pd->reply_id = REPLY_NAK;
 			pd->ephemeral_data[0] = OSDP_PD_NAK_MSG_CHK;
 			return OSDP_ERR_PKT_FMT;
@@ -364,6 +623,7 @@ int osdp_phy_decode_packet(struct osdp_pd *pd, uint8_t *buf, int len)
 		mac = is_cmd ? pd->sc.c_mac : pd->sc.r_mac;
 		if (memcmp(buf + 1 + mac_offset, mac, 4) != 0) {
 			LOG_ERR(TAG "invalid MAC");
+			OSDP_STATS_INC(pd, mac_errors);
 			pd->reply_id = REPLY_NAK;
 			pd->ephemeral_data[0] = OSDP_PD_NAK_SC_COND;
 			return OSDP_ERR_PKT_FMT;
@@ -398,9 +658,17 @@ int osdp_phy_decode_packet(struct osdp_pd *pd, uint8_t *buf, int len)
 	return len;
 }
 
+void osdp_phy_rx_reset(struct osdp_pd *pd)
+{
+	pd->rx_buf_len = 0;
+	pd->phy_rx.state = OSDP_PHY_RX_STATE_MARK;
+}
+
 void osdp_phy_state_reset(struct osdp_pd *pd)
 {
 	pd->phy_state = 0;
 	pd->seq_number = -1;
-	pd->rx_buf_len = 0;
+	pd->tx_buf_len = 0;
+	pd->resends = 0;
+	osdp_phy_rx_reset(pd);
 }
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**
+ * Pool of fixed size blocks that grows, one chunk at a time, as blocks are
+ * needed up to a cap. Chunks are not given back to the heap until the pool
+ * is deleted so a PD that had one burst of commands doesn't pay for the
+ * malloc() again on the next one. Free blocks are kept in a singly linked
+ * list threaded through the blocks themselves.
+ *
+ * Not thread safe; all calls must come from the thread that owns the pool.
+ */
+
+#include <stdlib.h>
+
+#include "osdp_common.h"
+
+/* blocks and the chunk header are aligned for any member of a block */
+#define POOL_ALIGN(x)       (((x) + sizeof(uint64_t) - 1) & \
+			     ~(sizeof(uint64_t) - 1))
+#define POOL_CHUNK_HDR      POOL_ALIGN(sizeof(void *))
+
+static int osdp_pool_grow(struct osdp_pool *p)
+{
+	int i, count;
+	uint8_t *chunk, *block;
+
+	count = p->max_blocks - p->num_blocks;
+	if (count > p->chunk_blocks) {
+		count = p->chunk_blocks;
+	}
+	if (count <= 0) {
+		return -1;
+	}
+	chunk = malloc(POOL_CHUNK_HDR + count * p->block_size);
+	if (chunk == NULL) {
+		return -1;
+	}
+	*(void **)chunk = p->chunks;
+	p->chunks = chunk;
+	block = chunk + POOL_CHUNK_HDR;
+	for (i = 0; i < count; i++) {
+		*(void **)block = p->free_list;
+		p->free_list = block;
+		block += p->block_size;
+	}
+	p->num_blocks += count;
+	return 0;
+}
+
+/**
+ * Set up a pool of at most `max_blocks` blocks of `block_size` bytes. The
+ * first chunk of `chunk_blocks` blocks is allocated right away so that a
+ * pool that never grows behaves just like a fixed one.
+ */
+int osdp_pool_init(struct osdp_pool *p, size_t block_size, int chunk_blocks,
+		   int max_blocks)
+{
+	p->block_size = POOL_ALIGN(block_size < sizeof(void *) ?
+				   sizeof(void *) : block_size);
+	p->chunk_blocks = chunk_blocks;
+	p->max_blocks = max_blocks;
+	p->num_blocks = 0;
+	p->used_blocks = 0;
+	p->free_list = NULL;
+	p->chunks = NULL;
+	return osdp_pool_grow(p);
+}
+
+void osdp_pool_del(struct osdp_pool *p)
+{
+	void *next;
+
+	while (p->chunks != NULL) {
+		next = *(void **)p->chunks;
+		free(p->chunks);
+		p->chunks = next;
+	}
+	p->free_list = NULL;
+	p->num_blocks = 0;
+	p->used_blocks = 0;
+}
+
+/**
+ * Returns a block or NULL if the pool has `max_blocks` in use (or the heap
+ * is exhausted).
+ */
+void *osdp_pool_alloc(struct osdp_pool *p)
+{
+	void *block;
+
+	if (p->free_list == NULL && osdp_pool_grow(p)) {
+		return NULL;
+	}
+	block = p->free_list;
+	p->free_list = *(void **)block;
+	p->used_blocks += 1;
+	return block;
+}
+
+void osdp_pool_free(struct osdp_pool *p, void *block)
+{
+	*(void **)block = p->free_list;
+	p->free_list = block;
+	p->used_blocks -= 1;
+}
@@ -29,10 +29,9 @@ void osdp_compute_scbk(struct osdp_pd *pd, uint8_t *scbk)
 	osdp_encrypt(ctx->sc_master_key, NULL, scbk, 16);
 }
 
-void osdp_compute_session_keys(struct osdp *ctx)
+void osdp_compute_session_keys(struct osdp_pd *pd)
 {
 	int i;
-	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
 
 	if (ISSET_FLAG(pd, PD_FLAG_SC_USE_SCBKD)) {
 		memcpy(pd->sc.scbk, osdp_scbk_default, 16);
@@ -63,6 +62,11 @@ void osdp_compute_session_keys(struct osdp *ctx)
 	osdp_encrypt(pd->sc.scbk, NULL, pd->sc.s_enc,  16);
 	osdp_encrypt(pd->sc.scbk, NULL, pd->sc.s_mac1, 16);
 	osdp_encrypt(pd->sc.scbk, NULL, pd->sc.s_mac2, 16);
+
+	/* expand once here; used for every packet while SC is active */
+	osdp_aes_key_init(&pd->sc.s_enc_ctx, pd->sc.s_enc);
+	osdp_aes_key_init(&pd->sc.s_mac1_ctx, pd->sc.s_mac1);
+	osdp_aes_key_init(&pd->sc.s_mac2_ctx, pd->sc.s_mac2);
 }
 
 void osdp_compute_cp_cryptogram(struct osdp_pd *pd)
@@ -70,7 +74,7 @@ void osdp_compute_cp_cryptogram(struct osdp_pd *pd)
 	/* cp_cryptogram = AES-ECB( pd_random[8] || cp_random[8], s_enc ) */
 	memcpy(pd->sc.cp_cryptogram + 0, pd->sc.pd_random, 8);
 	memcpy(pd->sc.cp_cryptogram + 8, pd->sc.cp_random, 8);
-	osdp_encrypt(pd->sc.s_enc, NULL, pd->sc.cp_cryptogram, 16);
+	osdp_encrypt_ctx(&pd->sc.s_enc_ctx, NULL, pd->sc.cp_cryptogram, 16);
 }
 
 /**
@@ -101,7 +105,7 @@ int osdp_verify_cp_cryptogram(struct osdp_pd *pd)
 	/* cp_cryptogram = AES-ECB( pd_random[8] || cp_random[8], s_enc ) */
 	memcpy(cp_crypto + 0, pd->sc.pd_random, 8);
 	memcpy(cp_crypto + 8, pd->sc.cp_random, 8);
-	osdp_encrypt(pd->sc.s_enc, NULL, cp_crypto, 16);
+	osdp_encrypt_ctx(&pd->sc.s_enc_ctx, NULL, cp_crypto, 16);
 
 	if (osdp_ct_compare(pd->sc.cp_cryptogram, cp_crypto, 16) != 0) {
 		return -1;
@@ -114,7 +118,7 @@ void osdp_compute_pd_cryptogram(struct osdp_pd *pd)
 	/* pd_cryptogram = AES-ECB( cp_random[8] || pd_random[8], s_enc ) */
 	memcpy(pd->sc.pd_cryptogram + 0, pd->sc.cp_random, 8);
 	memcpy(pd->sc.pd_cryptogram + 8, pd->sc.pd_random, 8);
-	osdp_encrypt(pd->sc.s_enc, NULL, pd->sc.pd_cryptogram, 16);
+	osdp_encrypt_ctx(&pd->sc.s_enc_ctx, NULL, pd->sc.pd_cryptogram, 16);
 }
 
 int osdp_verify_pd_cryptogram(struct osdp_pd *pd)
@@ -124,7 +128,7 @@ int osdp_verify_pd_cryptogram(struct osdp_pd *pd)
 	/* pd_cryptogram = AES-ECB( cp_random[8] || pd_random[8], s_enc ) */
 	memcpy(pd_crypto + 0, pd->sc.cp_random, 8);
 	memcpy(pd_crypto + 8, pd->sc.pd_random, 8);
-	osdp_encrypt(pd->sc.s_enc, NULL, pd_crypto, 16);
+	osdp_encrypt_ctx(&pd->sc.s_enc_ctx, NULL, pd_crypto, 16);
 
 	if (osdp_ct_compare(pd->sc.pd_cryptogram, pd_crypto, 16) != 0) {
 		return -1;
@@ -136,8 +140,8 @@ void osdp_compute_rmac_i(struct osdp_pd *pd)
 {
 	/* rmac_i = AES-ECB( AES-ECB( cp_cryptogram, s_mac1 ), s_mac2 ) */
 	memcpy(pd->sc.r_mac, pd->sc.cp_cryptogram, 16);
-	osdp_encrypt(pd->sc.s_mac1, NULL, pd->sc.r_mac, 16);
-	osdp_encrypt(pd->sc.s_mac2, NULL, pd->sc.r_mac, 16);
+	osdp_encrypt_ctx(&pd->sc.s_mac1_ctx, NULL, pd->sc.r_mac, 16);
+	osdp_encrypt_ctx(&pd->sc.s_mac2_ctx, NULL, pd->sc.r_mac, 16);
 }
 
 int osdp_decrypt_data(struct osdp_pd *pd, int is_cmd, uint8_t *data, int length)
@@ -155,7 +159,7 @@ int osdp_decrypt_data(struct osdp_pd *pd, int is_cmd, uint8_t *data, int length)
 		iv[i] = ~iv[i];
 	}
 
-	osdp_decrypt(pd->sc.s_enc, iv, data, length);
+	osdp_decrypt_ctx(&pd->sc.s_enc_ctx, iv, data, length);
 
 	while (data[length - 1] == 0x00) {
 		length--;
@@ -168,10 +172,16 @@ int osdp_decrypt_data(struct osdp_pd *pd, int is_cmd, uint8_t *data, int length)
 	return length - 1;
 }
 
-int osdp_encrypt_data(struct osdp_pd *pd, int is_cmd, uint8_t *data, int length)
+/**
+ * Encrypt data in place (AES-CBC with S-ENC) and feed each ciphertext block
+ * to `mac` as soon as it is produced so the frame is walked only once for
+ * encrypt-then-MAC.
+ */
+int osdp_encrypt_data(struct osdp_pd *pd, int is_cmd, uint8_t *data, int length,
+		      struct osdp_mac_ctx *mac)
 {
-	int i, pad_len;
-	uint8_t iv[16];
+	int i, j, pad_len;
+	uint8_t *prev, iv[16];
 
 	data[length] = OSDP_SC_EOM_MARKER;  /* append EOM marker */
 	pad_len = AES_PAD_LEN(length + 1);
@@ -183,41 +193,68 @@ int osdp_encrypt_data(struct osdp_pd *pd, int is_cmd, uint8_t *data, int length)
 		iv[i] = ~iv[i];
 	}
 
-	osdp_encrypt(pd->sc.s_enc, iv, data, pad_len);
+	prev = iv;
+	for (i = 0; i < pad_len; i += 16) {
+		for (j = 0; j < 16; j++) {
+			data[i + j] ^= prev[j];
+		}
+		osdp_encrypt_ctx(&pd->sc.s_enc_ctx, NULL, data + i, 16);
+		osdp_mac_update(mac, data + i, 16);
+		prev = data + i;
+	}
 
 	return pad_len;
 }
 
-int osdp_compute_mac(struct osdp_pd *pd, int is_cmd,
-		     const uint8_t *data, int len)
+/**
+ * MAC for data blocks B[1] .. B[N] (post padding) is computed as:
+ * IV1 = R_MAC (or) C_MAC  -- depending on is_cmd
+ * IV2 = B[N-1] after -- AES-CBC ( IV1, B[1] to B[N-1], SMAC-1 )
+ * MAC = AES-ECB ( IV2, B[N], SMAC-2 )
+ *
+ * The data is XORed straight into the CBC chaining value. A full block is
+ * encrypted with SMAC-1 only once more data shows up, since the last one
+ * must go through SMAC-2 in osdp_mac_final() instead.
+ */
+void osdp_mac_init(struct osdp_mac_ctx *mac, struct osdp_pd *pd, int is_cmd)
 {
-	int pad_len;
-	uint8_t buf[OSDP_PACKET_BUF_SIZE] = { 0 };
-	uint8_t iv[16];
+	mac->k1 = &pd->sc.s_mac1_ctx;
+	mac->k2 = &pd->sc.s_mac2_ctx;
+	memcpy(mac->chain, is_cmd ? pd->sc.r_mac : pd->sc.c_mac, 16);
+	mac->pos = 0;
+}
+
+void osdp_mac_update(struct osdp_mac_ctx *mac, const uint8_t *data, int len)
+{
+	int i;
 
-	memcpy(buf, data, len);
-	pad_len = (len % 16 == 0) ? len : AES_PAD_LEN(len);
-	if (len % 16 != 0) {
-		buf[len] = 0x80; /* end marker */
+	for (i = 0; i < len; i++) {
+		if (mac->pos == 16) {
+			osdp_encrypt_ctx(mac->k1, NULL, mac->chain, 16);
+			mac->pos = 0;
+		}
+		mac->chain[mac->pos++] ^= data[i];
 	}
-	/**
-	 * MAC for data blocks B[1] .. B[N] (post padding) is computed as:
-	 * IV1 = R_MAC (or) C_MAC  -- depending on is_cmd
-	 * IV2 = B[N-1] after -- AES-CBC ( IV1, B[1] to B[N-1], SMAC-1 )
-	 * MAC = AES-ECB ( IV2, B[N], SMAC-2 )
-	 */
+}
 
-	memcpy(iv, is_cmd ? pd->sc.r_mac : pd->sc.c_mac, 16);
-	if (pad_len > 16) {
-		/* N-1 blocks -- encrypted with SMAC-1 */
-		osdp_encrypt(pd->sc.s_mac1, iv, buf, pad_len - 16);
-		/* N-1 th block is the IV for N th block */
-		memcpy(iv, buf + pad_len - 32, 16);
+void osdp_mac_final(struct osdp_mac_ctx *mac, uint8_t *out)
+{
+	if (mac->pos < 16) {
+		/* 0x80 end marker; trailing zero pad is a no-op for XOR */
+		mac->chain[mac->pos] ^= 0x80;
 	}
+	osdp_encrypt_ctx(mac->k2, NULL, mac->chain, 16);
+	memcpy(out, mac->chain, 16);
+}
 
-	/* N-th Block encrypted with SMAC-2 == MAC */
-	osdp_encrypt(pd->sc.s_mac2, iv, buf + pad_len - 16, 16);
-	memcpy(is_cmd ? pd->sc.c_mac : pd->sc.r_mac, buf + pad_len - 16, 16);
+int osdp_compute_mac(struct osdp_pd *pd, int is_cmd,
+		     const uint8_t *data, int len)
+{
+	struct osdp_mac_ctx mac;
+
+	osdp_mac_init(&mac, pd, is_cmd);
+	osdp_mac_update(&mac, data, len);
+	osdp_mac_final(&mac, is_cmd ? pd->sc.c_mac : pd->sc.r_mac);
 
 	return 0;
 }
@@ -226,9 +263,8 @@ void osdp_sc_init(struct osdp_pd *pd)
 {
 	uint8_t key[16];
 
-	if (ISSET_FLAG(pd, PD_FLAG_PD_MODE)) {
-		memcpy(key, pd->sc.scbk, 16);
-	}
+	memcpy(key, pd->sc.scbk, 16);
+	osdp_sc_teardown(pd);
 	memset(&pd->sc, 0, sizeof(struct osdp_secure_channel));
 	if (ISSET_FLAG(pd, PD_FLAG_PD_MODE)) {
 		memcpy(pd->sc.scbk, key, 16);
@@ -244,3 +280,10 @@ void osdp_sc_init(struct osdp_pd *pd)
 		pd->sc.pd_client_uid[7] = BYTE_3(pd->id.serial_number);
 	}
 }
+
+void osdp_sc_teardown(struct osdp_pd *pd)
+{
+	osdp_aes_key_release(&pd->sc.s_enc_ctx);
+	osdp_aes_key_release(&pd->sc.s_mac1_ctx);
+	osdp_aes_key_release(&pd->sc.s_mac2_ctx);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+
+#include "bench.h"
+
+#define BENCH_CRC_TOTAL_BYTES          (64 * 1024 * 1024)
+
+typedef uint16_t (*crc16_kernel_t)(uint16_t, const uint8_t *, size_t);
+
+static const struct {
+	const char *name;
+	crc16_kernel_t fn;
+} bench_crc_kernels[] = {
+	{ "bytewise", osdp_crc16_bytewise },
+	{ "table",    osdp_crc16_table    },
+	{ "slice4",   osdp_crc16_slice4   },
+	{ "slice8",   osdp_crc16_slice8   },
+};
+
+/* typical POLL, short reply, card read and a full packet buffer */
+static const size_t bench_crc_lengths[] = { 8, 16, 64, OSDP_PACKET_BUF_SIZE };
+
+void run_crc_bench(void)
+{
+	size_t i, j, n, iter;
+	int64_t start, elapsed;
+	double rate;
+	uint8_t buf[OSDP_PACKET_BUF_SIZE];
+
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = (uint8_t)rand();
+	}
+
+	if (!bench_json) {
+		printf("\nCRC16 kernels (bytes/ns)\n");
+		printf("  %-10s", "len");
+		for (j = 0; j < ARRAY_SIZE(bench_crc_lengths); j++) {
+			printf("%10zu", bench_crc_lengths[j]);
+		}
+		printf("\n");
+	}
+
+	for (i = 0; i < ARRAY_SIZE(bench_crc_kernels); i++) {
+		if (!bench_json) {
+			printf("  %-10s", bench_crc_kernels[i].name);
+		}
+		for (j = 0; j < ARRAY_SIZE(bench_crc_lengths); j++) {
+			n = bench_crc_lengths[j];
+			iter = BENCH_CRC_TOTAL_BYTES / n;
+			start = bench_nanos_now();
+			while (iter--) {
+				BENCH_SINK(bench_crc_kernels[i].fn(0x1D0F,
+								   buf, n));
+			}
+			elapsed = bench_nanos_now() - start;
+			rate = (double)BENCH_CRC_TOTAL_BYTES / (double)elapsed;
+			if (bench_json) {
+				printf("{\"bench\":\"crc16\",\"kernel\":\"%s\","
+				       "\"len\":%zu,\"bytes_per_ns\":%.3f}\n",
+				       bench_crc_kernels[i].name, n, rate);
+			} else {
+				printf("%10.3f", rate);
+			}
+		}
+		if (!bench_json) {
+			printf("\n");
+		}
+	}
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+
+#include "bench.h"
+
+#ifdef CONFIG_OSDP_SC_ENABLED
+
+#define BENCH_AES_TOTAL_BYTES          (8 * 1024 * 1024)
+#define BENCH_AES_KEY_SETUPS           (256 * 1024)
+
+/* one block (cryptograms, MAC), a short command and a full packet buffer */
+static const int bench_aes_lengths[] = { 16, 64, OSDP_PACKET_BUF_SIZE };
+
+static double bench_aes_cbc(struct osdp_aes_key *k, int enc, uint8_t *iv,
+			    uint8_t *buf, int len)
+{
+	int64_t start, elapsed;
+	size_t iter = BENCH_AES_TOTAL_BYTES / len;
+
+	start = bench_nanos_now();
+	while (iter--) {
+		if (enc) {
+			osdp_encrypt_ctx(k, iv, buf, len);
+		} else {
+			osdp_decrypt_ctx(k, iv, buf, len);
+		}
+	}
+	elapsed = bench_nanos_now() - start;
+	BENCH_SINK(buf[0]);
+	return (double)BENCH_AES_TOTAL_BYTES / (double)elapsed;
+}
+
+static double bench_aes_key_setup(struct osdp_aes_key *k, uint8_t *key)
+{
+	int64_t start, elapsed;
+	size_t iter = BENCH_AES_KEY_SETUPS;
+
+	start = bench_nanos_now();
+	while (iter--) {
+		osdp_aes_key_init(k, key);
+		key[0]++;
+	}
+	elapsed = bench_nanos_now() - start;
+	return (double)elapsed / BENCH_AES_KEY_SETUPS;
+}
+
+void run_crypto_bench(void)
+{
+	int i, j, enc;
+	double rate;
+	uint8_t key[16], iv[16], buf[OSDP_PACKET_BUF_SIZE];
+	struct osdp_aes_key k = { 0 };
+	const struct osdp_aes_ops *ops, *saved = osdp_crypto_get_ops();
+
+	for (i = 0; i < 16; i++) {
+		key[i] = (uint8_t)rand();
+		iv[i] = (uint8_t)rand();
+	}
+	for (i = 0; i < (int)sizeof(buf); i++) {
+		buf[i] = (uint8_t)rand();
+	}
+
+	if (!bench_json) {
+		printf("\nAES-128 backends (CBC bytes/ns; key setup ns); "
+		       "default: %s\n", saved->name);
+		printf("  %-10s", "len");
+		for (enc = 1; enc >= 0; enc--) {
+			for (j = 0; j < (int)ARRAY_SIZE(bench_aes_lengths); j++) {
+				printf("%7s%-3d", enc ? "enc" : "dec",
+				       bench_aes_lengths[j]);
+			}
+		}
+		printf("%10s\n", "key");
+	}
+
+	for (i = 0; osdp_aes_backends[i] != NULL; i++) {
+		ops = osdp_aes_backends[i];
+		if (osdp_crypto_set_ops(ops) != 0) {
+			if (!bench_json) {
+				printf("  %-10s  (not supported on this CPU)\n",
+				       ops->name);
+			}
+			continue;
+		}
+		osdp_aes_key_init(&k, key);
+		if (!bench_json) {
+			printf("  %-10s", ops->name);
+		}
+		for (enc = 1; enc >= 0; enc--) {
+			for (j = 0; j < (int)ARRAY_SIZE(bench_aes_lengths); j++) {
+				rate = bench_aes_cbc(&k, enc, iv, buf,
+						     bench_aes_lengths[j]);
+				if (bench_json) {
+					printf("{\"bench\":\"aes_cbc\","
+					       "\"backend\":\"%s\",\"op\":\"%s\","
+					       "\"len\":%d,\"bytes_per_ns\":%.3f}\n",
+					       ops->name, enc ? "enc" : "dec",
+					       bench_aes_lengths[j], rate);
+				} else {
+					printf("%10.3f", rate);
+				}
+			}
+		}
+		rate = bench_aes_key_setup(&k, key);
+		if (bench_json) {
+			printf("{\"bench\":\"aes_key_setup\",\"backend\":\"%s\","
+			       "\"ns\":%.1f}\n", ops->name, rate);
+		} else {
+			printf("%10.1f\n", rate);
+		}
+		osdp_aes_key_release(&k);
+	}
+	osdp_crypto_set_ops(saved);
+}
+
+#else /* CONFIG_OSDP_SC_ENABLED */
+
+void run_crypto_bench(void)
+{
+}
+
+#endif /* CONFIG_OSDP_SC_ENABLED */
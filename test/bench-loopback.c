@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <osdp.h>
+
+#include "bench.h"
+
+/**
+ * CP <-> PD transaction throughput. One CP and N in-process PD contexts are
+ * wired through zero-latency memory channels (one per PD) and driven from a
+ * single loop. LibOSDP runs on a virtual clock that advances by a poll period
+ * per loop so that throughput is bound by CPU, not by protocol timers.
+ */
+
+#define BENCH_LB_DURATION_NS           (300 * 1000 * 1000LL)
+#define BENCH_LB_MAX_SAMPLES           (1 << 20)
+#define BENCH_LB_MAX_PENDING           4
+#define BENCH_LB_SETUP_STEPS           100000
+
+static const int bench_lb_num_pd[] = { 1, 8, 126, 1024 };
+
+enum bench_lb_load_e {
+	BENCH_LB_POLL,
+	BENCH_LB_COMMAND,
+	BENCH_LB_EVENT,
+};
+
+static const char *bench_lb_load_names[] = { "poll", "command", "event" };
+
+struct bench_lb_link {
+	uint8_t cp_to_pd[OSDP_PACKET_BUF_SIZE];
+	int cp_to_pd_len;
+	uint8_t pd_to_cp[OSDP_PACKET_BUF_SIZE];
+	int pd_to_cp_len;
+	int64_t tx_nanos;	/* when the CP sent the pending command */
+	int cmd_pending;
+	int event_pending;
+};
+
+struct bench_lb {
+	int num_pd;
+	struct osdp *cp_ctx;
+	struct osdp **pd_ctx;
+	struct bench_lb_link *link;
+	int64_t vtime;
+	int64_t *rtt;
+	int num_rtt;
+	uint64_t commands;
+	uint64_t events;
+};
+
+static int64_t bench_lb_millis(void *arg)
+{
+	return ((struct bench_lb *)arg)->vtime;
+}
+
+static int bench_lb_xfer(uint8_t *dst, int *dst_len, uint8_t *src, int len)
+{
+	if (*dst_len + len > OSDP_PACKET_BUF_SIZE) {
+		len = OSDP_PACKET_BUF_SIZE - *dst_len;
+	}
+	memcpy(dst + *dst_len, src, len);
+	*dst_len += len;
+	return len;
+}
+
+static int bench_lb_drain(uint8_t *src, int *src_len, uint8_t *buf, int max_len)
+{
+	int len = *src_len;
+
+	if (len > max_len) {
+		len = max_len;
+	}
+	memcpy(buf, src, len);
+	memmove(src, src + len, *src_len - len);
+	*src_len -= len;
+	return len;
+}
+
+static int bench_lb_cp_send(void *data, uint8_t *buf, int len)
+{
+	struct bench_lb_link *l = data;
+
+	l->tx_nanos = bench_nanos_now();
+	return bench_lb_xfer(l->cp_to_pd, &l->cp_to_pd_len, buf, len);
+}
+
+static struct bench_lb *g_bench_lb;
+
+static int bench_lb_cp_recv(void *data, uint8_t *buf, int len)
+{
+	struct bench_lb *b = g_bench_lb;
+	struct bench_lb_link *l = data;
+
+	if (l->pd_to_cp_len == 0) {
+		return 0;
+	}
+	if (l->tx_nanos != 0 && b->num_rtt < BENCH_LB_MAX_SAMPLES) {
+		b->rtt[b->num_rtt++] = bench_nanos_now() - l->tx_nanos;
+		l->tx_nanos = 0;
+	}
+	return bench_lb_drain(l->pd_to_cp, &l->pd_to_cp_len, buf, len);
+}
+
+static int bench_lb_pd_send(void *data, uint8_t *buf, int len)
+{
+	struct bench_lb_link *l = data;
+
+	return bench_lb_xfer(l->pd_to_cp, &l->pd_to_cp_len, buf, len);
+}
+
+static int bench_lb_pd_recv(void *data, uint8_t *buf, int len)
+{
+	struct bench_lb_link *l = data;
+
+	return bench_lb_drain(l->cp_to_pd, &l->cp_to_pd_len, buf, len);
+}
+
+static int bench_lb_pd_command(void *arg, int address, struct osdp_cmd *cmd)
+{
+	struct bench_lb_link *l = arg;
+
+	ARG_UNUSED(address);
+	ARG_UNUSED(cmd);
+
+	l->cmd_pending--;
+	g_bench_lb->commands++;
+	return 0;
+}
+
+static int bench_lb_cp_event(void *arg, int address, struct osdp_event *ev)
+{
+	struct bench_lb *b = arg;
+	int i = ev->keypress.data[0] | (ev->keypress.data[1] << 8);
+
+	ARG_UNUSED(address);
+
+	if (i < b->num_pd) {
+		b->link[i].event_pending--;
+	}
+	b->events++;
+	return 0;
+}
+
+static void bench_lb_teardown(struct bench_lb *b)
+{
+	int i;
+
+	if (b->cp_ctx != NULL) {
+		osdp_cp_teardown(b->cp_ctx);
+	}
+	for (i = 0; b->pd_ctx != NULL && i < b->num_pd; i++) {
+		if (b->pd_ctx[i] != NULL) {
+			osdp_pd_teardown(b->pd_ctx[i]);
+		}
+	}
+	osdp_set_time_source(NULL, NULL);
+	free(b->pd_ctx);
+	free(b->link);
+	free(b->rtt);
+}
+
+static void bench_lb_step(struct bench_lb *b)
+{
+	int i;
+
+	osdp_cp_refresh(b->cp_ctx);
+	for (i = 0; i < b->num_pd; i++) {
+		osdp_pd_refresh(b->pd_ctx[i]);
+	}
+	osdp_cp_refresh(b->cp_ctx);
+	b->vtime += OSDP_PD_POLL_TIMEOUT_MS;
+}
+
+static int bench_lb_ready(struct bench_lb *b, int sc)
+{
+	int i;
+	struct osdp_pd *pd;
+
+	for (i = 0; i < b->num_pd; i++) {
+		pd = TO_PD(b->cp_ctx, i);
+		if (pd->state != OSDP_CP_STATE_ONLINE) {
+			return false;
+		}
+		if (sc && !ISSET_FLAG(pd, PD_FLAG_SC_ACTIVE)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int bench_lb_setup(struct bench_lb *b, int num_pd, int sc)
+{
+	int i, steps;
+	osdp_pd_info_t *info;
+
+	memset(b, 0, sizeof(struct bench_lb));
+	b->num_pd = num_pd;
+	b->vtime = 1000000;
+	b->pd_ctx = calloc(num_pd, sizeof(struct osdp *));
+	b->link = calloc(num_pd, sizeof(struct bench_lb_link));
+	b->rtt = calloc(BENCH_LB_MAX_SAMPLES, sizeof(int64_t));
+	info = calloc(num_pd, sizeof(osdp_pd_info_t));
+	if (b->pd_ctx == NULL || b->link == NULL || b->rtt == NULL ||
+	    info == NULL) {
+		free(info);
+		return -1;
+	}
+	g_bench_lb = b;
+	osdp_set_time_source(bench_lb_millis, b);
+
+	for (i = 0; i < num_pd; i++) {
+		info[i].address = i % 126;
+		info[i].baud_rate = 115200;
+		info[i].channel.data = b->link + i;
+		info[i].channel.send = bench_lb_cp_send;
+		info[i].channel.recv = bench_lb_cp_recv;
+	}
+	b->cp_ctx = osdp_cp_setup(num_pd, info, NULL);
+	for (i = 0; i < num_pd; i++) {
+		info[i].channel.send = bench_lb_pd_send;
+		info[i].channel.recv = bench_lb_pd_recv;
+		b->pd_ctx[i] = osdp_pd_setup(info + i, NULL);
+		if (b->pd_ctx[i] == NULL) {
+			break;
+		}
+		osdp_pd_set_command_callback(b->pd_ctx[i], bench_lb_pd_command,
+					     b->link + i);
+		if (!sc) {
+			TO_PD(b->pd_ctx[i], 0)->cap
+				[OSDP_PD_CAP_COMMUNICATION_SECURITY]
+				.compliance_level = 0;
+		}
+	}
+	free(info);
+	if (b->cp_ctx == NULL || i < num_pd) {
+		return -1;
+	}
+	osdp_cp_set_event_callback(b->cp_ctx, bench_lb_cp_event, b);
+
+	for (steps = 0; steps < BENCH_LB_SETUP_STEPS; steps++) {
+		if (bench_lb_ready(b, sc)) {
+			return 0;
+		}
+		bench_lb_step(b);
+	}
+	return -1;
+}
+
+static void bench_lb_load(struct bench_lb *b, int load)
+{
+	int i;
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_LED,
+		.led = { .led_number = 0 },
+	};
+	struct osdp_event ev = {
+		.type = OSDP_EVENT_KEYPRESS,
+		.keypress = { .length = 2 },
+	};
+
+	for (i = 0; i < b->num_pd; i++) {
+		if (load == BENCH_LB_COMMAND &&
+		    b->link[i].cmd_pending < BENCH_LB_MAX_PENDING &&
+		    osdp_cp_send_command(b->cp_ctx, i, &cmd) == 0) {
+			b->link[i].cmd_pending++;
+		}
+		if (load == BENCH_LB_EVENT &&
+		    b->link[i].event_pending < BENCH_LB_MAX_PENDING) {
+			ev.keypress.data[0] = i & 0xff;
+			ev.keypress.data[1] = (i >> 8) & 0xff;
+			if (osdp_pd_notify_event(b->pd_ctx[i], &ev) == 0) {
+				b->link[i].event_pending++;
+			}
+		}
+	}
+}
+
+static int bench_lb_cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t bench_lb_rx_frames(struct bench_lb *b)
+{
+	int i;
+	uint64_t total = 0;
+	struct osdp_stats stats;
+
+	for (i = 0; i < b->num_pd; i++) {
+		osdp_get_stats(b->cp_ctx, i, &stats);
+		total += stats.rx_frames;
+	}
+	return total;
+}
+
+static void bench_lb_run(struct bench_lb *b, int sc, int load)
+{
+	uint64_t frames, commands, events;
+	int64_t start, elapsed, cpu;
+	double secs, p50 = 0, p99 = 0;
+
+	b->num_rtt = 0;
+	frames = bench_lb_rx_frames(b);
+	commands = b->commands;
+	events = b->events;
+	cpu = bench_cpu_nanos_now();
+	start = bench_nanos_now();
+	do {
+		bench_lb_load(b, load);
+		bench_lb_step(b);
+		elapsed = bench_nanos_now() - start;
+	} while (elapsed < BENCH_LB_DURATION_NS);
+	cpu = bench_cpu_nanos_now() - cpu;
+
+	frames = bench_lb_rx_frames(b) - frames;
+	commands = b->commands - commands;
+	events = b->events - events;
+	if (b->num_rtt) {
+		qsort(b->rtt, b->num_rtt, sizeof(int64_t), bench_lb_cmp);
+		p50 = b->rtt[b->num_rtt / 2] / 1000.0;
+		p99 = b->rtt[(b->num_rtt * 99) / 100] / 1000.0;
+	}
+	secs = elapsed / 1e9;
+
+	if (bench_json) {
+		printf("{\"bench\":\"loopback\",\"sc\":%d,\"num_pd\":%d,"
+		       "\"load\":\"%s\",\"transactions_per_sec\":%.0f,"
+		       "\"commands_per_sec\":%.0f,\"events_per_sec\":%.0f,"
+		       "\"rtt_p50_us\":%.2f,\"rtt_p99_us\":%.2f,"
+		       "\"cpu_ns_per_transaction\":%.0f}\n",
+		       sc, b->num_pd, bench_lb_load_names[load], frames / secs,
+		       commands / secs, events / secs, p50, p99,
+		       frames ? (double)cpu / frames : 0.0);
+		return;
+	}
+	printf("  %-5s%6d  %-8s%12.0f%12.0f%12.0f%10.2f%10.2f%10.0f\n",
+	       sc ? "sc" : "plain", b->num_pd, bench_lb_load_names[load],
+	       frames / secs, commands / secs, events / secs, p50, p99,
+	       frames ? (double)cpu / frames : 0.0);
+}
+
+void run_loopback_bench(void)
+{
+	int sc, load;
+	size_t i;
+	struct bench_lb b;
+
+	osdp_set_log_level(LOG_CRIT);
+	if (!bench_json) {
+		printf("\nCP <-> PD loopback (per second; RTT us; CPU ns/txn)\n");
+		printf("  %-5s%6s  %-8s%12s%12s%12s%10s%10s%10s\n", "mode",
+		       "PDs", "load", "txn", "commands", "events", "p50",
+		       "p99", "cpu");
+	}
+	for (sc = 0; sc <= (IS_ENABLED(CONFIG_OSDP_SC_ENABLED) ? 1 : 0); sc++) {
+		for (i = 0; i < ARRAY_SIZE(bench_lb_num_pd); i++) {
+			if (bench_lb_setup(&b, bench_lb_num_pd[i], sc)) {
+				printf(bench_json ?
+				       "{\"bench\":\"loopback\",\"sc\":%d,"
+				       "\"num_pd\":%d,\"error\":\"setup\"}\n" :
+				       "  %-5d%6d  setup failed\n",
+				       sc, bench_lb_num_pd[i]);
+				bench_lb_teardown(&b);
+				continue;
+			}
+			for (load = BENCH_LB_POLL; load <= BENCH_LB_EVENT;
+			     load++) {
+				bench_lb_run(&b, sc, load);
+			}
+			bench_lb_teardown(&b);
+		}
+	}
+	osdp_set_log_level(LOG_WARNING);
+}
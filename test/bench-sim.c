@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <osdp.h>
+
+#include "bench.h"
+#include "sim.h"
+
+/**
+ * Traffic on a fleet of RS-485 buses, simulated on a virtual clock (see
+ * sim.h). Reports what the fleet sees and how long it took to simulate.
+ */
+
+static const struct {
+	int64_t duration_sec;
+	struct sim_config cfg;
+} bench_sim_runs[] = {
+	{
+		3600, {
+			.num_bus = 8, .pd_per_bus = 126, .baud_rate = 9600,
+			.turnaround_us = 2000, .inter_byte_gap_us = 50,
+			.card_reads_per_sec = 10, .seed = 1,
+		}
+	},
+	{
+		60, {
+			.num_bus = 8, .pd_per_bus = 126, .baud_rate = 115200,
+			.turnaround_us = 500, .inter_byte_gap_us = 10,
+			.card_reads_per_sec = 10, .seed = 1,
+		}
+	},
+	{
+		600, {
+			.num_bus = 8, .pd_per_bus = 126, .baud_rate = 9600,
+			.turnaround_us = 2000, .inter_byte_gap_us = 50,
+			.noise_ppm = 10, .card_reads_per_sec = 10, .seed = 1,
+		}
+	},
+};
+
+static void bench_sim_run(const struct sim_config *cfg, int64_t duration_sec)
+{
+	struct sim *s;
+	struct sim_report r;
+	int64_t start, elapsed;
+	double online;
+
+	start = bench_nanos_now();
+	s = sim_create(cfg);
+	if (s == NULL) {
+		printf("  sim setup failed\n");
+		return;
+	}
+	sim_run(s, duration_sec * 1000 * 1000);
+	sim_get_report(s, &r);
+	sim_destroy(s);
+	elapsed = bench_nanos_now() - start;
+	online = (r.all_online_us < 0) ? -1.0 : r.all_online_us / 1e3;
+
+	if (bench_json) {
+		printf("{\"bench\":\"sim\",\"num_pd\":%d,\"baud_rate\":%d,"
+		       "\"noise_ppm\":%d,\"sim_sec\":%lld,\"wall_sec\":%.2f,"
+		       "\"bus_utilization\":%.3f,\"card_reads\":%u,"
+		       "\"card_reads_delivered\":%u,\"read_p50_ms\":%.1f,"
+		       "\"read_p99_ms\":%.1f,\"all_online_ms\":%.1f,"
+		       "\"offline_events\":%u}\n",
+		       cfg->num_bus * cfg->pd_per_bus, cfg->baud_rate,
+		       cfg->noise_ppm, (long long)(r.elapsed_us / 1000000),
+		       elapsed / 1e9, r.bus_utilization, r.card_reads,
+		       r.card_reads_delivered, r.read_latency_p50_us / 1e3,
+		       r.read_latency_p99_us / 1e3, online,
+		       r.offline_events);
+		return;
+	}
+	printf("  %6d%8d%7d%6lld%8.2f%7.2f%9u%9u%9.1f%9.1f%10.1f%9u\n",
+	       cfg->num_bus * cfg->pd_per_bus, cfg->baud_rate, cfg->noise_ppm,
+	       (long long)duration_sec, elapsed / 1e9, r.bus_utilization,
+	       r.card_reads, r.card_reads_delivered, r.read_latency_p50_us / 1e3,
+	       r.read_latency_p99_us / 1e3, online,
+	       r.offline_events);
+}
+
+void run_sim_bench(void)
+{
+	size_t i;
+
+	osdp_set_log_level(LOG_EMERG);
+	if (!bench_json) {
+		printf("\nBus simulator (simulated s; wall s; read latency ms; "
+		       "time to all online ms)\n");
+		printf("  %6s%8s%7s%6s%8s%7s%9s%9s%9s%9s%10s%9s\n", "PDs",
+		       "baud", "noise", "sim", "wall", "util", "reads", "done",
+		       "p50", "p99", "online", "offline");
+	}
+	for (i = 0; i < ARRAY_SIZE(bench_sim_runs); i++) {
+		bench_sim_run(&bench_sim_runs[i].cfg,
+			      bench_sim_runs[i].duration_sec);
+	}
+	osdp_set_log_level(LOG_WARNING);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <osdp.h>
+
+#include "bench.h"
+
+volatile uint32_t bench_sink;
+int bench_json;
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benches[] = {
+	{ "crc",      run_crc_bench      },
+	{ "crypto",   run_crypto_bench   },
+	{ "loopback", run_loopback_bench },
+	{ "sim",      run_sim_bench      },
+};
+
+static void usage(const char *prog)
+{
+	size_t i;
+
+	printf("Usage: %s [--json] [bench ...]\n\nBenches:", prog);
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		printf(" %s", benches[i].name);
+	}
+	printf("\n");
+}
+
+static int bench_selected(int argc, char *argv[], const char *name)
+{
+	int i, any = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] == '-') {
+			continue;
+		}
+		any = 1;
+		if (strcmp(argv[i], name) == 0) {
+			return 1;
+		}
+	}
+	return !any;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	size_t j;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--json") == 0) {
+			bench_json = 1;
+		} else if (argv[i][0] == '-') {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!bench_json) {
+		printf("\n");
+		printf("------------------------------------------\n");
+		printf("            OSDP - Benchmarks             \n");
+		printf("------------------------------------------\n");
+	}
+
+	for (j = 0; j < ARRAY_SIZE(benches); j++) {
+		if (bench_selected(argc, argv, benches[j].name)) {
+			benches[j].run();
+		}
+	}
+
+	if (!bench_json) {
+		printf("\n");
+	}
+	return 0;
+}
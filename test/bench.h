@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _OSDP_BENCH_H_
+#define _OSDP_BENCH_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "osdp_common.h"
+
+/**
+ * Keep the compiler from optimizing away a computation whose result is not
+ * otherwise used.
+ */
+#define BENCH_SINK(x)  do { bench_sink ^= (uint32_t)(x); } while (0)
+
+extern volatile uint32_t bench_sink;
+extern int bench_json;	/* print one JSON object per result line */
+
+static inline int64_t bench_nanos_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* CPU time used by this process; includes all threads */
+static inline int64_t bench_cpu_nanos_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void run_crc_bench(void);
+void run_crypto_bench(void);
+void run_loopback_bench(void);
+void run_sim_bench(void);
+
+#endif
@@ -0,0 +1,674 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <osdp.h>
+
+#include "sim.h"
+
+#define SIM_NEVER                      INT64_MAX
+#define SIM_PD_STREAM_SIZE             1024
+#define SIM_BUS_STREAM_SIZE            4096
+#define SIM_MAX_REFRESH                8
+#define SIM_BITS_PER_BYTE              10	/* 8N1 */
+
+/**
+ * Bytes in flight on a wire, each with the time at which it reaches the
+ * other end. Sizes are powers of 2; the oldest bytes are overwritten if the
+ * reader falls behind.
+ */
+struct sim_stream {
+	uint8_t *buf;
+	int64_t *tstamp;
+	uint32_t mask;
+	uint32_t head;		/* next byte to write */
+	uint32_t pos;		/* next byte to read */
+	int64_t last;		/* when the last byte written lands */
+};
+
+struct sim_pd {
+	struct sim_bus *bus;
+	osdp_t *ctx;		/* NULL while the PD is down */
+	osdp_pd_info_t info;
+	struct sim_stream rx;	/* CP -> this PD */
+	int64_t wake;
+	int online;		/* as seen by the CP */
+	int64_t down_tstamp;	/* -1 when not down (or already accounted) */
+	int64_t up_tstamp;	/* -1 when not recovering */
+};
+
+struct sim_bus {
+	struct sim *sim;
+	osdp_t *cp_ctx;
+	struct sim_pd *pd;
+	struct sim_stream rx;	/* all PDs -> CP */
+	int64_t busy_until;
+	int64_t busy_us;
+	int64_t pd_wake;
+	int64_t cp_wake;
+	int64_t cp_deadline;
+};
+
+struct sim {
+	struct sim_config cfg;
+	int num_pd;
+	int num_online;
+	int64_t now;
+	uint32_t rng;
+	struct sim_bus *bus;
+	struct sim_pd *pd;
+	int64_t next_read;
+	int64_t *read_tstamp;
+	int64_t *read_latency;	/* -1 till delivered */
+	uint32_t num_reads;
+	uint32_t max_reads;
+	uint32_t num_delivered;
+	uint64_t bytes;
+	uint32_t bytes_corrupted;
+	uint32_t frames_dropped;
+	uint32_t offline_events;
+	uint32_t num_recoveries;
+	int64_t detect_max;
+	int64_t recovery_sum;
+	int64_t recovery_max;
+	int64_t all_online;
+};
+
+static uint32_t sim_rand(struct sim *s)
+{
+	/* xorshift32; deterministic for a given seed */
+	s->rng ^= s->rng << 13;
+	s->rng ^= s->rng >> 17;
+	s->rng ^= s->rng << 5;
+	return s->rng;
+}
+
+static int sim_chance(struct sim *s, int ppm)
+{
+	return ppm > 0 && (int)(sim_rand(s) % 1000000) < ppm;
+}
+
+static int64_t sim_millis(void *arg)
+{
+	return ((struct sim *)arg)->now / 1000;
+}
+
+/* when byte `i` of a frame that started at `start` is fully on the wire */
+static int64_t sim_byte_time(struct sim *s, int64_t start, int i)
+{
+	return start + ((int64_t)(i + 1) * SIM_BITS_PER_BYTE * 1000000) /
+		       s->cfg.baud_rate + (int64_t)i * s->cfg.inter_byte_gap_us;
+}
+
+static int sim_stream_init(struct sim_stream *st, uint32_t size)
+{
+	st->buf = calloc(size, sizeof(uint8_t));
+	st->tstamp = calloc(size, sizeof(int64_t));
+	st->mask = size - 1;
+	return (st->buf == NULL || st->tstamp == NULL) ? -1 : 0;
+}
+
+static void sim_stream_free(struct sim_stream *st)
+{
+	free(st->buf);
+	free(st->tstamp);
+}
+
+static void sim_stream_write(struct sim *s, struct sim_stream *st,
+			     const uint8_t *buf, int len, int64_t start)
+{
+	int i;
+	uint8_t b;
+
+	for (i = 0; i < len; i++) {
+		b = buf[i];
+		if (sim_chance(s, s->cfg.noise_ppm)) {
+			b ^= 1 << (sim_rand(s) & 7);
+			s->bytes_corrupted++;
+		}
+		if (st->head - st->pos > st->mask) {
+			st->pos++;
+		}
+		st->buf[st->head & st->mask] = b;
+		st->tstamp[st->head & st->mask] = sim_byte_time(s, start, i);
+		st->head++;
+	}
+	st->last = sim_byte_time(s, start, len - 1);
+}
+
+static int sim_stream_read(struct sim *s, struct sim_stream *st, uint8_t *buf,
+			   int max_len)
+{
+	int len = 0;
+
+	while (len < max_len && st->pos != st->head &&
+	       st->tstamp[st->pos & st->mask] <= s->now) {
+		buf[len++] = st->buf[st->pos & st->mask];
+		st->pos++;
+	}
+	return len;
+}
+
+static void sim_stream_flush(struct sim *s, struct sim_stream *st)
+{
+	while (st->pos != st->head &&
+	       st->tstamp[st->pos & st->mask] <= s->now) {
+		st->pos++;
+	}
+}
+
+/* bytes have landed but were not read yet */
+static int sim_stream_ready(struct sim *s, struct sim_stream *st)
+{
+	return st->pos != st->head && st->tstamp[st->pos & st->mask] <= s->now;
+}
+
+/* when the reader must look at this stream again */
+static int64_t sim_stream_wake(struct sim *s, struct sim_stream *st)
+{
+	return (st->pos != st->head && st->last > s->now) ? st->last : SIM_NEVER;
+}
+
+/**
+ * Put a frame of `len` bytes on the bus. Returns the time at which its first
+ * byte starts or -1 if the frame is lost to line noise.
+ */
+static int64_t sim_bus_transmit(struct sim_bus *bus, int len)
+{
+	struct sim *s = bus->sim;
+	int64_t start, end;
+
+	start = (s->now > bus->busy_until) ? s->now : bus->busy_until;
+	start += s->cfg.turnaround_us;
+	end = sim_byte_time(s, start, len - 1);
+	bus->busy_until = end;
+	bus->busy_us += end - start;
+	s->bytes += len;
+	if (sim_chance(s, s->cfg.drop_ppm)) {
+		s->frames_dropped++;
+		return -1;
+	}
+	return start;
+}
+
+static void sim_pd_deliver(struct sim_pd *p, const uint8_t *buf, int len,
+			   int64_t start)
+{
+	struct sim *s = p->bus->sim;
+
+	sim_stream_write(s, &p->rx, buf, len, start);
+	if (p->rx.last < p->wake) {
+		p->wake = p->rx.last;
+	}
+	if (p->wake < p->bus->pd_wake) {
+		p->bus->pd_wake = p->wake;
+	}
+}
+
+/**
+ * Other PDs on a multi-drop bus see every command too but they would discard
+ * it after parsing the header. The simulator saves them that work and only
+ * delivers a command to the PD it is addressed to (or to all, if broadcast).
+ */
+static int sim_cp_send(void *data, uint8_t *buf, int len)
+{
+	int i, address;
+	int64_t start;
+	struct sim_bus *bus = data;
+	struct sim *s = bus->sim;
+
+	start = sim_bus_transmit(bus, len);
+	if (start < 0) {
+		return len;
+	}
+	address = osdp_phy_packet_get_address(buf);
+	for (i = 0; i < s->cfg.pd_per_bus; i++) {
+		if (address == 0x7F || address == bus->pd[i].info.address) {
+			sim_pd_deliver(bus->pd + i, buf, len, start);
+		}
+	}
+	return len;
+}
+
+static int sim_cp_recv(void *data, uint8_t *buf, int len)
+{
+	struct sim_bus *bus = data;
+
+	return sim_stream_read(bus->sim, &bus->rx, buf, len);
+}
+
+static void sim_cp_flush(void *data)
+{
+	struct sim_bus *bus = data;
+
+	sim_stream_flush(bus->sim, &bus->rx);
+}
+
+static int sim_pd_send(void *data, uint8_t *buf, int len)
+{
+	int64_t start;
+	struct sim_pd *p = data;
+	struct sim_bus *bus = p->bus;
+
+	start = sim_bus_transmit(bus, len);
+	if (start < 0) {
+		return len;
+	}
+	sim_stream_write(bus->sim, &bus->rx, buf, len, start);
+	if (bus->rx.last < bus->cp_wake) {
+		bus->cp_wake = bus->rx.last;
+	}
+	return len;
+}
+
+static int sim_pd_recv(void *data, uint8_t *buf, int len)
+{
+	struct sim_pd *p = data;
+
+	return sim_stream_read(p->bus->sim, &p->rx, buf, len);
+}
+
+static void sim_pd_flush(void *data)
+{
+	struct sim_pd *p = data;
+
+	sim_stream_flush(p->bus->sim, &p->rx);
+}
+
+static int sim_cp_event(void *arg, int address, struct osdp_event *ev)
+{
+	struct sim *s = arg;
+	uint32_t id;
+
+	ARG_UNUSED(address);
+
+	if (ev->type != OSDP_EVENT_CARDREAD || ev->cardread.length != 32) {
+		return 0;
+	}
+	id = ev->cardread.data[0] | (ev->cardread.data[1] << 8) |
+	     (ev->cardread.data[2] << 16) | ((uint32_t)ev->cardread.data[3] << 24);
+	if (id < s->num_reads && s->read_latency[id] < 0) {
+		s->read_latency[id] = s->now - s->read_tstamp[id];
+		s->num_delivered++;
+	}
+	return 0;
+}
+
+static int sim_pd_start(struct sim_pd *p)
+{
+	struct sim *s = p->bus->sim;
+
+	p->ctx = osdp_pd_setup(&p->info, NULL);
+	if (p->ctx == NULL) {
+		return -1;
+	}
+	if (!s->cfg.sc) {
+		TO_PD(p->ctx, 0)->cap[OSDP_PD_CAP_COMMUNICATION_SECURITY]
+			.compliance_level = 0;
+	}
+	return 0;
+}
+
+/* account for PD state changes seen by the CP */
+static void sim_bus_check_status(struct sim_bus *bus)
+{
+	int i, online;
+	struct sim_pd *p;
+	struct sim *s = bus->sim;
+	uint64_t map[OSDP_STATUS_BITMAP_WORDS(126)];
+
+	osdp_get_status_bitmap(bus->cp_ctx, map, ARRAY_SIZE(map));
+	for (i = 0; i < s->cfg.pd_per_bus; i++) {
+		p = bus->pd + i;
+		online = (map[i / 64] >> (i % 64)) & 1;
+		if (online == p->online) {
+			continue;
+		}
+		p->online = online;
+		if (!online) {
+			s->num_online--;
+			s->offline_events++;
+			if (p->down_tstamp >= 0 &&
+			    s->now - p->down_tstamp > s->detect_max) {
+				s->detect_max = s->now - p->down_tstamp;
+			}
+			p->down_tstamp = -1;
+			continue;
+		}
+		s->num_online++;
+		if (s->num_online == s->num_pd && s->all_online < 0) {
+			s->all_online = s->now;
+		}
+		if (p->up_tstamp >= 0) {
+			s->num_recoveries++;
+			s->recovery_sum += s->now - p->up_tstamp;
+			if (s->now - p->up_tstamp > s->recovery_max) {
+				s->recovery_max = s->now - p->up_tstamp;
+			}
+			p->up_tstamp = -1;
+		}
+	}
+}
+
+static void sim_bus_cp_refresh(struct sim_bus *bus)
+{
+	int i, next = 0;
+	struct sim *s = bus->sim;
+
+	for (i = 0; i < SIM_MAX_REFRESH && next == 0; i++) {
+		osdp_cp_refresh(bus->cp_ctx);
+		next = osdp_cp_next_deadline(bus->cp_ctx);
+	}
+	if (next == 0) {
+		next = 1;
+	}
+	bus->cp_deadline = (s->now / 1000 + next) * 1000;
+	bus->cp_wake = sim_stream_wake(s, &bus->rx);
+	sim_bus_check_status(bus);
+}
+
+static void sim_bus_pd_refresh(struct sim_bus *bus)
+{
+	int i, n;
+	struct sim_pd *p;
+	struct sim *s = bus->sim;
+
+	bus->pd_wake = SIM_NEVER;
+	for (i = 0; i < s->cfg.pd_per_bus; i++) {
+		p = bus->pd + i;
+		if (p->wake <= s->now) {
+			if (p->ctx == NULL) {
+				sim_stream_flush(s, &p->rx);
+			}
+			for (n = 0; p->ctx != NULL && n < SIM_MAX_REFRESH; n++) {
+				osdp_pd_refresh(p->ctx);
+				if (!sim_stream_ready(s, &p->rx) &&
+				    TO_PD(p->ctx, 0)->state == OSDP_PD_STATE_IDLE) {
+					break;
+				}
+			}
+			p->wake = sim_stream_wake(s, &p->rx);
+		}
+		if (p->wake < bus->pd_wake) {
+			bus->pd_wake = p->wake;
+		}
+	}
+}
+
+static void sim_auto_card_read(struct sim *s)
+{
+	sim_card_read(s, sim_rand(s) % s->num_pd);
+	s->next_read += 1000000 / s->cfg.card_reads_per_sec;
+}
+
+void sim_run(struct sim *s, int64_t duration_us)
+{
+	int i;
+	int64_t next, end = s->now + duration_us;
+	struct sim_bus *bus;
+
+	for (;;) {
+		next = end;
+		if (s->next_read < next) {
+			next = s->next_read;
+		}
+		for (i = 0; i < s->cfg.num_bus; i++) {
+			bus = s->bus + i;
+			if (bus->pd_wake < next) {
+				next = bus->pd_wake;
+			}
+			if (bus->cp_wake < next) {
+				next = bus->cp_wake;
+			}
+			if (bus->cp_deadline < next) {
+				next = bus->cp_deadline;
+			}
+		}
+		s->now = next;
+		if (s->next_read <= s->now) {
+			sim_auto_card_read(s);
+		}
+		for (i = 0; i < s->cfg.num_bus; i++) {
+			bus = s->bus + i;
+			if (bus->pd_wake <= s->now) {
+				sim_bus_pd_refresh(bus);
+			}
+			if (bus->cp_wake <= s->now || bus->cp_deadline <= s->now) {
+				sim_bus_cp_refresh(bus);
+			}
+		}
+		if (s->now >= end) {
+			break;
+		}
+	}
+}
+
+int sim_run_until_online(struct sim *s, int64_t timeout_us)
+{
+	int64_t end = s->now + timeout_us;
+
+	while (s->num_online < s->num_pd && s->now < end) {
+		sim_run(s, 10 * 1000);
+	}
+	return (s->num_online == s->num_pd) ? 0 : -1;
+}
+
+int sim_card_read(struct sim *s, int pd)
+{
+	uint32_t id = s->num_reads;
+	int64_t *p;
+	struct osdp_event ev = {
+		.type = OSDP_EVENT_CARDREAD,
+		.cardread = {
+			.format = OSDP_CARD_FMT_RAW_UNSPECIFIED,
+			.length = 32,
+			.data = { id & 0xff, (id >> 8) & 0xff, (id >> 16) & 0xff,
+				  (id >> 24) & 0xff },
+		},
+	};
+
+	if (s->pd[pd].ctx == NULL) {
+		return -1;
+	}
+	if (s->num_reads == s->max_reads) {
+		s->max_reads = s->max_reads ? s->max_reads * 2 : 1024;
+		p = realloc(s->read_tstamp, s->max_reads * sizeof(int64_t));
+		if (p == NULL) {
+			return -1;
+		}
+		s->read_tstamp = p;
+		p = realloc(s->read_latency, s->max_reads * sizeof(int64_t));
+		if (p == NULL) {
+			return -1;
+		}
+		s->read_latency = p;
+	}
+	if (osdp_pd_notify_event(s->pd[pd].ctx, &ev)) {
+		return -1;
+	}
+	s->read_tstamp[id] = s->now;
+	s->read_latency[id] = -1;
+	s->num_reads++;
+	return 0;
+}
+
+void sim_pd_set_down(struct sim *s, int pd, int down)
+{
+	struct sim_pd *p = s->pd + pd;
+
+	if (down && p->ctx != NULL) {
+		osdp_pd_teardown(p->ctx);
+		p->ctx = NULL;
+		p->down_tstamp = s->now;
+		p->up_tstamp = -1;
+	} else if (!down && p->ctx == NULL) {
+		p->rx.pos = p->rx.head;
+		if (sim_pd_start(p) == 0) {
+			p->up_tstamp = s->now;
+		}
+	}
+}
+
+int sim_pd_is_online(struct sim *s, int pd)
+{
+	return s->pd[pd].online;
+}
+
+int64_t sim_now_us(struct sim *s)
+{
+	return s->now;
+}
+
+static int sim_cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+void sim_get_report(struct sim *s, struct sim_report *r)
+{
+	int i;
+	uint32_t n = 0;
+	int64_t *lat;
+
+	memset(r, 0, sizeof(struct sim_report));
+	r->elapsed_us = s->now;
+	for (i = 0; i < s->cfg.num_bus; i++) {
+		r->bus_utilization += (double)s->bus[i].busy_us / s->now;
+	}
+	r->bus_utilization /= s->cfg.num_bus;
+	r->bytes = s->bytes;
+	r->bytes_corrupted = s->bytes_corrupted;
+	r->frames_dropped = s->frames_dropped;
+	r->card_reads = s->num_reads;
+	r->card_reads_delivered = s->num_delivered;
+	r->all_online_us = s->all_online;
+	r->offline_events = s->offline_events;
+	r->detect_max_us = s->detect_max;
+	r->num_recoveries = s->num_recoveries;
+	r->recovery_max_us = s->recovery_max;
+	if (s->num_recoveries) {
+		r->recovery_avg_us = s->recovery_sum / s->num_recoveries;
+	}
+
+	lat = malloc((s->num_delivered + 1) * sizeof(int64_t));
+	if (lat == NULL) {
+		return;
+	}
+	for (i = 0; i < (int)s->num_reads; i++) {
+		if (s->read_latency[i] >= 0) {
+			lat[n++] = s->read_latency[i];
+		}
+	}
+	if (n) {
+		qsort(lat, n, sizeof(int64_t), sim_cmp);
+		r->read_latency_p50_us = lat[n / 2];
+		r->read_latency_p99_us = lat[(n * 99) / 100];
+		r->read_latency_max_us = lat[n - 1];
+	}
+	free(lat);
+}
+
+struct sim *sim_create(const struct sim_config *cfg)
+{
+	int i, j;
+	struct sim *s;
+	struct sim_bus *bus;
+	struct sim_pd *p;
+	osdp_pd_info_t *info;
+
+	if (cfg->num_bus <= 0 || cfg->pd_per_bus <= 0 ||
+	    cfg->pd_per_bus > 126 || cfg->baud_rate <= 0) {
+		return NULL;
+	}
+	s = calloc(1, sizeof(struct sim));
+	if (s == NULL) {
+		return NULL;
+	}
+	memcpy(&s->cfg, cfg, sizeof(struct sim_config));
+	s->num_pd = cfg->num_bus * cfg->pd_per_bus;
+	s->rng = cfg->seed ? cfg->seed : 1;
+	s->all_online = -1;
+	s->next_read = cfg->card_reads_per_sec ? 0 : SIM_NEVER;
+	s->bus = calloc(cfg->num_bus, sizeof(struct sim_bus));
+	s->pd = calloc(s->num_pd, sizeof(struct sim_pd));
+	info = calloc(cfg->pd_per_bus, sizeof(osdp_pd_info_t));
+	if (s->bus == NULL || s->pd == NULL || info == NULL) {
+		goto error;
+	}
+	osdp_set_time_source(sim_millis, s);
+
+	for (i = 0; i < cfg->num_bus; i++) {
+		bus = s->bus + i;
+		bus->sim = s;
+		bus->pd = s->pd + i * cfg->pd_per_bus;
+		bus->pd_wake = SIM_NEVER;
+		bus->cp_wake = SIM_NEVER;
+		if (sim_stream_init(&bus->rx, SIM_BUS_STREAM_SIZE)) {
+			goto error;
+		}
+		for (j = 0; j < cfg->pd_per_bus; j++) {
+			p = bus->pd + j;
+			p->bus = bus;
+			p->wake = SIM_NEVER;
+			p->down_tstamp = -1;
+			p->up_tstamp = -1;
+			p->info.address = j;
+			p->info.baud_rate = cfg->baud_rate;
+			p->info.channel.data = p;
+			p->info.channel.send = sim_pd_send;
+			p->info.channel.recv = sim_pd_recv;
+			p->info.channel.flush = sim_pd_flush;
+			if (sim_stream_init(&p->rx, SIM_PD_STREAM_SIZE) ||
+			    sim_pd_start(p)) {
+				goto error;
+			}
+			info[j].address = j;
+			info[j].baud_rate = cfg->baud_rate;
+			info[j].channel.data = bus;
+			info[j].channel.send = sim_cp_send;
+			info[j].channel.recv = sim_cp_recv;
+			info[j].channel.flush = sim_cp_flush;
+		}
+		bus->cp_ctx = osdp_cp_setup(cfg->pd_per_bus, info, NULL);
+		if (bus->cp_ctx == NULL) {
+			goto error;
+		}
+		osdp_cp_set_event_callback(bus->cp_ctx, sim_cp_event, s);
+	}
+	free(info);
+	return s;
+error:
+	free(info);
+	sim_destroy(s);
+	return NULL;
+}
+
+void sim_destroy(struct sim *s)
+{
+	int i;
+
+	for (i = 0; s->bus != NULL && i < s->cfg.num_bus; i++) {
+		if (s->bus[i].cp_ctx != NULL) {
+			osdp_cp_teardown(s->bus[i].cp_ctx);
+		}
+		sim_stream_free(&s->bus[i].rx);
+	}
+	for (i = 0; s->pd != NULL && i < s->num_pd; i++) {
+		if (s->pd[i].ctx != NULL) {
+			osdp_pd_teardown(s->pd[i].ctx);
+		}
+		sim_stream_free(&s->pd[i].rx);
+	}
+	osdp_set_time_source(NULL, NULL);
+	free(s->bus);
+	free(s->pd);
+	free(s->read_tstamp);
+	free(s->read_latency);
+	free(s);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _OSDP_SIM_H_
+#define _OSDP_SIM_H_
+
+#include <stdint.h>
+#include "osdp_common.h"
+
+/**
+ * A discrete-event simulator of RS-485 buses. Each bus has one CP context
+ * and up to 126 PD contexts whose channels model byte time at the configured
+ * baud rate (8N1), the reply turnaround, inter-byte gaps and line noise.
+ * LibOSDP runs on the simulator's virtual clock, which jumps from one event
+ * (a transmission landing, a CP timer, a card read) to the next so that long
+ * stretches of bus traffic can be simulated in a fraction of the time.
+ *
+ * The time source of LibOSDP is global so only one simulator can exist at a
+ * time.
+ */
+
+struct sim_config {
+	int num_bus;
+	int pd_per_bus;			/* at most 126 */
+	int baud_rate;
+	int turnaround_us;		/* line turnaround before each frame */
+	int inter_byte_gap_us;
+	int noise_ppm;			/* chance of a bit flip in each byte */
+	int drop_ppm;			/* chance of losing a whole frame */
+	int card_reads_per_sec;		/* across all PDs; 0 to disable */
+	int sc;				/* let PDs negotiate secure channel */
+	uint32_t seed;
+};
+
+struct sim_report {
+	int64_t elapsed_us;		/* virtual time simulated */
+	double bus_utilization;		/* mean over buses; 0.0 to 1.0 */
+	uint64_t bytes;			/* on all buses, both directions */
+	uint32_t bytes_corrupted;
+	uint32_t frames_dropped;
+	uint32_t card_reads;		/* accepted by the PDs */
+	uint32_t card_reads_delivered;	/* reported by the CP */
+	int64_t read_latency_p50_us;	/* card read to CP event callback */
+	int64_t read_latency_p99_us;
+	int64_t read_latency_max_us;
+	int64_t all_online_us;		/* since sim_create(); -1 if never */
+	uint32_t offline_events;	/* PD online -> offline at the CP */
+	int64_t detect_max_us;		/* PD down -> offline at the CP */
+	int64_t recovery_avg_us;	/* PD up -> online at the CP */
+	int64_t recovery_max_us;
+	uint32_t num_recoveries;
+};
+
+struct sim;
+
+struct sim *sim_create(const struct sim_config *cfg);
+void sim_destroy(struct sim *s);
+
+/**
+ * Advance the virtual clock by `duration_us`, running CP and PD state
+ * machines as the events come due.
+ */
+void sim_run(struct sim *s, int64_t duration_us);
+
+/**
+ * Run until all PDs are online at the CP or `timeout_us` elapses.
+ *
+ * @retval 0 when all PDs are online; -1 on timeout
+ */
+int sim_run_until_online(struct sim *s, int64_t timeout_us);
+
+/**
+ * Report a card read on PD `pd` (0 to num_bus * pd_per_bus - 1) now.
+ *
+ * @retval 0 on success; -1 if the PD is down or its event queue is full
+ */
+int sim_card_read(struct sim *s, int pd);
+
+/**
+ * Power a PD off (it stops answering and loses its state) or back on.
+ */
+void sim_pd_set_down(struct sim *s, int pd, int down);
+
+int sim_pd_is_online(struct sim *s, int pd);
+int64_t sim_now_us(struct sim *s);
+void sim_get_report(struct sim *s, struct sim_report *r);
+
+#endif /* _OSDP_SIM_H_ */
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <osdp.h>
+#include "test.h"
+
+#define TEST_CAPTURE_MAX_STEPS          20000
+
+struct test_capture {
+	struct test_loopback lb;
+	int num_events;
+	int num_replay_events;
+	char cp_path[64];
+	char pd_path[64];
+} test_capture_data;
+
+int test_capture_event(void *arg, int address, struct osdp_event *ev)
+{
+	int *count = arg;
+
+	ARG_UNUSED(address);
+
+	if (ev->type == OSDP_EVENT_KEYPRESS && ev->keypress.length == 4 &&
+	    ev->keypress.data[3] == 0x44) {
+		(*count)++;
+	}
+	return 0;
+}
+
+static int test_capture_mktemp(char *path, int len, const char *name)
+{
+	int fd;
+
+	snprintf(path, len, "/tmp/osdp-%s-XXXXXX", name);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+int test_capture_setup(struct test *t)
+{
+	struct test_capture *c = &test_capture_data;
+	osdp_pd_info_t info_pd;
+
+	memset(c, 0, sizeof(struct test_capture));
+	memset(&info_pd, 0, sizeof(info_pd));
+	if (test_loopback_setup(&c->lb, 1, TEST_LOOPBACK_VTIME, &info_pd)) {
+		return -1;
+	}
+	/* keep the traffic in plain text so all of it can be replayed */
+	TO_PD(c->lb.pd_ctx[0], 0)->cap[OSDP_PD_CAP_COMMUNICATION_SECURITY]
+		.compliance_level = 0;
+	osdp_cp_set_event_callback(c->lb.cp_ctx, test_capture_event,
+				   &c->num_events);
+
+	if (test_capture_mktemp(c->cp_path, sizeof(c->cp_path), "cp") ||
+	    test_capture_mktemp(c->pd_path, sizeof(c->pd_path), "pd") ||
+	    osdp_capture_start(c->lb.cp_ctx, c->cp_path) ||
+	    osdp_capture_start(c->lb.pd_ctx[0], c->pd_path)) {
+		printf("   capture start failed!\n");
+		return -1;
+	}
+	osdp_set_log_level(LOG_INFO);
+	t->mock_data = c;
+	return 0;
+}
+
+void test_capture_teardown(struct test *t)
+{
+	struct test_capture *c = t->mock_data;
+
+	test_loopback_teardown(&c->lb);
+	unlink(c->cp_path);
+	unlink(c->pd_path);
+}
+
+static int test_capture_online(void *arg)
+{
+	struct test_capture *c = arg;
+
+	return osdp_get_status_mask(c->lb.cp_ctx) == 0x01;
+}
+
+static int test_capture_got_event(void *arg)
+{
+	struct test_capture *c = arg;
+
+	return c->num_events == 1;
+}
+
+void run_capture_tests(struct test *t)
+{
+	int result = false;
+	struct test_capture *c;
+	struct osdp_stats cp_stats, pd_stats;
+	struct osdp_replay_stats rs;
+	struct osdp_event ev = {
+		.type = OSDP_EVENT_KEYPRESS,
+		.keypress = {
+			.length = 4,
+			.data = { 0x11, 0x22, 0x33, 0x44 },
+		},
+	};
+
+	printf("\nStarting packet capture tests\n");
+
+	if (test_capture_setup(t))
+		return;
+
+	c = t->mock_data;
+
+	if (test_loopback_run(&c->lb, test_capture_online, c,
+			      TEST_CAPTURE_MAX_STEPS)) {
+		printf("    -- PD did not come online\n");
+		goto out;
+	}
+	osdp_pd_notify_event(c->lb.pd_ctx[0], &ev);
+	if (test_loopback_run(&c->lb, test_capture_got_event, c,
+			      TEST_CAPTURE_MAX_STEPS)) {
+		printf("    -- CP did not get the event\n");
+		goto out;
+	}
+	osdp_capture_stop(c->lb.cp_ctx);
+	osdp_capture_stop(c->lb.pd_ctx[0]);
+	osdp_get_stats(c->lb.cp_ctx, 0, &cp_stats);
+	osdp_get_stats(c->lb.pd_ctx[0], 0, &pd_stats);
+
+	printf("    -- replaying CP capture\n");
+	if (osdp_capture_replay(c->cp_path, test_capture_event,
+				&c->num_replay_events, &rs)) {
+		printf("    -- CP replay failed\n");
+		goto out;
+	}
+	if (rs.records < cp_stats.tx_frames + cp_stats.rx_frames ||
+	    rs.frames != cp_stats.rx_frames || rs.errors != 0 ||
+	    c->num_replay_events != 1) {
+		printf("    -- CP replay: %u records %u/%u frames %u errors "
+		       "%d events\n", rs.records, rs.frames,
+		       cp_stats.rx_frames, rs.errors, c->num_replay_events);
+		goto out;
+	}
+
+	printf("    -- replaying PD capture\n");
+	if (osdp_capture_replay(c->pd_path, NULL, NULL, &rs)) {
+		printf("    -- PD replay failed\n");
+		goto out;
+	}
+	if (rs.frames != pd_stats.rx_frames || rs.errors != 0) {
+		printf("    -- PD replay: %u/%u frames %u errors\n",
+		       rs.frames, pd_stats.rx_frames, rs.errors);
+		goto out;
+	}
+	result = true;
+out:
+	TEST_REPORT(t, result);
+	test_capture_teardown(t);
+}
@@ -0,0 +1,606 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <osdp.h>
+#include "test.h"
+
+#define TEST_BUS_NUM_PD                 2
+#define TEST_BUS_NUM_CMDS               8
+#define TEST_BUS_MAX_STEPS              20000
+
+/* all PDs on one multi-drop channel */
+struct test_bus {
+	struct test_loopback lb;
+	int order[TEST_BUS_NUM_PD * TEST_BUS_NUM_CMDS];
+	int num_cmds;
+	int num_status_changes[TEST_BUS_NUM_PD];
+	enum osdp_pd_status_e status[TEST_BUS_NUM_PD];
+	enum osdp_pd_status_reason_e status_reason[TEST_BUS_NUM_PD];
+	bool status_mismatch;
+	int num_received[TEST_BUS_NUM_PD];
+	int num_sent;
+	int num_queue_high;
+	int num_queue_low;
+	int last_color[TEST_BUS_NUM_PD];	/* of permanent LED state */
+	int output_at[TEST_BUS_NUM_PD];	/* LEDs received before an output */
+	int output_codes[TEST_BUS_NUM_CMDS];	/* as received by PD[0] */
+	int num_outputs;
+	int num_completions[OSDP_CMD_RESULT_COALESCED + 1];
+	struct osdp_cmd_completion completion[TEST_BUS_NUM_CMDS];
+} test_bus_data;
+
+int test_bus_pd_command(void *arg, int address, struct osdp_cmd *cmd)
+{
+	struct test_bus *b = &test_bus_data;
+
+	ARG_UNUSED(address);
+
+	if (cmd->id == OSDP_CMD_OUTPUT) {
+		b->output_at[(int)(long)arg] = b->num_received[(int)(long)arg];
+		if ((int)(long)arg == 0 && b->num_outputs < TEST_BUS_NUM_CMDS) {
+			b->output_codes[b->num_outputs++] =
+				cmd->output.control_code;
+		}
+	}
+	if (cmd->id == OSDP_CMD_BUZZER) {
+		return -1; /* NAK */
+	}
+	if (cmd->id != OSDP_CMD_LED) {
+		return 0;
+	}
+	b->num_received[(int)(long)arg]++;
+	b->last_color[(int)(long)arg] = cmd->led.permanent.on_color;
+	if (b->num_cmds < TEST_BUS_NUM_PD * TEST_BUS_NUM_CMDS) {
+		b->order[b->num_cmds++] = (int)(long)arg;
+	}
+	return 0;
+}
+
+void test_bus_cp_status(void *arg, int pd, enum osdp_pd_status_e old_status,
+			enum osdp_pd_status_e new_status,
+			enum osdp_pd_status_reason_e reason)
+{
+	struct test_bus *b = arg;
+
+	if (old_status != b->status[pd]) {
+		b->status_mismatch = true;
+	}
+	b->num_status_changes[pd]++;
+	b->status[pd] = new_status;
+	b->status_reason[pd] = reason;
+}
+
+void test_bus_cp_queue(void *arg, int pd, int depth, int high)
+{
+	struct test_bus *b = arg;
+
+	ARG_UNUSED(depth);
+
+	if (pd == 0 && high) {
+		b->num_queue_high++;
+	} else if (pd == 0) {
+		b->num_queue_low++;
+	}
+}
+
+void test_bus_cp_completion(void *arg, int pd, struct osdp_cmd_completion *c)
+{
+	struct test_bus *b = arg;
+
+	if (pd == 0 && c->tag < TEST_BUS_NUM_CMDS) {
+		b->num_completions[c->result]++;
+		b->completion[c->tag] = *c;
+	}
+}
+
+int test_bus_setup(struct test *t)
+{
+	int i;
+	struct test_bus *b = &test_bus_data;
+	struct osdp_pd_cap cap[] = {
+		{
+			.function_code = OSDP_PD_CAP_READER_LED_CONTROL,
+			.compliance_level = 1,
+			.num_items = 1
+		},
+		{ -1, 0, 0 }
+	};
+	osdp_pd_info_t info_pd = {
+		.cap = cap,
+	};
+
+	memset(b, 0, sizeof(struct test_bus));
+	if (test_loopback_setup(&b->lb, TEST_BUS_NUM_PD,
+				TEST_LOOPBACK_MULTI_DROP | TEST_LOOPBACK_VTIME,
+				&info_pd)) {
+		return -1;
+	}
+	osdp_cp_set_status_callback(b->lb.cp_ctx, test_bus_cp_status, b);
+	for (i = 0; i < TEST_BUS_NUM_PD; i++) {
+		osdp_pd_set_command_callback(b->lb.pd_ctx[i],
+					     test_bus_pd_command,
+					     (void *)(long)i);
+	}
+	osdp_set_log_level(LOG_INFO);
+	t->mock_data = b;
+	return 0;
+}
+
+void test_bus_teardown(struct test *t)
+{
+	struct test_bus *b = t->mock_data;
+
+	test_loopback_teardown(&b->lb);
+}
+
+static int test_bus_run(struct test_bus *b, int (*done)(void *arg),
+			int max_steps)
+{
+	return test_loopback_run(&b->lb, done, b, max_steps);
+}
+
+static int test_bus_online(void *arg)
+{
+	struct test_bus *b = arg;
+	uint64_t map[1];
+
+	return osdp_get_status_mask(b->lb.cp_ctx) == 0x03 &&
+	       osdp_get_status_bitmap(b->lb.cp_ctx, map, 1) == 2 && map[0] == 3;
+}
+
+static int test_bus_delivered(void *arg)
+{
+	struct test_bus *b = arg;
+	return b->num_cmds == TEST_BUS_NUM_PD * TEST_BUS_NUM_CMDS;
+}
+
+static int test_bus_pd1_offline(void *arg)
+{
+	struct test_bus *b = arg;
+	return osdp_get_status_mask(b->lb.cp_ctx) == 0x01;
+}
+
+static int test_bus_pd0_drained(void *arg)
+{
+	struct test_bus *b = arg;
+	return b->num_received[0] == b->num_sent;
+}
+
+static int test_bus_never(void *arg)
+{
+	ARG_UNUSED(arg);
+	return false;
+}
+
+/* longest streak of commands delivered to the same PD */
+static int test_bus_max_streak(struct test_bus *b)
+{
+	int i, run = 1, max = 1;
+
+	for (i = 1; i < b->num_cmds; i++) {
+		run = (b->order[i] == b->order[i - 1]) ? run + 1 : 1;
+		if (run > max) {
+			max = run;
+		}
+	}
+	return max;
+}
+
+/**
+ * Both PDs share one bus: they come online, take turns sending commands, and
+ * a PD that replies late goes offline without taking the other one with it.
+ * Only one command is on the wire at a time.
+ */
+static int test_bus_shared(struct test_bus *b)
+{
+	int i, j;
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_LED,
+		.led = { .led_number = 1 },
+	};
+
+	if (TO_CP(b->lb.cp_ctx)->num_bus != 1) {
+		printf("    -- PDs on the same channel are not on one bus\n");
+		return -1;
+	}
+
+	if (test_bus_run(b, test_bus_online, TEST_BUS_MAX_STEPS)) {
+		printf("    -- PDs did not come online\n");
+		return -1;
+	}
+	for (i = 0; i < TEST_BUS_NUM_PD; i++) {
+		if (b->num_status_changes[i] != 1 ||
+		    b->status[i] == OSDP_PD_STATUS_OFFLINE ||
+		    b->status_reason[i] != OSDP_PD_STATUS_REASON_CONNECTED) {
+			printf("    -- bad status callbacks for PD[%d]\n", i);
+			return -1;
+		}
+	}
+
+	printf("    -- queueing %d commands to each PD\n", TEST_BUS_NUM_CMDS);
+	for (i = 0; i < TEST_BUS_NUM_CMDS; i++) {
+		for (j = 0; j < TEST_BUS_NUM_PD; j++) {
+			osdp_cp_send_command(b->lb.cp_ctx, j, &cmd);
+		}
+	}
+	if (test_bus_run(b, test_bus_delivered, TEST_BUS_MAX_STEPS)) {
+		printf("    -- only %d commands delivered\n", b->num_cmds);
+		return -1;
+	}
+	if (test_bus_max_streak(b) > 2) {
+		printf("    -- unfair scheduling; streak of %d\n",
+		       test_bus_max_streak(b));
+		return -1;
+	}
+
+	printf("    -- stalling PD[1] so that it replies late\n");
+	b->lb.stalled_pd = 1;
+	if (test_bus_run(b, test_bus_pd1_offline, TEST_BUS_MAX_STEPS)) {
+		printf("    -- PD[1] did not time out\n");
+		return -1;
+	}
+	b->lb.stalled_pd = -1;
+	test_bus_run(b, test_bus_never, 10 * OSDP_PD_POLL_TIMEOUT_MS);
+	if (!test_bus_pd1_offline(b)) {
+		printf("    -- late reply from PD[1] took PD[0] offline\n");
+		return -1;
+	}
+	if (b->status_mismatch ||
+	    b->num_status_changes[0] != 1 || b->num_status_changes[1] != 2 ||
+	    b->status[1] != OSDP_PD_STATUS_OFFLINE ||
+	    b->status_reason[1] != OSDP_PD_STATUS_REASON_LINK_ERROR) {
+		printf("    -- bad status callbacks after PD[1] went offline\n");
+		return -1;
+	}
+
+	if (b->lb.max_in_flight != 1) {
+		printf("    -- %d commands were in flight at once\n",
+		       b->lb.max_in_flight);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Queue commands for PD[0] in one burst, with no refresh in between; only
+ * OSDP_CP_CMD_POOL_SIZE of them fit in the ingress queue. Then keep sending,
+ * refreshing whenever told to back off; all of them up to
+ * OSDP_CP_CMD_POOL_MAX must be taken (the queue growing on the way, with
+ * watermark callbacks) and then delivered.
+ */
+static int test_bus_backlog(struct test_bus *b)
+{
+	int ret;
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_LED,
+		.led = { .led_number = 1 },
+	};
+
+	osdp_cp_set_queue_watermarks(b->lb.cp_ctx, 64, 8, test_bus_cp_queue, b);
+	b->num_received[0] = 0;
+	b->num_sent = 0;
+	while ((ret = osdp_cp_send_command(b->lb.cp_ctx, 0, &cmd)) == 0) {
+		b->num_sent++;
+	}
+	if (ret != OSDP_ERR_WOULD_BLOCK ||
+	    b->num_sent != OSDP_CP_CMD_POOL_SIZE) {
+		printf("    -- burst stopped at %d commands (%d)\n",
+		       b->num_sent, ret);
+		return -1;
+	}
+	while (osdp_cp_get_queue_depth(b->lb.cp_ctx, 0) <
+	       OSDP_CP_CMD_POOL_MAX) {
+		ret = osdp_cp_send_command(b->lb.cp_ctx, 0, &cmd);
+		if (ret == 0) {
+			b->num_sent++;
+		} else if (ret == OSDP_ERR_WOULD_BLOCK) {
+			test_bus_run(b, test_bus_never, 1);
+		} else {
+			printf("    -- send failed after %d commands (%d)\n",
+			       b->num_sent, ret);
+			return -1;
+		}
+	}
+	test_bus_run(b, test_bus_never, 1);
+	if (TO_PD(b->lb.cp_ctx, 0)->cmd.pool.num_blocks <=
+	    OSDP_CP_CMD_POOL_SIZE) {
+		printf("    -- command queue did not grow to its cap\n");
+		return -1;
+	}
+	if (test_bus_run(b, test_bus_pd0_drained, 4 * TEST_BUS_MAX_STEPS)) {
+		printf("    -- only %d/%d queued commands delivered\n",
+		       b->num_received[0], b->num_sent);
+		return -1;
+	}
+	if (b->num_queue_high != 1 || b->num_queue_low != 1 ||
+	    osdp_cp_get_queue_depth(b->lb.cp_ctx, 0) != 0) {
+		printf("    -- bad queue watermark callbacks: %d high %d low\n",
+		       b->num_queue_high, b->num_queue_low);
+		return -1;
+	}
+	printf("    -- %d commands delivered through a backlog\n",
+	       b->num_sent);
+	return 0;
+}
+
+/**
+ * With coalescing, a burst of updates to the same LED goes out as just the
+ * last one; updates to another LED are not affected.
+ */
+static int test_bus_coalesce(struct test_bus *b)
+{
+	int i;
+	struct osdp_stats stats;
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_LED,
+		.led = {
+			.led_number = 1,
+			.permanent = { .control_code = 1 },
+		},
+	};
+
+	osdp_cp_set_command_coalescing(b->lb.cp_ctx, 1);
+	osdp_reset_stats(b->lb.cp_ctx, 0);
+	b->num_received[0] = 0;
+	b->num_sent = 0;
+	for (i = 0; i < 10; i++) {
+		cmd.led.permanent.on_color = i;
+		if (osdp_cp_send_command(b->lb.cp_ctx, 0, &cmd) == 0) {
+			b->num_sent++;
+		}
+	}
+	cmd.led.led_number = 2;
+	osdp_cp_send_command(b->lb.cp_ctx, 0, &cmd);
+	b->num_sent = 2;
+	if (test_bus_run(b, test_bus_pd0_drained, TEST_BUS_MAX_STEPS)) {
+		printf("    -- %d LED commands delivered\n", b->num_received[0]);
+		return -1;
+	}
+	test_bus_run(b, test_bus_never, 10 * OSDP_PD_POLL_TIMEOUT_MS);
+	osdp_get_stats(b->lb.cp_ctx, 0, &stats);
+	osdp_cp_set_command_coalescing(b->lb.cp_ctx, 0);
+	if (b->num_received[0] != 2 || stats.coalesced != 9 ||
+	    osdp_cp_get_queue_depth(b->lb.cp_ctx, 0) != 0) {
+		printf("    -- coalescing failed: %d sent; %u coalesced\n",
+		       b->num_received[0], stats.coalesced);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Output commands are coalesced like LED states: a permanent state that lets
+ * a timed operation complete (3/4) must not replace a pulse (5/6) queued
+ * before it, but one that aborts it (1/2) replaces both.
+ */
+static int test_bus_coalesce_output(struct test_bus *b)
+{
+	int ret = -1;
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_OUTPUT,
+		.output = { .output_no = 1 },
+	};
+
+	osdp_cp_set_command_coalescing(b->lb.cp_ctx, 1);
+	b->num_outputs = 0;
+	cmd.output.control_code = 5;
+	cmd.output.timer_count = 10;
+	osdp_cp_send_command(b->lb.cp_ctx, 0, &cmd);
+	cmd.output.control_code = 4;
+	cmd.output.timer_count = 0;
+	osdp_cp_send_command(b->lb.cp_ctx, 0, &cmd);
+	test_bus_run(b, test_bus_never, 10 * OSDP_PD_POLL_TIMEOUT_MS);
+	if (b->num_outputs != 2 || b->output_codes[0] != 5 ||
+	    b->output_codes[1] != 4) {
+		printf("    -- pulse then permanent: %d outputs sent\n",
+		       b->num_outputs);
+		goto out;
+	}
+
+	b->num_outputs = 0;
+	cmd.output.control_code = 5;
+	cmd.output.timer_count = 10;
+	osdp_cp_send_command(b->lb.cp_ctx, 0, &cmd);
+	cmd.output.control_code = 4;
+	cmd.output.timer_count = 0;
+	osdp_cp_send_command(b->lb.cp_ctx, 0, &cmd);
+	cmd.output.control_code = 1;
+	osdp_cp_send_command(b->lb.cp_ctx, 0, &cmd);
+	test_bus_run(b, test_bus_never, 10 * OSDP_PD_POLL_TIMEOUT_MS);
+	if (b->num_outputs != 2 || b->output_codes[0] != 5 ||
+	    b->output_codes[1] != 1) {
+		printf("    -- pulse, permanent, abort: %d outputs sent\n",
+		       b->num_outputs);
+		goto out;
+	}
+	ret = 0;
+out:
+	osdp_cp_set_command_coalescing(b->lb.cp_ctx, 0);
+	return ret;
+}
+
+/**
+ * An output command queued behind a burst of LED commands goes out first;
+ * commands that can't make their deadline are dropped.
+ */
+static int test_bus_priority(struct test_bus *b)
+{
+	int i;
+	struct osdp_stats stats;
+	struct osdp_cmd led = {
+		.id = OSDP_CMD_LED,
+		.led = { .led_number = 1 },
+	};
+	struct osdp_cmd output = {
+		.id = OSDP_CMD_OUTPUT,
+		.output = { .output_no = 0, .control_code = 1 },
+	};
+
+	b->num_received[0] = 0;
+	b->num_sent = 6;
+	b->output_at[0] = -1;
+	for (i = 0; i < b->num_sent; i++) {
+		osdp_cp_send_command(b->lb.cp_ctx, 0, &led);
+	}
+	osdp_cp_send_command(b->lb.cp_ctx, 0, &output);
+	if (test_bus_run(b, test_bus_pd0_drained, TEST_BUS_MAX_STEPS) ||
+	    b->output_at[0] < 0 || b->output_at[0] > 1) {
+		printf("    -- output sent after %d LED commands\n",
+		       b->output_at[0]);
+		return -1;
+	}
+
+	/* a command and its reply take more than one step (1ms) here */
+	led.deadline_ms = 1;
+	osdp_reset_stats(b->lb.cp_ctx, 0);
+	b->num_received[0] = 0;
+	for (i = 0; i < 6; i++) {
+		osdp_cp_send_command(b->lb.cp_ctx, 0, &led);
+	}
+	test_bus_run(b, test_bus_never, 10 * OSDP_PD_POLL_TIMEOUT_MS);
+	osdp_get_stats(b->lb.cp_ctx, 0, &stats);
+	if (b->num_received[0] > 2 || b->num_received[0] + stats.expired != 6 ||
+	    osdp_cp_get_queue_depth(b->lb.cp_ctx, 0) != 0) {
+		printf("    -- %d sent and %u expired of 6 with deadlines\n",
+		       b->num_received[0], stats.expired);
+		return -1;
+	}
+	return 0;
+}
+
+static int test_bus_completed(void *arg)
+{
+	struct test_bus *b = arg;
+	int i, n = 0;
+
+	for (i = 0; i <= OSDP_CMD_RESULT_COALESCED; i++) {
+		n += b->num_completions[i];
+	}
+	return n == 5;
+}
+
+/**
+ * Each command that the application sends completes exactly once, with the
+ * tag it was sent with: whether the PD replied, or why it wasn't sent. The
+ * commands are sent a little ahead of the clock that the CP has cached (as
+ * when a worker reads it just before they come in); their latency must still
+ * not go negative.
+ */
+static int test_bus_completion(struct test_bus *b)
+{
+	struct osdp_cmd_completion *c = b->completion;
+	struct osdp_cmd led = {
+		.id = OSDP_CMD_LED,
+		.led = {
+			.led_number = 1,
+			.permanent = { .control_code = 1 },
+		},
+		.tag = 1,
+	};
+	struct osdp_cmd buzzer = {
+		.id = OSDP_CMD_BUZZER,
+		.tag = 2,
+	};
+
+	osdp_cp_set_completion_callback(b->lb.cp_ctx, test_bus_cp_completion,
+					b);
+	osdp_cp_set_command_coalescing(b->lb.cp_ctx, 1);
+	b->lb.vtime += 5;
+	osdp_cp_send_command(b->lb.cp_ctx, 0, &led);
+	osdp_cp_send_command(b->lb.cp_ctx, 0, &buzzer);
+	led.tag = 3;
+	osdp_cp_send_command(b->lb.cp_ctx, 0, &led);
+	led.tag = 4;
+	led.led.led_number = 2;
+	led.deadline_ms = 1;
+	osdp_cp_send_command(b->lb.cp_ctx, 0, &led);
+	led.tag = 5;
+	led.led.led_number = 3;
+	led.deadline_ms = 0;
+	osdp_cp_send_command(b->lb.cp_ctx, 0, &led);
+	b->lb.vtime -= 5;
+	test_bus_run(b, test_bus_completed, TEST_BUS_MAX_STEPS);
+	osdp_cp_set_command_coalescing(b->lb.cp_ctx, 0);
+	osdp_cp_set_completion_callback(b->lb.cp_ctx, NULL, NULL);
+
+	/* LED 2 expires while LED 1 and the buzzer go out ahead of it */
+	if (!test_bus_completed(b) ||
+	    b->num_completions[OSDP_CMD_RESULT_ACK] != 2 ||
+	    c[1].result != OSDP_CMD_RESULT_COALESCED || c[1].latency_ms > 5 ||
+	    c[2].result != OSDP_CMD_RESULT_NAK ||
+	    c[2].nak_code != OSDP_PD_NAK_RECORD ||
+	    c[3].result != OSDP_CMD_RESULT_ACK || c[3].latency_ms == 0 ||
+	    c[4].result != OSDP_CMD_RESULT_EXPIRED ||
+	    c[5].result != OSDP_CMD_RESULT_ACK ||
+	    c[5].latency_ms < c[3].latency_ms) {
+		printf("    -- bad command completions\n");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Move both PDs to new addresses and a faster baud rate with COMSET; the CP
+ * must keep polling them (at the new addresses) and tighten the poll gap.
+ */
+static int test_bus_comset(struct test_bus *b)
+{
+	int i;
+	struct osdp_bus *bus = TO_PD(b->lb.cp_ctx, 0)->bus;
+	struct osdp_stats stats[TEST_BUS_NUM_PD];
+	int64_t poll_gap_us;
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_COMSET,
+		.comset = { .baud_rate = 38400 },
+	};
+
+	if (test_bus_run(b, test_bus_online, TEST_BUS_MAX_STEPS)) {
+		printf("    -- PDs did not come back online\n");
+		return -1;
+	}
+	poll_gap_us = bus->poll_gap_us;
+	for (i = 0; i < TEST_BUS_NUM_PD; i++) {
+		osdp_reset_stats(b->lb.cp_ctx, i);
+		cmd.comset.address = 111 + i;
+		osdp_cp_send_command(b->lb.cp_ctx, i, &cmd);
+	}
+	/* long enough for a PD that isn't answering to go offline */
+	test_bus_run(b, test_bus_never, 2 * OSDP_CP_BACKOFF_MIN_MS);
+	for (i = 0; i < TEST_BUS_NUM_PD; i++) {
+		osdp_get_stats(b->lb.cp_ctx, i, &stats[i]);
+	}
+	if (!test_bus_online(b) || stats[0].offline || stats[1].offline ||
+	    TO_PD(b->lb.cp_ctx, 0)->address != 111 ||
+	    TO_PD(b->lb.cp_ctx, 1)->address != 112 ||
+	    TO_PD(b->lb.pd_ctx[1], 0)->address != 112) {
+		printf("    -- PDs lost after COMSET\n");
+		return -1;
+	}
+	if (bus->poll_gap_us != poll_gap_us / 4) {
+		printf("    -- poll gap %lld us after COMSET; was %lld us\n",
+		       (long long)bus->poll_gap_us, (long long)poll_gap_us);
+		return -1;
+	}
+	return 0;
+}
+
+void run_cp_bus_tests(struct test *t)
+{
+	printf("\nStarting CP multi-drop bus tests\n");
+
+	if (test_bus_setup(t))
+		return;
+
+	DO_TEST(t, test_bus_shared);
+	DO_TEST(t, test_bus_backlog);
+	DO_TEST(t, test_bus_coalesce);
+	DO_TEST(t, test_bus_coalesce_output);
+	DO_TEST(t, test_bus_priority);
+	DO_TEST(t, test_bus_completion);
+	DO_TEST(t, test_bus_comset);
+
+	test_bus_teardown(t);
+}
@@ -47,6 +47,9 @@ int test_cp_fsm_receive(void *data, uint8_t *buf, int len)
 	uint8_t resp_ack[] = {
 		0xff, 0x53, 0xe5, 0x08, 0x00, 0x06, 0x40, 0xb0, 0xf0
 	};
+	uint8_t resp_busy[] = {
+		0xff, 0x53, 0xe5, 0x08, 0x00, 0x06, 0x79, 0xca, 0x57
+	};
 
 	ARG_UNUSED(len);
 
@@ -60,6 +63,9 @@ int test_cp_fsm_receive(void *data, uint8_t *buf, int len)
 	case 3:
 		memcpy(buf, resp_cap, sizeof(resp_cap));
 		return sizeof(resp_cap);
+	case 4:
+		memcpy(buf, resp_busy, sizeof(resp_busy));
+		return sizeof(resp_busy);
 	}
 	return -1;
 }
@@ -93,6 +99,182 @@ void test_cp_fsm_teardown(struct test *t)
 	osdp_cp_teardown(t->mock_data);
 }
 
+static int64_t test_cp_fsm_vtime;
+
+static int64_t test_cp_fsm_millis(void *arg)
+{
+	ARG_UNUSED(arg);
+
+	return test_cp_fsm_vtime;
+}
+
+int test_cp_fsm_deadline(struct osdp *ctx)
+{
+	int timeout, count = 0, ret = false;
+	queue_node_t *node;
+	uint64_t map[1];
+	struct osdp_cmd cmd = { .id = OSDP_CMD_BUZZER };
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+
+	if (pd->state != OSDP_CP_STATE_ONLINE) {
+		printf("    -- PD not online\n");
+		return false;
+	}
+
+	/*
+	 * Freeze the clock where it is (timestamps taken so far stay valid) so
+	 * that no new POLL falls due on the way.
+	 */
+	test_cp_fsm_vtime = osdp_millis_now();
+	osdp_set_time_source(test_cp_fsm_millis, NULL);
+
+	/* state_update() may have stopped with a POLL still queued */
+	while (queue_peek_first(&pd->cmd.queue, &node) == 0 && count++ < 8) {
+		test_state_update(pd);
+	}
+
+	/* idle and online; next work is the POLL */
+	pd->phy_state = OSDP_CP_PHY_STATE_IDLE;
+	CLEAR_FLAG(pd, PD_FLAG_AWAIT_RESP);
+	pd->tstamp = test_cp_fsm_vtime;
+	timeout = osdp_cp_next_deadline(ctx);
+	if (timeout != OSDP_PD_POLL_TIMEOUT_MS) {
+		printf("    -- bad poll deadline %d\n", timeout);
+		goto out;
+	}
+
+	/* a queued command must be sent right away */
+	if (osdp_cp_send_command(ctx, 0, &cmd) ||
+	    osdp_cp_next_deadline(ctx) != 0) {
+		printf("    -- queued command not due\n");
+		goto out;
+	}
+
+	/* sent; due at response timeout and the PD is awaiting a reply */
+	test_fsm_resp = 0;
+	osdp_cp_notify_readable(ctx, 0);
+	timeout = osdp_cp_next_deadline(ctx);
+	if (pd->phy_state != OSDP_CP_PHY_STATE_REPLY_WAIT ||
+	    osdp_cp_get_rx_wait_bitmap(ctx, map, 1) != 1 || map[0] != 1 ||
+	    timeout != OSDP_RESP_TOUT_MS + 1) {
+		printf("    -- bad reply wait deadline %d\n", timeout);
+		goto out;
+	}
+	ret = true;
+out:
+	osdp_set_time_source(NULL, NULL);
+	return ret;
+}
+
+int test_cp_fsm_time_source(struct osdp *ctx)
+{
+	int ret = false;
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+
+	test_cp_fsm_vtime = 1000000;
+	osdp_set_time_source(test_cp_fsm_millis, NULL);
+
+	/* POLL was just sent; nothing to do until virtual time moves */
+	osdp_cp_refresh(ctx);
+	pd->phy_state = OSDP_CP_PHY_STATE_IDLE;
+	CLEAR_FLAG(pd, PD_FLAG_AWAIT_RESP);
+	pd->tstamp = test_cp_fsm_vtime;
+	if (osdp_cp_next_deadline(ctx) != OSDP_PD_POLL_TIMEOUT_MS) {
+		printf("    -- deadline not in virtual time\n");
+		goto out;
+	}
+	test_cp_fsm_vtime += OSDP_PD_POLL_TIMEOUT_MS;
+	if (osdp_cp_next_deadline(ctx) != 0) {
+		printf("    -- virtual time did not advance\n");
+		goto out;
+	}
+	ret = true;
+out:
+	osdp_set_time_source(NULL, NULL);
+	return ret;
+}
+
+int test_cp_fsm_num_completions;
+enum osdp_cmd_result_e test_cp_fsm_result;
+
+void test_cp_fsm_completion(void *arg, int pd, struct osdp_cmd_completion *c)
+{
+	ARG_UNUSED(arg);
+	ARG_UNUSED(pd);
+
+	test_cp_fsm_num_completions++;
+	test_cp_fsm_result = c->result;
+}
+
+/**
+ * A PD that replies osdp_BUSY is sent the same command again a little later;
+ * the command completes as BUSY only once the CP runs out of retries.
+ */
+int test_cp_fsm_busy(struct osdp *ctx)
+{
+	int i, ret = false;
+	struct osdp_stats stats;
+	struct osdp_cmd cmd = { .id = OSDP_CMD_BUZZER };
+	struct osdp_pd *pd = GET_CURRENT_PD(ctx);
+
+	test_cp_fsm_vtime = osdp_millis_now();
+	osdp_set_time_source(test_cp_fsm_millis, NULL);
+	osdp_cp_set_completion_callback(ctx, test_cp_fsm_completion, NULL);
+	osdp_reset_stats(ctx, 0);
+	test_cp_fsm_num_completions = 0;
+	pd->tstamp = test_cp_fsm_vtime; /* no POLL on the way */
+
+	test_fsm_resp = 4;
+	osdp_cp_send_command(ctx, 0, &cmd);
+	test_state_update(pd); /* sent */
+	test_state_update(pd); /* busy */
+	if (pd->phy_state != OSDP_CP_PHY_STATE_WAIT ||
+	    test_cp_fsm_num_completions != 0 ||
+	    osdp_cp_next_deadline(ctx) != OSDP_CP_BUSY_RETRY_MS) {
+		printf("    -- not waiting to retry after busy\n");
+		goto out;
+	}
+	test_fsm_resp = 1;
+	test_cp_fsm_vtime += OSDP_CP_BUSY_RETRY_MS;
+	test_state_update(pd); /* sent again */
+	test_state_update(pd); /* acked */
+	osdp_get_stats(ctx, 0, &stats);
+	if (test_cp_fsm_num_completions != 1 ||
+	    test_cp_fsm_result != OSDP_CMD_RESULT_ACK ||
+	    stats.busy != 1 || stats.retries != 1) {
+		printf("    -- command not retried after busy\n");
+		goto out;
+	}
+
+	test_state_update(pd); /* clean up */
+	pd->tstamp = test_cp_fsm_vtime;
+	test_fsm_resp = 4;
+	test_cp_fsm_num_completions = 0;
+	osdp_cp_send_command(ctx, 0, &cmd);
+	for (i = 0; i < 4 * OSDP_CP_MAX_BUSY_RETRIES; i++) {
+		if (test_cp_fsm_num_completions) {
+			break;
+		}
+		test_state_update(pd);
+		test_cp_fsm_vtime += OSDP_CP_BUSY_RETRY_MS;
+	}
+	osdp_get_stats(ctx, 0, &stats);
+	if (test_cp_fsm_num_completions != 1 ||
+	    test_cp_fsm_result != OSDP_CMD_RESULT_BUSY ||
+	    stats.retries != 1 + OSDP_CP_MAX_BUSY_RETRIES ||
+	    pd->state != OSDP_CP_STATE_ONLINE) {
+		printf("    -- busy PD: %d completions, %u retries\n",
+		       test_cp_fsm_num_completions, stats.retries);
+		goto out;
+	}
+	ret = true;
+out:
+	test_fsm_resp = 0;
+	osdp_cp_set_completion_callback(ctx, NULL, NULL);
+	osdp_set_time_source(NULL, NULL);
+	return ret;
+}
+
 void run_cp_fsm_tests(struct test *t)
 {
 	int result = true;
@@ -121,6 +303,19 @@ void run_cp_fsm_tests(struct test *t)
 	}
 	printf("    -- state_update() complete\n");
 
+	if (result == true) {
+		printf("    -- checking osdp_cp_next_deadline()\n");
+		result = test_cp_fsm_deadline(ctx);
+	}
+	if (result == true) {
+		printf("    -- checking osdp_set_time_source()\n");
+		result = test_cp_fsm_time_source(ctx);
+	}
+	if (result == true) {
+		printf("    -- retrying a command the PD is busy for\n");
+		result = test_cp_fsm_busy(ctx);
+	}
+
 	TEST_REPORT(t, result);
 
 	test_cp_fsm_teardown(t);
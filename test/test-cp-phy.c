@@ -68,6 +68,33 @@ int test_cp_build_packet_id(struct osdp *ctx)
 	return 0;
 }
 
+int test_cp_poll_frame_cache(struct osdp *ctx)
+{
+	int seq, len, cached_len;
+	struct osdp_pd *p = GET_CURRENT_PD(ctx);
+	int saved_seq = p->seq_number;
+	uint8_t packet[512], cached[512];
+
+	printf("Testing osdp_phy_poll_frame() against cp_build_packet -- ");
+	for (seq = -1; seq <= 3; seq++) {
+		packet[0] = CMD_POLL;
+		p->seq_number = seq;
+		len = test_cp_build_packet(p, packet, 1, 512);
+		p->seq_number = seq;
+		cached_len = osdp_phy_poll_frame(p, cached, 512);
+		if (len < 0 || cached_len != len ||
+		    memcmp(packet, cached, len)) {
+			printf("error! mismatch at seq %d\n", seq + 1);
+			osdp_dump("  Expected: ", packet, len);
+			osdp_dump("  Got", cached, cached_len);
+			return -1;
+		}
+	}
+	p->seq_number = saved_seq;
+	printf("success!\n");
+	return 0;
+}
+
 int test_phy_decode_packet_ack(struct osdp *ctx)
 {
 	int len;
@@ -86,6 +113,72 @@ int test_phy_decode_packet_ack(struct osdp *ctx)
 	return 0;
 }
 
+int test_phy_check_packet_stream(struct osdp *ctx)
+{
+	int i, ret, len;
+	struct osdp_pd *p = GET_CURRENT_PD(ctx);
+	uint8_t stream[] = { 0x00, 0x53, 0xff, 0x00, /* line noise */
+		0xff, 0x53, 0xe5, 0x08, 0x00, 0x05, 0x40, 0xe3, 0xa5
+	};
+	uint8_t expected[] = { REPLY_ACK };
+
+	printf("Testing phy_check_packet(REPLY_ACK) -- ");
+	osdp_phy_rx_reset(p);
+	for (i = 0; i < (int)sizeof(stream); i++) {
+		p->rx_buf[p->rx_buf_len++] = stream[i];
+		ret = osdp_phy_check_packet(p);
+		if (i < (int)sizeof(stream) - 1 && ret != OSDP_ERR_PKT_WAIT) {
+			printf("early return %d at byte %d\n", ret, i);
+			return -1;
+		}
+	}
+	if (ret != 9) {
+		printf("bad frame length %d\n", ret);
+		return -1;
+	}
+	if ((len = osdp_phy_decode_packet(p, p->rx_buf, ret)) < 0) {
+		printf("decode failed\n");
+		return -1;
+	}
+	CHECK_ARRAY(p->rx_buf, len, expected);
+	osdp_phy_rx_reset(p);
+	printf("success!\n");
+	return 0;
+}
+
+int test_phy_check_packet_resync(struct osdp *ctx)
+{
+	int i, ret, len;
+	struct osdp_pd *p = GET_CURRENT_PD(ctx);
+	uint8_t stream[] = { 0xff, 0x53, 0xe5, 0x08, 0x00, /* stray header */
+		0xff, 0x53, 0xe5, 0x08, 0x00, 0x05, 0x40, 0xe3, 0xa5
+	};
+	uint8_t expected[] = { REPLY_ACK };
+
+	printf("Testing phy_check_packet(stray header) -- ");
+	osdp_phy_rx_reset(p);
+	for (i = 0; i < (int)sizeof(stream); i++) {
+		p->rx_buf[p->rx_buf_len++] = stream[i];
+		ret = osdp_phy_check_packet(p);
+		if (i < (int)sizeof(stream) - 1 && ret != OSDP_ERR_PKT_WAIT) {
+			printf("early return %d at byte %d\n", ret, i);
+			return -1;
+		}
+	}
+	if (ret != 9) {
+		printf("bad frame length %d\n", ret);
+		return -1;
+	}
+	if ((len = osdp_phy_decode_packet(p, p->rx_buf, ret)) < 0) {
+		printf("decode failed\n");
+		return -1;
+	}
+	CHECK_ARRAY(p->rx_buf, len, expected);
+	osdp_phy_rx_reset(p);
+	printf("success!\n");
+	return 0;
+}
+
 int test_cp_phy_setup(struct test *t)
 {
 	/* mock application data */
@@ -120,7 +213,10 @@ void run_cp_phy_tests(struct test *t)
 
 	DO_TEST(t, test_cp_build_packet_poll);
 	DO_TEST(t, test_cp_build_packet_id);
+	DO_TEST(t, test_cp_poll_frame_cache);
 	DO_TEST(t, test_phy_decode_packet_ack);
+	DO_TEST(t, test_phy_check_packet_stream);
+	DO_TEST(t, test_phy_check_packet_resync);
 
 	test_cp_phy_teardown(t);
 }
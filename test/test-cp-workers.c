@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <unistd.h>
+
+#include <osdp.h>
+#include "test.h"
+
+#ifdef CONFIG_OSDP_THREADED_CP
+
+#include <pthread.h>
+
+#define TEST_WORKERS_NUM_BUS            2
+#define TEST_WORKERS_NUM_PRODUCERS      2
+#define TEST_WORKERS_CMDS_PER_PRODUCER  8
+#define TEST_WORKERS_NUM_EVENTS         (OSDP_CP_EVENT_QUEUE_SIZE + 4)
+
+/* 5s of 200us steps */
+#define TEST_WORKERS_MAX_STEPS          25000
+
+/* one point-to-point bus between the CP and each PD */
+struct test_workers {
+	struct test_loopback lb;
+	int num_cmds[TEST_WORKERS_NUM_BUS];
+	int num_sent[TEST_WORKERS_NUM_BUS];
+	int num_events;
+	int num_online;			/* from status callbacks */
+	int num_acked;			/* from completion callbacks */
+	pthread_t app_thread;
+	bool foreign_callback;		/* a callback on another thread */
+} test_workers_data;
+
+int test_workers_pd_command(void *arg, int address, struct osdp_cmd *cmd)
+{
+	int *num_cmds = arg;
+
+	ARG_UNUSED(address);
+
+	if (cmd->id == OSDP_CMD_LED) {
+		(*num_cmds)++;
+	}
+	return 0;
+}
+
+int test_workers_cp_event(void *arg, int address, struct osdp_event *ev)
+{
+	struct test_workers *p = arg;
+
+	if (!pthread_equal(pthread_self(), p->app_thread)) {
+		p->foreign_callback = true;
+	}
+	if (address == 101 && ev->type == OSDP_EVENT_KEYPRESS) {
+		p->num_events++;
+	}
+	return 0;
+}
+
+void test_workers_cp_status(void *arg, int pd,
+			    enum osdp_pd_status_e old_status,
+			    enum osdp_pd_status_e new_status,
+			    enum osdp_pd_status_reason_e reason)
+{
+	struct test_workers *p = arg;
+
+	ARG_UNUSED(pd);
+	ARG_UNUSED(reason);
+
+	if (!pthread_equal(pthread_self(), p->app_thread)) {
+		p->foreign_callback = true;
+	}
+	if (old_status == OSDP_PD_STATUS_OFFLINE) {
+		p->num_online++;
+	} else if (new_status == OSDP_PD_STATUS_OFFLINE) {
+		p->num_online--;
+	}
+}
+
+void test_workers_cp_completion(void *arg, int pd,
+				struct osdp_cmd_completion *c)
+{
+	struct test_workers *p = arg;
+
+	ARG_UNUSED(pd);
+
+	if (!pthread_equal(pthread_self(), p->app_thread)) {
+		p->foreign_callback = true;
+	}
+	if (c->result == OSDP_CMD_RESULT_ACK) {
+		p->num_acked++;
+	}
+}
+
+void *test_workers_producer(void *arg)
+{
+	int i, j;
+	struct test_workers *p = arg;
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_LED,
+		.led = { .led_number = 1 },
+	};
+
+	for (i = 0; i < TEST_WORKERS_CMDS_PER_PRODUCER; i++) {
+		for (j = 0; j < TEST_WORKERS_NUM_BUS; j++) {
+			if (osdp_cp_send_command(p->lb.cp_ctx, j, &cmd) == 0) {
+				__atomic_add_fetch(&p->num_sent[j], 1,
+						   __ATOMIC_RELAXED);
+			}
+		}
+	}
+	return NULL;
+}
+
+int test_workers_setup(struct test *t)
+{
+	int i;
+	struct test_workers *p = &test_workers_data;
+	struct osdp_pd_cap cap[] = {
+		{
+			.function_code = OSDP_PD_CAP_READER_LED_CONTROL,
+			.compliance_level = 1,
+			.num_items = 1
+		},
+		{ -1, 0, 0 }
+	};
+	osdp_pd_info_t info_pd = {
+		.cap = cap,
+	};
+
+	memset(p, 0, sizeof(struct test_workers));
+	if (test_loopback_setup(&p->lb, TEST_WORKERS_NUM_BUS, 0, &info_pd)) {
+		return -1;
+	}
+	osdp_cp_set_event_callback(p->lb.cp_ctx, test_workers_cp_event, p);
+	osdp_cp_set_status_callback(p->lb.cp_ctx, test_workers_cp_status, p);
+	osdp_cp_set_completion_callback(p->lb.cp_ctx,
+					test_workers_cp_completion, p);
+	p->app_thread = pthread_self();
+
+	for (i = 0; i < TEST_WORKERS_NUM_BUS; i++) {
+		osdp_pd_set_command_callback(p->lb.pd_ctx[i],
+					     test_workers_pd_command,
+					     &p->num_cmds[i]);
+	}
+	osdp_set_log_level(LOG_INFO);
+	t->mock_data = p;
+	return 0;
+}
+
+void test_workers_teardown(struct test *t)
+{
+	struct test_workers *p = t->mock_data;
+
+	test_loopback_teardown(&p->lb);
+}
+
+/**
+ * Drive the PDs (and deliver CP events) from this thread until `done`
+ * returns true or we time out.
+ */
+static int test_workers_run(struct test_workers *p, int (*done)(void *arg))
+{
+	return test_loopback_run(&p->lb, done, p, TEST_WORKERS_MAX_STEPS);
+}
+
+static int test_workers_events_held(void *arg)
+{
+	struct test_workers *p = arg;
+	return __atomic_load_n(&TO_CP(p->lb.cp_ctx)->events_held,
+			       __ATOMIC_ACQUIRE);
+}
+
+static int test_workers_all_events(void *arg)
+{
+	struct test_workers *p = arg;
+	return p->num_events == 1 + TEST_WORKERS_NUM_EVENTS;
+}
+
+static int test_workers_online(void *arg)
+{
+	struct test_workers *p = arg;
+	return osdp_get_status_mask(p->lb.cp_ctx) == 0x03 &&
+	       p->num_online == TEST_WORKERS_NUM_BUS;
+}
+
+static int test_workers_delivered(void *arg)
+{
+	struct test_workers *p = arg;
+	int i;
+
+	for (i = 0; i < TEST_WORKERS_NUM_BUS; i++) {
+		if (p->num_cmds[i] != p->num_sent[i]) {
+			return false;
+		}
+	}
+	return p->num_events == 1 &&
+	       p->num_acked == p->num_sent[0] + p->num_sent[1];
+}
+
+void run_cp_workers_tests(struct test *t)
+{
+	int i, result = false;
+	struct test_workers *p;
+	int64_t start;
+	pthread_t producers[TEST_WORKERS_NUM_PRODUCERS];
+	struct osdp_event event = {
+		.type = OSDP_EVENT_KEYPRESS,
+		.keypress = { .reader_no = 0, .length = 1, .data = { 0x31 } },
+	};
+
+	printf("\nStarting CP worker thread tests\n");
+
+	if (test_workers_setup(t))
+		return;
+
+	p = t->mock_data;
+
+	printf("    -- starting workers\n");
+	if (osdp_cp_start_workers(p->lb.cp_ctx) ||
+	    TO_CP(p->lb.cp_ctx)->num_workers != TEST_WORKERS_NUM_BUS) {
+		printf("    -- failed to start one worker per bus\n");
+		goto out;
+	}
+
+	if (test_workers_run(p, test_workers_online)) {
+		printf("    -- PDs did not come online\n");
+		goto out;
+	}
+
+	printf("    -- sending commands from %d threads\n",
+	       TEST_WORKERS_NUM_PRODUCERS);
+	for (i = 0; i < TEST_WORKERS_NUM_PRODUCERS; i++) {
+		pthread_create(producers + i, NULL, test_workers_producer, p);
+	}
+	for (i = 0; i < TEST_WORKERS_NUM_PRODUCERS; i++) {
+		pthread_join(producers[i], NULL);
+	}
+	osdp_pd_notify_event(p->lb.pd_ctx[0], &event);
+
+	if (test_workers_run(p, test_workers_delivered)) {
+		printf("    -- sent %d/%d cmds; got %d/%d; acked %d; "
+		       "events %d\n", p->num_sent[0], p->num_sent[1],
+		       p->num_cmds[0], p->num_cmds[1], p->num_acked,
+		       p->num_events);
+		goto out;
+	}
+	printf("    -- %d/%d commands delivered\n",
+	       p->num_cmds[0], p->num_cmds[1]);
+
+	/* more events than cp->events holds, while the app isn't looking */
+	for (i = 0; i < TEST_WORKERS_NUM_EVENTS; i++) {
+		osdp_pd_notify_event(p->lb.pd_ctx[0], &event);
+	}
+	start = osdp_millis_now();
+	while (!test_workers_events_held(p)) {
+		for (i = 0; i < TEST_WORKERS_NUM_BUS; i++) {
+			osdp_pd_refresh(p->lb.pd_ctx[i]);
+		}
+		if (p->num_events != 1 || osdp_millis_since(start) > 10 * 1000) {
+			printf("    -- event queue did not fill up\n");
+			goto out;
+		}
+		usleep(200);
+	}
+	if (test_workers_run(p, test_workers_all_events)) {
+		printf("    -- only %d/%d events delivered\n", p->num_events,
+		       1 + TEST_WORKERS_NUM_EVENTS);
+		goto out;
+	}
+
+	osdp_cp_stop_workers(p->lb.cp_ctx);
+	if (p->foreign_callback) {
+		printf("    -- callback invoked from a worker thread\n");
+		goto out;
+	}
+	result = true;
+out:
+	TEST_REPORT(t, result);
+	test_workers_teardown(t);
+}
+
+#else /* CONFIG_OSDP_THREADED_CP */
+
+void run_cp_workers_tests(struct test *t)
+{
+	ARG_UNUSED(t);
+}
+
+#endif /* CONFIG_OSDP_THREADED_CP */
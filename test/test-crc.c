@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+
+#include "test.h"
+
+#define TEST_CRC_BUF_LEN               (OSDP_PACKET_BUF_SIZE + 7)
+
+typedef uint16_t (*crc16_kernel_t)(uint16_t, const uint8_t *, size_t);
+
+static const struct {
+	const char *name;
+	crc16_kernel_t fn;
+} test_crc_kernels[] = {
+	{ "table",  osdp_crc16_table  },
+	{ "slice4", osdp_crc16_slice4 },
+	{ "slice8", osdp_crc16_slice8 },
+};
+
+int test_crc_known_vector(void *data)
+{
+	uint16_t crc;
+	/* CMD_POLL to PD 101 (see test-cp-phy.c); excluding mark byte */
+	uint8_t poll[] = { 0x53, 0x65, 0x08, 0x00, 0x04, 0x60 };
+
+	ARG_UNUSED(data);
+
+	printf("Testing osdp_compute_crc16(CMD_POLL) -- ");
+	crc = osdp_compute_crc16(poll, sizeof(poll));
+	if (crc != 0x9060) {
+		printf("error! got 0x%04x\n", crc);
+		return -1;
+	}
+	printf("success!\n");
+	return 0;
+}
+
+int test_crc_kernels_match(void *data)
+{
+	size_t i, len, off;
+	uint16_t ref, crc;
+	uint8_t buf[TEST_CRC_BUF_LEN];
+
+	ARG_UNUSED(data);
+
+	printf("Testing crc16 kernels against reference -- ");
+	srand(0x1D0F);
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = (uint8_t)rand();
+	}
+	/* every length and a few misaligned start offsets */
+	for (off = 0; off < 8; off++) {
+		for (len = 0; len <= OSDP_PACKET_BUF_SIZE; len++) {
+			ref = osdp_crc16_bytewise(0x1D0F, buf + off, len);
+			for (i = 0; i < ARRAY_SIZE(test_crc_kernels); i++) {
+				crc = test_crc_kernels[i].fn(0x1D0F, buf + off, len);
+				if (crc != ref) {
+					printf("error! %s: off:%zu len:%zu "
+					       "0x%04x/0x%04x\n",
+					       test_crc_kernels[i].name,
+					       off, len, crc, ref);
+					return -1;
+				}
+			}
+		}
+	}
+	printf("success!\n");
+	return 0;
+}
+
+void run_crc_tests(struct test *t)
+{
+	printf("\nStarting CRC16 tests\n");
+
+	DO_TEST(t, test_crc_known_vector);
+	DO_TEST(t, test_crc_kernels_match);
+}
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+
+#include "test.h"
+
+#ifdef CONFIG_OSDP_SC_ENABLED
+
+/* FIPS-197, Appendix C.1 (AES-128) */
+static const uint8_t test_fips197_key[16] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+static const uint8_t test_fips197_pt[16] = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+	0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+};
+static const uint8_t test_fips197_ct[16] = {
+	0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+	0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a
+};
+
+/* NIST SP 800-38A, F.2.1 CBC-AES128.Encrypt */
+static const uint8_t test_cbc_key[16] = {
+	0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+	0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+};
+static const uint8_t test_cbc_iv[16] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+static const uint8_t test_cbc_pt[64] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+	0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+	0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+	0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+	0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+};
+static const uint8_t test_cbc_ct[64] = {
+	0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46,
+	0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+	0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee,
+	0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+	0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b,
+	0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+	0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09,
+	0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7
+};
+
+static int test_crypto_kat_one(const struct osdp_aes_ops *ops)
+{
+	struct osdp_aes_key k = { 0 };
+	uint8_t buf[64];
+	int ret = -1;
+
+	if (osdp_crypto_set_ops(ops) != 0) {
+		printf("(%s: unsupported) ", ops->name);
+		return 0;
+	}
+
+	osdp_aes_key_init(&k, test_fips197_key);
+	memcpy(buf, test_fips197_pt, 16);
+	osdp_encrypt_ctx(&k, NULL, buf, 16);
+	if (memcmp(buf, test_fips197_ct, 16) != 0) {
+		printf("%s: ECB encrypt mismatch\n", ops->name);
+		goto out;
+	}
+	osdp_decrypt_ctx(&k, NULL, buf, 16);
+	if (memcmp(buf, test_fips197_pt, 16) != 0) {
+		printf("%s: ECB decrypt mismatch\n", ops->name);
+		goto out;
+	}
+
+	osdp_aes_key_init(&k, test_cbc_key);
+	memcpy(buf, test_cbc_pt, 64);
+	osdp_encrypt_ctx(&k, (uint8_t *)test_cbc_iv, buf, 64);
+	if (memcmp(buf, test_cbc_ct, 64) != 0) {
+		printf("%s: CBC encrypt mismatch\n", ops->name);
+		goto out;
+	}
+	osdp_decrypt_ctx(&k, (uint8_t *)test_cbc_iv, buf, 64);
+	if (memcmp(buf, test_cbc_pt, 64) != 0) {
+		printf("%s: CBC decrypt mismatch\n", ops->name);
+		goto out;
+	}
+	ret = 0;
+out:
+	osdp_aes_key_release(&k);
+	return ret;
+}
+
+int test_crypto_known_answers(void *data)
+{
+	int i, ret = 0;
+	const struct osdp_aes_ops *saved = osdp_crypto_get_ops();
+
+	ARG_UNUSED(data);
+
+	printf("Testing AES backends against FIPS-197/SP800-38A -- ");
+	for (i = 0; osdp_aes_backends[i] != NULL; i++) {
+		if (test_crypto_kat_one(osdp_aes_backends[i])) {
+			ret = -1;
+		}
+	}
+	osdp_crypto_set_ops(saved);
+	if (ret == 0) {
+		printf("success!\n");
+	}
+	return ret;
+}
+
+int test_crypto_backends_match(void *data)
+{
+	int i, len, ret = 0;
+	uint8_t key[16], iv[16];
+	uint8_t ref[OSDP_PACKET_BUF_SIZE], buf[OSDP_PACKET_BUF_SIZE];
+	struct osdp_aes_key k = { 0 };
+	const struct osdp_aes_ops *ops, *saved = osdp_crypto_get_ops();
+
+	ARG_UNUSED(data);
+
+	printf("Testing AES backends against tiny-aes -- ");
+	srand(0xAE5);
+	for (i = 0; i < 16; i++) {
+		key[i] = (uint8_t)rand();
+		iv[i] = (uint8_t)rand();
+	}
+	for (i = 0; i < OSDP_PACKET_BUF_SIZE; i++) {
+		ref[i] = (uint8_t)rand();
+	}
+	/* every block count a secure channel packet can have */
+	for (i = 0; osdp_aes_backends[i] != NULL && ret == 0; i++) {
+		ops = osdp_aes_backends[i];
+		if (osdp_crypto_set_ops(ops) != 0) {
+			continue;
+		}
+		osdp_aes_key_init(&k, key);
+		for (len = 16; len <= OSDP_PACKET_BUF_SIZE; len += 16) {
+			memcpy(buf, ref, len);
+			osdp_encrypt_ctx(&k, iv, buf, len);
+			osdp_crypto_set_ops(&osdp_aes_tiny_ops);
+			osdp_decrypt(key, iv, buf, len);
+			osdp_crypto_set_ops(ops);
+			if (memcmp(buf, ref, len) != 0) {
+				printf("%s: CBC encrypt len:%d mismatch\n",
+				       ops->name, len);
+				ret = -1;
+				break;
+			}
+			osdp_crypto_set_ops(&osdp_aes_tiny_ops);
+			osdp_encrypt(key, iv, buf, len);
+			osdp_crypto_set_ops(ops);
+			osdp_decrypt_ctx(&k, iv, buf, len);
+			if (memcmp(buf, ref, len) != 0) {
+				printf("%s: CBC decrypt len:%d mismatch\n",
+				       ops->name, len);
+				ret = -1;
+				break;
+			}
+		}
+		osdp_aes_key_release(&k);
+	}
+	osdp_crypto_set_ops(saved);
+	if (ret == 0) {
+		printf("success!\n");
+	}
+	return ret;
+}
+
+/* Pad-and-copy MAC as osdp_compute_mac() used to do it */
+static void test_crypto_mac_ref(struct osdp_pd *pd, const uint8_t *data,
+				int len, uint8_t *mac)
+{
+	int pad_len;
+	uint8_t buf[OSDP_PACKET_BUF_SIZE + 16] = { 0 };
+	uint8_t iv[16];
+
+	memcpy(buf, data, len);
+	pad_len = (len % 16 == 0) ? len : AES_PAD_LEN(len);
+	if (len % 16 != 0) {
+		buf[len] = 0x80;
+	}
+	memcpy(iv, pd->sc.r_mac, 16);
+	if (pad_len > 16) {
+		osdp_encrypt(pd->sc.s_mac1, iv, buf, pad_len - 16);
+		memcpy(iv, buf + pad_len - 32, 16);
+	}
+	osdp_encrypt(pd->sc.s_mac2, iv, buf + pad_len - 16, 16);
+	memcpy(mac, buf + pad_len - 16, 16);
+}
+
+int test_crypto_mac_incremental(void *data)
+{
+	int i, len, chunk, ret = -1;
+	uint8_t buf[OSDP_PACKET_BUF_SIZE], ref[16], out[16];
+	struct osdp_mac_ctx mac;
+	struct osdp_pd *pd;
+
+	ARG_UNUSED(data);
+
+	printf("Testing incremental MAC against reference -- ");
+	pd = calloc(1, sizeof(struct osdp_pd));
+	if (pd == NULL) {
+		return -1;
+	}
+	srand(0x3AC);
+	for (i = 0; i < 16; i++) {
+		pd->sc.s_mac1[i] = (uint8_t)rand();
+		pd->sc.s_mac2[i] = (uint8_t)rand();
+		pd->sc.r_mac[i] = (uint8_t)rand();
+	}
+	for (i = 0; i < (int)sizeof(buf); i++) {
+		buf[i] = (uint8_t)rand();
+	}
+	osdp_aes_key_init(&pd->sc.s_mac1_ctx, pd->sc.s_mac1);
+	osdp_aes_key_init(&pd->sc.s_mac2_ctx, pd->sc.s_mac2);
+
+	for (len = 1; len <= OSDP_PACKET_BUF_SIZE; len++) {
+		test_crypto_mac_ref(pd, buf, len, ref);
+		/* odd sized chunks to cross block boundaries mid update */
+		for (chunk = 1; chunk <= 33; chunk += 16) {
+			osdp_mac_init(&mac, pd, 1);
+			for (i = 0; i < len; i += chunk) {
+				osdp_mac_update(&mac, buf + i,
+						(len - i < chunk) ? len - i : chunk);
+			}
+			osdp_mac_final(&mac, out);
+			if (memcmp(out, ref, 16) != 0) {
+				printf("len:%d chunk:%d mismatch\n", len, chunk);
+				goto out;
+			}
+		}
+	}
+	printf("success!\n");
+	ret = 0;
+out:
+	osdp_sc_teardown(pd);
+	free(pd);
+	return ret;
+}
+
+int test_crypto_encrypt_then_mac(void *data)
+{
+	int i, len, enc_len, ret = -1;
+	uint8_t hdr[8], buf[OSDP_PACKET_BUF_SIZE], ref[OSDP_PACKET_BUF_SIZE];
+	uint8_t iv[16], mac_ref[16];
+	struct osdp_mac_ctx mac;
+	struct osdp_pd *pd;
+
+	ARG_UNUSED(data);
+
+	printf("Testing fused encrypt-then-MAC -- ");
+	pd = calloc(1, sizeof(struct osdp_pd));
+	if (pd == NULL) {
+		return -1;
+	}
+	srand(0xE7A);
+	for (i = 0; i < 16; i++) {
+		pd->sc.s_enc[i] = (uint8_t)rand();
+		pd->sc.s_mac1[i] = (uint8_t)rand();
+		pd->sc.s_mac2[i] = (uint8_t)rand();
+		pd->sc.r_mac[i] = (uint8_t)rand();
+		iv[i] = ~pd->sc.r_mac[i];
+	}
+	for (i = 0; i < (int)sizeof(hdr); i++) {
+		hdr[i] = (uint8_t)rand();
+	}
+	osdp_aes_key_init(&pd->sc.s_enc_ctx, pd->sc.s_enc);
+	osdp_aes_key_init(&pd->sc.s_mac1_ctx, pd->sc.s_mac1);
+	osdp_aes_key_init(&pd->sc.s_mac2_ctx, pd->sc.s_mac2);
+
+	for (len = 1; len < OSDP_PACKET_BUF_SIZE - 32; len += 7) {
+		/* reference: pad, CBC encrypt, then MAC hdr || cipher text */
+		memcpy(ref, hdr, sizeof(hdr));
+		for (i = 0; i < len; i++) {
+			ref[sizeof(hdr) + i] = (uint8_t)(i * 31);
+		}
+		memcpy(buf, ref, sizeof(hdr) + len);
+		enc_len = AES_PAD_LEN(len + 1);
+		ref[sizeof(hdr) + len] = 0x80;
+		memset(ref + sizeof(hdr) + len + 1, 0, enc_len - len - 1);
+		osdp_encrypt(pd->sc.s_enc, iv, ref + sizeof(hdr), enc_len);
+		osdp_compute_mac(pd, 1, ref, sizeof(hdr) + enc_len);
+		memcpy(mac_ref, pd->sc.c_mac, 16);
+
+		osdp_mac_init(&mac, pd, 1);
+		osdp_mac_update(&mac, buf, sizeof(hdr));
+		if (osdp_encrypt_data(pd, 1, buf + sizeof(hdr), len,
+				      &mac) != enc_len) {
+			printf("len:%d bad encrypted length\n", len);
+			goto out;
+		}
+		osdp_mac_final(&mac, pd->sc.c_mac);
+		if (memcmp(buf, ref, sizeof(hdr) + enc_len) != 0 ||
+		    memcmp(pd->sc.c_mac, mac_ref, 16) != 0) {
+			printf("len:%d mismatch\n", len);
+			goto out;
+		}
+	}
+	printf("success!\n");
+	ret = 0;
+out:
+	osdp_sc_teardown(pd);
+	free(pd);
+	return ret;
+}
+
+void run_crypto_tests(struct test *t)
+{
+	printf("\nStarting AES backend tests\n");
+
+	DO_TEST(t, test_crypto_known_answers);
+	DO_TEST(t, test_crypto_backends_match);
+	DO_TEST(t, test_crypto_mac_incremental);
+	DO_TEST(t, test_crypto_encrypt_then_mac);
+}
+
+#else /* CONFIG_OSDP_SC_ENABLED */
+
+void run_crypto_tests(struct test *t)
+{
+	ARG_UNUSED(t);
+}
+
+#endif /* CONFIG_OSDP_SC_ENABLED */
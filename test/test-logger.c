@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdarg.h>
+#include <osdp.h>
+#include "test.h"
+
+struct test_logger_sink {
+	char msg[LOG_MSG_MAX_LEN];
+	int pd;
+	int num_msgs;
+};
+
+struct test_logger {
+	char line[LOG_MSG_MAX_LEN * 2];
+	int num_lines;
+	struct osdp *ctx[2];
+	struct test_logger_sink sink[2];
+} test_logger_data;
+
+static void test_logger_sink(void *arg, int log_level, int pd, const char *msg)
+{
+	struct test_logger_sink *s = arg;
+
+	ARG_UNUSED(log_level);
+
+	snprintf(s->msg, sizeof(s->msg), "%s", msg);
+	s->pd = pd;
+	s->num_msgs++;
+}
+
+static int test_logger_dummy_send(void *data, uint8_t *buf, int len)
+{
+	ARG_UNUSED(data);
+	ARG_UNUSED(buf);
+
+	return len;
+}
+
+static int test_logger_dummy_recv(void *data, uint8_t *buf, int len)
+{
+	ARG_UNUSED(data);
+	ARG_UNUSED(buf);
+	ARG_UNUSED(len);
+
+	return 0;
+}
+
+static int test_logger_printf(const char *fmt, ...)
+{
+	int ret;
+	va_list args;
+	struct test_logger *l = &test_logger_data;
+
+	va_start(args, fmt);
+	ret = vsnprintf(l->line, sizeof(l->line), fmt, args);
+	va_end(args);
+	l->num_lines++;
+	return ret;
+}
+
+static int test_logger_expect(struct test_logger *l, const char *msg)
+{
+	if (strstr(l->line, msg) == NULL) {
+		printf("    -- expected '%s' in '%s'\n", msg, l->line);
+		return -1;
+	}
+	return 0;
+}
+
+static int test_logger_deferred(struct test_logger *l)
+{
+	int ret;
+
+	osdp_logger_set_deferred(1);
+	LOG_ERR("int %d str %s hex %02x ll %lld w %*d", 42, "abc", 15,
+		123456789012LL, 4, 7);
+	if (l->num_lines != 0) {
+		printf("    -- deferred message printed at call site\n");
+		return -1;
+	}
+	ret = osdp_logger_flush();
+	if (ret != 1 || l->num_lines != 1) {
+		printf("    -- flushed %d/%d messages\n", ret, l->num_lines);
+		return -1;
+	}
+	return test_logger_expect(l, "int 42 str abc hex 0f ll 123456789012 w    7");
+}
+
+static int test_logger_overflow(struct test_logger *l)
+{
+	int i, ret;
+
+	l->num_lines = 0;
+	for (i = 0; i < OSDP_LOG_RING_SIZE + 5; i++) {
+		LOG_ERR("message %d", i);
+	}
+	ret = osdp_logger_flush();
+	if (ret != OSDP_LOG_RING_SIZE) {
+		printf("    -- flushed %d messages\n", ret);
+		return -1;
+	}
+	return test_logger_expect(l, "5 log messages dropped");
+}
+
+static int test_logger_immediate(struct test_logger *l)
+{
+	osdp_logger_set_deferred(0);
+	l->num_lines = 0;
+	osdp_log_ctx_set(TO_PD(l->ctx[1], 0));
+	LOG_ERR("now %s", "printed");
+	osdp_log_ctx_reset();
+	if (l->num_lines != 1) {
+		printf("    -- message not printed at call site\n");
+		return -1;
+	}
+	return test_logger_expect(l, "ERROR: PD[0] now printed");
+}
+
+static int test_logger_contexts(struct test_logger *l)
+{
+	osdp_logger_ctx_init(l->ctx[1], LOG_ERR, test_logger_sink, &l->sink[1]);
+	l->num_lines = 0;
+
+	osdp_log_ctx_set(TO_PD(l->ctx[1], 0));
+	LOG_INF("ctx1 info");
+	osdp_log_ctx_restore();
+	osdp_log_ctx_set(TO_PD(l->ctx[0], 0));
+	LOG_INF("ctx0 info");
+	osdp_log_ctx_restore();
+	LOG_INF("global info");
+
+	if (l->sink[1].num_msgs != 0) {
+		printf("    -- context log level not applied\n");
+		return -1;
+	}
+	if (l->sink[0].num_msgs != 1 || l->sink[0].pd != 0 ||
+	    strcmp(l->sink[0].msg, "ctx0 info")) {
+		printf("    -- context sink got %d msgs; '%s'\n",
+		       l->sink[0].num_msgs, l->sink[0].msg);
+		return -1;
+	}
+	if (l->num_lines != 1) {
+		printf("    -- context messages went to the global sink\n");
+		return -1;
+	}
+
+	/* deferred messages go to the sink of the context they were for */
+	osdp_logger_set_deferred(1);
+	osdp_log_ctx_set(TO_PD(l->ctx[1], 0));
+	LOG_ERR("ctx1 %s", "deferred");
+	osdp_log_ctx_restore();
+	osdp_logger_set_deferred(0);
+	if (l->sink[1].num_msgs != 1 ||
+	    strcmp(l->sink[1].msg, "ctx1 deferred")) {
+		printf("    -- deferred context message lost\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int test_logger_levels(struct test_logger *l)
+{
+	int n = 0;
+
+	ARG_UNUSED(l);
+
+	/* arguments must not be evaluated for suppressed levels */
+	osdp_logger_init(LOG_WARNING, NULL);
+	LOG_INF("%d", n++);
+	osdp_logger_init(LOG_DEBUG, NULL);
+	if (OSDP_LOG_MIN_LEVEL < LOG_DEBUG) {
+		LOG_DBG("%d", n++);
+	}
+	if (n != 0) {
+		printf("    -- suppressed log arguments were evaluated\n");
+		return -1;
+	}
+	return 0;
+}
+
+void run_logger_tests(struct test *t)
+{
+	int i;
+	struct test_logger *l = &test_logger_data;
+	osdp_pd_info_t info = {
+		.address = 101,
+		.baud_rate = 9600,
+		.channel.send = test_logger_dummy_send,
+		.channel.recv = test_logger_dummy_recv,
+	};
+
+	printf("\nStarting logger tests\n");
+
+	memset(l, 0, sizeof(struct test_logger));
+	for (i = 0; i < 2; i++) {
+		l->ctx[i] = osdp_pd_setup(&info, NULL);
+		if (l->ctx[i] == NULL) {
+			printf("    -- pd init failed!\n");
+			return;
+		}
+	}
+	osdp_logger_ctx_init(l->ctx[0], LOG_DEBUG, test_logger_sink, &l->sink[0]);
+	osdp_logger_init(LOG_DEBUG, test_logger_printf);
+	t->mock_data = l;
+
+	DO_TEST(t, test_logger_deferred);
+	DO_TEST(t, test_logger_overflow);
+	DO_TEST(t, test_logger_immediate);
+	DO_TEST(t, test_logger_levels);
+	DO_TEST(t, test_logger_contexts);
+
+	osdp_logger_set_deferred(0);
+	osdp_logger_init(LOG_INFO, printf);
+	osdp_pd_teardown(l->ctx[0]);
+	osdp_pd_teardown(l->ctx[1]);
+}
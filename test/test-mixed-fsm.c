@@ -142,6 +142,235 @@ void test_mixed_fsm_teardown(struct test *t)
 	osdp_pd_teardown((osdp_t *) p->pd_ctx);
 }
 
+int test_mixed_fsm_stats(struct test_mixed *p)
+{
+	int i;
+	uint32_t count = 0;
+	struct osdp_stats cp, pd;
+
+	if (osdp_get_stats(p->cp_ctx, 0, &cp) ||
+	    osdp_get_stats(p->pd_ctx, 0, &pd)) {
+		printf("    -- failed to get stats\n");
+		return false;
+	}
+	/* every frame one side sent, the other side has received */
+	if (cp.tx_frames == 0 || cp.tx_frames != pd.rx_frames ||
+	    cp.rx_frames != pd.tx_frames || cp.tx_bytes != pd.rx_bytes ||
+	    cp.rx_bytes != pd.tx_bytes) {
+		printf("    -- frames/bytes mismatch; CP: %u/%u %u/%u "
+		       "PD: %u/%u %u/%u\n", cp.tx_frames, cp.rx_frames,
+		       cp.tx_bytes, cp.rx_bytes, pd.tx_frames, pd.rx_frames,
+		       pd.tx_bytes, pd.rx_bytes);
+		return false;
+	}
+	for (i = 0; i < OSDP_STATS_LATENCY_BUCKETS; i++) {
+		count += cp.latency[i];
+	}
+	if (count != cp.rx_frames) {
+		printf("    -- latency histogram has %u/%u replies\n",
+		       count, cp.rx_frames);
+		return false;
+	}
+#ifdef CONFIG_OSDP_SC_ENABLED
+	if (cp.sc_handshakes == 0 || pd.sc_handshakes == 0) {
+		printf("    -- SC handshake not counted\n");
+		return false;
+	}
+#endif
+	osdp_reset_stats(p->cp_ctx, 0);
+	osdp_get_stats(p->cp_ctx, 0, &cp);
+	if (cp.tx_frames != 0 || cp.latency[0] != 0) {
+		printf("    -- stats not reset\n");
+		return false;
+	}
+	if (osdp_get_stats(p->cp_ctx, 1, &cp) == 0) {
+		printf("    -- stats of invalid PD\n");
+		return false;
+	}
+	return true;
+}
+
+/* drop a reply; the CP must resend the command and the PD, its reply */
+int test_mixed_fsm_resend(struct test_mixed *p)
+{
+	struct osdp_pd *pd_cp = GET_CURRENT_PD(p->cp_ctx);
+	struct osdp_pd *pd_pd = GET_CURRENT_PD(p->pd_ctx);
+	struct osdp_stats cp, pd;
+	int64_t start = osdp_millis_now();
+	uint32_t pd_tx;
+
+	osdp_get_stats(p->pd_ctx, 0, &pd);
+	pd_tx = pd.tx_frames;
+	while (test_mixed_cp_to_pd_buf_length == 0 &&
+	       osdp_millis_since(start) < 1000) {
+		test_state_update(pd_cp);
+	}
+	test_osdp_pd_update(pd_pd);
+	test_mixed_pd_to_cp_buf_length = 0; /* lost */
+
+	while (test_mixed_cp_to_pd_buf_length == 0 &&
+	       osdp_millis_since(start) < 2000) {
+		test_state_update(pd_cp);
+	}
+	test_osdp_pd_update(pd_pd);
+	test_state_update(pd_cp); /* take the reply */
+	test_state_update(pd_cp); /* and clean up */
+
+	osdp_get_stats(p->cp_ctx, 0, &cp);
+	osdp_get_stats(p->pd_ctx, 0, &pd);
+	if (cp.resends != 1 || pd.resends != 1 || pd.tx_frames != pd_tx + 2) {
+		printf("    -- resends CP: %u PD: %u\n", cp.resends,
+		       pd.resends);
+		return false;
+	}
+	if (pd_cp->state != OSDP_CP_STATE_ONLINE ||
+	    pd_cp->phy_state != OSDP_CP_PHY_STATE_IDLE) {
+		printf("    -- CP did not take the resent reply\n");
+		return false;
+	}
+#ifdef CONFIG_OSDP_SC_ENABLED
+	if (!osdp_get_sc_status_mask(p->cp_ctx) ||
+	    !ISSET_FLAG(pd_pd, PD_FLAG_SC_ACTIVE)) {
+		printf("    -- secure channel lost\n");
+		return false;
+	}
+#endif
+	return true;
+}
+
+int test_mixed_num_led_cmds;
+int test_mixed_pd_busy;	/* LED commands to reply osdp_BUSY to */
+
+int test_mixed_pd_command(void *arg, int address, struct osdp_cmd *cmd)
+{
+	ARG_UNUSED(arg);
+	ARG_UNUSED(address);
+
+	if (cmd->id == OSDP_CMD_LED) {
+		test_mixed_num_led_cmds++;
+		if (test_mixed_pd_busy > 0) {
+			test_mixed_pd_busy--;
+			return OSDP_ERR_WOULD_BLOCK;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Lose all frames until the CP gives up on the PD. It must reconnect after
+ * the shortest backoff and deliver the command that was still queued.
+ */
+int test_mixed_fsm_reconnect(struct test_mixed *p)
+{
+	struct osdp_pd *pd_cp = GET_CURRENT_PD(p->cp_ctx);
+	struct osdp_pd *pd_pd = GET_CURRENT_PD(p->pd_ctx);
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_LED,
+		.led = { .led_number = 1 },
+	};
+	queue_node_t *node;
+	int64_t start;
+
+	osdp_pd_set_command_callback((osdp_t *)p->pd_ctx,
+				     test_mixed_pd_command, NULL);
+	test_mixed_num_led_cmds = 0;
+	/* the first one goes out (and is lost); the second stays queued */
+	if (osdp_cp_send_command((osdp_t *)p->cp_ctx, 0, &cmd) ||
+	    osdp_cp_send_command((osdp_t *)p->cp_ctx, 0, &cmd)) {
+		printf("    -- failed to send command\n");
+		return false;
+	}
+	start = osdp_millis_now();
+	while (pd_cp->state != OSDP_CP_STATE_OFFLINE &&
+	       osdp_millis_since(start) < 2000) {
+		test_state_update(pd_cp);
+		test_mixed_cp_to_pd_buf_length = 0;
+	}
+	if (pd_cp->state != OSDP_CP_STATE_OFFLINE ||
+	    pd_cp->retry_wait > OSDP_CP_BACKOFF_MIN_MS ||
+	    queue_peek_first(&pd_cp->cmd_parked, &node)) {
+		printf("    -- CP offline: %d retry in: %lld ms\n",
+		       pd_cp->state == OSDP_CP_STATE_OFFLINE,
+		       (long long)pd_cp->retry_wait);
+		return false;
+	}
+
+	start = osdp_millis_now();
+	while (test_mixed_num_led_cmds == 0 &&
+	       osdp_millis_since(start) < OSDP_CP_BACKOFF_MIN_MS + 2000) {
+		test_state_update(pd_cp);
+		test_osdp_pd_update(pd_pd);
+	}
+	if (pd_cp->state != OSDP_CP_STATE_ONLINE ||
+	    test_mixed_num_led_cmds != 1) {
+		printf("    -- parked command delivered: %d\n",
+		       test_mixed_num_led_cmds);
+		return false;
+	}
+	return true;
+}
+
+struct osdp_cmd_completion test_mixed_completion;
+
+void test_mixed_cp_completion(void *arg, int pd, struct osdp_cmd_completion *c)
+{
+	ARG_UNUSED(arg);
+	ARG_UNUSED(pd);
+
+	test_mixed_completion = *c;
+}
+
+/**
+ * The PD replies osdp_BUSY to a command twice before it takes it. The CP must
+ * send it again each time (not repeat the sequence number of the one that the
+ * PD replied to, which would only get the osdp_BUSY resent) till it does.
+ */
+int test_mixed_fsm_busy(struct test_mixed *p)
+{
+	struct osdp_pd *pd_cp = GET_CURRENT_PD(p->cp_ctx);
+	struct osdp_pd *pd_pd = GET_CURRENT_PD(p->pd_ctx);
+	struct osdp_cmd cmd = {
+		.id = OSDP_CMD_LED,
+		.led = { .led_number = 1 },
+		.tag = 17,
+	};
+	struct osdp_stats cp;
+	int64_t start;
+
+	osdp_reset_stats(p->cp_ctx, 0);
+	osdp_cp_set_completion_callback((osdp_t *)p->cp_ctx,
+					test_mixed_cp_completion, NULL);
+	memset(&test_mixed_completion, 0, sizeof(test_mixed_completion));
+	test_mixed_num_led_cmds = 0;
+	test_mixed_pd_busy = 2;
+	if (osdp_cp_send_command((osdp_t *)p->cp_ctx, 0, &cmd)) {
+		printf("    -- failed to send command\n");
+		return false;
+	}
+	start = osdp_millis_now();
+	while (test_mixed_completion.tag != cmd.tag &&
+	       osdp_millis_since(start) < 2000) {
+		test_state_update(pd_cp);
+		test_osdp_pd_update(pd_pd);
+	}
+	osdp_cp_set_completion_callback((osdp_t *)p->cp_ctx, NULL, NULL);
+
+	osdp_get_stats(p->cp_ctx, 0, &cp);
+	if (test_mixed_completion.tag != cmd.tag ||
+	    test_mixed_completion.result != OSDP_CMD_RESULT_ACK ||
+	    test_mixed_num_led_cmds != 3 || cp.busy != 2 || cp.retries != 2) {
+		printf("    -- result: %d LED cmds: %d busy: %u retries: %u\n",
+		       test_mixed_completion.result, test_mixed_num_led_cmds,
+		       cp.busy, cp.retries);
+		return false;
+	}
+	if (pd_cp->state != OSDP_CP_STATE_ONLINE) {
+		printf("    -- PD went offline\n");
+		return false;
+	}
+	return true;
+}
+
 void run_mixed_fsm_tests(struct test *t)
 {
 	int result = true;
@@ -188,6 +417,22 @@ void run_mixed_fsm_tests(struct test *t)
 			break;
 		}
 	}
+	if (result == true) {
+		printf("    -- checking link stats\n");
+		result = test_mixed_fsm_stats(p);
+	}
+	if (result == true) {
+		printf("    -- dropping a reply\n");
+		result = test_mixed_fsm_resend(p);
+	}
+	if (result == true) {
+		printf("    -- losing the PD for a while\n");
+		result = test_mixed_fsm_reconnect(p);
+	}
+	if (result == true) {
+		printf("    -- keeping the PD busy for a while\n");
+		result = test_mixed_fsm_busy(p);
+	}
 	printf("    -- CP - PD mixed tests complete\n");
 
 	TEST_REPORT(t, result);
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2020 Siddharth Chandrasekaran <siddharth@embedjournal.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <osdp.h>
+#include "test.h"
+#include "sim.h"
+
+#define TEST_SIM_SEC                    (1000 * 1000LL)
+
+static const struct sim_config test_sim_config = {
+	.num_bus = 2,
+	.pd_per_bus = 16,
+	.baud_rate = 9600,
+	.turnaround_us = 2000,
+	.inter_byte_gap_us = 50,
+	.card_reads_per_sec = 5,
+	.seed = 42,
+};
+
+static void test_sim_print(struct sim_report *r)
+{
+	printf("    -- %llds: util %.2f reads %u/%u p50 %lldus p99 %lldus "
+	       "offline %u recovery %lldus\n",
+	       (long long)(r->elapsed_us / TEST_SIM_SEC), r->bus_utilization,
+	       r->card_reads_delivered, r->card_reads,
+	       (long long)r->read_latency_p50_us,
+	       (long long)r->read_latency_p99_us, r->offline_events,
+	       (long long)r->recovery_max_us);
+}
+
+static int test_sim_fleet(void *data)
+{
+	int ret = -1;
+	struct sim *s;
+	struct sim_report r;
+
+	ARG_UNUSED(data);
+
+	s = sim_create(&test_sim_config);
+	if (s == NULL) {
+		printf("    -- sim init failed\n");
+		return -1;
+	}
+	if (sim_run_until_online(s, 60 * TEST_SIM_SEC)) {
+		printf("    -- PDs did not come online\n");
+		goto out;
+	}
+	sim_run(s, 600 * TEST_SIM_SEC);
+	sim_get_report(s, &r);
+	test_sim_print(&r);
+
+	/* at most one read per PD can still be in flight */
+	if (r.card_reads < 2000 ||
+	    r.card_reads - r.card_reads_delivered > 32 ||
+	    r.read_latency_p99_us > TEST_SIM_SEC || r.offline_events != 0 ||
+	    r.bus_utilization < 0.1 || r.bus_utilization > 1.0) {
+		goto out;
+	}
+	ret = 0;
+out:
+	sim_destroy(s);
+	return ret;
+}
+
+static int test_sim_outage(void *data)
+{
+	int ret = -1;
+	struct sim *s;
+	struct sim_report r;
+
+	ARG_UNUSED(data);
+
+	s = sim_create(&test_sim_config);
+	if (s == NULL || sim_run_until_online(s, 60 * TEST_SIM_SEC)) {
+		printf("    -- PDs did not come online\n");
+		goto out;
+	}
+	sim_pd_set_down(s, 3, 1);
+	sim_run(s, 5 * TEST_SIM_SEC);
+	if (sim_pd_is_online(s, 3)) {
+		printf("    -- PD down but still online\n");
+		goto out;
+	}
+	sim_pd_set_down(s, 3, 0);
+	sim_run(s, 60 * TEST_SIM_SEC);
+	sim_get_report(s, &r);
+	test_sim_print(&r);
+
+	/* after 5s of failed reconnects, the backoff is no more than 8s */
+	if (r.offline_events != 1 || r.detect_max_us > TEST_SIM_SEC ||
+	    r.num_recoveries != 1 || r.recovery_max_us > 8 * TEST_SIM_SEC) {
+		goto out;
+	}
+	ret = 0;
+out:
+	if (s != NULL) {
+		sim_destroy(s);
+	}
+	return ret;
+}
+
+static int test_sim_burst(void *data)
+{
+	int i, ret = -1;
+	struct sim *s;
+	struct sim_report r;
+	struct sim_config cfg = test_sim_config;
+
+	ARG_UNUSED(data);
+
+	cfg.card_reads_per_sec = 0;
+	s = sim_create(&cfg);
+	if (s == NULL || sim_run_until_online(s, 60 * TEST_SIM_SEC)) {
+		printf("    -- PDs did not come online\n");
+		goto out;
+	}
+	/* long idle; then a burst of reads on one PD */
+	sim_run(s, 60 * TEST_SIM_SEC);
+	for (i = 0; i < 10; i++) {
+		sim_card_read(s, 3);
+		sim_run(s, TEST_SIM_SEC / 4);
+	}
+	sim_get_report(s, &r);
+	test_sim_print(&r);
+
+	if (r.card_reads_delivered != 10 ||
+	    r.read_latency_p50_us > TEST_SIM_SEC / 5) {
+		goto out;
+	}
+	ret = 0;
+out:
+	if (s != NULL) {
+		sim_destroy(s);
+	}
+	return ret;
+}
+
+static int test_sim_large_bus(void *data)
+{
+	int ret = -1;
+	struct sim *s;
+	struct sim_config cfg = test_sim_config;
+
+	ARG_UNUSED(data);
+
+	/* status of PDs past the first 64 comes from the next bitmap word */
+	cfg.num_bus = 1;
+	cfg.pd_per_bus = 100;
+	cfg.baud_rate = 115200;
+	cfg.card_reads_per_sec = 0;
+	s = sim_create(&cfg);
+	if (s == NULL || sim_run_until_online(s, 60 * TEST_SIM_SEC)) {
+		printf("    -- PDs did not come online\n");
+		goto out;
+	}
+	sim_pd_set_down(s, 80, 1);
+	sim_run(s, 5 * TEST_SIM_SEC);
+	if (sim_pd_is_online(s, 80) || !sim_pd_is_online(s, 79)) {
+		printf("    -- bad status for PD[79] or PD[80]\n");
+		goto out;
+	}
+	ret = 0;
+out:
+	if (s != NULL) {
+		sim_destroy(s);
+	}
+	return ret;
+}
+
+static int test_sim_noise(void *data)
+{
+	int i;
+	struct sim *s;
+	struct sim_report r[2];
+	struct sim_config cfg = test_sim_config;
+
+	ARG_UNUSED(data);
+
+	cfg.noise_ppm = 100;
+	cfg.drop_ppm = 1000;
+	for (i = 0; i < 2; i++) {
+		s = sim_create(&cfg);
+		if (s == NULL) {
+			return -1;
+		}
+		sim_run(s, 600 * TEST_SIM_SEC);
+		sim_get_report(s, &r[i]);
+		sim_destroy(s);
+	}
+	test_sim_print(&r[0]);
+
+	if (r[0].bytes_corrupted == 0 || r[0].frames_dropped == 0 ||
+	    r[0].card_reads_delivered == 0) {
+		return -1;
+	}
+	/* same seed, same run */
+	if (memcmp(&r[0], &r[1], sizeof(struct sim_report))) {
+		printf("    -- simulation is not deterministic\n");
+		return -1;
+	}
+	return 0;
+}
+
+void run_sim_tests(struct test *t)
+{
+	printf("\nStarting bus simulator tests\n");
+
+	osdp_set_log_level(LOG_EMERG);
+	DO_TEST(t, test_sim_fleet);
+	DO_TEST(t, test_sim_outage);
+	DO_TEST(t, test_sim_burst);
+	DO_TEST(t, test_sim_large_bus);
+	DO_TEST(t, test_sim_noise);
+	osdp_set_log_level(LOG_INFO);
+}
@@ -5,11 +5,218 @@
  */
 
 #include <stdio.h>
+#include <unistd.h>
 #include <osdp.h>
 #include "osdp_common.h"
 
 #include "test.h"
 
+static void test_pipe_init(struct test_pipe *p)
+{
+	p->len = 0;
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_init(&p->lock, NULL);
+#endif
+}
+
+static void test_pipe_deinit(struct test_pipe *p)
+{
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_destroy(&p->lock);
+#else
+	ARG_UNUSED(p);
+#endif
+}
+
+static int test_pipe_write(struct test_pipe *p, uint8_t *buf, int len)
+{
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_lock(&p->lock);
+#endif
+	if (p->len + len > OSDP_PACKET_BUF_SIZE) {
+		len = OSDP_PACKET_BUF_SIZE - p->len;
+	}
+	memcpy(p->buf + p->len, buf, len);
+	p->len += len;
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_unlock(&p->lock);
+#endif
+	return len;
+}
+
+static int test_pipe_read(struct test_pipe *p, uint8_t *buf, int max_len)
+{
+	int len;
+
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_lock(&p->lock);
+#endif
+	len = p->len;
+	if (len > max_len) {
+		len = max_len;
+	}
+	memcpy(buf, p->buf, len);
+	memmove(p->buf, p->buf + len, p->len - len);
+	p->len -= len;
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_unlock(&p->lock);
+#endif
+	return len;
+}
+
+static int test_loopback_cp_send(void *data, uint8_t *buf, int len)
+{
+	int i;
+	struct test_loopback_port *port = data;
+	struct test_loopback *lb = port->lb;
+
+	if (!(lb->flags & TEST_LOOPBACK_MULTI_DROP)) {
+		return test_pipe_write(&lb->cp_to_pd[port->pd], buf, len);
+	}
+	for (i = 0; i < lb->num_pd; i++) {
+		test_pipe_write(&lb->cp_to_pd[i], buf, len);
+	}
+	return len;
+}
+
+static int test_loopback_cp_recv(void *data, uint8_t *buf, int len)
+{
+	struct test_loopback_port *port = data;
+
+	return test_pipe_read(&port->lb->pd_to_cp[port->pd], buf, len);
+}
+
+static int test_loopback_pd_send(void *data, uint8_t *buf, int len)
+{
+	struct test_loopback_port *port = data;
+	struct test_loopback *lb = port->lb;
+	int i = (lb->flags & TEST_LOOPBACK_MULTI_DROP) ? 0 : port->pd;
+
+	return test_pipe_write(&lb->pd_to_cp[i], buf, len);
+}
+
+static int test_loopback_pd_recv(void *data, uint8_t *buf, int len)
+{
+	struct test_loopback_port *port = data;
+
+	return test_pipe_read(&port->lb->cp_to_pd[port->pd], buf, len);
+}
+
+static int64_t test_loopback_millis(void *arg)
+{
+	return ((struct test_loopback *)arg)->vtime;
+}
+
+/**
+ * Set up the CP and PDs of `lb`. Callers can fill in `info_pd` (caps, etc.,)
+ * for all PDs; the address and channel are set here.
+ */
+int test_loopback_setup(struct test_loopback *lb, int num_pd, int flags,
+			osdp_pd_info_t *info_pd)
+{
+	int i;
+	osdp_pd_info_t info_cp[TEST_LOOPBACK_MAX_PD];
+
+	assert(num_pd <= TEST_LOOPBACK_MAX_PD);
+
+	memset(lb, 0, sizeof(struct test_loopback));
+	memset(info_cp, 0, sizeof(info_cp));
+	lb->num_pd = num_pd;
+	lb->flags = flags;
+	lb->stalled_pd = -1;
+	if (flags & TEST_LOOPBACK_VTIME) {
+		lb->vtime = 1000000;
+		osdp_set_time_source(test_loopback_millis, lb);
+	}
+
+	for (i = 0; i < num_pd; i++) {
+		test_pipe_init(&lb->cp_to_pd[i]);
+		test_pipe_init(&lb->pd_to_cp[i]);
+		lb->port[i].lb = lb;
+		lb->port[i].pd = i;
+		info_cp[i].address = 101 + i;
+		info_cp[i].baud_rate = 9600;
+		info_cp[i].channel.data = (flags & TEST_LOOPBACK_MULTI_DROP) ?
+					  &lb->port[0] : &lb->port[i];
+		info_cp[i].channel.send = test_loopback_cp_send;
+		info_cp[i].channel.recv = test_loopback_cp_recv;
+	}
+	lb->cp_ctx = osdp_cp_setup(num_pd, info_cp, NULL);
+	if (lb->cp_ctx == NULL) {
+		printf("   cp init failed!\n");
+		return -1;
+	}
+
+	for (i = 0; i < num_pd; i++) {
+		info_pd->address = 101 + i;
+		info_pd->baud_rate = 9600;
+		info_pd->channel.data = &lb->port[i];
+		info_pd->channel.send = test_loopback_pd_send;
+		info_pd->channel.recv = test_loopback_pd_recv;
+		lb->pd_ctx[i] = osdp_pd_setup(info_pd, NULL);
+		if (lb->pd_ctx[i] == NULL) {
+			printf("   pd init failed!\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void test_loopback_teardown(struct test_loopback *lb)
+{
+	int i;
+
+	osdp_cp_teardown(lb->cp_ctx);
+	for (i = 0; i < lb->num_pd; i++) {
+		osdp_pd_teardown(lb->pd_ctx[i]);
+		test_pipe_deinit(&lb->cp_to_pd[i]);
+		test_pipe_deinit(&lb->pd_to_cp[i]);
+	}
+	if (lb->flags & TEST_LOOPBACK_VTIME) {
+		osdp_set_time_source(NULL, NULL);
+	}
+}
+
+/**
+ * Refresh the PDs and the CP until `done` returns true or `max_steps` pass.
+ * In virtual time, each step is 1ms and the number of commands on the wire
+ * at once is tracked; otherwise, the steps are 200us apart in real time.
+ */
+int test_loopback_run(struct test_loopback *lb, int (*done)(void *arg),
+		      void *arg, int max_steps)
+{
+	int i, step, in_flight;
+
+	for (step = 0; step < max_steps; step++) {
+		if (done(arg)) {
+			return 0;
+		}
+		/* last PD first, so a late reply lands ahead of PD[0]'s */
+		for (i = lb->num_pd - 1; i >= 0; i--) {
+			if (i != lb->stalled_pd) {
+				osdp_pd_refresh(lb->pd_ctx[i]);
+			}
+		}
+		osdp_cp_refresh(lb->cp_ctx);
+		if (!(lb->flags & TEST_LOOPBACK_VTIME)) {
+			usleep(200);
+			continue;
+		}
+		in_flight = 0;
+		for (i = 0; i < lb->num_pd; i++) {
+			if (TO_PD(lb->cp_ctx, i)->phy_state ==
+			    OSDP_CP_PHY_STATE_REPLY_WAIT) {
+				in_flight++;
+			}
+		}
+		if (in_flight > lb->max_in_flight) {
+			lb->max_in_flight = in_flight;
+		}
+		lb->vtime += 1;
+	}
+	return done(arg) ? 0 : -1;
+}
+
 void test_start(struct test *t)
 {
 	printf("\n");
@@ -46,6 +253,10 @@ int main(int argc, char *argv[])
 
 	test_start(&t);
 
+	run_crc_tests(&t);
+
+	run_crypto_tests(&t);
+
 	run_cp_phy_tests(&t);
 
 	run_cp_phy_fsm_tests(&t);
@@ -54,5 +265,15 @@ int main(int argc, char *argv[])
 
 	run_mixed_fsm_tests(&t);
 
+	run_cp_workers_tests(&t);
+
+	run_cp_bus_tests(&t);
+
+	run_logger_tests(&t);
+
+	run_capture_tests(&t);
+
+	run_sim_tests(&t);
+
 	return test_end(&t);
 }
@@ -11,6 +11,10 @@
 #include <string.h>
 #include "osdp_common.h"
 
+#ifdef CONFIG_OSDP_THREADED_CP
+#include <pthread.h>
+#endif
+
 #define DO_TEST(t, m) do {          \
         t->tests++;                 \
         if (m(t->mock_data)) {      \
@@ -46,9 +50,63 @@ struct test {
 	void *mock_data;
 };
 
+#define TEST_LOOPBACK_MAX_PD            2
+
+/* all PDs share one channel (else, one point-to-point channel per PD) */
+#define TEST_LOOPBACK_MULTI_DROP        0x01
+/* step the CP and PDs in virtual time, 1ms per step */
+#define TEST_LOOPBACK_VTIME             0x02
+
+/* a byte stream from one end of a loopback channel to the other */
+struct test_pipe {
+#ifdef CONFIG_OSDP_THREADED_CP
+	pthread_mutex_t lock;
+#endif
+	uint8_t buf[OSDP_PACKET_BUF_SIZE];
+	int len;
+};
+
+struct test_loopback;
+
+struct test_loopback_port {
+	struct test_loopback *lb;
+	int pd;
+};
+
+/**
+ * A CP and `num_pd` PDs (addresses 101, 102, ...) connected in memory. On
+ * a multi-drop channel, every byte the CP sends reaches all PDs and all PDs
+ * reply into a single stream back to the CP.
+ */
+struct test_loopback {
+	struct osdp *cp_ctx;
+	struct osdp *pd_ctx[TEST_LOOPBACK_MAX_PD];
+	int num_pd;
+	int flags;
+	int stalled_pd;			/* PD that is not refreshed; -1 if none */
+	int max_in_flight;		/* commands on the wire at once */
+	int64_t vtime;
+	struct test_pipe cp_to_pd[TEST_LOOPBACK_MAX_PD];
+	struct test_pipe pd_to_cp[TEST_LOOPBACK_MAX_PD];
+	struct test_loopback_port port[TEST_LOOPBACK_MAX_PD];
+};
+
+int test_loopback_setup(struct test_loopback *lb, int num_pd, int flags,
+			osdp_pd_info_t *info_pd);
+void test_loopback_teardown(struct test_loopback *lb);
+int test_loopback_run(struct test_loopback *lb, int (*done)(void *arg),
+		      void *arg, int max_steps);
+
+void run_crc_tests(struct test *t);
+void run_crypto_tests(struct test *t);
 void run_cp_phy_tests(struct test *t);
 void run_cp_phy_fsm_tests(struct test *t);
 void run_cp_fsm_tests(struct test *t);
 void run_mixed_fsm_tests(struct test *t);
+void run_cp_workers_tests(struct test *t);
+void run_cp_bus_tests(struct test *t);
+void run_logger_tests(struct test *t);
+void run_capture_tests(struct test *t);
+void run_sim_tests(struct test *t);
 
 #endif